@@ -0,0 +1,765 @@
+/**
+ *  AntSimulator -- simulated ANT stick with scripted fault injection
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "AntSimulator.h"
+#include "Tools.h"
+#include <algorithm>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+
+/** IMPLEMENTATION NOTE
+ *
+ * The simulated stick only implements the messages used by AntStick and
+ * AntChannel, see D00000652_ANT_Message_Protocol_and_Usage_Rev_5.1.  Each
+ * open channel has a "slot" once every channel period, in which it either
+ * receives a broadcast from the device it is paired with, or reports an
+ * event (RX fail, drop to search, search timeout).  Acknowledged data is
+ * sent to the device in the next slot and its result is reported right
+ * after it.  Command responses are queued up immediately, as the AntStick
+ * waits for them.
+ */
+
+namespace {
+
+enum {
+    MAX_CHANNELS = 8,
+    MAX_NETWORKS = 8,
+    SERIAL_NUMBER = 0x0051AB00,
+
+    // Delay (milliseconds) before the simulation starts: sensor classes
+    // use a timestamp of 0 to mean "no data received".
+    START_TIME = 1000,
+    // Length of the simulation after the last fault, if no end is given.
+    DEFAULT_TAIL = 30000,
+    // Time (milliseconds) a read waits for a message, when there is none.
+    READ_TIMEOUT = 10,
+    // Consecutive lost messages after which a channel drops to search.
+    RX_FAILS_BEFORE_SEARCH = 8,
+    // Unit of SET_CHANNEL_SEARCH_TIMEOUT, milliseconds
+    SEARCH_TIMEOUT_UNIT = 2500,
+
+    HRM_DEVICE_TYPE = 0x78,
+    HRM_DEVICE_NUMBER = 1001,
+    HRM_HEART_RATE = 140,
+    // HRM device information, sent in the background pages
+    HRM_MANUFACTURER_ID = 1,
+    HRM_SERIAL_HIGH = 0x1234,           // upper 16 bits of the serial number
+    HRM_HARDWARE_VERSION = 5,
+    HRM_SOFTWARE_VERSION = 34,
+    HRM_MODEL_NUMBER = 7,
+    HRM_BATTERY_LEVEL = 85,             // percent
+    HRM_BATTERY_DESCRIPTIVE = 0x23,     // 3 volts, status good
+    FEC_DEVICE_TYPE = 0x11,
+    FEC_DEVICE_NUMBER = 2002,
+    FEC_DEFAULT_POWER = 150,
+    FEC_CADENCE = 90,
+    FEC_SPEED = 8333                    // mm/s, 30 km/h
+};
+
+const uint8_t g_DeviceTypes[AntSimulation::DEVICE_COUNT] = {
+    HRM_DEVICE_TYPE, FEC_DEVICE_TYPE
+};
+const uint32_t g_DeviceNumbers[AntSimulation::DEVICE_COUNT] = {
+    HRM_DEVICE_NUMBER, FEC_DEVICE_NUMBER
+};
+const char *g_DeviceNames[AntSimulation::DEVICE_COUNT] = { "hrm", "fec" };
+
+double PeriodMilliseconds(uint32_t period)
+{
+    return period * 1000.0 / 32768.0;
+}
+
+};                                      // end anonymous namespace
+
+
+// ................................................. SimulatedTransport ....
+
+/** Transport connecting an AntStick to an AntSimulation.  Waiting for
+ * events advances the simulation (and the virtual clock). */
+class SimulatedTransport : public AntTransport
+{
+public:
+    explicit SimulatedTransport(AntSimulation *simulation)
+        : m_Simulation(simulation) {}
+
+    Status WriteMessage(const Buffer &message) override
+    {
+        if (! m_Simulation->WriteMessage(message))
+            return Fail(LibusbError("libusb_submit_transfer", LIBUSB_ERROR_PIPE).what());
+        return IO_OK;
+    }
+
+    Status MaybeGetNextMessage(Buffer &message) override
+    {
+        return Read(message);
+    }
+
+    Status GetNextMessage(Buffer &message) override
+    {
+        if (Read(message) != IO_OK)
+            return IO_FAILED;
+        if (message.empty()) {
+            m_Simulation->Advance(READ_TIMEOUT);
+            return Read(message);
+        }
+        return IO_OK;
+    }
+
+    Status WaitForEvents(int milliseconds) override
+    {
+        m_Simulation->Advance(milliseconds);
+        return IO_OK;
+    }
+
+private:
+    Status Read(Buffer &message)
+    {
+        if (! m_Simulation->ReadMessage(message))
+            return Fail(LibusbError("AntMessageReader", LIBUSB_ERROR_PIPE).what());
+        return IO_OK;
+    }
+
+    AntSimulation *m_Simulation;
+};
+
+
+// ...................................................... AntSimulation ....
+
+AntSimulation::AntSimulation(std::istream &input)
+    : m_End(0),
+      m_Random(1),
+      m_Channels(MAX_CHANNELS),
+      m_TargetPower(0)
+{
+    AdvanceVirtualClock(START_TIME);
+    m_Start = CurrentMilliseconds();
+    ParseScenario(input);
+}
+
+AntSimulation::~AntSimulation()
+{
+    // empty
+}
+
+void AntSimulation::ParseScenario(std::istream &input)
+{
+    std::string line;
+    int line_number = 0;
+    bool have_end = false;
+    uint32_t last_fault_end = 0;
+
+    while (std::getline(input, line)) {
+        line_number++;
+        auto comment = line.find('#');
+        if (comment != std::string::npos)
+            line.erase(comment);
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+
+        auto fail = [&](const char *reason) {
+            std::ostringstream msg;
+            msg << "scenario line " << line_number << ": " << reason;
+            throw std::runtime_error(msg.str());
+        };
+
+        std::istringstream in(line);
+        std::string word;
+        if (! (in >> word))
+            continue;                   // empty line
+
+        if (word == "seed") {
+            unsigned seed;
+            if (! (in >> seed))
+                fail("bad seed");
+            m_Random.seed(seed);
+            continue;
+        }
+
+        Fault f;
+        f.device = DEVICE_COUNT;
+        f.duration = 0;
+        f.probability = 1.0;
+        std::fill(std::begin(f.recovery_time), std::end(f.recovery_time), -1);
+        std::istringstream time_in(word);
+        if (! (time_in >> f.start))
+            fail("bad event time");
+
+        std::string event;
+        in >> event;
+        if (event == "end") {
+            m_End = f.start;
+            have_end = true;
+            continue;
+        }
+
+        if (event == "loss")
+            f.type = LOSS;
+        else if (event == "go-to-search")
+            f.type = GO_TO_SEARCH;
+        else if (event == "search-timeout")
+            f.type = SEARCH_TIMEOUT;
+        else if (event == "ack-fail")
+            f.type = ACK_FAIL;
+        else if (event == "usb-stall")
+            f.type = USB_STALL;
+        else if (event == "bad-reply")
+            f.type = BAD_REPLY;
+        else
+            fail("unknown event");
+
+        if (f.type != USB_STALL && f.type != BAD_REPLY) {
+            std::string device;
+            in >> device;
+            auto d = std::find(std::begin(g_DeviceNames), std::end(g_DeviceNames), device);
+            if (d == std::end(g_DeviceNames))
+                fail("unknown device");
+            f.device = static_cast<Device>(d - std::begin(g_DeviceNames));
+        }
+
+        if (! (in >> f.duration))
+            fail("bad duration");
+
+        if (f.type == LOSS && (! (in >> f.probability)
+                               || f.probability < 0 || f.probability > 1))
+            fail("bad loss probability");
+
+        f.text = line;
+        last_fault_end = std::max(last_fault_end, f.start + f.duration);
+        m_Faults.push_back(f);
+    }
+
+    if (! have_end)
+        m_End = last_fault_end + DEFAULT_TAIL;
+}
+
+std::unique_ptr<AntTransport> AntSimulation::CreateTransport()
+{
+    return std::unique_ptr<AntTransport>(new SimulatedTransport(this));
+}
+
+uint32_t AntSimulation::Now() const
+{
+    return CurrentMilliseconds() - m_Start;
+}
+
+bool AntSimulation::Finished() const
+{
+    return Now() >= m_End;
+}
+
+const AntSimulation::Fault* AntSimulation::ActiveFault(FaultType type, Device device) const
+{
+    auto now = Now();
+    for (const auto &f : m_Faults) {
+        if (f.type == type && (f.device == device || f.device == DEVICE_COUNT)
+            && now >= f.start && now < f.start + f.duration)
+            return &f;
+    }
+    return nullptr;
+}
+
+bool AntSimulation::UsbStalled() const
+{
+    return ActiveFault(USB_STALL, DEVICE_COUNT) != nullptr;
+}
+
+void AntSimulation::Advance(uint32_t milliseconds)
+{
+    for (uint32_t i = 0; i < milliseconds; ++i) {
+        AdvanceVirtualClock(1);
+        auto now = Now();
+        for (unsigned ch = 0; ch < m_Channels.size(); ++ch) {
+            Channel &c = m_Channels[ch];
+            while (c.open && c.next_slot <= now) {
+                c.next_slot += PeriodMilliseconds(c.period);
+                RunSlot(static_cast<uint8_t>(ch));
+            }
+        }
+    }
+}
+
+void AntSimulation::DataReceived(Device device)
+{
+    auto now = Now();
+    DeviceState &d = m_Devices[device];
+    if (d.first_data < 0)
+        d.first_data = now;
+    else
+        d.max_gap = std::max(d.max_gap, now - d.last_data);
+    d.last_data = now;
+    d.samples++;
+
+    for (auto &f : m_Faults) {
+        if ((f.device == device || f.device == DEVICE_COUNT)
+            && f.recovery_time[device] < 0 && now >= f.start + f.duration)
+            f.recovery_time[device] = now - (f.start + f.duration);
+    }
+}
+
+void AntSimulation::WriteReport(std::ostream &out) const
+{
+    out << "Simulation ran for " << Now() << " ms\n";
+
+    for (const auto &f : m_Faults) {
+        out << "  " << f.text << ":";
+        for (int d = 0; d < DEVICE_COUNT; ++d) {
+            if (f.device != d && f.device != DEVICE_COUNT)
+                continue;
+            out << " " << g_DeviceNames[d];
+            if (f.recovery_time[d] < 0)
+                out << " not recovered";
+            else
+                out << " recovered after " << f.recovery_time[d] << " ms";
+        }
+        out << "\n";
+    }
+
+    for (int d = 0; d < DEVICE_COUNT; ++d) {
+        const DeviceState &s = m_Devices[d];
+        out << "  " << g_DeviceNames[d] << ": " << s.samples << " samples";
+        if (s.first_data >= 0) {
+            // A gap which lasts until the end counts too
+            auto gap = std::max(s.max_gap, Now() - s.last_data);
+            out << ", first at " << s.first_data << " ms, longest gap "
+                << gap << " ms";
+        }
+        out << "\n";
+    }
+
+    const Counters &c = m_Counters;
+    out << "  stick: " << c.resets << " resets, "
+        << c.usb_failures << " USB failures, "
+        << c.bad_replies << " bad replies, "
+        << c.channel_opens << " channel opens, "
+        << c.channel_closes << " channel closes, "
+        << c.search_timeouts << " search timeouts, "
+        << c.rx_fails << " RX fails, "
+        << c.go_to_search << " drops to search, "
+        << c.acks_failed << " of " << c.acks_sent << " acks failed\n"
+        << std::flush;
+}
+
+bool AntSimulation::WriteMessage(const Buffer &message)
+{
+    if (UsbStalled()) {
+        m_Counters.usb_failures++;
+        return false;
+    }
+    ProcessCommand(message);
+    return true;
+}
+
+bool AntSimulation::ReadMessage(Buffer &message)
+{
+    message.clear();
+    if (UsbStalled()) {
+        m_Counters.usb_failures++;
+        return false;
+    }
+    if (! m_Received.empty()) {
+        message = m_Received.front();
+        m_Received.pop_front();
+    }
+    return true;
+}
+
+void AntSimulation::Channel::Clear()
+{
+    assigned = false;
+    open = false;
+    tracking = false;
+    device_type = 0;
+    device_number = 0;
+    period = 8192;
+    search_timeout = 10 * SEARCH_TIMEOUT_UNIT;
+    next_slot = 0;
+    search_start = 0;
+    paired = -1;
+    consecutive_fails = 0;
+    messages_since_paired = 0;
+    ack_data.clear();
+}
+
+void AntSimulation::ProcessCommand(const Buffer &message)
+{
+    if (message.size() < 5)
+        return;
+
+    uint8_t id = message[2];
+    uint8_t ch = message[3];
+
+    if (id == RESET_SYSTEM) {
+        m_Counters.resets++;
+        for (auto &c : m_Channels)
+            c.Clear();
+        m_Received.clear();
+        Buffer data(1, 0x20);           // reset caused by a command
+        Send(STARTUP_MESSAGE, data);
+        return;
+    }
+    if (id == REQUEST_MESSAGE) {
+        if (message.size() > 5)
+            ProcessRequest(ch, message[4]);
+        return;
+    }
+    if (id == SET_NETWORK_KEY) {
+        SendResponse(ch, id, ch < MAX_NETWORKS
+                     ? RESPONSE_NO_ERROR : INVALID_NETWORK_NUMBER);
+        return;
+    }
+
+    if (ch >= m_Channels.size()) {
+        SendResponse(ch, id, INVALID_PARAMETER_PROVIDED);
+        return;
+    }
+
+    Channel &c = m_Channels[ch];
+    uint8_t response = RESPONSE_NO_ERROR;
+
+    switch (id) {
+    case ASSIGN_CHANNEL:
+        if (c.assigned)
+            response = CHANNEL_IN_WRONG_STATE;
+        c.assigned = true;
+        break;
+    case SET_CHANNEL_ID:
+        if (message.size() > 8) {
+            c.device_number = message[4] | (message[5] << 8)
+                | ((message[7] & 0xF0) << 12);
+            c.device_type = message[6];
+        }
+        break;
+    case SET_CHANNEL_PERIOD:
+        if (message.size() > 6)
+            c.period = std::max(message[4] | (message[5] << 8), 1);
+        break;
+    case SET_CHANNEL_SEARCH_TIMEOUT:
+        // 0xFF means no timeout
+        c.search_timeout = (message[4] == 0xFF) ? 0 : message[4] * SEARCH_TIMEOUT_UNIT;
+        break;
+    case OPEN_CHANNEL:
+        if (! c.assigned || c.open) {
+            response = CHANNEL_IN_WRONG_STATE;
+            break;
+        }
+        m_Counters.channel_opens++;
+        c.open = true;
+        c.tracking = false;
+        c.search_start = Now();
+        c.next_slot = Now() + PeriodMilliseconds(c.period);
+        break;
+    case CLOSE_CHANNEL:
+        if (! c.open) {
+            response = CHANNEL_IN_WRONG_STATE;
+            break;
+        }
+        SendResponse(ch, id, RESPONSE_NO_ERROR);
+        CloseChannel(ch);
+        return;
+    case UNASSIGN_CHANNEL:
+        if (c.open)
+            response = CHANNEL_IN_WRONG_STATE;
+        else
+            c.Clear();
+        break;
+    case ACKNOWLEDGE_DATA:
+        // The result is reported after the next channel slot.
+        if (c.open)
+            c.ack_data.assign(message.begin() + 4, message.end() - 1);
+        else
+            SendResponse(ch, id, CHANNEL_NOT_OPENED);
+        return;
+    default:
+        // Other configuration commands are accepted and ignored
+        break;
+    }
+
+    SendResponse(ch, id, response);
+}
+
+void AntSimulation::ProcessRequest(uint8_t channel, uint8_t message_id)
+{
+    Buffer data;
+    switch (message_id) {
+    case RESPONSE_SERIAL_NUMBER:
+        for (int i = 0; i < 4; ++i)
+            data.push_back(static_cast<uint8_t>((SERIAL_NUMBER >> (i * 8)) & 0xFF));
+        break;
+    case RESPONSE_VERSION: {
+        const char version[] = "SIM1.00";
+        data.assign(version, version + sizeof(version));
+        break;
+    }
+    case RESPONSE_CAPABILITIES:
+        data.push_back(MAX_CHANNELS);
+        data.push_back(MAX_NETWORKS);
+        data.insert(data.end(), 4, 0);
+        break;
+    case RESPONSE_CHANNEL_ID: {
+        if (channel >= m_Channels.size()) {
+            SendResponse(channel, REQUEST_MESSAGE, INVALID_PARAMETER_PROVIDED);
+            return;
+        }
+        const Channel &c = m_Channels[channel];
+        uint32_t number = c.device_number;
+        uint8_t type = c.device_type;
+        if (c.tracking) {
+            number = g_DeviceNumbers[c.paired];
+            type = g_DeviceTypes[c.paired];
+        }
+        data.push_back(channel);
+        data.push_back(static_cast<uint8_t>(number & 0xFF));
+        data.push_back(static_cast<uint8_t>((number >> 8) & 0xFF));
+        data.push_back(type);
+        data.push_back(static_cast<uint8_t>(ANT_INDEPENDENT_CHANNEL | ((number >> 12) & 0xF0)));
+        break;
+    }
+    default:
+        SendResponse(channel, REQUEST_MESSAGE, INVALID_MESSAGE);
+        return;
+    }
+
+    if (message_id != RESPONSE_CHANNEL_ID && ActiveFault(BAD_REPLY, DEVICE_COUNT)) {
+        m_Counters.bad_replies++;
+        // Either no reply, which AntStick sees as a timeout, or a reply with
+        // only the first data byte.
+        if (std::bernoulli_distribution(0.5)(m_Random))
+            return;
+        data.resize(1);
+    }
+    Send(message_id, data);
+}
+
+/** Run one channel period for 'channel': receive a message from the paired
+ * device, or search for one. */
+void AntSimulation::RunSlot(uint8_t channel)
+{
+    Channel &c = m_Channels[channel];
+    auto now = Now();
+    bool ack_ok = false;
+
+    if (c.tracking) {
+        Device d = static_cast<Device>(c.paired);
+        const Fault *loss = ActiveFault(LOSS, d);
+        std::uniform_real_distribution<double> chance(0, 1);
+        bool lost = ActiveFault(SEARCH_TIMEOUT, d)
+            || (loss && chance(m_Random) < loss->probability);
+        if (lost) {
+            m_Counters.rx_fails++;
+            if (++c.consecutive_fails >= RX_FAILS_BEFORE_SEARCH) {
+                m_Counters.go_to_search++;
+                c.tracking = false;
+                c.search_start = now;
+                SendEvent(channel, EVENT_RX_FAIL_GO_TO_SEARCH);
+            } else {
+                SendEvent(channel, EVENT_RX_FAIL);
+            }
+        } else if (ActiveFault(GO_TO_SEARCH, d) && c.messages_since_paired > 0) {
+            m_Counters.go_to_search++;
+            c.tracking = false;
+            c.search_start = now;
+            SendEvent(channel, EVENT_RX_FAIL_GO_TO_SEARCH);
+        } else {
+            c.consecutive_fails = 0;
+            c.messages_since_paired++;
+            SendBroadcast(channel, d);
+            ack_ok = ! ActiveFault(ACK_FAIL, d);
+        }
+    } else {
+        int found = -1;
+        for (int d = 0; d < DEVICE_COUNT && found < 0; ++d) {
+            if ((c.device_type == 0 || c.device_type == g_DeviceTypes[d])
+                && (c.device_number == 0 || c.device_number == g_DeviceNumbers[d])
+                && ! ActiveFault(SEARCH_TIMEOUT, static_cast<Device>(d)))
+                found = d;
+        }
+        if (found >= 0) {
+            c.tracking = true;
+            c.paired = found;
+            c.consecutive_fails = 0;
+            c.messages_since_paired = 1;
+            SendBroadcast(channel, static_cast<Device>(found));
+        } else if (c.search_timeout > 0 && now - c.search_start >= c.search_timeout) {
+            m_Counters.search_timeouts++;
+            SendEvent(channel, EVENT_RX_SEARCH_TIMEOUT);
+            CloseChannel(channel);
+        }
+    }
+
+    if (! c.ack_data.empty()) {
+        m_Counters.acks_sent++;
+        if (ack_ok) {
+            ProcessAckData(static_cast<Device>(c.paired), c.ack_data);
+        } else {
+            m_Counters.acks_failed++;
+        }
+        c.ack_data.clear();
+        SendEvent(channel, ack_ok ? EVENT_TRANSFER_TX_COMPLETED : EVENT_TRANSFER_TX_FAILED);
+    }
+}
+
+void AntSimulation::CloseChannel(uint8_t channel)
+{
+    Channel &c = m_Channels[channel];
+    m_Counters.channel_closes++;
+    c.open = false;
+    c.tracking = false;
+    SendEvent(channel, EVENT_CHANNEL_CLOSED);
+}
+
+/** Handle acknowledged data received by 'device': data page requests and
+ * target power for the trainer, everything else is ignored. */
+void AntSimulation::ProcessAckData(Device device, const Buffer &data)
+{
+    const uint8_t DP_REQUEST = 0x46, DP_FE_CAPABILITIES = 0x36, DP_TARGET_POWER = 0x31;
+    if (device != FEC || data.size() < 8)
+        return;
+    if (data[0] == DP_REQUEST && data[6] == DP_FE_CAPABILITIES)
+        m_Devices[FEC].capabilities_requested = true;
+    else if (data[0] == DP_TARGET_POWER)
+        m_TargetPower = (data[6] | (data[7] << 8)) * 0.25;
+}
+
+void AntSimulation::SendResponse(uint8_t channel, uint8_t message_id, uint8_t code)
+{
+    Buffer data;
+    data.push_back(channel);
+    data.push_back(message_id);
+    data.push_back(code);
+    Send(CHANNEL_RESPONSE, data);
+}
+
+void AntSimulation::SendEvent(uint8_t channel, uint8_t event)
+{
+    // Channel events are responses to message 1
+    SendResponse(channel, 0x01, event);
+}
+
+void AntSimulation::SendBroadcast(uint8_t channel, Device device)
+{
+    Buffer data = MakePayload(device);
+    data.insert(data.begin(), channel);
+    Send(BROADCAST_DATA, data);
+    m_Devices[device].messages_sent++;
+}
+
+/** Build the next 8 byte data page sent by 'device' */
+Buffer AntSimulation::MakePayload(Device device)
+{
+    DeviceState &d = m_Devices[device];
+    auto now = Now();
+    Buffer p;
+
+    if (device == HRM) {
+        // Page 4 (previous heart beat), the page toggle bit changes every 4
+        // messages.  Every 16th group of 4 messages is a background page
+        // with the manufacturer (2), product (3) or battery (7) info.  Event
+        // times are in 1/1024 seconds.
+        const double beat_interval = 60000.0 / HRM_HEART_RATE;
+        auto beats = static_cast<uint32_t>(now / beat_interval);
+        auto beat_time = static_cast<uint32_t>(beats * beat_interval * 1.024);
+        auto previous_time = beats > 0
+            ? static_cast<uint32_t>((beats - 1) * beat_interval * 1.024) : 0;
+        uint32_t group = d.messages_sent / 4;
+        uint8_t page = 4;
+        if (group % 16 == 15) {
+            const uint8_t background[] = { 2, 3, 7 };
+            page = background[(group / 16) % 3];
+        }
+        p.push_back(static_cast<uint8_t>(page | ((group & 1) << 7)));
+        switch (page) {
+        case 2:
+            p.push_back(HRM_MANUFACTURER_ID);
+            p.push_back(HRM_SERIAL_HIGH & 0xFF);
+            p.push_back((HRM_SERIAL_HIGH >> 8) & 0xFF);
+            break;
+        case 3:
+            p.push_back(HRM_HARDWARE_VERSION);
+            p.push_back(HRM_SOFTWARE_VERSION);
+            p.push_back(HRM_MODEL_NUMBER);
+            break;
+        case 7:
+            p.push_back(HRM_BATTERY_LEVEL);
+            p.push_back(0);                 // fractional voltage
+            p.push_back(HRM_BATTERY_DESCRIPTIVE);
+            break;
+        default:
+            p.push_back(0xFF);
+            p.push_back(previous_time & 0xFF);
+            p.push_back((previous_time >> 8) & 0xFF);
+            break;
+        }
+        p.push_back(beat_time & 0xFF);
+        p.push_back((beat_time >> 8) & 0xFF);
+        p.push_back(beats & 0xFF);
+        p.push_back(HRM_HEART_RATE);
+        return p;
+    }
+
+    if (d.capabilities_requested) {
+        d.capabilities_requested = false;
+        p.push_back(0x36);
+        p.insert(p.end(), 4, 0xFF);
+        p.push_back(0xE8);              // max resistance, 1000 N
+        p.push_back(0x03);
+        p.push_back(0x07);              // all control modes supported
+        return p;
+    }
+
+    const uint8_t IN_USE = 3 << 4;
+    if (d.messages_sent % 2 == 0) {
+        p.push_back(0x10);              // general page
+        p.push_back(25);                // trainer
+        p.push_back(static_cast<uint8_t>((now / 250) & 0xFF));
+        p.push_back(0);
+        p.push_back(FEC_SPEED & 0xFF);
+        p.push_back((FEC_SPEED >> 8) & 0xFF);
+        p.push_back(0xFF);
+        p.push_back(IN_USE);
+    } else {
+        auto power = static_cast<uint32_t>(m_TargetPower > 0 ? m_TargetPower : FEC_DEFAULT_POWER);
+        auto accumulated = power * (d.messages_sent / 2);
+        p.push_back(0x19);              // trainer specific page
+        p.push_back(static_cast<uint8_t>((d.messages_sent / 2) & 0xFF));
+        p.push_back(FEC_CADENCE);
+        p.push_back(accumulated & 0xFF);
+        p.push_back((accumulated >> 8) & 0xFF);
+        p.push_back(power & 0xFF);
+        p.push_back((power >> 8) & 0x0F);
+        p.push_back(IN_USE);
+    }
+    return p;
+}
+
+void AntSimulation::Send(uint8_t id, const Buffer &data)
+{
+    // Messages sent while the USB transfers fail are lost.
+    if (UsbStalled())
+        return;
+    Buffer b;
+    b.push_back(SYNC_BYTE);
+    b.push_back(static_cast<uint8_t>(data.size()));
+    b.push_back(id);
+    b.insert(b.end(), data.begin(), data.end());
+    uint8_t c = 0;
+    for (auto e : b)
+        c ^= e;
+    b.push_back(c);
+    m_Received.push_back(b);
+}
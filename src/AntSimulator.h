@@ -0,0 +1,190 @@
+/**
+ *  AntSimulator -- simulated ANT stick with scripted fault injection
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "AntStick.h"
+#include <deque>
+#include <iosfwd>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+/** Simulates an ANT stick with a heart rate monitor and a trainer in range,
+ * and injects the faults listed in a scenario, so the AntStick and
+ * AntChannel state machines and the sensor recovery in the server can be
+ * exercised, and their timeouts tuned, without hardware.
+ *
+ * The simulation runs on the virtual clock (see EnableVirtualClock()), which
+ * is advanced by the simulated transport when the AntStick waits for
+ * events, so a scenario runs much faster than real time and the same
+ * scenario always produces the same results.
+ *
+ * A scenario is a text file with one event per line, '#' starts a comment.
+ * Times and durations are in milliseconds, DEVICE is "hrm" or "fec":
+ *
+ *    seed N -- seed for the random number generator
+ *    TIME loss DEVICE DURATION PROBABILITY -- messages from DEVICE are lost
+ *        with PROBABILITY (0 .. 1), the channel drops to search after a
+ *        number of consecutive losses
+ *    TIME go-to-search DEVICE DURATION -- the channel drops to search right
+ *        after each time it pairs with DEVICE (an RX_FAIL_GO_TO_SEARCH storm)
+ *    TIME search-timeout DEVICE DURATION -- DEVICE stops transmitting, long
+ *        enough outages end with a search timeout and a closed channel
+ *    TIME ack-fail DEVICE DURATION -- acknowledged data sent to DEVICE fails
+ *    TIME usb-stall DURATION -- all USB transfers fail
+ *    TIME bad-reply DURATION -- requests for the stick serial number,
+ *        version and capabilities get no reply or a truncated one
+ *    TIME end -- end of the simulation, defaults to 30 seconds after the
+ *        last fault
+ */
+class AntSimulation
+{
+public:
+    enum Device { HRM, FEC, DEVICE_COUNT };
+
+    /** Read a scenario from 'input', throws std::runtime_error if it
+     * contains invalid lines. */
+    explicit AntSimulation(std::istream &input);
+    ~AntSimulation();
+
+    /** Create a transport for an AntStick, connected to this simulation.
+     * The simulated stick state is kept by the simulation, so a new stick
+     * can be created after a failure. */
+    std::unique_ptr<AntTransport> CreateTransport();
+
+    /** Run the simulation for 'milliseconds', advancing the virtual
+     * clock. */
+    void Advance(uint32_t milliseconds);
+
+    /** Milliseconds since the start of the simulation */
+    uint32_t Now() const;
+    bool Finished() const;
+
+    /** Called by the application when it received new data from 'device',
+     * used to measure the data gaps and the recovery time after faults. */
+    void DataReceived(Device device);
+
+    /** Write the fault recovery times and the data gaps to 'out'. */
+    void WriteReport(std::ostream &out) const;
+
+private:
+    friend class SimulatedTransport;
+
+    enum FaultType {
+        LOSS, GO_TO_SEARCH, SEARCH_TIMEOUT, ACK_FAIL, USB_STALL, BAD_REPLY
+    };
+
+    struct Fault {
+        FaultType type;
+        Device device;                  // DEVICE_COUNT for all devices
+        uint32_t start;
+        uint32_t duration;
+        double probability;
+        std::string text;               // scenario line, for the report
+        /** Time from the end of the fault until data was received from each
+         * device, -1 if no data was received yet */
+        int recovery_time[DEVICE_COUNT];
+    };
+
+    struct Channel {
+        Channel() { Clear(); }
+        void Clear();
+        bool assigned;
+        bool open;
+        bool tracking;
+        uint8_t device_type;
+        uint32_t device_number;         // 0 means any device
+        uint32_t period;                // 1/32768 seconds
+        uint32_t search_timeout;        // milliseconds, 0 means never
+        double next_slot;               // milliseconds
+        uint32_t search_start;
+        int paired;                     // Device, or -1
+        int consecutive_fails;
+        int messages_since_paired;
+        /** Acknowledged data waiting for the next channel slot, empty if
+         * there is none */
+        Buffer ack_data;
+    };
+
+    struct DeviceState {
+        DeviceState() : samples(0), first_data(-1), last_data(0), max_gap(0),
+                        messages_sent(0), capabilities_requested(false) {}
+        int samples;
+        int first_data;                 // -1 if no data received yet
+        uint32_t last_data;
+        uint32_t max_gap;
+        uint32_t messages_sent;
+        bool capabilities_requested;
+    };
+
+    struct Counters {
+        Counters() : resets(0), channel_opens(0), channel_closes(0),
+                     rx_fails(0), go_to_search(0), search_timeouts(0),
+                     acks_sent(0), acks_failed(0), usb_failures(0),
+                     bad_replies(0) {}
+        int resets;
+        int channel_opens;
+        int channel_closes;
+        int rx_fails;
+        int go_to_search;
+        int search_timeouts;
+        int acks_sent;
+        int acks_failed;
+        int usb_failures;
+        int bad_replies;
+    };
+
+    void ParseScenario(std::istream &input);
+    const Fault* ActiveFault(FaultType type, Device device) const;
+    bool UsbStalled() const;
+
+    /** Pass 'message' to the stick, or return the next message received
+     * from it, empty if there is none.  Return false if USB transfers
+     * fail. */
+    bool WriteMessage(const Buffer &message);
+    bool ReadMessage(Buffer &message);
+
+    void ProcessCommand(const Buffer &message);
+    void ProcessRequest(uint8_t channel, uint8_t message_id);
+    void RunSlot(uint8_t channel);
+    void CloseChannel(uint8_t channel);
+    void SendResponse(uint8_t channel, uint8_t message_id, uint8_t code);
+    void SendEvent(uint8_t channel, uint8_t event);
+    void SendBroadcast(uint8_t channel, Device device);
+    void ProcessAckData(Device device, const Buffer &data);
+    Buffer MakePayload(Device device);
+    void Send(uint8_t id, const Buffer &data);
+
+    std::vector<Fault> m_Faults;
+    uint32_t m_Start;
+    uint32_t m_End;
+    std::mt19937 m_Random;
+
+    std::vector<Channel> m_Channels;
+    std::deque<Buffer> m_Received;
+    DeviceState m_Devices[DEVICE_COUNT];
+    Counters m_Counters;
+    /** Target power last sent to the trainer, watts */
+    double m_TargetPower;
+};
+
+/*
+  Local Variables:
+  mode: c++
+  End:
+*/
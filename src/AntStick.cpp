@@ -49,6 +49,49 @@
 
 namespace {
 
+enum {
+    // Maximum number of messages set aside while waiting for a response to
+    // a command, see AntStick::ReadInternalMessage().  When more arrive, the
+    // oldest ones are dropped: these are broadcast messages, which are
+    // repeated by the devices.
+    MAX_DELAYED_MESSAGES = 64,
+    // Maximum number of messages processed by one AntStick::Tick() call,
+    // any remaining ones are processed by the next call.
+    MAX_TICK_MESSAGES = 64,
+    // USB reads are this many packets of the read endpoint max packet size,
+    // see AntMessageReader::SubmitUsbTransfer()
+    READ_PACKETS = 4,
+    // Max packet size used if the endpoint does not report one, this is
+    // the size used by full speed devices, which ANT sticks are.
+    DEFAULT_MAX_PACKET_SIZE = 64
+};
+
+// ANT+ common data pages, see D00001198_-_ANT+_Common_Data_Pages_Rev_3.1
+enum CommonPage {
+    CP_MANUFACTURER_INFO = 0x50,
+    CP_PRODUCT_INFO = 0x51,
+    CP_BATTERY_STATUS = 0x52
+};
+
+// Heart rate monitors send their device information in their own data
+// pages, see D00000693_-_ANT+_Device_Profile_-_Heart_Rate_Rev_2.1
+enum HrmPage {
+    HRM_DEVICE_TYPE = 0x78,
+    HRM_MANUFACTURER_INFO = 2,
+    HRM_PRODUCT_INFO = 3,
+    HRM_BATTERY_STATUS = 7
+};
+
+// Slots in AntChannel::m_CommonPages for the pages above
+enum DeviceInfoPage {
+    DIP_MANUFACTURER_INFO,
+    DIP_PRODUCT_INFO,
+    DIP_BATTERY_STATUS,
+    DIP_HRM_MANUFACTURER_INFO,
+    DIP_HRM_PRODUCT_INFO,
+    DIP_HRM_BATTERY_STATUS
+};
+
 enum ChannelType {
     BIDIRECTIONAL_RECEIVE = 0x00,
     BIDIRECTIONAL_TRANSMIT = 0x10,
@@ -60,6 +103,21 @@ enum ChannelType {
     UNIDIRECTIONAL_TRANSMIT_ONLY = 0x50
 };
 
+/** Return true if 'response' is a channel response for 'cmd' on 'channel'
+ * with the expected 'status'.  Unlike CheckChannelResponse(), this does not
+ * throw, it is used while processing messages in AntStick::Tick(), where a
+ * bad response from the stick is not a reason to stop.
+ */
+bool IsChannelResponse (
+    const Buffer &response, uint8_t channel, uint8_t cmd, uint8_t status)
+{
+    return response.size() > 5
+        && response[2] == CHANNEL_RESPONSE
+        && response[3] == channel
+        && response[4] == cmd
+        && response[5] == status;
+}
+
 void CheckChannelResponse (
     const Buffer &response, uint8_t channel, uint8_t cmd, uint8_t status)
 {
@@ -68,10 +126,7 @@ void CheckChannelResponse (
         if (! std::uncaught_exception())
             throw std::runtime_error ("CheckChannelResponse: short response");
     }
-    else if (response[2] != CHANNEL_RESPONSE
-        || response[3] != channel
-        || response[4] != cmd
-        || response[5] != status)
+    else if (! IsChannelResponse (response, channel, cmd, status))
     {
 #if defined DEBUG_OUTPUT
         DumpData(&response[0], response.size(), std::cerr);
@@ -85,6 +140,38 @@ void CheckChannelResponse (
     }
 }
 
+/** Check the response for an optional channel command, one which older ANT
+ * sticks might not support.  Returns false if the stick rejected the
+ * command, throws if the response is not for this command.
+ */
+bool CheckOptionalChannelResponse (
+    const Buffer &response, uint8_t channel, uint8_t cmd)
+{
+    if (response.size() > 5
+        && response[2] == CHANNEL_RESPONSE
+        && response[3] == channel
+        && response[4] == cmd
+        && response[5] != RESPONSE_NO_ERROR)
+        return false;
+    CheckChannelResponse (response, channel, cmd, RESPONSE_NO_ERROR);
+    return true;
+}
+
+/** Check that 'reply' is a 'msg_id' message with at least 'size' data
+ * bytes, throws otherwise.  AntStick::ReadInternalMessage() returns an empty
+ * message if the stick did not reply in time.
+ */
+void CheckQueryReply (const Buffer &reply, uint8_t msg_id, unsigned size)
+{
+    // An ANT message is SYNC, LEN, MSGID, DATA, CHECKSUM
+    if (reply.size() < 4)
+        throw std::runtime_error ("AntStick::QueryInfo: no reply");
+    if (reply[2] != msg_id)
+        throw std::runtime_error ("AntStick::QueryInfo: unexpected message");
+    if (reply[1] < size || reply.size() < size + 4u)
+        throw std::runtime_error ("AntStick::QueryInfo: short reply");
+}
+
 void AddMessageChecksum (Buffer &b)
 {
     uint8_t c = 0;
@@ -245,6 +332,47 @@ const char *ChannelEventAsString(AntChannelEvent e)
     return "unknown channel event";
 }
 
+const char *BatteryStatusAsString(AntChannel::BatteryStatus s)
+{
+    switch (s) {
+    case AntChannel::BATTERY_NEW: return "NEW";
+    case AntChannel::BATTERY_GOOD: return "GOOD";
+    case AntChannel::BATTERY_OK: return "OK";
+    case AntChannel::BATTERY_LOW: return "LOW";
+    case AntChannel::BATTERY_CRITICAL: return "CRITICAL";
+    default: return "UNKNOWN";
+    }
+}
+
+std::ostream& operator<<(std::ostream &out, const AntChannel::DeviceInfo &info)
+{
+    const char *separator = "";
+    auto field = [&](const char *name) -> std::ostream& {
+        out << separator << name << ": ";
+        separator = ";";
+        return out;
+    };
+    if (info.ManufacturerId >= 0)
+        field("MFR") << info.ManufacturerId;
+    if (info.ModelNumber >= 0)
+        field("MODEL") << info.ModelNumber;
+    if (info.HardwareRevision >= 0)
+        field("HW") << info.HardwareRevision;
+    if (info.SoftwareVersion >= 0)
+        field("SW") << info.SoftwareVersion;
+    if (info.SerialNumber >= 0)
+        field("SERIAL") << info.SerialNumber;
+    if (info.Battery != AntChannel::BATTERY_UNKNOWN)
+        field("BATTERY") << BatteryStatusAsString(info.Battery);
+    if (info.BatteryLevel >= 0)
+        field("CHARGE") << info.BatteryLevel;
+    if (info.BatteryVoltage >= 0)
+        field("VOLTAGE") << info.BatteryVoltage;
+    if (info.OperatingTime >= 0)
+        field("UPTIME") << info.OperatingTime;
+    return out;
+}
+
 
 // ................................................... AntMessageReader ....
 
@@ -255,25 +383,38 @@ public:
     AntMessageReader (libusb_device_handle *dh, uint8_t endpoint);
     ~AntMessageReader();
 
-    void MaybeGetNextMessage(Buffer &message);
-    void GetNextMessage (Buffer &message);
+    int MaybeGetNextMessage(Buffer &message, const char *&who);
+    int GetNextMessage (Buffer &message, const char *&who);
+    bool GetReceivedMessage (Buffer &message);
 
-private:
+    /** Number of messages discarded because of a bad checksum */
+    int BadMessageCount() const { return m_BadMessages; }
 
-    void GetNextMessage1(Buffer &message);
+private:
 
     static void LIBUSB_CALL Trampoline (libusb_transfer *);
-    void SubmitUsbTransfer();
+    int SubmitUsbTransfer();
     void CompleteUsbTransfer(const libusb_transfer *);
+    void DecodeMessages();
 
     libusb_device_handle *m_DeviceHandle;
     uint8_t m_Endpoint;
     libusb_transfer *m_Transfer;
+    int m_ReadSize;             // a multiple of the endpoint max packet size
 
     /** Hold partial data received from the USB stick.  A single USB read
      * might not return an entire ANT message. */
     Buffer m_Buffer;
     unsigned m_Mark;            // buffer position up to where data is available
+
+    /** Messages decoded from the received data, not yet returned.  Entries
+     * m_ReadyHead to m_ReadyCount are valid, the others are kept so their
+     * storage is reused. */
+    std::vector<Buffer> m_Ready;
+    unsigned m_ReadyHead;
+    unsigned m_ReadyCount;
+
+    int m_BadMessages;
     bool m_Active;              // is there a transfer active?
 };
 
@@ -282,10 +423,18 @@ AntMessageReader::AntMessageReader (libusb_device_handle *dh, uint8_t endpoint)
     : m_DeviceHandle (dh),
       m_Endpoint (endpoint),
       m_Transfer (nullptr),
+      m_ReadSize (0),
       m_Mark(0),
+      m_ReadyHead(0),
+      m_ReadyCount(0),
+      m_BadMessages(0),
       m_Active (false)
 {
-    m_Buffer.reserve (1024);
+    int packet_size = libusb_get_max_packet_size(libusb_get_device(dh), endpoint);
+    if (packet_size <= 0)
+        packet_size = DEFAULT_MAX_PACKET_SIZE;
+    m_ReadSize = READ_PACKETS * packet_size;
+    m_Buffer.reserve (1024 + m_ReadSize);
     m_Transfer = libusb_alloc_transfer (0);
 }
 
@@ -303,81 +452,117 @@ AntMessageReader::~AntMessageReader()
 /** Fill `message' with the next available message.  If no message is received
  * within a small amount of time, an empty buffer is returned.  If a message
  * is returned, it is a valid message (good header, length and checksum).
+ * Returns a negative libusb error code, with the failed call in `who', if
+ * the USB transfers failed.
  */
-void AntMessageReader::MaybeGetNextMessage (Buffer &message)
+int AntMessageReader::MaybeGetNextMessage (Buffer &message, const char *&who)
 {
-    message.clear();
+    // Keep a read outstanding, even when there are decoded messages, so the
+    // stick can send data while they are processed.
+    if (! m_Active) {
+        int r = SubmitUsbTransfer();
+        if (r < 0) {
+            who = "libusb_submit_transfer";
+            message.clear();
+            return r;
+        }
+    }
 
-    if (m_Active) {
-        struct timeval tv;
-        tv.tv_sec = 0;
-        tv.tv_usec = 10 * 1000;
-        int r = libusb_handle_events_timeout_completed (nullptr, &tv, nullptr);
-        if (r < 0)
-            throw LibusbError ("libusb_handle_events_timeout_completed", r);
+    if (GetReceivedMessage(message))
+        return LIBUSB_SUCCESS;
+
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = 10 * 1000;
+    int r = libusb_handle_events_timeout_completed (nullptr, &tv, nullptr);
+    if (r < 0) {
+        who = "libusb_handle_events_timeout_completed";
+        return r;
     }
 
-    if(! m_Active) {
-        // a transfer was completed, see if we have a full message.
-        GetNextMessage1(message);
+    GetReceivedMessage(message);
+    return LIBUSB_SUCCESS;
+}
+
+/** Fill `message' with a message already decoded, without waiting for USB
+ * transfers.  Returns false, with an empty `message', if there is none.
+ * The storage of `message' is swapped with the decoded message, so no
+ * memory is allocated once the buffers have grown to the message size.
+ */
+bool AntMessageReader::GetReceivedMessage (Buffer &message)
+{
+    if (m_ReadyHead == m_ReadyCount) {
+        message.clear();
+        return false;
     }
+    message.swap(m_Ready[m_ReadyHead++]);
+    if (m_ReadyHead == m_ReadyCount)
+        m_ReadyHead = m_ReadyCount = 0;
+    return true;
 }
 
 
 /** Fill `message' with the next available message.  If a message is returned,
- * it is a valid message (good header, length and checksum).  If no message is
- * received within a small amount of time, a timeout exception will be
- * thrown.
+ * it is a valid message (good header, length and checksum).  `message' is
+ * empty if no message is received within a small amount of time.  Errors
+ * are returned as for MaybeGetNextMessage().
  */
-void AntMessageReader::GetNextMessage(Buffer &message)
+int AntMessageReader::GetNextMessage(Buffer &message, const char *&who)
 {
-    MaybeGetNextMessage(message);
+    int r = MaybeGetNextMessage(message, who);
     int tries = 100;
-    while (message.empty() && tries > 0)
+    while (r == LIBUSB_SUCCESS && message.empty() && tries > 0)
     {
-        MaybeGetNextMessage(message);
+        r = MaybeGetNextMessage(message, who);
         tries--;
     }
-    if (message.empty())
-        throw std::runtime_error ("AntMessageReader::GetNextMessage: timed out");
+    return r;
 }
 
-void AntMessageReader::GetNextMessage1(Buffer &message)
+/** Decode all the complete messages in the received data and add them to
+ * the ready messages.  A partial message at the end is kept until the rest
+ * of it is received. */
+void AntMessageReader::DecodeMessages()
 {
     // Cannot operate on the buffer while a transfer is active
     assert (! m_Active);
 
-    // In case the CompleteUsbTransfer was not called...
-    m_Buffer.erase(m_Buffer.begin() + m_Mark, m_Buffer.end());
-
-    // Look for the sync byte which starts a message
-    while ((! m_Buffer.empty()) && m_Buffer[0] != SYNC_BYTE) {
-        m_Buffer.erase(m_Buffer.begin());
-        m_Mark--;
-    }
-
-    // An ANT message has the following sequence: SYNC, LEN, MSGID, DATA,
-    // CHECKSUM.  An empty message has at least 4 bytes in it.
-    if (m_Mark < 4) {
-        SubmitUsbTransfer();
-        return MaybeGetNextMessage(message);
-    }
-
-    // LEN is the length of the data, actual message length is LEN + 4.
-    unsigned len = m_Buffer[1] + 4;
+    unsigned pos = 0;
+    while (pos < m_Mark) {
+        // Look for the sync byte which starts a message
+        if (m_Buffer[pos] != SYNC_BYTE) {
+            pos++;
+            continue;
+        }
 
-    if (m_Mark < len) {
-        SubmitUsbTransfer();
-        return MaybeGetNextMessage(message);
+        // An ANT message has the following sequence: SYNC, LEN, MSGID, DATA,
+        // CHECKSUM.  An empty message has at least 4 bytes in it.  LEN is
+        // the length of the data, actual message length is LEN + 4.
+        if (m_Mark - pos < 4 || m_Mark - pos < m_Buffer[pos + 1] + 4u)
+            break;
+        unsigned len = m_Buffer[pos + 1] + 4;
+
+        if (m_ReadyCount == m_Ready.size())
+            m_Ready.emplace_back();
+        Buffer &message = m_Ready[m_ReadyCount];
+        message.assign(m_Buffer.begin() + pos, m_Buffer.begin() + pos + len);
+        pos += len;
+
+        // A corrupted message is dropped, the next one is likely to be good.
+        if (IsGoodChecksum (message)) {
+            m_ReadyCount++;
+        } else {
+#if defined DEBUG_OUTPUT
+            std::cerr << "AntMessageReader: dropping message with bad checksum\n";
+            DumpData (&message[0], message.size(), std::cerr);
+#endif
+            m_BadMessages++;
+        }
     }
 
-    std::copy(m_Buffer.begin(), m_Buffer.begin() + len, std::back_inserter(message));
-    // Remove the message from the buffer.
-    m_Buffer.erase (m_Buffer.begin(), m_Buffer.begin() + len);
-    m_Mark -= len;
-
-    if (! IsGoodChecksum (message))
-        throw std::runtime_error ("AntMessageReader::GetNextMessage1: bad checksum");
+    // Remove the decoded messages from the buffer, in one go.
+    m_Buffer.erase (m_Buffer.begin(), m_Buffer.begin() + pos);
+    m_Mark -= pos;
 }
 
 void LIBUSB_CALL AntMessageReader::Trampoline (libusb_transfer *t)
@@ -386,25 +571,27 @@ void LIBUSB_CALL AntMessageReader::Trampoline (libusb_transfer *t)
     a->CompleteUsbTransfer (t);
 }
 
-void AntMessageReader::SubmitUsbTransfer()
+int AntMessageReader::SubmitUsbTransfer()
 {
     assert (! m_Active);
 
-    const int read_size = 128;
     const int timeout = 10000;
 
-    // Make sure we have enough space in the buffer.
-    m_Buffer.resize (m_Mark + read_size);
+    // Make sure we have enough space in the buffer.  The read size is a
+    // multiple of the max packet size: the stick sends whole packets, and a
+    // packet which does not fit in a read fails it with an overflow error.
+    m_Buffer.resize (m_Mark + m_ReadSize);
 
     libusb_fill_bulk_transfer (
         m_Transfer, m_DeviceHandle, m_Endpoint,
-        &m_Buffer[m_Mark], read_size, Trampoline, this, timeout);
+        &m_Buffer[m_Mark], m_ReadSize, Trampoline, this, timeout);
 
     int r = libusb_submit_transfer (m_Transfer);
     if (r < 0)
-        throw LibusbError ("libusb_submit_transfer", r);
+        return r;
 
     m_Active = true;
+    return LIBUSB_SUCCESS;
 }
 
 void AntMessageReader::CompleteUsbTransfer(const libusb_transfer *t)
@@ -418,6 +605,7 @@ void AntMessageReader::CompleteUsbTransfer(const libusb_transfer *t)
     }
 
     m_Buffer.erase(m_Buffer.begin() + m_Mark, m_Buffer.end());
+    DecodeMessages();
 }
 
 
@@ -431,14 +619,14 @@ public:
     AntMessageWriter (libusb_device_handle *dh, uint8_t endpoint);
     ~AntMessageWriter();
 
-    void WriteMessage (const Buffer &message);
+    int WriteMessage (const Buffer &message, const char *&who);
 
 private:
 
     static void LIBUSB_CALL Trampoline (libusb_transfer *);
-    void SubmitUsbTransfer(const Buffer &message, int timeout);
+    int SubmitUsbTransfer(const Buffer &message, int timeout);
     void CompleteUsbTransfer(const libusb_transfer *);
-    void WaitForCompletion(int timeout);
+    int WaitForCompletion(int timeout);
 
     libusb_device_handle *m_DeviceHandle;
     uint8_t m_Endpoint;
@@ -466,14 +654,24 @@ AntMessageWriter::~AntMessageWriter()
 
 /** Write `message' to the USB device.  This is presumably an ANT message, but
  * we don't check.  When this function returns, the message has been written
- * (there is no buffering on the application side). An exception is thrown if
- * there is an error or a timeout.
+ * (there is no buffering on the application side).  Returns
+ * LIBUSB_SUCCESS, or, if there is an error or a timeout, the libusb error
+ * code or transfer status, with the failed call in `who'.
  */
-void AntMessageWriter::WriteMessage (const Buffer &message)
+int AntMessageWriter::WriteMessage (const Buffer &message, const char *&who)
 {
     assert (! m_Active);
-    SubmitUsbTransfer(message, 2000 /* milliseconds */);
-    WaitForCompletion(2000 /* milliseconds */);
+    int r = SubmitUsbTransfer(message, 2000 /* milliseconds */);
+    if (r < 0) {
+        who = "libusb_submit_transfer";
+        return r;
+    }
+    r = WaitForCompletion(2000 /* milliseconds */);
+    if (r < 0) {
+        // The transfer is still active, it is cancelled by the destructor
+        who = "libusb_handle_events_timeout_completed";
+        return r;
+    }
 
     if (m_Transfer->status == LIBUSB_TRANSFER_COMPLETED) {
         m_Active = false; // sometimes CompleteUsbTransfer() is not called, not sure why...
@@ -481,17 +679,19 @@ void AntMessageWriter::WriteMessage (const Buffer &message)
 
     if (m_Active || m_Transfer->status != LIBUSB_TRANSFER_COMPLETED) {
         m_Active = false;
-        int r = 0;
 
         if (m_Transfer->status == LIBUSB_TRANSFER_STALL) {
             r = libusb_clear_halt(m_DeviceHandle, m_Endpoint);
             if (r < 0) {
-                throw LibusbError("libusb_clear_halt", r);
+                who = "libusb_clear_halt";
+                return r;
             }
         }
 
-        throw LibusbError("AntMessageReader", m_Transfer->status);
+        who = "AntMessageWriter";
+        return m_Transfer->status;
     }
+    return LIBUSB_SUCCESS;
 }
 
 void LIBUSB_CALL AntMessageWriter::Trampoline (libusb_transfer *t)
@@ -500,7 +700,7 @@ void LIBUSB_CALL AntMessageWriter::Trampoline (libusb_transfer *t)
     a->CompleteUsbTransfer (t);
 }
 
-void AntMessageWriter::SubmitUsbTransfer(const Buffer &message, int timeout)
+int AntMessageWriter::SubmitUsbTransfer(const Buffer &message, int timeout)
 {
     m_Buffer = message;
 
@@ -510,9 +710,10 @@ void AntMessageWriter::SubmitUsbTransfer(const Buffer &message, int timeout)
 
     int r = libusb_submit_transfer (m_Transfer);
     if (r < 0)
-        throw LibusbError ("libusb_submit_transfer", r);
+        return r;
 
     m_Active = true;
+    return LIBUSB_SUCCESS;
 }
 
 void AntMessageWriter::CompleteUsbTransfer(const libusb_transfer *t)
@@ -521,7 +722,7 @@ void AntMessageWriter::CompleteUsbTransfer(const libusb_transfer *t)
     m_Active = false;
 }
 
-void AntMessageWriter::WaitForCompletion(int timeout)
+int AntMessageWriter::WaitForCompletion(int timeout)
 {
     using namespace std::chrono;
 
@@ -529,7 +730,7 @@ void AntMessageWriter::WaitForCompletion(int timeout)
     tv.tv_sec = timeout / 1000;
     tv.tv_usec = (timeout - tv.tv_sec * 1000) * 1000;
     auto start = high_resolution_clock::now();
-    milliseconds accumulated;
+    milliseconds accumulated(0);
 
     // NOTE: libusb_handle_events and friends will handle all USB events, but
     // not necessarily our event, as such they might return before our
@@ -540,10 +741,11 @@ void AntMessageWriter::WaitForCompletion(int timeout)
     {
         int r = libusb_handle_events_timeout_completed (nullptr, &tv, nullptr);
         if (r < 0)
-            throw LibusbError ("libusb_handle_events_timeout_completed", r);
+            return r;
         auto now = high_resolution_clock::now();
         accumulated = duration_cast<milliseconds>(now - start);
     }
+    return LIBUSB_SUCCESS;
 }
 
 
@@ -553,26 +755,35 @@ AntChannel::AntChannel (AntStick *stick,
                         AntChannel::Id channel_id,
                         unsigned period,
                         uint8_t timeout,
-                        uint8_t frequency)
+                        uint8_t frequency,
+                        const SearchConfig &search,
+                        int network)
     : m_Stick (stick),
       m_IdReqestOutstanding (false),
       m_AckDataRequestOutstanding(false),
       m_ChannelId(channel_id),
       m_MessagesReceived(0),
-      m_MessagesFailed(0)
+      m_LastMessageTime(0),
+      m_MessagesFailed(0),
+      m_DeviceInfoUpdates(0)
 {
+    ResetDeviceInfo();
     m_ChannelNumber = stick->NextChannelId();
 
     if (m_ChannelNumber == -1)
         throw std::runtime_error("AntChannel: no more channel ids left");
 
+    m_Network = (network >= 0) ? network : m_Stick->GetNetwork();
+    if (m_Network < 0)
+        throw std::runtime_error("AntChannel: no network key set");
+
     // we hard code the type to BIDIRECTIONAL_RECEIVE, using other channel
     // types would require changes to the handling code anyway.
     m_Stick->WriteMessage (
         MakeMessage (
             ASSIGN_CHANNEL, m_ChannelNumber,
             static_cast<uint8_t>(BIDIRECTIONAL_RECEIVE),
-            static_cast<uint8_t>(m_Stick->GetNetwork())));
+            static_cast<uint8_t>(m_Network)));
     Buffer response = m_Stick->ReadInternalMessage();
     CheckChannelResponse (response, m_ChannelNumber, ASSIGN_CHANNEL, 0);
 
@@ -588,6 +799,7 @@ AntChannel::AntChannel (AntStick *stick,
     CheckChannelResponse (response, m_ChannelNumber, SET_CHANNEL_ID, 0);
 
     Configure(period, timeout, frequency);
+    ConfigureSearch(search);
 
     m_Stick->WriteMessage (
         MakeMessage (OPEN_CHANNEL, m_ChannelNumber));
@@ -602,8 +814,8 @@ AntChannel::~AntChannel()
 {
     try {
         // The user has not called RequestClose(), try to close the channel
-        // now, but this might fail.
-        if (m_State != CH_CLOSED) {
+        // now, but this might fail.  There is no point if the stick failed.
+        if (m_State != CH_CLOSED && ! m_Stick->Failed()) {
             m_Stick->WriteMessage (MakeMessage (CLOSE_CHANNEL, m_ChannelNumber));
             Buffer response = m_Stick->ReadInternalMessage();
             CheckChannelResponse (response, m_ChannelNumber, CLOSE_CHANNEL, 0);
@@ -638,7 +850,22 @@ void AntChannel::RequestClose()
 
 void AntChannel::SendAcknowledgedData(int tag, const Buffer &message)
 {
-    m_AckDataQueue.push(AckDataItem(tag, message));
+    // The first item is in flight if a request is outstanding, it cannot be
+    // replaced.
+    auto start = m_AckDataQueue.begin();
+    if (m_AckDataRequestOutstanding && start != m_AckDataQueue.end())
+        ++start;
+    auto pending = std::find_if(start, m_AckDataQueue.end(),
+                                [tag](const AckDataItem &item) { return item.tag == tag; });
+    if (pending != m_AckDataQueue.end() && pending + 1 == m_AckDataQueue.end()) {
+        pending->data = message;
+        return;
+    }
+    // Updating a message in place would send the new value ahead of the
+    // messages queued after the old one, so it is moved to the end instead.
+    if (pending != m_AckDataQueue.end())
+        m_AckDataQueue.erase(pending);
+    m_AckDataQueue.push_back(AckDataItem(tag, message));
 }
 
 void AntChannel::RequestDataPage(uint8_t page_id, int transmit_count)
@@ -679,6 +906,56 @@ void AntChannel::Configure (unsigned period, uint8_t timeout, uint8_t frequency)
     CheckChannelResponse(response, m_ChannelNumber, SET_CHANNEL_RF_FREQ, 0);
 }
 
+/** Set up the inclusion/exclusion list and proximity search for the
+ * channel, these need to be configured before the channel is opened.  A
+ * stick which does not support these features is reported, but the channel
+ * still works, with an unrestricted search.
+ */
+void AntChannel::ConfigureSearch (const SearchConfig &search)
+{
+    if (m_ChannelId.DeviceNumber != 0)
+        return;                         // not searching
+
+    bool ok = true;
+    int list_size = std::min(static_cast<int>(search.DeviceList.size()),
+                             static_cast<int>(SearchConfig::MAX_DEVICES));
+    for (int i = 0; i < list_size && ok; ++i) {
+        uint32_t device_number = search.DeviceList[i];
+        Buffer data;
+        data.push_back(static_cast<uint8_t>(m_ChannelNumber));
+        data.push_back(static_cast<uint8_t>(device_number & 0xFF));
+        data.push_back(static_cast<uint8_t>((device_number >> 8) & 0xFF));
+        data.push_back(m_ChannelId.DeviceType);
+        // High nibble of the transmission type holds the top 4 bits of the
+        // 20 bit device number, as for SET_CHANNEL_ID.
+        data.push_back(static_cast<uint8_t>((device_number >> 12) & 0xF0));
+        data.push_back(static_cast<uint8_t>(i));
+        m_Stick->WriteMessage (MakeMessage (ADD_CHANNEL_ID, data));
+        ok = CheckOptionalChannelResponse (
+            m_Stick->ReadInternalMessage(), m_ChannelNumber, ADD_CHANNEL_ID);
+    }
+    if (list_size > 0 && ok) {
+        m_Stick->WriteMessage (
+            MakeMessage (CONFIG_LIST, m_ChannelNumber,
+                         static_cast<uint8_t>(list_size),
+                         static_cast<uint8_t>(search.Exclude ? 1 : 0)));
+        ok = CheckOptionalChannelResponse (
+            m_Stick->ReadInternalMessage(), m_ChannelNumber, CONFIG_LIST);
+    }
+    if (! ok)
+        std::cerr << "AntChannel: inclusion/exclusion lists not supported by ANT stick\n";
+
+    if (search.ProximityBin > 0) {
+        int bin = std::min(search.ProximityBin,
+                           static_cast<int>(SearchConfig::MAX_PROXIMITY_BIN));
+        m_Stick->WriteMessage (
+            MakeMessage (PROXIMITY_SEARCH, m_ChannelNumber, static_cast<uint8_t>(bin)));
+        if (! CheckOptionalChannelResponse (
+                m_Stick->ReadInternalMessage(), m_ChannelNumber, PROXIMITY_SEARCH))
+            std::cerr << "AntChannel: proximity search not supported by ANT stick\n";
+    }
+}
+
 /** Called by the AntStick::Tick method to process a message received on this
  * channel.  This will look for some channel events, and process them, but
  * delegate most of the messages to ProcessMessage() in the derived class.
@@ -705,11 +982,13 @@ void AntChannel::HandleMessage(const uint8_t *data, int size)
             // We received a broadcast message on this channel and we don't
             // have a master serial number, find out who is sending us
             // broadcast data
-            m_Stick->WriteMessage (
+            m_Stick->TryWriteMessage (
                 MakeMessage (REQUEST_MESSAGE, m_ChannelNumber, SET_CHANNEL_ID));
             m_IdReqestOutstanding = true;
         }
         MaybeSendAckData();
+        m_LastMessageTime = CurrentMicroseconds();
+        ProcessCommonPage(data, size);
         OnMessageReceived(data, size);
         m_MessagesReceived++;
         break;
@@ -729,7 +1008,7 @@ void AntChannel::MaybeSendAckData()
 {
     if (! m_AckDataRequestOutstanding && ! m_AckDataQueue.empty()) {
         const AckDataItem &item = m_AckDataQueue.front();
-        m_Stick->WriteMessage(MakeMessage(ACKNOWLEDGE_DATA, m_ChannelNumber, item.data));
+        m_Stick->TryWriteMessage(MakeMessage(ACKNOWLEDGE_DATA, m_ChannelNumber, item.data));
         m_AckDataRequestOutstanding = true;
     }
 }
@@ -758,9 +1037,19 @@ void AntChannel::OnChannelResponseMessage (const uint8_t *data, int size)
             // NOTE: a search timeout will close the channel.
             if (m_State != CH_CLOSED) {
                 ChangeState(CH_CLOSED);
-                m_Stick->WriteMessage(MakeMessage(UNASSIGN_CHANNEL, m_ChannelNumber));
+                if (! m_Stick->TryWriteMessage(MakeMessage(UNASSIGN_CHANNEL, m_ChannelNumber)))
+                    return;             // the stick failed, see AntStick::Failed()
                 Buffer response = m_Stick->ReadInternalMessage();
-                CheckChannelResponse(response, m_ChannelNumber, UNASSIGN_CHANNEL, 0);
+                if (m_Stick->Failed())
+                    return;
+                if (! IsChannelResponse(response, m_ChannelNumber, UNASSIGN_CHANNEL, 0)) {
+                    // The channel is closed anyway, don't stop the other
+                    // channels because of this.
+                    m_Stick->m_DroppedMessages++;
+#if defined DEBUG_OUTPUT
+                    std::cerr << "AntChannel: bad response to UNASSIGN_CHANNEL\n";
+#endif
+                }
             }
             return;
         }
@@ -771,10 +1060,11 @@ void AntChannel::OnChannelResponseMessage (const uint8_t *data, int size)
         else if (event == RESPONSE_NO_ERROR) {
             // we seem to be getting these from time to time, ignore them
         }
-        else if (m_AckDataRequestOutstanding) {
-            // We received a status for a ACKNOWLEDGE_DATA transmission
+        else if (m_AckDataRequestOutstanding && event != EVENT_RX_FAIL) {
+            // We received a status for a ACKNOWLEDGE_DATA transmission.  An
+            // RX fail can arrive while waiting for it, it is not the reply.
             auto tag = m_AckDataQueue.front().tag;
-            m_AckDataQueue.pop();
+            m_AckDataQueue.pop_front();
             m_AckDataRequestOutstanding = false;
             OnAcknowledgedDataReply(tag, event);
         }
@@ -808,7 +1098,11 @@ void AntChannel::OnChannelIdMessage (const uint8_t *data, int size)
     // therefore it should be an assert(), but this is a packet we received
     // from the AntStick...)
     if (data[3] != m_ChannelNumber) {
-        throw std::runtime_error ("AntChannel::OnChannelIdMessage: unexpected channel number");
+        m_Stick->m_DroppedMessages++;
+#if defined DEBUG_OUTPUT
+        std::cerr << "AntChannel::OnChannelIdMessage: unexpected channel number\n";
+#endif
+        return;
     }
 
     auto transmission_type = static_cast<TransmissionType>(data[7] & 0x03);
@@ -821,16 +1115,28 @@ void AntChannel::OnChannelIdMessage (const uint8_t *data, int size)
         m_ChannelId.DeviceType = device_type;
     } else if (m_ChannelId.DeviceType != device_type) {
         // we seem to have paired up with a different device type than we
-        // asked for...
-        throw std::runtime_error ("AntChannel::OnChannelIdMessage: unexpected device type");
+        // asked for... Ignore the reply, the channel ID is requested again
+        // with the next broadcast message.
+        m_Stick->m_DroppedMessages++;
+        m_IdReqestOutstanding = false;
+#if defined DEBUG_OUTPUT
+        std::cerr << "AntChannel::OnChannelIdMessage: unexpected device type\n";
+#endif
+        return;
     }
 
     if (m_ChannelId.DeviceNumber == 0) {
         m_ChannelId.DeviceNumber = device_number;
+        m_DeviceInfoUpdates++;          // users report the device number too
     } else if (m_ChannelId.DeviceNumber != device_number) {
         // we seem to have paired up with a different device than we asked
         // for...
-        throw std::runtime_error ("AntChannel::OnChannelIdMessage: unexpected device number");
+        m_Stick->m_DroppedMessages++;
+        m_IdReqestOutstanding = false;
+#if defined DEBUG_OUTPUT
+        std::cerr << "AntChannel::OnChannelIdMessage: unexpected device number\n";
+#endif
+        return;
     }
 
     // NOTE: fist channel id responses might not contain a message ID.
@@ -844,11 +1150,119 @@ void AntChannel::OnChannelIdMessage (const uint8_t *data, int size)
     m_IdReqestOutstanding = false;
 }
 
+/** Decode the ANT+ common data pages, which are the same for all device
+ * profiles, into m_DeviceInfo.  Devices broadcast these pages every few
+ * seconds, but their contents rarely change, so a page is only decoded if
+ * it is different from the last one received.  The message is still passed
+ * on to OnMessageReceived(), profiles can ignore these pages.
+ */
+void AntChannel::ProcessCommonPage(const uint8_t *data, int size)
+{
+    if (size < 4 + PAYLOAD_SIZE)
+        return;
+    const uint8_t *payload = data + 4;
+    int page = payload[0];
+    // Number of payload bytes which hold the device information
+    int length = PAYLOAD_SIZE;
+    int index = -1;
+
+    if (m_ChannelId.DeviceType == HRM_DEVICE_TYPE) {
+        // Bit 7 of the HRM page number is a toggle bit, which changes every
+        // four messages.  The last four bytes of all HRM pages hold the
+        // heart beat data, only the first four describe the device.
+        page &= 0x7F;
+        switch (page) {
+        case HRM_MANUFACTURER_INFO: index = DIP_HRM_MANUFACTURER_INFO; break;
+        case HRM_PRODUCT_INFO: index = DIP_HRM_PRODUCT_INFO; break;
+        case HRM_BATTERY_STATUS: index = DIP_HRM_BATTERY_STATUS; break;
+        }
+        if (index >= 0)
+            length = 4;
+    }
+    if (index < 0) {
+        switch (page) {
+        case CP_MANUFACTURER_INFO: index = DIP_MANUFACTURER_INFO; break;
+        case CP_PRODUCT_INFO: index = DIP_PRODUCT_INFO; break;
+        case CP_BATTERY_STATUS: index = DIP_BATTERY_STATUS; break;
+        default: return;
+        }
+    }
+
+    if (memcmp(m_CommonPages[index], payload, length) == 0)
+        return;
+    memcpy(m_CommonPages[index], payload, length);
+
+    // The battery voltage and status are encoded the same way in the common
+    // and in the HRM battery pages.
+    auto decode_battery = [this](uint8_t fractional, uint8_t descriptive) {
+        int coarse = descriptive & 0x0F;
+        m_DeviceInfo.BatteryVoltage = (coarse == 0x0F) ? -1 : coarse + fractional / 256.0;
+        int status = (descriptive >> 4) & 0x07;
+        m_DeviceInfo.Battery = (status >= BATTERY_NEW && status <= BATTERY_CRITICAL)
+            ? static_cast<BatteryStatus>(status) : BATTERY_UNKNOWN;
+    };
+
+    switch (index) {
+    case DIP_MANUFACTURER_INFO:
+        m_DeviceInfo.HardwareRevision = payload[3];
+        m_DeviceInfo.ManufacturerId = payload[4] | (payload[5] << 8);
+        m_DeviceInfo.ModelNumber = payload[6] | (payload[7] << 8);
+        break;
+    case DIP_PRODUCT_INFO: {
+        // The supplemental revision is 0xFF if not used, otherwise the
+        // version is MAIN.SUPPLEMENTAL, e.g 1.05
+        int supplemental = payload[2];
+        int main = payload[3];
+        m_DeviceInfo.SoftwareVersion = (supplemental == 0xFF)
+            ? main / 10.0 : (main * 100 + supplemental) / 1000.0;
+        uint32_t serial = payload[4] | (payload[5] << 8)
+            | (payload[6] << 16) | (static_cast<uint32_t>(payload[7]) << 24);
+        m_DeviceInfo.SerialNumber = (serial == 0xFFFFFFFF) ? -1 : serial;
+        break;
+    }
+    case DIP_BATTERY_STATUS: {
+        uint32_t ticks = payload[3] | (payload[4] << 8) | (payload[5] << 16);
+        // Bit 7 of the descriptive field selects 2 or 16 second ticks.
+        m_DeviceInfo.OperatingTime = ticks * ((payload[7] & 0x80) ? 2 : 16);
+        decode_battery(payload[6], payload[7]);
+        break;
+    }
+    case DIP_HRM_MANUFACTURER_INFO:
+        m_DeviceInfo.ManufacturerId = payload[1];
+        // The page holds the upper 16 bits of the serial number, the lower
+        // 16 bits are the device number.
+        m_DeviceInfo.SerialNumber = (static_cast<uint32_t>(payload[2] | (payload[3] << 8)) << 16)
+            | (m_ChannelId.DeviceNumber & 0xFFFF);
+        break;
+    case DIP_HRM_PRODUCT_INFO:
+        m_DeviceInfo.HardwareRevision = payload[1];
+        // Same scale as the common product page main software revision
+        m_DeviceInfo.SoftwareVersion = payload[2] / 10.0;
+        m_DeviceInfo.ModelNumber = payload[3];
+        break;
+    case DIP_HRM_BATTERY_STATUS:
+        m_DeviceInfo.BatteryLevel = (payload[1] == 0xFF) ? -1 : payload[1];
+        decode_battery(payload[2], payload[3]);
+        break;
+    }
+    m_DeviceInfoUpdates++;
+}
+
+void AntChannel::ResetDeviceInfo()
+{
+    memset(m_CommonPages, 0, sizeof(m_CommonPages));
+    m_DeviceInfo = DeviceInfo();
+    m_DeviceInfoUpdates++;
+}
+
 /** Change the channel state to 'new_state' and call OnStateChanged() if the
  * state has actually changed.
  */
 void AntChannel::ChangeState(State new_state)
 {
+    // We might pair with a different device after searching again.
+    if (new_state == CH_SEARCHING && m_State != CH_SEARCHING)
+        ResetDeviceInfo();
     if (m_State != new_state) {
         OnStateChanged(m_State, new_state);
         m_State = new_state;
@@ -1023,13 +1437,32 @@ void GetAntStickReadWriteEndpoints(
     }
 }
 
-AntStick::AntStick()
-    : m_DeviceHandle (nullptr),
-      m_SerialNumber (0),
-      m_Version (""),
-      m_MaxNetworks (-1),
-      m_MaxChannels (-1),
-      m_Network(-1)
+// ....................................................... UsbTransport ....
+
+/** Transport for an ANT stick connected to an USB port. */
+class UsbTransport : public AntTransport
+{
+public:
+    UsbTransport();
+    ~UsbTransport();
+
+    Status WriteMessage(const Buffer &message) override;
+    Status MaybeGetNextMessage(Buffer &message) override;
+    Status GetNextMessage(Buffer &message) override;
+    Status GetReceivedMessage(Buffer &message) override;
+    Status WaitForEvents(int milliseconds) override;
+    int BadMessageCount() const override;
+
+private:
+    Status CheckResult(int r, const char *who);
+
+    libusb_device_handle *m_DeviceHandle;
+    std::unique_ptr<AntMessageReader> m_Reader;
+    std::unique_ptr<AntMessageWriter> m_Writer;
+};
+
+UsbTransport::UsbTransport()
+    : m_DeviceHandle (nullptr)
 {
     try {
         m_DeviceHandle = FindAntStick();
@@ -1068,11 +1501,6 @@ AntStick::AntStick()
         auto wt = std::unique_ptr<AntMessageWriter>(
             new AntMessageWriter (m_DeviceHandle, write_endpoint));
         m_Writer = std::move (wt);
-
-        Reset();
-        QueryInfo();
-
-        m_LastReadMessage.reserve (1024);
     }
     catch (...)
     {
@@ -1085,7 +1513,7 @@ AntStick::AntStick()
     }
 }
 
-AntStick::~AntStick()
+UsbTransport::~UsbTransport()
 {
     m_Reader = std::move (std::unique_ptr<AntMessageReader>());
     m_Writer = std::move (std::unique_ptr<AntMessageWriter>());
@@ -1094,9 +1522,112 @@ AntStick::~AntStick()
     }
 }
 
+/** Return IO_OK if 'r' is LIBUSB_SUCCESS, otherwise record the error of
+ * the call 'who' and return IO_FAILED. */
+AntTransport::Status UsbTransport::CheckResult(int r, const char *who)
+{
+    if (r == LIBUSB_SUCCESS)
+        return IO_OK;
+    return Fail(LibusbError(who, r).what());
+}
+
+AntTransport::Status UsbTransport::WriteMessage(const Buffer &message)
+{
+    const char *who = nullptr;
+    int r = m_Writer->WriteMessage(message, who);
+    return CheckResult(r, who);
+}
+
+AntTransport::Status UsbTransport::MaybeGetNextMessage(Buffer &message)
+{
+    const char *who = nullptr;
+    int r = m_Reader->MaybeGetNextMessage(message, who);
+    return CheckResult(r, who);
+}
+
+AntTransport::Status UsbTransport::GetNextMessage(Buffer &message)
+{
+    const char *who = nullptr;
+    int r = m_Reader->GetNextMessage(message, who);
+    return CheckResult(r, who);
+}
+
+AntTransport::Status UsbTransport::GetReceivedMessage(Buffer &message)
+{
+    m_Reader->GetReceivedMessage(message);
+    return IO_OK;
+}
+
+AntTransport::Status UsbTransport::WaitForEvents(int milliseconds)
+{
+    struct timeval tv;
+    tv.tv_sec = milliseconds / 1000;
+    tv.tv_usec = (milliseconds % 1000) * 1000;
+    int r = libusb_handle_events_timeout_completed (nullptr, &tv, nullptr);
+    return CheckResult(r < 0 ? r : LIBUSB_SUCCESS,
+                       "libusb_handle_events_timeout_completed");
+}
+
+int UsbTransport::BadMessageCount() const
+{
+    return m_Reader->BadMessageCount();
+}
+
+std::unique_ptr<AntTransport> OpenUsbTransport()
+{
+    return std::unique_ptr<AntTransport>(new UsbTransport());
+}
+
+
+// ........................................................... AntStick ....
+
+AntStick::AntStick()
+    : AntStick(OpenUsbTransport())
+{
+}
+
+AntStick::AntStick(std::unique_ptr<AntTransport> transport)
+    : m_Transport (std::move(transport)),
+      m_SerialNumber (0),
+      m_Version (""),
+      m_MaxNetworks (-1),
+      m_MaxChannels (-1),
+      m_Network(-1),
+      m_DroppedMessages(0),
+      m_Failed(false)
+{
+    Reset();
+    QueryInfo();
+    m_LastReadMessage.reserve (1024);
+}
+
+AntStick::~AntStick()
+{
+    // empty
+}
+
+/** Send 'b' to the stick, returns false if the stick failed, see
+ * Failed().  Used while processing messages in Tick(), where the failure is
+ * reported by Failed() and not by an exception. */
+bool AntStick::TryWriteMessage(const Buffer &b)
+{
+    if (! m_Failed)
+        CheckStatus(m_Transport->WriteMessage (b));
+    return ! m_Failed;
+}
+
+/** Send 'b' to the stick, used when setting up the stick and channels,
+ * where a failed stick is a reason to stop, so this throws if it failed. */
 void AntStick::WriteMessage(const Buffer &b)
 {
-    m_Writer->WriteMessage (b);
+    if (! TryWriteMessage(b))
+        throw std::runtime_error(FailureMessage());
+}
+
+void AntStick::CheckStatus(AntTransport::Status status)
+{
+    if (status != AntTransport::IO_OK)
+        m_Failed = true;
 }
 
 /** Read a message from the ANT stick and return it.  This is used only for
@@ -1115,11 +1646,17 @@ const Buffer& AntStick::ReadInternalMessage()
                         message[4] == BURST_TRANSFER_DATA)));
     };
 
-    for(int i = 0; i < 50; ++i) {
-        m_Reader->GetNextMessage(m_LastReadMessage);
-        if (SetAsideMessage(m_LastReadMessage))
+    for(int i = 0; i < 50 && ! m_Failed; ++i) {
+        CheckStatus(m_Transport->GetNextMessage(m_LastReadMessage));
+        if (m_LastReadMessage.empty())
+            break;                      // timed out, or the stick failed
+        if (SetAsideMessage(m_LastReadMessage)) {
+            if (m_DelayedMessages.size() >= MAX_DELAYED_MESSAGES) {
+                m_DelayedMessages.pop();
+                m_DroppedMessages++;
+            }
             m_DelayedMessages.push(m_LastReadMessage);
-        else
+        } else
             return m_LastReadMessage;
     }
 
@@ -1143,7 +1680,7 @@ void AntStick::Reset()
         int ntries = 50;
         while (ntries-- > 0) {
             Buffer message = ReadInternalMessage();
-            if(message.size() >= 2 && message[2] == STARTUP_MESSAGE) {
+            if(message.size() > 2 && message[2] == STARTUP_MESSAGE) {
                 std::swap(m_DelayedMessages, std::queue<Buffer>());
                 return;
             }
@@ -1169,21 +1706,21 @@ void AntStick::QueryInfo()
 {
     WriteMessage (MakeMessage (REQUEST_MESSAGE, 0, RESPONSE_SERIAL_NUMBER));
     Buffer msg_serial = ReadInternalMessage();
-    if (msg_serial[2] != RESPONSE_SERIAL_NUMBER)
-        throw std::runtime_error ("AntStick::QueryInfo: unexpected message");
+    CheckQueryReply (msg_serial, RESPONSE_SERIAL_NUMBER, 4);
     m_SerialNumber = msg_serial[3] | (msg_serial[4] << 8) | (msg_serial[5] << 16) | (msg_serial[6] << 24);
 
     WriteMessage (MakeMessage (REQUEST_MESSAGE, 0, RESPONSE_VERSION));
     Buffer msg_version = ReadInternalMessage();
-    if (msg_version[2] != RESPONSE_VERSION)
-        throw std::runtime_error ("AntStick::QueryInfo: unexpected message");
-    const char *version = reinterpret_cast<const char *>(&msg_version[3]);
-    m_Version = version;
+    CheckQueryReply (msg_version, RESPONSE_VERSION, 1);
+    // The version is a null terminated string, but don't rely on the null
+    // being there.
+    auto version = msg_version.begin() + 3;
+    auto version_end = std::find (version, version + msg_version[1], 0);
+    m_Version.assign (version, version_end);
 
     WriteMessage (MakeMessage (REQUEST_MESSAGE, 0, RESPONSE_CAPABILITIES));
     Buffer msg_caps = ReadInternalMessage();
-    if (msg_caps[2] != RESPONSE_CAPABILITIES)
-        throw std::runtime_error ("AntStick::QueryInfo: unexpected message");
+    CheckQueryReply (msg_caps, RESPONSE_CAPABILITIES, 2);
 
     m_MaxChannels = msg_caps[3];
     m_MaxNetworks = msg_caps[4];
@@ -1217,18 +1754,28 @@ int AntStick::NextChannelId() const
 
 void AntStick::SetNetworkKey (uint8_t key[8])
 {
-    // Currently, only one network use is supported, so always use network id
-    // 0 for now
-    uint8_t network = 0;
+    m_Network = AddNetwork (key);
+}
+
+int AntStick::AddNetwork (const uint8_t key[8])
+{
+    std::vector<uint8_t> k(&key[0], &key[8]);
+    auto existing = std::find(m_NetworkKeys.begin(), m_NetworkKeys.end(), k);
+    if (existing != m_NetworkKeys.end())
+        return static_cast<int>(existing - m_NetworkKeys.begin());
+
+    int network = static_cast<int>(m_NetworkKeys.size());
+    if (network >= m_MaxNetworks)
+        throw std::runtime_error ("AntStick::AddNetwork: no more networks left");
 
-    m_Network = -1;
     Buffer nkey;
-    nkey.push_back (network);
-    nkey.insert (nkey.end(), &key[0], &key[8]);
+    nkey.push_back (static_cast<uint8_t>(network));
+    nkey.insert (nkey.end(), k.begin(), k.end());
     WriteMessage (MakeMessage (SET_NETWORK_KEY, nkey));
     Buffer response = ReadInternalMessage();
-    CheckChannelResponse (response, network, SET_NETWORK_KEY, 0);
-    m_Network = network;
+    CheckChannelResponse (response, static_cast<uint8_t>(network), SET_NETWORK_KEY, 0);
+    m_NetworkKeys.push_back(k);
+    return network;
 }
 
 bool AntStick::MaybeProcessMessage(const Buffer &message)
@@ -1248,39 +1795,58 @@ bool AntStick::MaybeProcessMessage(const Buffer &message)
     return false;
 }
 
+int AntStick::GetDroppedMessages() const
+{
+    return m_DroppedMessages + m_Transport->BadMessageCount();
+}
+
+/** Process the messages set aside by ReadInternalMessage() and all the
+ * messages the transport has already received, so the broadcasts received
+ * together from several channels are processed in one call.  Only the first
+ * read waits for data, and only if there are no set aside messages.  Once
+ * the stick failed, this does nothing, see Failed().
+ */
 void AntStick::Tick()
 {
-    if (m_DelayedMessages.empty())
-    {
-        m_Reader->MaybeGetNextMessage(m_LastReadMessage);
-    }
-    else
+    for (int i = 0; i < MAX_TICK_MESSAGES && ! m_Failed; i++)
     {
-        m_LastReadMessage = m_DelayedMessages.front();
-        m_DelayedMessages.pop();
-    }
+        if (! m_DelayedMessages.empty())
+        {
+            m_LastReadMessage.swap(m_DelayedMessages.front());
+            m_DelayedMessages.pop();
+        }
+        else if (i == 0)
+        {
+            CheckStatus(m_Transport->MaybeGetNextMessage(m_LastReadMessage));
+        }
+        else
+        {
+            CheckStatus(m_Transport->GetReceivedMessage(m_LastReadMessage));
+        }
 
-    if (m_LastReadMessage.empty()) return;
+        if (m_LastReadMessage.empty()) return;
 
-    //std::cout << "AntStick::Tick() got a message\n";
-    //DumpData(&m_LastReadMessage[0], m_LastReadMessage.size(), std::cout);
+        //std::cout << "AntStick::Tick() got a message\n";
+        //DumpData(&m_LastReadMessage[0], m_LastReadMessage.size(), std::cout);
 
-    if (! MaybeProcessMessage (m_LastReadMessage))
-    {
+        if (! MaybeProcessMessage (m_LastReadMessage))
+        {
 #if defined DEBUG_OUTPUT
-        std::cerr << "Unprocessed message:\n";
-        DumpData (&m_LastReadMessage[0], m_LastReadMessage.size(), std::cerr);
+            std::cerr << "Unprocessed message:\n";
+            DumpData (&m_LastReadMessage[0], m_LastReadMessage.size(), std::cerr);
 #endif
+        }
     }
 }
 
+void AntStick::WaitForEvents(int milliseconds)
+{
+    if (! m_Failed)
+        CheckStatus(m_Transport->WaitForEvents(milliseconds));
+}
+
 void TickAntStick(AntStick *s)
 {
     s->Tick();
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = 10 * 1000;
-    int r = libusb_handle_events_timeout_completed (nullptr, &tv, nullptr);
-    if (r < 0)
-        throw LibusbError("libusb_handle_events_timeout_completed", r);
+    s->WaitForEvents(10);
 }
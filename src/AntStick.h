@@ -17,8 +17,12 @@
  */
 #pragma once
 
+#include <iosfwd>
+#include <deque>
 #include <memory>
 #include <queue>
+#include <string>
+#include <vector>
 #include <stdint.h>
 
 // TODO: move libusb in the C++ file
@@ -29,8 +33,6 @@
 
 typedef std::vector<uint8_t> Buffer;
 
-class AntMessageReader;
-class AntMessageWriter;
 class AntStick;
 
 enum AntMessageId {
@@ -186,6 +188,29 @@ public:
         uint32_t DeviceNumber;
     };
 
+    /** Restrict the devices a channel searching for any device (with a
+     * DeviceNumber of 0) can pair with.  This avoids pairing with the wrong
+     * device when many devices of the same type are nearby, and makes
+     * pairing faster.
+     */
+    struct SearchConfig {
+        SearchConfig() : Exclude(false), ProximityBin(0) {}
+
+        enum { MAX_DEVICES = 4, MAX_PROXIMITY_BIN = 10 };
+
+        /** Device numbers of up to MAX_DEVICES devices which are the only
+         * ones the channel can pair with (an inclusion list) or, if
+         * 'Exclude' is true, which the channel will not pair with. */
+        std::vector<uint32_t> DeviceList;
+        bool Exclude;
+
+        /** Only pair with devices whose signal strength places them in
+         * this proximity bin or closer, 1 is the closest bin (about 30 cm)
+         * and MAX_PROXIMITY_BIN the farthest.  0 disables proximity
+         * search. */
+        int ProximityBin;
+    };
+
     /** The state of the channel, you can get the current state with
      * ChannelState()
      */
@@ -196,19 +221,67 @@ public:
                           // needs to be destroyed
     };
 
+    /** Battery status, as reported in the ANT+ common battery page */
+    enum BatteryStatus {
+        BATTERY_UNKNOWN = 0,
+        BATTERY_NEW = 1,
+        BATTERY_GOOD = 2,
+        BATTERY_OK = 3,
+        BATTERY_LOW = 4,
+        BATTERY_CRITICAL = 5
+    };
+
+    /** Information about the master device, decoded from the ANT+ common
+     * data pages (0x50 manufacturer, 0x51 product and 0x52 battery), which
+     * are broadcast by devices of all profiles, and from the heart rate
+     * monitor pages 2, 3 and 7, which HRMs send instead.  Values not
+     * received yet are -1.
+     */
+    struct DeviceInfo {
+        DeviceInfo()
+            : ManufacturerId(-1), ModelNumber(-1), HardwareRevision(-1),
+              SoftwareVersion(-1), SerialNumber(-1),
+              Battery(BATTERY_UNKNOWN), BatteryLevel(-1), BatteryVoltage(-1),
+              OperatingTime(-1) {}
+        int ManufacturerId;
+        int ModelNumber;
+        int HardwareRevision;
+        double SoftwareVersion;
+        int64_t SerialNumber;
+        BatteryStatus Battery;
+        int BatteryLevel;               // percent, only sent by HRMs
+        double BatteryVoltage;          // volts
+        int64_t OperatingTime;          // seconds, cumulative
+    };
+
     AntChannel (AntStick *stick,
                 Id channel_id,
                 unsigned period,
                 uint8_t timeout,
-                uint8_t frequency);
+                uint8_t frequency,
+                const SearchConfig &search = SearchConfig(),
+                int network = -1);
     virtual ~AntChannel();
 
     void RequestClose();
     State ChannelState() const { return m_State; }
     Id ChannelId() const { return m_ChannelId; }
+    /** The ANT network this channel was assigned to, see
+     * AntStick::AddNetwork() */
+    int Network() const { return m_Network; }
     int MessagesReceived() const { return m_MessagesReceived; }
+    /** Time when the last broadcast message was received from the master,
+     * in microseconds as returned by CurrentMicroseconds(), or 0 if none
+     * was received yet.  Sensor values are decoded from broadcast messages,
+     * so this is the sample time of the latest values of the channel. */
+    uint64_t LastMessageTime() const { return m_LastMessageTime; }
     int MessagesFailed() const { return m_MessagesFailed; }
 
+    const DeviceInfo& GetDeviceInfo() const { return m_DeviceInfo; }
+    /** Incremented each time the device info changes, so users can detect
+     * changes without comparing the DeviceInfo contents. */
+    int DeviceInfoUpdates() const { return m_DeviceInfoUpdates; }
+
 protected:
     /* Derived classes can use these methods. */
 
@@ -217,6 +290,13 @@ protected:
      * broadcast message is received).  OnAcknowledgedDataReply() will be
      * called with 'tag' and the result of the transmission.  If the
      * transmission fails, it will not be retried.
+     *
+     * If a message with the same 'tag' is already waiting to be sent, it is
+     * removed and 'message' is queued at the end, so a message which is
+     * updated often (e.g. the trainer resistance) only keeps its latest
+     * value, and messages are still sent in the order of their last
+     * update.  OnAcknowledgedDataReply() is called only once for the
+     * replaced message.
      */
     void SendAcknowledgedData(int tag, const Buffer &message);
 
@@ -263,6 +343,7 @@ private:
      * is used when assembling messages or decoding messages received by the
      * ANT Stick. */
     int m_ChannelNumber;
+    int m_Network;
 
     /** A queued ACKNOWLEDGE_DATA message.  We can only send these messages
      * one-by-one when a broadcast message is received, so
@@ -277,7 +358,7 @@ private:
 
     /** Queue of ACKNOWLEDGE_DATA messages waiting to be sent.
      */
-    std::queue<AckDataItem> m_AckDataQueue;
+    std::deque<AckDataItem> m_AckDataQueue;
 
     /** When true, an ACKNOWLEDGE_DATA message was send out and we have not
      * received confirmation for it yet.
@@ -295,20 +376,39 @@ private:
      * useful data from the sensors).
      */
     int m_MessagesReceived;
+    uint64_t m_LastMessageTime;
 
     /** Number of times we failed to receive a message.
      */
     int m_MessagesFailed;
 
+    /** Last payload received for each common data page, and for the HRM
+     * pages with device information, a page is only decoded when its
+     * contents change. */
+    enum { COMMON_PAGE_COUNT = 6, PAYLOAD_SIZE = 8 };
+    uint8_t m_CommonPages[COMMON_PAGE_COUNT][PAYLOAD_SIZE];
+    DeviceInfo m_DeviceInfo;
+    int m_DeviceInfoUpdates;
+
     void Configure (unsigned period, uint8_t timeout, uint8_t frequency);
+    void ConfigureSearch (const SearchConfig &search);
     void HandleMessage(const uint8_t *data, int size);
     void MaybeSendAckData();
     void OnChannelResponseMessage (const uint8_t *data, int size);
     void OnChannelIdMessage (const uint8_t *data, int size);
+    void ProcessCommonPage (const uint8_t *data, int size);
+    void ResetDeviceInfo ();
     void ChangeState(State new_state);
 };
 
 
+/** Write the known fields of 'info' as "NAME: value" pairs separated by
+ * ';', in the format used by the telemetry server messages. */
+std::ostream& operator<<(std::ostream &out, const AntChannel::DeviceInfo &info);
+
+const char *BatteryStatusAsString(AntChannel::BatteryStatus s);
+
+
 // ........................................................... AntStick ....
 
 /** Exception thrown when the ANT stick is not found (perhaps because it is
@@ -320,14 +420,87 @@ public:
 };
 
 
+/** Low level message transport for an AntStick.  The default one talks to
+ * an USB ANT stick, a simulated one can be used to test the stick and
+ * channel state machines without hardware, see AntSimulator.h.  Messages
+ * are complete ANT messages, including the sync byte and checksum.
+ *
+ * A stick which stops working, for example because it was unplugged, is
+ * expected while the server runs, so I/O failures are returned as a Status
+ * instead of being thrown.  After a failure the stick has to be opened
+ * again, LastError() describes what went wrong.  Only opening the transport
+ * throws.
+ */
+class AntTransport
+{
+public:
+    enum Status {
+        IO_OK,
+        IO_FAILED
+    };
+
+    virtual ~AntTransport() {}
+
+    /** Send 'message' to the stick. */
+    virtual Status WriteMessage(const Buffer &message) = 0;
+
+    /** Store the next received message in 'message', or clear it if there
+     * is no message available. */
+    virtual Status MaybeGetNextMessage(Buffer &message) = 0;
+
+    /** Wait a short while for the next received message, 'message' is
+     * empty if none arrived. */
+    virtual Status GetNextMessage(Buffer &message) = 0;
+
+    /** Store a message which was already received in 'message', without
+     * waiting for I/O, 'message' is empty if there is none.  Used to
+     * process all the messages received together in one AntStick::Tick()
+     * call.  The default implementation is suitable for transports whose
+     * MaybeGetNextMessage() does not wait. */
+    virtual Status GetReceivedMessage(Buffer &message)
+    {
+        return MaybeGetNextMessage(message);
+    }
+
+    /** Process pending I/O, waiting at most 'milliseconds' for it. */
+    virtual Status WaitForEvents(int milliseconds) = 0;
+
+    /** Number of corrupted messages received and discarded. */
+    virtual int BadMessageCount() const { return 0; }
+
+    /** Description of the last failure, empty if there was none. */
+    const std::string& LastError() const { return m_LastError; }
+
+protected:
+    /** Record 'error' as the reason of a failure and return IO_FAILED. */
+    Status Fail(const std::string &error)
+    {
+        m_LastError = error;
+        return IO_FAILED;
+    }
+
+private:
+    std::string m_LastError;
+};
+
+
+/** Open the first USB ANT stick found and return a transport for it.
+ * Throws AntStickNotFound if there is no stick plugged in.
+ *
+ * @hint Don't forget to call libusb_init() somewhere in your program before
+ * using this function.
+ */
+std::unique_ptr<AntTransport> OpenUsbTransport();
+
+
 /**
  * Represents the physical USB ANT Stick used to communicate with ANT+
  * devices.  An ANT Stick manages one or more AntChannel instances.  The
  * Tick() method needs to be called periodically to process the received
  * messages and distribute them to the AntChannel instances.  In addition to
- * that, `libusb_handle_events_timeout_completed` or equivalent needs to be
- * called periodically to allow libusb to process messages.  See also
- * `TickAntStick()`
+ * that, WaitForEvents() (`libusb_handle_events_timeout_completed` for an USB
+ * stick) needs to be called periodically to allow the transport to process
+ * messages.  See also `TickAntStick()`
  *
  * @hint Don't forget to call libusb_init() somewhere in your program before
  * using this class.
@@ -338,24 +511,56 @@ class AntStick
 
 public:
     AntStick();
+    /** Use an ANT stick reached through 'transport', instead of the first
+     * USB stick found. */
+    explicit AntStick(std::unique_ptr<AntTransport> transport);
     ~AntStick();
 
+    /** Set the key of the default network, used by channels which don't
+     * specify a network.  This is normally the ANT+ network key. */
     void SetNetworkKey (uint8_t key[8]);
 
+    /** Set up a network with 'key' and return its network number, which
+     * can be passed to the AntChannel constructor.  If a network with the
+     * same key already exists, its number is returned.  Each network uses
+     * one of the GetMaxNetworks() networks supported by the stick, this
+     * allows channels on different networks (e.g. ANT+ and a private
+     * network) to share the same stick.  Throws std::runtime_error if all
+     * networks are in use.
+     */
+    int AddNetwork (const uint8_t key[8]);
+
     unsigned GetSerialNumber() const { return m_SerialNumber; }
     std::string GetVersion() const { return m_Version; }
     int GetMaxNetworks() const { return m_MaxNetworks; }
     int GetMaxChannels() const { return m_MaxChannels; }
+    /** The default network, -1 if SetNetworkKey() was not called yet */
     int GetNetwork() const { return m_Network; }
 
+    /** True if the stick stopped working, for example because it was
+     * unplugged.  The channels cannot be used anymore and the stick has to
+     * be opened again, FailureMessage() describes the failure. */
+    bool Failed() const { return m_Failed; }
+    const std::string& FailureMessage() const { return m_Transport->LastError(); }
+
+    /** Number of messages received from the stick which were dropped,
+     * because they were corrupted or were unexpected replies.  These are
+     * not errors, but a high count indicates a problem with the stick. */
+    int GetDroppedMessages() const;
+
     void Tick();
 
+    /** Let the transport process I/O for at most 'milliseconds'. */
+    void WaitForEvents(int milliseconds);
+
     static uint8_t g_AntPlusNetworkKey[8];
 
 private:
 
+    bool TryWriteMessage(const Buffer &b);
     void WriteMessage(const Buffer &b);
     const Buffer& ReadInternalMessage();
+    void CheckStatus(AntTransport::Status status);
 
     void Reset();
     void QueryInfo();
@@ -365,21 +570,26 @@ private:
 
     bool MaybeProcessMessage(const Buffer &message);
 
-    libusb_device_handle *m_DeviceHandle;
+    std::unique_ptr<AntTransport> m_Transport;
 
     unsigned m_SerialNumber;
     std::string m_Version;
     int m_MaxNetworks;
     int m_MaxChannels;
 
+    /** Default network used by channels */
     int m_Network;
+    /** Keys of the networks set up so far, indexed by network number */
+    std::vector<std::vector<uint8_t>> m_NetworkKeys;
+
+    /** Messages dropped by channels, see GetDroppedMessages() */
+    int m_DroppedMessages;
+    /** Set when the transport fails, see Failed() */
+    bool m_Failed;
 
     std::queue <Buffer> m_DelayedMessages;
     Buffer m_LastReadMessage;
 
-    std::unique_ptr<AntMessageReader> m_Reader;
-    std::unique_ptr<AntMessageWriter> m_Writer;
-
     std::vector<AntChannel*> m_Channels;
 };
 
@@ -0,0 +1,306 @@
+/**
+ *  AntTrace -- record and replay the messages received from an ANT stick
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "AntTrace.h"
+#include "Tools.h"
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+enum {
+    // Reported by the replayed stick
+    REPLAY_MAX_CHANNELS = 8,
+    REPLAY_MAX_NETWORKS = 8,
+    // Virtual time (milliseconds) of the first replayed message, sensor
+    // classes use a timestamp of 0 to mean "no data received".
+    REPLAY_START_TIME = 1000
+};
+
+/** Return true if 'message' is channel data or a channel event, the
+ * messages which are replayed.  Replies to commands are not. */
+bool IsChannelMessage(const Buffer &message)
+{
+    switch (message[2]) {
+    case BROADCAST_DATA:
+    case ACKNOWLEDGE_DATA:
+    case BURST_TRANSFER_DATA:
+    case RESPONSE_CHANNEL_ID:
+        return true;
+    case CHANNEL_RESPONSE:
+        return message[4] == 0x01;      // channel event
+    default:
+        return false;
+    }
+}
+
+Buffer MakeReply(uint8_t id, const Buffer &data)
+{
+    Buffer b;
+    b.push_back(SYNC_BYTE);
+    b.push_back(static_cast<uint8_t>(data.size()));
+    b.push_back(id);
+    b.insert(b.end(), data.begin(), data.end());
+    uint8_t c = 0;
+    for (auto e : b)
+        c ^= e;
+    b.push_back(c);
+    return b;
+}
+
+};                                      // end anonymous namespace
+
+
+// ...................................................... TraceRecorder ....
+
+TraceRecorder::TraceRecorder(std::unique_ptr<AntTransport> transport, std::ostream &out)
+    : m_Transport(std::move(transport)),
+      m_Out(out)
+{
+    // empty
+}
+
+AntTransport::Status TraceRecorder::WriteMessage(const Buffer &message)
+{
+    return Check(m_Transport->WriteMessage(message));
+}
+
+AntTransport::Status TraceRecorder::MaybeGetNextMessage(Buffer &message)
+{
+    Status status = m_Transport->MaybeGetNextMessage(message);
+    Record(message);
+    return Check(status);
+}
+
+AntTransport::Status TraceRecorder::GetNextMessage(Buffer &message)
+{
+    Status status = m_Transport->GetNextMessage(message);
+    Record(message);
+    return Check(status);
+}
+
+AntTransport::Status TraceRecorder::GetReceivedMessage(Buffer &message)
+{
+    Status status = m_Transport->GetReceivedMessage(message);
+    Record(message);
+    return Check(status);
+}
+
+AntTransport::Status TraceRecorder::WaitForEvents(int milliseconds)
+{
+    return Check(m_Transport->WaitForEvents(milliseconds));
+}
+
+/** Pass on a failure of the recorded transport, so LastError() works. */
+AntTransport::Status TraceRecorder::Check(Status status)
+{
+    if (status != IO_OK)
+        return Fail(m_Transport->LastError());
+    return IO_OK;
+}
+
+int TraceRecorder::BadMessageCount() const
+{
+    return m_Transport->BadMessageCount();
+}
+
+void TraceRecorder::Record(const Buffer &message)
+{
+    if (message.empty())
+        return;
+    m_Out << CurrentMilliseconds() << std::hex << std::setfill('0');
+    for (auto b : message)
+        m_Out << ' ' << std::setw(2) << static_cast<int>(b);
+    m_Out << std::dec << '\n';
+}
+
+
+// .................................................... ReplayTransport ....
+
+/** Transport for an AntStick replaying a TraceReplay */
+class ReplayTransport : public AntTransport
+{
+public:
+    explicit ReplayTransport(TraceReplay *replay)
+        : m_Replay(replay) {}
+
+    Status WriteMessage(const Buffer &message) override
+    {
+        m_Replay->ReplyToCommand(message);
+        return IO_OK;
+    }
+
+    Status MaybeGetNextMessage(Buffer &message) override
+    {
+        if (! m_Replay->m_Replies.empty()) {
+            message = m_Replay->m_Replies.front();
+            m_Replay->m_Replies.pop_front();
+        } else {
+            message.swap(m_Replay->m_Current);
+            m_Replay->m_Current.clear();
+        }
+        return IO_OK;
+    }
+
+    Status GetNextMessage(Buffer &message) override
+    {
+        // Only replies are waited for, the recorded messages arrive when
+        // TraceReplay::NextMessage() is called.
+        message.clear();
+        if (! m_Replay->m_Replies.empty()) {
+            message = m_Replay->m_Replies.front();
+            m_Replay->m_Replies.pop_front();
+        }
+        return IO_OK;
+    }
+
+    Status WaitForEvents(int milliseconds) override
+    {
+        // Nothing to wait for, time moves with the replayed messages.
+        return IO_OK;
+    }
+
+private:
+    TraceReplay *m_Replay;
+};
+
+
+// ........................................................ TraceReplay ....
+
+TraceReplay::TraceReplay(std::istream &input)
+    : m_ChannelCount(0),
+      m_Next(0)
+{
+    std::string line;
+    int line_number = 0;
+    while (std::getline(input, line)) {
+        line_number++;
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        std::istringstream in(line);
+        Message m;
+        unsigned byte;
+        in >> m.time >> std::hex;
+        while (in >> byte)
+            m.data.push_back(static_cast<uint8_t>(byte));
+
+        uint8_t checksum = 0;
+        for (auto b : m.data)
+            checksum ^= b;
+        if (m.data.size() < 5 || m.data[0] != SYNC_BYTE
+            || m.data.size() != m.data[1] + 4u || checksum != 0) {
+            std::ostringstream msg;
+            msg << "trace line " << line_number << ": bad message";
+            throw std::runtime_error(msg.str());
+        }
+
+        if (IsChannelMessage(m.data)) {
+            int channel = m.data[3];
+            if (m.data[2] == BURST_TRANSFER_DATA)
+                channel &= 0x1F;
+            m_ChannelCount = std::max(m_ChannelCount, channel + 1);
+            m_Messages.push_back(m);
+        }
+    }
+}
+
+TraceReplay::~TraceReplay()
+{
+    // empty
+}
+
+std::unique_ptr<AntTransport> TraceReplay::CreateTransport()
+{
+    return std::unique_ptr<AntTransport>(new ReplayTransport(this));
+}
+
+bool TraceReplay::NextMessage()
+{
+    if (m_Next >= m_Messages.size())
+        return false;
+    const Message &m = m_Messages[m_Next];
+    if (m_Next == 0) {
+        AdvanceVirtualClock(REPLAY_START_TIME);
+    } else {
+        // Unsigned difference, correct when the recorded time wraps around
+        AdvanceVirtualClock(m.time - m_Messages[m_Next - 1].time);
+    }
+    m_Current = m.data;
+    m_Next++;
+    return true;
+}
+
+bool TraceReplay::HasPending() const
+{
+    return ! m_Replies.empty() || ! m_Current.empty();
+}
+
+/** Make up the reply the stick would send for the command 'message'.
+ * Channel ID requests are not answered, the recorded replies are
+ * replayed. */
+void TraceReplay::ReplyToCommand(const Buffer &message)
+{
+    if (message.size() < 5)
+        return;
+    uint8_t id = message[2];
+    Buffer data;
+
+    switch (id) {
+    case RESET_SYSTEM:
+        m_Replies.clear();
+        data.push_back(0x20);           // reset caused by a command
+        m_Replies.push_back(MakeReply(STARTUP_MESSAGE, data));
+        return;
+    case REQUEST_MESSAGE:
+        if (message.size() < 6)
+            return;
+        switch (message[4]) {
+        case RESPONSE_SERIAL_NUMBER:
+            data.assign(4, 0);
+            break;
+        case RESPONSE_VERSION: {
+            const char version[] = "REPLAY";
+            data.assign(version, version + sizeof(version));
+            break;
+        }
+        case RESPONSE_CAPABILITIES:
+            data.push_back(REPLAY_MAX_CHANNELS);
+            data.push_back(REPLAY_MAX_NETWORKS);
+            data.insert(data.end(), 4, 0);
+            break;
+        default:
+            return;
+        }
+        m_Replies.push_back(MakeReply(message[4], data));
+        return;
+    case ACKNOWLEDGE_DATA:
+    case BURST_TRANSFER_DATA:
+        // The results of the transfer are in the trace
+        return;
+    default:
+        data.push_back(message[3]);
+        data.push_back(id);
+        data.push_back(RESPONSE_NO_ERROR);
+        m_Replies.push_back(MakeReply(CHANNEL_RESPONSE, data));
+        return;
+    }
+}
@@ -0,0 +1,112 @@
+/**
+ *  AntTrace -- record and replay the messages received from an ANT stick
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "AntStick.h"
+#include <deque>
+#include <iosfwd>
+#include <memory>
+#include <vector>
+
+/** A transport which writes every message received from the ANT stick to a
+ * trace, and passes all calls on to another transport.  The trace has one
+ * message per line: the time in milliseconds (see CurrentMilliseconds()),
+ * followed by the message bytes in hex, including the sync byte and the
+ * checksum.  Messages sent to the stick are not recorded.
+ */
+class TraceRecorder : public AntTransport
+{
+public:
+    /** Record the messages received through 'transport' to 'out'.  'out'
+     * must outlive the recorder, so a trace can be continued by a new
+     * recorder when the stick is opened again. */
+    TraceRecorder(std::unique_ptr<AntTransport> transport, std::ostream &out);
+
+    Status WriteMessage(const Buffer &message) override;
+    Status MaybeGetNextMessage(Buffer &message) override;
+    Status GetNextMessage(Buffer &message) override;
+    Status GetReceivedMessage(Buffer &message) override;
+    Status WaitForEvents(int milliseconds) override;
+    int BadMessageCount() const override;
+
+private:
+    Status Check(Status status);
+    void Record(const Buffer &message);
+
+    std::unique_ptr<AntTransport> m_Transport;
+    std::ostream &m_Out;
+};
+
+/** Replays a trace written by TraceRecorder, one message at a time, on the
+ * virtual clock (see EnableVirtualClock()), so the decoders see the same
+ * messages at the same times as when the trace was recorded, but without
+ * waiting between them.
+ *
+ * Only the channel data and events are replayed.  Replies to the stick and
+ * channel set up commands are made up by the replay transport, so the
+ * channels can be opened in any order, but a channel opened on the stick
+ * receives the messages recorded for the same channel number.
+ */
+class TraceReplay
+{
+public:
+    /** Read a trace from 'input', throws std::runtime_error if it contains
+     * invalid lines. */
+    explicit TraceReplay(std::istream &input);
+    ~TraceReplay();
+
+    /** Create the transport for the AntStick replaying this trace. */
+    std::unique_ptr<AntTransport> CreateTransport();
+
+    /** Number of messages which will be replayed */
+    int MessageCount() const { return static_cast<int>(m_Messages.size()); }
+
+    /** Number of channels used in the trace: the highest channel number
+     * plus one. */
+    int ChannelCount() const { return m_ChannelCount; }
+
+    /** Advance the virtual clock to the time of the next message and make
+     * it available to the stick.  Returns false at the end of the trace. */
+    bool NextMessage();
+
+    /** Return true if there are messages the stick has not read yet. */
+    bool HasPending() const;
+
+private:
+    friend class ReplayTransport;
+
+    struct Message {
+        uint32_t time;
+        Buffer data;
+    };
+
+    void ReplyToCommand(const Buffer &message);
+
+    std::vector<Message> m_Messages;
+    int m_ChannelCount;
+    /** Index of the next message returned by NextMessage() */
+    unsigned m_Next;
+    /** Messages available to the stick, made up replies come first */
+    std::deque<Buffer> m_Replies;
+    Buffer m_Current;
+};
+
+/*
+  Local Variables:
+  mode: c++
+  End:
+*/
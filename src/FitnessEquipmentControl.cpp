@@ -18,6 +18,8 @@
 #include "stdafx.h"
 #include "FitnessEquipmentControl.h"
 #include "Tools.h"
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <iomanip>
 
@@ -40,6 +42,12 @@ enum {
 
 enum {
     DP_GENERAL = 0x10,
+    DP_GENERAL_SETTINGS = 0x11,
+    DP_TREADMILL = 0x13,
+    DP_ELLIPTICAL = 0x14,
+    DP_ROWER = 0x16,
+    DP_CLIMBER = 0x17,
+    DP_NORDIC_SKIER = 0x18,
     DP_TRAINER_SPECIFIC = 0x19,
     DP_USER_CONFIG = 0x37,
     DP_FE_CAPABILITIES = 0x36,
@@ -54,14 +62,22 @@ enum {
     STALE_TIMEOUT = 5000
 };
 
+// Values marking a field as not sent by the equipment
+enum {
+    INVALID_POWER = 0xFFFF,
+    INVALID_INCLINE = 0x7FFF
+};
+
 };                                      // end anonymous namespace
 
-FitnessEquipmentControl::FitnessEquipmentControl(AntStick *stick, uint32_t device_number)
+FitnessEquipmentControl::FitnessEquipmentControl(
+    AntStick *stick, uint32_t device_number, const SearchConfig &search)
     : AntChannel(stick,
                  AntChannel::Id(ANT_DEVICE_TYPE, device_number),
                  CHANNEL_PERIOD,
                  SEARCH_TIMEOUT,
-                 CHANNEL_FREQUENCY)
+                 CHANNEL_FREQUENCY,
+                 search)
 {
     // Set some reasonable defaults for all parameters
     m_UpdateUserConfig = true;
@@ -81,6 +97,10 @@ FitnessEquipmentControl::FitnessEquipmentControl(AntStick *stick, uint32_t devic
 
     m_TargetResistance = 0;
     m_TargetPower = 0;
+    m_TargetPowerMode = false;
+
+    m_GearRatio = 1.0;
+    m_SentSlope = 0;
 
     m_CapabilitiesStatus = CAPABILITIES_UNKNOWN;
     m_MaxResistance = 0;
@@ -102,6 +122,12 @@ FitnessEquipmentControl::FitnessEquipmentControl(AntStick *stick, uint32_t devic
     m_InstantCadenceTimestamp = ts;
     m_InstantCadence = 0;
     m_TrainerState = STATE_RESERVED;
+    m_EquipmentType = ET_UNKNOWN;
+    m_StrokeRateTimestamp = ts;
+    m_StrokeRate = -1;
+    m_InclineTimestamp = ts;
+    m_InclineValid = false;
+    m_Incline = 0;
     m_SimulationState = TS_AT_TARGET_POWER;
 }
 
@@ -116,7 +142,7 @@ double FitnessEquipmentControl::InstantPower() const
 
 double FitnessEquipmentControl::InstantSpeed() const
 {
-    if ((CurrentMilliseconds() - m_InstantPowerTimestamp) > STALE_TIMEOUT) {
+    if ((CurrentMilliseconds() - m_InstantSpeedTimestamp) > STALE_TIMEOUT) {
         return 0;
     } else {
         return m_InstantSpeed;
@@ -130,13 +156,43 @@ bool FitnessEquipmentControl::InstantSpeedIsVirtual() const
 
 double FitnessEquipmentControl::InstantCadence() const
 {
-    if ((CurrentMilliseconds() - m_InstantPowerTimestamp) > STALE_TIMEOUT) {
+    if ((CurrentMilliseconds() - m_InstantCadenceTimestamp) > STALE_TIMEOUT) {
         return 0;
     } else {
         return m_InstantCadence;
     }
 }
 
+double FitnessEquipmentControl::StrokeRate() const
+{
+    if ((CurrentMilliseconds() - m_StrokeRateTimestamp) > STALE_TIMEOUT) {
+        return -1;
+    } else {
+        return m_StrokeRate;
+    }
+}
+
+double FitnessEquipmentControl::Pace() const
+{
+    switch (m_EquipmentType) {
+    case ET_TREADMILL:
+    case ET_ELLIPTICAL:
+    case ET_ROWER:
+    case ET_NORDIC_SKIER: {
+        double speed = InstantSpeed();
+        return speed > 0 ? 1000.0 / speed : -1;
+    }
+    default:
+        return -1;
+    }
+}
+
+bool FitnessEquipmentControl::HasIncline() const
+{
+    return m_InclineValid
+        && (CurrentMilliseconds() - m_InclineTimestamp) <= STALE_TIMEOUT;
+}
+
 void FitnessEquipmentControl::SetUserParams(
     double user_weight,
     double bike_weight,
@@ -157,6 +213,20 @@ void FitnessEquipmentControl::OnMessageReceived(const uint8_t *data, int size)
     case DP_GENERAL:
         ProcessGeneralPage(data + 4, size - 4);
         break;
+    case DP_GENERAL_SETTINGS:
+        ProcessGeneralSettingsPage(data + 4, size - 4);
+        break;
+    case DP_TREADMILL:
+        ProcessTreadmillPage(data + 4, size - 4);
+        break;
+    case DP_ELLIPTICAL:
+        ProcessEllipticalPage(data + 4, size - 4);
+        break;
+    case DP_ROWER:
+    case DP_CLIMBER:
+    case DP_NORDIC_SKIER:
+        ProcessStrokePage(data + 4, size - 4);
+        break;
     case DP_TRAINER_SPECIFIC:
         ProcessTrainerSpecificPage(data + 4, size - 4);
         break;
@@ -222,6 +292,7 @@ void FitnessEquipmentControl::ProcessGeneralPage(
     m_InstantSpeed = ((speed_msb << 8) + speed_lsb) * 0.001;
     m_InstantSpeedIsVirtual = (capabilities & 0x3) != 0;
     m_EquipmentType = static_cast<EquipmentType>(data[1] & 0x1F);
+    MaybeUpdateEffectiveSlope();
 }
 
 void FitnessEquipmentControl::ProcessTrainerSpecificPage(
@@ -237,7 +308,7 @@ void FitnessEquipmentControl::ProcessTrainerSpecificPage(
     m_InstantPowerTimestamp = ts;
     m_InstantPower = (power_msb << 8) + power_lsb;
     m_SimulationState = static_cast<SimulationState>(flags & 0x03);
-    m_InstantPowerTimestamp = ts;
+    m_InstantCadenceTimestamp = ts;
     m_InstantCadence = data[2];
     m_ZeroOffsetCalibrationRequired = (trainer_status & 0x01) != 0;
     m_SpinDownCalibrationRequired = (trainer_status & 0x02) != 0;
@@ -245,6 +316,67 @@ void FitnessEquipmentControl::ProcessTrainerSpecificPage(
     m_UpdateUserConfig = m_UpdateUserConfig | m_UserConfigurationRequired;
 }
 
+void FitnessEquipmentControl::ProcessGeneralSettingsPage(
+    const uint8_t *data, int size)
+{
+    m_TrainerState = static_cast<TrainerState>((data[7] >> 4) & 0x07);
+    uint16_t raw_incline = (data[5] << 8) + data[4];
+    if (raw_incline != INVALID_INCLINE) {
+        m_InclineTimestamp = CurrentMilliseconds();
+        m_InclineValid = true;
+        m_Incline = static_cast<int16_t>(raw_incline) * 0.01;
+    }
+}
+
+/** The treadmill page has the cadence and the vertical distance, treadmills
+ * report speed in the general page and don't report power. */
+void FitnessEquipmentControl::ProcessTreadmillPage(
+    const uint8_t *data, int size)
+{
+    m_TrainerState = static_cast<TrainerState>((data[7] >> 4) & 0x07);
+    UpdateStrokeRate(data[4]);
+    m_Descent.Update(data[5]);
+    m_Ascent.Update(data[6]);
+}
+
+void FitnessEquipmentControl::ProcessEllipticalPage(
+    const uint8_t *data, int size)
+{
+    m_TrainerState = static_cast<TrainerState>((data[7] >> 4) & 0x07);
+    m_StrokeCount.Update(data[2]);
+    m_Ascent.Update(data[3]);
+    UpdateStrokeRate(data[4]);
+    UpdatePower(data[5], data[6]);
+}
+
+/** The rower, climber and nordic skier pages have the same layout: stroke
+ * (or stride) count, stroke rate and power. */
+void FitnessEquipmentControl::ProcessStrokePage(
+    const uint8_t *data, int size)
+{
+    m_TrainerState = static_cast<TrainerState>((data[7] >> 4) & 0x07);
+    m_StrokeCount.Update(data[3]);
+    UpdateStrokeRate(data[4]);
+    UpdatePower(data[5], data[6]);
+}
+
+void FitnessEquipmentControl::UpdateStrokeRate(uint8_t rate)
+{
+    if (rate != 0xFF) {
+        m_StrokeRateTimestamp = CurrentMilliseconds();
+        m_StrokeRate = rate;
+    }
+}
+
+void FitnessEquipmentControl::UpdatePower(uint8_t lsb, uint8_t msb)
+{
+    uint16_t power = (msb << 8) + lsb;
+    if (power != INVALID_POWER) {
+        m_InstantPowerTimestamp = CurrentMilliseconds();
+        m_InstantPower = power;
+    }
+}
+
 void FitnessEquipmentControl::ProcessCapabilitiesPage(
     const uint8_t *data, int size)
 {
@@ -286,6 +418,8 @@ void FitnessEquipmentControl::OnAcknowledgedDataReply(
             m_UpdateUserConfig = true;
         } else if (tag == DP_TRACK_RESISTANCE) {
             SendTrackResistanceDataPage();
+        } else if (tag == DP_TARGET_POWER) {
+            SendTargetPowerDataPage();
         }
     }
 }
@@ -315,6 +449,14 @@ void FitnessEquipmentControl::OnStateChanged (
         m_InstantCadence = 0;
         m_TrainerState = STATE_RESERVED;
         m_SimulationState = TS_AT_TARGET_POWER;
+        m_StrokeRate = -1;
+        m_InclineValid = false;
+
+        // The equipment counters may have been reset while the channel was
+        // closed, keep the totals but don't add the difference.
+        m_StrokeCount.last = -1;
+        m_Ascent.last = -1;
+        m_Descent.last = -1;
     }
 }
 
@@ -322,9 +464,78 @@ void FitnessEquipmentControl::SetSlope(double slope)
 {
     std::cout << "Set Slope to " << slope << std::endl;
     m_Slope = slope;
+    m_TargetPowerMode = false;
     SendTrackResistanceDataPage();
 }
 
+void FitnessEquipmentControl::SetGearRatio(double ratio)
+{
+    m_GearRatio = ratio > 0 ? ratio : 1.0;
+    if (! m_TargetPowerMode)
+        SendTrackResistanceDataPage();
+}
+
+/** Return the slope (percent) to send to the trainer, so that riding at
+ * the trainer speed produces the same power as riding in the virtual gear,
+ * at the simulated slope.
+ *
+ * At the same cadence, the virtual speed is m_GearRatio (R) times the
+ * trainer speed v, so the trainer force must be R times the force needed at
+ * the virtual speed: R * (m * g * (slope + crr) + K * (R * v)^2), where K is
+ * the air resistance coefficient.  The trainer applies m * g * (slope' +
+ * crr) + K * v^2 for a slope', which gives the formula below.
+ */
+double FitnessEquipmentControl::EffectiveSlope() const
+{
+    if (m_GearRatio == 1.0)
+        return m_Slope;
+
+    const double g = 9.81;
+    double r = m_GearRatio;
+    double mass = m_UserWeight + m_BikeWeight;
+    double v = InstantSpeed();
+    double k = 0.5 * m_WindResistanceCoefficient * m_DraftingFactor;
+    double crr = m_RollingResistance;
+    double grade = r * (m_Slope / 100.0 + crr) - crr
+        + k * v * v * (r * r * r - 1) / (mass * g);
+    // Range of the slope field in the track resistance page
+    return std::max(-200.0, std::min(200.0, grade * 100.0));
+}
+
+/** With virtual gearing, the effective slope depends on speed, resend it
+ * when it changed enough to make a difference to the trainer resistance.
+ * Resent pages replace any queued ones, see SendAcknowledgedData(). */
+void FitnessEquipmentControl::MaybeUpdateEffectiveSlope()
+{
+    const double min_change = 0.1;      // percent
+    if (m_GearRatio != 1.0 && ! m_TargetPowerMode
+        && std::abs(EffectiveSlope() - m_SentSlope) >= min_change)
+        SendTrackResistanceDataPage();
+}
+
+void FitnessEquipmentControl::SetTargetPower(double watts)
+{
+    m_TargetPower = std::max(0.0, watts);
+    m_TargetPowerMode = true;
+    SendTargetPowerDataPage();
+}
+
+void FitnessEquipmentControl::SendTargetPowerDataPage()
+{
+    Buffer msg;
+    msg.push_back(DP_TARGET_POWER);
+    msg.push_back(0xFF);
+    msg.push_back(0xFF);
+    msg.push_back(0xFF);
+    msg.push_back(0xFF);
+    msg.push_back(0xFF);
+    // Target power is sent in 0.25 watt units
+    uint16_t raw_power = static_cast<uint16_t>(std::min(m_TargetPower / 0.25, 65535.0));
+    msg.push_back(raw_power & 0xFF);
+    msg.push_back((raw_power >> 8) & 0xFF);
+    SendAcknowledgedData(DP_TARGET_POWER, msg);
+}
+
 void FitnessEquipmentControl::SendTrackResistanceDataPage()
 {
     Buffer msg;
@@ -333,7 +544,8 @@ void FitnessEquipmentControl::SendTrackResistanceDataPage()
     msg.push_back(0xFF);
     msg.push_back(0xFF);
     msg.push_back(0xFF);
-    uint16_t raw_slope = static_cast<uint16_t>((m_Slope + 200.0) / 0.01);
+    m_SentSlope = EffectiveSlope();
+    uint16_t raw_slope = static_cast<uint16_t>((m_SentSlope + 200.0) / 0.01);
     msg.push_back(raw_slope & 0xFF);
     msg.push_back((raw_slope >> 8) & 0xFF);
     uint8_t raw_rr = static_cast<uint8_t>(m_RollingResistance * 5e5);
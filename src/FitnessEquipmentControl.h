@@ -20,8 +20,10 @@
 #include "AntStick.h"
 
 /** Read data and control resistance from an ANT+ FE-C capable trainer.
- * Currently, instant power, speed and cadence can be read, and the slope can
- * be set.
+ * Currently, instant power, speed and cadence can be read, and the slope or
+ * a target power can be set.  For treadmills, ellipticals, rowers, climbers
+ * and nordic skiers, the stroke rate, stroke count, vertical distance and
+ * incline are read as well.
  */
 class FitnessEquipmentControl : public AntChannel
 {
@@ -54,13 +56,34 @@ public:
         TS_POWER_LIMIT_REACHED = 3 // undetermined (min or max) power limit reached
     };
 
-    FitnessEquipmentControl(AntStick *stick, uint32_t device_number = 0);
+    FitnessEquipmentControl(AntStick *stick, uint32_t device_number = 0,
+                            const SearchConfig &search = SearchConfig());
 
     double InstantPower() const;
     double InstantSpeed() const;
     bool InstantSpeedIsVirtual() const;
     double InstantCadence() const;
 
+    /** Strokes (rower) or strides per minute, or -1 if the equipment does
+     * not send them or they are stale. */
+    double StrokeRate() const;
+    /** Strokes or strides since the equipment was first connected */
+    uint32_t StrokeCount() const { return m_StrokeCount.total; }
+    /** Vertical distance climbed and descended since the equipment was
+     * first connected, in meters */
+    double VerticalAscent() const { return m_Ascent.total * 0.1; }
+    double VerticalDescent() const { return m_Descent.total * 0.1; }
+    /** Time to cover one kilometer at the current speed, in seconds, or -1
+     * if the equipment is not moving or is a bike. */
+    double Pace() const;
+    /** Incline in percent, only valid if HasIncline() returns true */
+    bool HasIncline() const;
+    double Incline() const { return m_Incline; }
+
+    /** Timestamp (as returned by CurrentMilliseconds()) when the instant
+     * power was last received from the trainer. */
+    uint32_t InstantPowerTimestamp() const { return m_InstantPowerTimestamp; }
+
     EquipmentType GetEquipmentType() const { return m_EquipmentType; }
 
     void SetUserParams(
@@ -68,7 +91,24 @@ public:
         double bike_weight,
         double wheel_diameter);
 
+    double UserWeight() const { return m_UserWeight; }
+    double BikeWeight() const { return m_BikeWeight; }
+    double BikeWheelDiameter() const { return m_BikeWheelDiameter; }
+
     void SetSlope(double slope);
+
+    /** Put the trainer in target power (ERG) mode, holding 'watts'
+     * regardless of cadence.  Calling SetSlope() puts the trainer back in
+     * simulation mode. */
+    void SetTargetPower(double watts);
+    double TargetPower() const { return m_TargetPower; }
+
+    /** Set the virtual gear ratio, relative to the gear the bike is in, see
+     * VirtualGearing::RatioFactor().  In simulation mode, the slope sent
+     * to the trainer is adjusted so the rider works as if riding in the
+     * virtual gear.  A ratio of 1 disables virtual gearing. */
+    void SetGearRatio(double ratio);
+    double GearRatio() const { return m_GearRatio; }
     
 private:
 
@@ -77,10 +117,19 @@ private:
     void ProcessGeneralPage(const uint8_t *data, int size);
     void ProcessTrainerSpecificPage(const uint8_t *data, int size);
     void ProcessCapabilitiesPage(const uint8_t *data, int size);
+    void ProcessGeneralSettingsPage(const uint8_t *data, int size);
+    void ProcessTreadmillPage(const uint8_t *data, int size);
+    void ProcessEllipticalPage(const uint8_t *data, int size);
+    void ProcessStrokePage(const uint8_t *data, int size);
+    void UpdateStrokeRate(uint8_t rate);
+    void UpdatePower(uint8_t lsb, uint8_t msb);
     void OnAcknowledgedDataReply(int tag, AntChannelEvent event);
     void OnStateChanged (AntChannel::State old_state, AntChannel::State new_state) override;
 
     void SendTrackResistanceDataPage();
+    void SendTargetPowerDataPage();
+    double EffectiveSlope() const;
+    void MaybeUpdateEffectiveSlope();
 
     // User configuration
 
@@ -105,6 +154,12 @@ private:
     // Parameters used when trainer is in target power mode
 
     double m_TargetPower;
+    bool m_TargetPowerMode;
+
+    // Virtual gearing, see SetGearRatio()
+    double m_GearRatio;
+    // Slope sent in the last track resistance page, including the gearing
+    double m_SentSlope;
 
     // Trainer capabilities
 
@@ -137,6 +192,29 @@ private:
     double m_InstantCadence;
     TrainerState m_TrainerState;
 
+    /** Total of a one byte counter sent by the equipment, which rolls over
+     * at 256. */
+    struct Accumulator {
+        Accumulator() : last(-1), total(0) {}
+        void Update(uint8_t value) {
+            if (last >= 0)
+                total += (value - last) & 0xFF;
+            last = value;
+        }
+        int last;                       // -1 until the first value
+        uint32_t total;
+    };
+
+    // Treadmill, elliptical, rower, climber and nordic skier outputs
+    Accumulator m_StrokeCount;
+    Accumulator m_Ascent;               // 0.1 m
+    Accumulator m_Descent;              // 0.1 m
+    uint32_t m_StrokeRateTimestamp;
+    double m_StrokeRate;                // -1 if never received
+    uint32_t m_InclineTimestamp;
+    bool m_InclineValid;
+    double m_Incline;
+
     // Only used if we are in target power mode, otherwise it is 0 --
     // TS_AT_TARGET_POWER
     SimulationState m_SimulationState;
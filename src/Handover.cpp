@@ -0,0 +1,427 @@
+/**
+ *  Handover -- pass a running server to a new server process
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "Handover.h"
+#include "Tools.h"
+#include <chrono>
+#include <iostream>
+#include <sstream>
+
+/** IMPLEMENTATION NOTE
+ *
+ * Sockets are passed to the new process using WSADuplicateSocket(), which
+ * produces a WSAPROTOCOL_INFO structure that the new process passes to
+ * WSASocket() to obtain its own descriptor for the same socket.  The
+ * exchange happens over the named pipe \\.\pipe\TrainerControl-<port>:
+ *
+ *   - the new process sends HANDOVER_MAGIC and its process id
+ *   - the old process sends HANDOVER_MAGIC, the rider states, the
+ *     WSAPROTOCOL_INFO for the server socket and, for each client, its
+ *     WSAPROTOCOL_INFO followed by the client settings.
+ *   - the new process sends HANDOVER_MAGIC to confirm it has created its
+ *     sockets, after which the old process closes its sockets, releases the
+ *     ANT stick and exits.
+ *
+ * Both processes are expected to be built for the same architecture, values
+ * are sent in their native representation.
+ *
+ * Both ends of the pipe are in PIPE_NOWAIT mode and each step of the
+ * exchange must complete within HANDOVER_TIMEOUT, see TimedPipe.  The old
+ * process runs the exchange on the ANT thread, so a new process which
+ * connects and then stops responding must not block it.  A new process
+ * which goes away or misbehaves is expected, so the HandoverListener
+ * reports failures as results, not exceptions.  TakeOver() runs when the
+ * new process starts and throws, since it cannot continue without the
+ * state of the old one.
+ *
+ * Unlike the sockets, the USB device handle of the ANT stick cannot be
+ * shared between processes on Windows, so the new process has to open and
+ * reset the stick.  Since it receives the device numbers of the paired
+ * sensors, the channels are opened directly to these sensors, which is a lot
+ * faster than a wildcard search.
+ */
+
+namespace {
+
+enum {
+    HANDOVER_MAGIC = 0x54434831,        // "TCH1", also the format version
+
+    // Time (milliseconds) to wait for the other process
+    HANDOVER_TIMEOUT = 5000,
+
+    // Time (milliseconds) to wait before retrying a read or write on a pipe
+    // which is not ready
+    PIPE_RETRY_INTERVAL = 1
+};
+
+std::string PipeName(int port)
+{
+    std::ostringstream name;
+    name << "\\\\.\\pipe\\TrainerControl-" << port;
+    return name.str();
+}
+
+void Put(std::vector<uint8_t> &out, const void *data, size_t size)
+{
+    const uint8_t *p = reinterpret_cast<const uint8_t*>(data);
+    out.insert(out.end(), p, p + size);
+}
+
+template <typename T>
+void Put(std::vector<uint8_t> &out, const T &value)
+{
+    Put(out, &value, sizeof(T));
+}
+
+void PutString(std::vector<uint8_t> &out, const std::string &s)
+{
+    Put(out, static_cast<uint32_t>(s.size()));
+    Put(out, s.data(), s.size());
+}
+
+/** Read and write a pipe in PIPE_NOWAIT mode, giving up if the other
+ * process does not keep up.  ReadFile() and WriteFile() never block on such
+ * a pipe, so they are retried until HANDOVER_TIMEOUT has passed since the
+ * TimedPipe was created.  WriteAll() and ReadAll() return false if the pipe
+ * failed or timed out, Error() describes the failure.  The timeout uses the
+ * real clock, as CurrentMilliseconds() does not move when the virtual clock
+ * is enabled.
+ */
+class TimedPipe
+{
+public:
+    TimedPipe(HANDLE pipe)
+        : m_Pipe(pipe),
+          m_Deadline(std::chrono::steady_clock::now()
+                     + std::chrono::milliseconds(HANDOVER_TIMEOUT))
+    {
+        // empty
+    }
+
+    bool WriteAll(const std::vector<uint8_t> &data)
+    {
+        size_t pos = 0;
+        while (pos < data.size()) {
+            DWORD written = 0;
+            if (! WriteFile(m_Pipe, &data[pos], static_cast<DWORD>(data.size() - pos),
+                            &written, NULL))
+                return Fail(Win32Error("Handover: WriteFile()", GetLastError()).what());
+            pos += written;
+            if (pos < data.size() && ! Wait("WriteFile()"))
+                return false;           // the pipe buffer stayed full
+        }
+        return true;
+    }
+
+    bool ReadAll(void *data, size_t size)
+    {
+        uint8_t *p = reinterpret_cast<uint8_t*>(data);
+        while (size > 0) {
+            DWORD nread = 0;
+            BOOL ok = ReadFile(m_Pipe, p, static_cast<DWORD>(size), &nread, NULL);
+            if (ok && nread > 0) {
+                p += nread;
+                size -= nread;
+            } else if (ok || GetLastError() == ERROR_NO_DATA) {
+                if (! Wait("ReadFile()"))
+                    return false;       // nothing was sent
+            } else {
+                return Fail(Win32Error("Handover: ReadFile()", GetLastError()).what());
+            }
+        }
+        return true;
+    }
+
+    /** Record 'error' as the reason of the failure and return false. */
+    bool Fail(const std::string &error)
+    {
+        m_Error = error;
+        return false;
+    }
+
+    const std::string& Error() const { return m_Error; }
+
+private:
+    bool Wait(const char *who)
+    {
+        if (std::chrono::steady_clock::now() >= m_Deadline)
+            return Fail(std::string("Handover: ") + who + " timed out");
+        Sleep(PIPE_RETRY_INTERVAL);
+        return true;
+    }
+
+    HANDLE m_Pipe;
+    std::chrono::steady_clock::time_point m_Deadline;
+    std::string m_Error;
+};
+
+template <typename T>
+bool Get(TimedPipe &pipe, T &value)
+{
+    return pipe.ReadAll(&value, sizeof(T));
+}
+
+bool GetString(TimedPipe &pipe, std::string &s)
+{
+    uint32_t size = 0;
+    if (! Get(pipe, size))
+        return false;
+    s.assign(size, '\0');
+    return size == 0 || pipe.ReadAll(&s[0], size);
+}
+
+/** Add the WSAPROTOCOL_INFO for 's' to 'out', returns false if the socket
+ * cannot be duplicated, for example because the new process exited. */
+bool PutSocket(TimedPipe &pipe, std::vector<uint8_t> &out, SOCKET s, DWORD process_id)
+{
+    WSAPROTOCOL_INFOW info;
+    if (WSADuplicateSocketW(s, process_id, &info) != 0)
+        return pipe.Fail(Win32Error("WSADuplicateSocket()", WSAGetLastError()).what());
+    Put(out, info);
+    return true;
+}
+
+bool GetSocket(TimedPipe &pipe, SOCKET &s)
+{
+    WSAPROTOCOL_INFOW info;
+    if (! Get(pipe, info))
+        return false;
+    s = WSASocketW(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO,
+                   &info, 0, WSA_FLAG_OVERLAPPED);
+    if (s == INVALID_SOCKET)
+        return pipe.Fail(Win32Error("WSASocket()", WSAGetLastError()).what());
+    return true;
+}
+
+/** Throw the failure of the last 'pipe' operation, used by TakeOver(). */
+void Check(bool ok, const TimedPipe &pipe)
+{
+    if (! ok)
+        throw std::runtime_error(pipe.Error());
+}
+
+};                                      // end anonymous namespace
+
+
+// ................................................... HandoverListener ....
+
+HandoverListener::HandoverListener(int port)
+    : m_PipeName(PipeName(port)),
+      m_Pipe(INVALID_HANDLE_VALUE),
+      m_ProcessId(0)
+{
+    if (! Reset())
+        throw std::runtime_error(m_Error);
+}
+
+HandoverListener::~HandoverListener()
+{
+    if (m_Pipe != INVALID_HANDLE_VALUE)
+        CloseHandle(m_Pipe);
+}
+
+bool HandoverListener::Poll()
+{
+    // NOTE: the pipe is in PIPE_NOWAIT mode, so ConnectNamedPipe() only
+    // reports if a client is connected.
+    if (ConnectNamedPipe(m_Pipe, NULL))
+        return true;
+
+    switch (GetLastError()) {
+    case ERROR_PIPE_CONNECTED:
+        return true;
+    case ERROR_NO_DATA:
+        // A client connected and went away, wait for another one.
+        DisconnectNamedPipe(m_Pipe);
+        return false;
+    default:
+        return false;
+    }
+}
+
+bool HandoverListener::ReadRequest()
+{
+    TimedPipe pipe(m_Pipe);
+    uint32_t magic = 0;
+    if (! Get(pipe, magic))
+        return Fail(pipe.Error());
+    if (magic != HANDOVER_MAGIC)
+        return Fail("Handover: bad request");
+    uint32_t process_id = 0;
+    if (! Get(pipe, process_id))
+        return Fail(pipe.Error());
+    m_ProcessId = process_id;
+    return true;
+}
+
+bool HandoverListener::Send(const HandoverState &state)
+{
+    TimedPipe pipe(m_Pipe);
+    DWORD process_id = m_ProcessId;
+    std::vector<uint8_t> data;
+    Put(data, static_cast<uint32_t>(HANDOVER_MAGIC));
+    Put(data, static_cast<uint32_t>(state.riders.size()));
+    for (const auto &r : state.riders) {
+        Put(data, r.hrm_device_number);
+        Put(data, r.fec_device_number);
+        Put(data, r.weight);
+    }
+    if (! PutSocket(pipe, data, state.server, process_id))
+        return Fail(pipe.Error());
+    Put(data, static_cast<uint32_t>(state.clients.size()));
+    for (const auto &c : state.clients) {
+        if (! PutSocket(pipe, data, c.socket, process_id))
+            return Fail(pipe.Error());
+        Put(data, static_cast<int32_t>(c.rider));
+        Put(data, static_cast<int32_t>(c.group));
+        Put(data, static_cast<uint8_t>(c.binary ? 1 : 0));
+        PutString(data, c.session_token);
+        Put(data, c.session_seq);
+    }
+
+    uint32_t magic = 0;
+    if (! pipe.WriteAll(data) || ! Get(pipe, magic))
+        return Fail(pipe.Error());
+    if (magic != HANDOVER_MAGIC)
+        return Fail("Handover: not confirmed");
+    return true;
+}
+
+/** Record 'error', wait for another process and return false. */
+bool HandoverListener::Fail(const std::string &error)
+{
+    if (Reset())
+        m_Error = error;
+    else
+        m_Error = error + ", " + m_Error;
+    return false;
+}
+
+/** Create a new pipe instance, for the next process.  Returns false, with
+ * the reason in m_Error, if the pipe cannot be created, in which case
+ * Poll() does not find any process. */
+bool HandoverListener::Reset()
+{
+    if (m_Pipe != INVALID_HANDLE_VALUE)
+        CloseHandle(m_Pipe);
+    m_Pipe = CreateNamedPipeA(m_PipeName.c_str(), PIPE_ACCESS_DUPLEX,
+                              PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_NOWAIT,
+                              1, 4096, 4096, 0, NULL);
+    if (m_Pipe == INVALID_HANDLE_VALUE) {
+        m_Error = Win32Error("CreateNamedPipe()", GetLastError()).what();
+        return false;
+    }
+    return true;
+}
+
+
+// ........................................................... TakeOver ....
+
+HandoverState TakeOver(int port)
+{
+    WSADATA wsaData;
+    memset(&wsaData, 0, sizeof(wsaData));
+    HRESULT r = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    if (r != 0 )
+        throw Win32Error("WSAStartup()", r);
+
+    std::string name = PipeName(port);
+    if (! WaitNamedPipeA(name.c_str(), HANDOVER_TIMEOUT))
+        throw Win32Error("TakeOver: no server to take over from", GetLastError());
+    HANDLE handle = CreateFileA(name.c_str(), GENERIC_READ | GENERIC_WRITE,
+                                0, NULL, OPEN_EXISTING, 0, NULL);
+    if (handle == INVALID_HANDLE_VALUE)
+        throw Win32Error("TakeOver: CreateFile()", GetLastError());
+
+    HandoverState state;
+    HANDLE old_process = NULL;
+
+    try {
+        DWORD mode = PIPE_READMODE_BYTE | PIPE_NOWAIT;
+        if (! SetNamedPipeHandleState(handle, &mode, NULL, NULL))
+            throw Win32Error("TakeOver: SetNamedPipeHandleState()", GetLastError());
+
+        ULONG old_process_id = 0;
+        if (GetNamedPipeServerProcessId(handle, &old_process_id))
+            old_process = OpenProcess(SYNCHRONIZE, FALSE, old_process_id);
+
+        TimedPipe pipe(handle);
+        std::vector<uint8_t> request;
+        Put(request, static_cast<uint32_t>(HANDOVER_MAGIC));
+        Put(request, static_cast<uint32_t>(GetCurrentProcessId()));
+        Check(pipe.WriteAll(request), pipe);
+
+        uint32_t magic = 0;
+        Check(Get(pipe, magic), pipe);
+        if (magic != HANDOVER_MAGIC)
+            throw std::runtime_error("TakeOver: incompatible server version");
+
+        uint32_t nriders = 0;
+        Check(Get(pipe, nriders), pipe);
+        for (uint32_t i = 0; i < nriders; ++i) {
+            HandoverState::RiderState rider;
+            Check(Get(pipe, rider.hrm_device_number)
+                  && Get(pipe, rider.fec_device_number)
+                  && Get(pipe, rider.weight), pipe);
+            state.riders.push_back(rider);
+        }
+
+        Check(GetSocket(pipe, state.server), pipe);
+        uint32_t nclients = 0;
+        Check(Get(pipe, nclients), pipe);
+        for (uint32_t i = 0; i < nclients; ++i) {
+            ClientHandover client;
+            Check(GetSocket(pipe, client.socket), pipe);
+            state.clients.push_back(client);
+            auto &c = state.clients.back();
+            int32_t rider = 0, group = 0;
+            uint8_t binary = 0;
+            Check(Get(pipe, rider) && Get(pipe, group) && Get(pipe, binary)
+                  && GetString(pipe, c.session_token)
+                  && Get(pipe, c.session_seq), pipe);
+            c.rider = rider;
+            c.group = static_cast<GroupMode>(group);
+            c.binary = binary != 0;
+        }
+
+        std::vector<uint8_t> confirm;
+        Put(confirm, static_cast<uint32_t>(HANDOVER_MAGIC));
+        Check(pipe.WriteAll(confirm), pipe);
+    }
+    catch (...) {
+        if (state.server != INVALID_SOCKET)
+            closesocket(state.server);
+        for (const auto &c : state.clients)
+            closesocket(c.socket);
+        if (old_process)
+            CloseHandle(old_process);
+        CloseHandle(handle);
+        throw;
+    }
+
+    // Wait for the old process to exit, so the ANT stick is available.
+    if (old_process) {
+        WaitForSingleObject(old_process, HANDOVER_TIMEOUT);
+        CloseHandle(old_process);
+    }
+    CloseHandle(handle);
+
+    std::cout << "Took over " << state.clients.size() << " clients and "
+              << state.riders.size() << " riders" << std::endl;
+    return state;
+}
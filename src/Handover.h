@@ -0,0 +1,96 @@
+/**
+ *  Handover -- pass a running server to a new server process
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "NetTools.h"
+#include "NetworkWorker.h"
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/** The state of a server which is passed on to the process replacing it:
+ * the network sockets, so clients remain connected, and the devices used by
+ * each rider, so the new process can open the ANT channels directly to them,
+ * without searching.
+ */
+struct HandoverState
+{
+    struct RiderState {
+        RiderState() : hrm_device_number(0), fec_device_number(0), weight(0) {}
+        uint32_t hrm_device_number;
+        uint32_t fec_device_number;
+        double weight;
+    };
+
+    HandoverState() : server(INVALID_SOCKET) {}
+    SOCKET server;
+    std::vector<RiderState> riders;
+    std::vector<ClientHandover> clients;
+};
+
+/** Wait for a new server process requesting to take over from this one.
+ * The new process is started with the -takeover command line option and
+ * connects to a named pipe served by the running process.
+ */
+class HandoverListener
+{
+public:
+    HandoverListener(int port);
+    ~HandoverListener();
+
+    /** Return true if a new process is waiting to take over.  Never
+     * blocks. */
+    bool Poll();
+
+    /** Read the request of the new process found by Poll().  If the
+     * process does not send a valid request within the handover timeout
+     * (5 seconds), this returns false and the listener waits for another
+     * process, Error() describes the failure. */
+    bool ReadRequest();
+
+    /** Send 'state' to the new process, after ReadRequest(), and wait for
+     * it to confirm that it has taken over the sockets, for at most the
+     * handover timeout.  The caller still has to close its own copies of
+     * the sockets.  If this returns false, the handover failed and the
+     * listener waits for another process, see Error(). */
+    bool Send(const HandoverState &state);
+
+    /** Reason why the last ReadRequest() or Send() failed. */
+    const std::string& Error() const { return m_Error; }
+
+private:
+    bool Fail(const std::string &error);
+    bool Reset();
+
+    std::string m_PipeName;
+    HANDLE m_Pipe;
+    /** Process id of the new process, received by ReadRequest() */
+    DWORD m_ProcessId;
+    std::string m_Error;
+};
+
+/** Take over from the server running on 'port'.  Returns after the old
+ * server has released the ANT stick, so it can be opened by this process.
+ * Throws an exception if there is no server to take over from. */
+HandoverState TakeOver(int port);
+
+/*
+  Local Variables:
+  mode: c++
+  End:
+*/
@@ -0,0 +1,89 @@
+/**
+ *  HeartRateController -- adjust trainer power to hold a heart rate
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "HeartRateController.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+// Longest time step (seconds) used for an update, when heart beats were
+// missed (e.g. the HRM lost contact), so a single update after a gap does
+// not produce a large correction.
+const double MAX_TIME_STEP = 2.0;
+
+};                                      // end anonymous namespace
+
+HeartRateController::HeartRateController(const Params &params, double initial_power)
+    : m_Params(params),
+      m_BasePower(initial_power),
+      m_Power(initial_power),
+      m_Integral(0),
+      m_HaveLast(false),
+      m_LastHeartRate(0)
+{
+    m_Power = std::max(m_Params.min_power, std::min(m_Params.max_power, m_Power));
+    m_BasePower = m_Power;
+}
+
+void HeartRateController::SetParams(const Params &params)
+{
+    // Restart the PID from the current power, so the new gains don't cause
+    // a jump with the integral accumulated using the old ones.
+    m_Params = params;
+    m_BasePower = std::max(m_Params.min_power, std::min(m_Params.max_power, m_Power));
+    m_Power = m_BasePower;
+    m_Integral = 0;
+}
+
+double HeartRateController::Update(double heart_rate, double dt)
+{
+    if (heart_rate <= 0 || dt <= 0)
+        return m_Power;                 // no valid measurement, hold power
+    dt = std::min(dt, MAX_TIME_STEP);
+
+    // Positive error means the heart rate is too low and power needs to go
+    // up.  Inside the band, the error is 0 and the power is held.
+    double error = m_Params.target_hr - heart_rate;
+    if (std::abs(error) <= m_Params.band)
+        error = 0;
+    else
+        error -= (error > 0 ? m_Params.band : -m_Params.band);
+
+    double derivative = m_HaveLast ? (heart_rate - m_LastHeartRate) / dt : 0;
+    m_LastHeartRate = heart_rate;
+    m_HaveLast = true;
+
+    double integral = m_Integral + error * dt;
+    double output = m_BasePower
+        + m_Params.kp * error
+        + m_Params.ki * integral
+        - m_Params.kd * derivative;
+
+    double max_step = m_Params.max_rate * dt;
+    double power = std::max(m_Power - max_step, std::min(m_Power + max_step, output));
+    power = std::max(m_Params.min_power, std::min(m_Params.max_power, power));
+
+    // Anti-windup: only accept the integral if the output is not limited,
+    // or if the error drives the output back from the limit.
+    if (power == output || (error > 0) == (output < power))
+        m_Integral = integral;
+
+    m_Power = power;
+    return m_Power;
+}
@@ -0,0 +1,81 @@
+/**
+ *  HeartRateController -- adjust trainer power to hold a heart rate
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/** Closed loop controller which adjusts the target power of a trainer so
+ * the heart rate of the rider stays within a band around a target heart
+ * rate.
+ *
+ * This is a PID controller on the heart rate error, with these additions:
+ * no correction is made while the heart rate is inside the band, the
+ * derivative term uses the heart rate rather than the error (so changing
+ * the target does not cause a power spike), the power changes by at most
+ * 'max_rate' watts per second and the integral term is not accumulated
+ * while the power is limited (anti-windup).
+ *
+ * Heart rate responds to power changes with a delay of a minute or more, so
+ * the default gains are small, they change power by a few watts for each
+ * beat the heart rate is off target.
+ */
+class HeartRateController
+{
+public:
+    struct Params {
+        Params()
+            : target_hr(0), band(3), min_power(50), max_power(400),
+              kp(1.0), ki(0.05), kd(0), max_rate(2.0) {}
+        double target_hr;               // BPM
+        double band;                    // +/- BPM around target_hr
+        double min_power;               // watts
+        double max_power;               // watts
+        double kp;                      // watts / BPM
+        double ki;                      // watts / (BPM * second)
+        double kd;                      // watts / (BPM / second)
+        double max_rate;                // watts / second
+    };
+
+    /** Create a controller starting at 'initial_power' watts. */
+    HeartRateController(const Params &params, double initial_power);
+
+    /** Change the controller parameters, the current power is kept. */
+    void SetParams(const Params &params);
+    const Params& GetParams() const { return m_Params; }
+
+    /** Update the controller with a new heart rate measurement, 'dt' is the
+     * time in seconds since the previous measurement, normally the R-R
+     * interval of the heart beat.  Returns the new target power. */
+    double Update(double heart_rate, double dt);
+
+    /** The current target power, in watts */
+    double TargetPower() const { return m_Power; }
+
+private:
+    Params m_Params;
+    /** Power around which the PID output is applied, the starting power */
+    double m_BasePower;
+    double m_Power;
+    double m_Integral;
+    bool m_HaveLast;
+    double m_LastHeartRate;
+};
+
+/*
+  Local Variables:
+  mode: c++
+  End:
+*/
@@ -41,17 +41,27 @@ enum {
     STALE_TIMEOUT = 5000
 };
 
+enum {
+    // Data page containing the event time of the previous heart beat
+    DP_PREVIOUS_HEART_BEAT = 4
+};
+
 };                                      // end anonymous namespace
 
-HeartRateMonitor::HeartRateMonitor (AntStick *stick, uint32_t device_number)
+HeartRateMonitor::HeartRateMonitor (AntStick *stick, uint32_t device_number,
+                                    const SearchConfig &search)
     : AntChannel(
         stick, 
         AntChannel::Id(ANT_DEVICE_TYPE, device_number),
-        CHANNEL_PERIOD, SEARCH_TIMEOUT, CHANNEL_FREQUENCY)
+        CHANNEL_PERIOD, SEARCH_TIMEOUT, CHANNEL_FREQUENCY, search)
 {
     m_LastMeasurementTime = 0;
     m_MeasurementTime = 0;
     m_HeartBeats = 0;
+    m_HeartBeatCount = 0;
+    m_RRInterval = 0;
+    m_HasDataPages = false;
+    m_LastToggle = -1;
     m_InstantHeartRate = 0;
     m_InstantHeartRateTimestamp = 0;
 }
@@ -64,9 +74,35 @@ void HeartRateMonitor::OnMessageReceived(const unsigned char *data, int size)
     // NOTE: the last 3 values in the payload are always the same regardless
     // of the data page.  Also for the data page, we need to observe the
     // highest bit toggle, as old HRM's don't have data pages.
-    m_LastMeasurementTime = m_MeasurementTime;
-    m_MeasurementTime = data[8] + (data[9] << 8);
-    m_HeartBeats = data[10];
+    int toggle = data[4] & 0x80;
+    if (m_LastToggle >= 0 && toggle != m_LastToggle)
+        m_HasDataPages = true;
+    m_LastToggle = toggle;
+
+    int measurement_time = data[8] + (data[9] << 8);
+    int heart_beats = data[10];
+
+    // The same heart beat event is broadcast several times, the R-R
+    // interval is only determined when a new beat arrives.  Event times are
+    // in 1/1024 seconds and roll over every 64 seconds.
+    if (m_InstantHeartRateTimestamp != 0) {
+        int new_beats = (heart_beats - m_HeartBeats) & 0xFF;
+        if (new_beats > 0) {
+            int rr = 0;
+            if (m_HasDataPages && (data[4] & 0x7F) == DP_PREVIOUS_HEART_BEAT) {
+                int previous_time = data[6] + (data[7] << 8);
+                rr = (measurement_time - previous_time) & 0xFFFF;
+            } else if (new_beats == 1) {
+                rr = (measurement_time - m_MeasurementTime) & 0xFFFF;
+            }
+            m_RRInterval = rr * 1000.0 / 1024.0;
+            m_HeartBeatCount += new_beats;
+            m_LastMeasurementTime = m_MeasurementTime;
+        }
+    }
+
+    m_MeasurementTime = measurement_time;
+    m_HeartBeats = heart_beats;
     m_InstantHeartRate = data[11];
     m_InstantHeartRateTimestamp = CurrentMilliseconds();
 }
@@ -92,6 +128,9 @@ void HeartRateMonitor::OnStateChanged (
         m_LastMeasurementTime = 0;
         m_MeasurementTime = 0;
         m_HeartBeats = 0;
+        m_RRInterval = 0;
+        m_HasDataPages = false;
+        m_LastToggle = -1;
         m_InstantHeartRate = 0;
         m_InstantHeartRateTimestamp = 0;
     }
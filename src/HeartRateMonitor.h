@@ -21,18 +21,32 @@
 
 /** Receive data from an ANT+ heart rate monitor. 
  *
- * @warning At this time, only the InstantHeartRate() is received and there is
- * no mechanism implemented to provide average HR information when broadcasts
- * are missed (as described in the profile document), "correct" R-R interval
- * measurement is also not implemented.
+ * @warning At this time, only the InstantHeartRate() and the R-R interval
+ * are received and there is no mechanism implemented to provide average HR
+ * information when broadcasts are missed (as described in the profile
+ * document).
  **/
 class HeartRateMonitor : public AntChannel
 {
 public:
 
-    HeartRateMonitor(AntStick *stick, uint32_t device_number = 0);
+    HeartRateMonitor(AntStick *stick, uint32_t device_number = 0,
+                     const SearchConfig &search = SearchConfig());
     double InstantHeartRate() const;
 
+    /** Timestamp (as returned by CurrentMilliseconds()) when the heart rate
+     * was last received from the HRM. */
+    uint32_t InstantHeartRateTimestamp() const { return m_InstantHeartRateTimestamp; }
+
+    /** Number of heart beats counted since the channel was opened.  This
+     * changes once for each new heart beat event received, which may cover
+     * more than one beat if broadcasts were missed. */
+    int HeartBeatCount() const { return m_HeartBeatCount; }
+
+    /** Time in milliseconds between the last two heart beats, as measured
+     * by the HRM, or 0 if it is not known (e.g. beats were missed). */
+    double RRInterval() const { return m_RRInterval; }
+
 private:
     void OnMessageReceived(const unsigned char *data, int size) override;
     void OnStateChanged (AntChannel::State old_state, AntChannel::State new_state) override;
@@ -40,6 +54,12 @@ private:
     int m_LastMeasurementTime;
     int m_MeasurementTime;
     int m_HeartBeats;
+    int m_HeartBeatCount;
+    double m_RRInterval;
+    /** Data pages are only decoded once the page toggle bit was seen to
+     * change, legacy HRMs don't send data pages. */
+    bool m_HasDataPages;
+    int m_LastToggle;
     uint32_t m_InstantHeartRateTimestamp;
     double m_InstantHeartRate;
 };
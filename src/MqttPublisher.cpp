@@ -0,0 +1,406 @@
+/**
+ *  MqttPublisher -- publish telemetry to an MQTT broker
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include <ws2tcpip.h>
+#include "MqttPublisher.h"
+#include "Tools.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+
+/** IMPLEMENTATION NOTE
+ *
+ * The MQTT packet formats are described in the "MQTT Version 3.1.1" OASIS
+ * standard, http://docs.oasis-open.org/mqtt/mqtt/v3.1.1/mqtt-v3.1.1.html
+ *
+ * Only the packets needed by a QoS 0 publisher are implemented: CONNECT,
+ * CONNACK, PUBLISH, PINGREQ and PINGRESP.
+ *
+ * The MqttWorker thread reads frames from the FrameRing, the same way the
+ * network workers do, and calls MqttPublisher::Tick() every POLL_INTERVAL.
+ * Frames published between two intervals are skipped, only the latest one
+ * is sent to the broker.
+ */
+
+namespace {
+
+enum {
+    MQTT_CONNECT = 0x10,
+    MQTT_CONNACK = 0x20,
+    MQTT_PUBLISH = 0x30,                // QoS 0, no DUP, no RETAIN
+    MQTT_PINGREQ = 0xC0,
+    MQTT_PINGRESP = 0xD0
+};
+
+enum {
+    // Keep alive interval sent to the broker, in seconds.  We send a PINGREQ
+    // if nothing was sent for half of this interval.
+    KEEP_ALIVE = 60,
+
+    // Reconnect delays, in milliseconds.  The delay doubles after each failed
+    // attempt, up to the maximum.
+    MIN_RECONNECT_DELAY = 1000,
+    MAX_RECONNECT_DELAY = 30000,
+
+    // Time to wait for the TCP connection and CONNACK, in milliseconds
+    CONNECT_TIMEOUT = 10000,
+
+    // Maximum amount of unsent data we keep.  If the broker cannot keep up,
+    // new messages are discarded.
+    MAX_OUTPUT = 64 * 1024,
+
+    // Time (milliseconds) the MqttWorker waits between calls to
+    // MqttPublisher::Tick(), frames are produced about every 10
+    // milliseconds.
+    POLL_INTERVAL = 10
+};
+
+void PutRemainingLength(std::vector<uint8_t> &out, size_t length)
+{
+    do {
+        uint8_t b = length & 0x7F;
+        length >>= 7;
+        if (length > 0)
+            b |= 0x80;
+        out.push_back(b);
+    } while (length > 0);
+}
+
+void PutString(std::vector<uint8_t> &out, const std::string &s)
+{
+    out.push_back(static_cast<uint8_t>((s.size() >> 8) & 0xFF));
+    out.push_back(static_cast<uint8_t>(s.size() & 0xFF));
+    out.insert(out.end(), s.begin(), s.end());
+}
+
+/** Decode the remaining length field starting at 'data[pos]'.  Returns false
+ * if not enough data is available, otherwise 'length' is set and 'pos' is
+ * advanced past the field. */
+bool GetRemainingLength(const std::vector<uint8_t> &data, size_t &pos, size_t &length)
+{
+    length = 0;
+    int shift = 0;
+    while (pos < data.size()) {
+        uint8_t b = data[pos++];
+        length |= static_cast<size_t>(b & 0x7F) << shift;
+        if ((b & 0x80) == 0)
+            return true;
+        shift += 7;
+        if (shift > 21)
+            throw std::runtime_error("MqttPublisher: bad remaining length");
+    }
+    return false;
+}
+
+bool SetNonBlocking(SOCKET s)
+{
+    unsigned long mode = 1;
+    return ioctlsocket(s, FIONBIO, &mode) == 0;
+}
+
+};                                      // end anonymous namespace
+
+MqttPublisher::MqttPublisher(const std::string &host, int port, const std::string &client_id)
+    : m_Host(host),
+      m_Port(port),
+      m_ClientId(client_id),
+      m_Socket(INVALID_SOCKET),
+      m_State(MQTT_DISCONNECTED),
+      m_LastSendTime(0),
+      m_ReconnectTime(CurrentMilliseconds()),
+      m_ReconnectDelay(MIN_RECONNECT_DELAY)
+{
+    // Messages are queued up to MAX_OUTPUT, reserve it so queueing does not
+    // allocate.
+    m_Output.reserve(MAX_OUTPUT);
+}
+
+MqttPublisher::~MqttPublisher()
+{
+    if (m_Socket != INVALID_SOCKET)
+        closesocket(m_Socket);
+}
+
+void MqttPublisher::Publish(const std::string &topic, const std::string &payload)
+{
+    if (m_State != MQTT_CONNECTED)
+        return;
+
+    size_t length = 2 + topic.size() + payload.size();
+    if (m_Output.size() + length + 5 > MAX_OUTPUT)
+        return;                         // congested, discard the message
+
+    m_Output.push_back(MQTT_PUBLISH);
+    PutRemainingLength(m_Output, length);
+    PutString(m_Output, topic);
+    m_Output.insert(m_Output.end(), payload.begin(), payload.end());
+}
+
+void MqttPublisher::Tick()
+{
+    uint32_t now = CurrentMilliseconds();
+
+    switch (m_State) {
+    case MQTT_DISCONNECTED:
+        if (static_cast<int32_t>(now - m_ReconnectTime) >= 0)
+            StartConnect();
+        break;
+    case MQTT_CONNECTING:
+        CheckConnect();
+        break;
+    case MQTT_WAIT_CONNACK:
+        ReadPackets();
+        if (m_State == MQTT_WAIT_CONNACK && (now - m_LastSendTime) > CONNECT_TIMEOUT)
+            Disconnect("timed out waiting for CONNACK");
+        break;
+    case MQTT_CONNECTED:
+        ReadPackets();
+        if (m_State == MQTT_CONNECTED
+            && m_Output.empty()
+            && (now - m_LastSendTime) > (KEEP_ALIVE * 1000 / 2)) {
+            m_Output.push_back(MQTT_PINGREQ);
+            m_Output.push_back(0x00);
+        }
+        break;
+    }
+
+    if (m_State == MQTT_CONNECTED || m_State == MQTT_WAIT_CONNACK)
+        Flush();
+}
+
+/** Start a non-blocking connection to the broker.  The connection is
+ * completed in CheckConnect().
+ *
+ * @hint getaddrinfo() may block while resolving a host name, use a numeric
+ * address for the broker to avoid this.
+ */
+void MqttPublisher::StartConnect()
+{
+    std::ostringstream service_name;
+    service_name << m_Port;
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    struct addrinfo *addresses = nullptr;
+    int r = getaddrinfo(m_Host.c_str(), service_name.str().c_str(), &hints, &addresses);
+    if (r != 0 || addresses == nullptr) {
+        Disconnect("cannot resolve " + m_Host);
+        return;
+    }
+
+    m_Socket = socket(addresses->ai_family, addresses->ai_socktype, addresses->ai_protocol);
+    if (m_Socket == INVALID_SOCKET || ! SetNonBlocking(m_Socket)) {
+        freeaddrinfo(addresses);
+        Disconnect("cannot create socket");
+        return;
+    }
+
+    r = connect(m_Socket, addresses->ai_addr, static_cast<int>(addresses->ai_addrlen));
+    freeaddrinfo(addresses);
+    if (r == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK) {
+        Disconnect("connect failed");
+        return;
+    }
+
+    m_State = MQTT_CONNECTING;
+    m_LastSendTime = CurrentMilliseconds();
+}
+
+void MqttPublisher::CheckConnect()
+{
+    std::vector<SOCKET> sockets;
+    sockets.push_back(m_Socket);
+    auto status = get_socket_status(sockets, 0);
+
+    // NOTE: a failed non-blocking connect is reported as an exception on
+    // the socket.
+    if (status[0] & SK_EXCEPT) {
+        Disconnect("connect failed");
+    } else if (status[0] & SK_WRITE) {
+        unsigned long flag = 1;
+        setsockopt(m_Socket, IPPROTO_TCP, TCP_NODELAY,
+                   reinterpret_cast<const char*>(&flag), sizeof(flag));
+        SendConnect();
+    } else if ((CurrentMilliseconds() - m_LastSendTime) > CONNECT_TIMEOUT) {
+        Disconnect("connect timed out");
+    }
+}
+
+void MqttPublisher::SendConnect()
+{
+    std::vector<uint8_t> body;
+    PutString(body, "MQTT");
+    body.push_back(0x04);               // protocol level 3.1.1
+    body.push_back(0x02);               // flags: clean session
+    body.push_back((KEEP_ALIVE >> 8) & 0xFF);
+    body.push_back(KEEP_ALIVE & 0xFF);
+    PutString(body, m_ClientId);
+
+    m_Output.clear();
+    m_Output.push_back(MQTT_CONNECT);
+    PutRemainingLength(m_Output, body.size());
+    m_Output.insert(m_Output.end(), body.begin(), body.end());
+    m_State = MQTT_WAIT_CONNACK;
+    m_LastSendTime = CurrentMilliseconds();
+}
+
+/** Read and process any packets sent by the broker. */
+void MqttPublisher::ReadPackets()
+{
+    uint8_t buf[256];
+    while (true) {
+        int r = recv(m_Socket, reinterpret_cast<char*>(&buf[0]), sizeof(buf), 0);
+        if (r == 0) {
+            Disconnect("connection closed by broker");
+            return;
+        }
+        if (r == SOCKET_ERROR) {
+            if (WSAGetLastError() == WSAEWOULDBLOCK)
+                break;
+            Disconnect("recv failed");
+            return;
+        }
+        m_Input.insert(m_Input.end(), &buf[0], &buf[r]);
+    }
+
+    while (! m_Input.empty()) {
+        size_t pos = 1;
+        size_t length = 0;
+        if (! GetRemainingLength(m_Input, pos, length) || m_Input.size() < pos + length)
+            break;                      // incomplete packet
+
+        uint8_t type = m_Input[0] & 0xF0;
+        if (type == MQTT_CONNACK) {
+            if (length < 2 || m_Input[pos + 1] != 0) {
+                Disconnect("connection refused by broker");
+                return;
+            }
+            std::cout << "Connected to MQTT broker " << m_Host << ":" << m_Port << std::endl;
+            m_State = MQTT_CONNECTED;
+            m_ReconnectDelay = MIN_RECONNECT_DELAY;
+        }
+        // PINGRESP and anything else is ignored, we only care that the
+        // broker is responding, which the TCP connection tells us anyway.
+
+        m_Input.erase(m_Input.begin(), m_Input.begin() + pos + length);
+    }
+}
+
+/** Send as much of the queued data as the socket will accept without
+ * blocking. */
+void MqttPublisher::Flush()
+{
+    if (m_Output.empty())
+        return;
+
+    int r = send(m_Socket, reinterpret_cast<const char*>(&m_Output[0]),
+                 static_cast<int>(m_Output.size()), 0);
+    if (r == SOCKET_ERROR) {
+        if (WSAGetLastError() != WSAEWOULDBLOCK)
+            Disconnect("send failed");
+        return;
+    }
+
+    m_Output.erase(m_Output.begin(), m_Output.begin() + r);
+    m_LastSendTime = CurrentMilliseconds();
+}
+
+void MqttPublisher::Disconnect(const std::string &reason)
+{
+    if (m_State != MQTT_DISCONNECTED || m_ReconnectDelay == MIN_RECONNECT_DELAY) {
+        std::cerr << "MQTT broker " << m_Host << ":" << m_Port << ": " << reason
+                  << ", will retry in " << m_ReconnectDelay / 1000 << " seconds" << std::endl;
+    }
+
+    if (m_Socket != INVALID_SOCKET) {
+        closesocket(m_Socket);
+        m_Socket = INVALID_SOCKET;
+    }
+    m_Output.clear();
+    m_Input.clear();
+    m_State = MQTT_DISCONNECTED;
+    m_ReconnectTime = CurrentMilliseconds() + m_ReconnectDelay;
+    m_ReconnectDelay = std::min(m_ReconnectDelay * 2, static_cast<uint32_t>(MAX_RECONNECT_DELAY));
+}
+
+
+// ......................................................... MqttWorker ....
+
+MqttWorker::MqttWorker(const std::string &host, int port, const std::string &client_id,
+                       const std::string &topic_prefix, int interval,
+                       const FrameRing &frames)
+    : m_Publisher(host, port, client_id),
+      m_TopicPrefix(topic_prefix),
+      m_Interval(interval),
+      m_Frames(frames),
+      m_NextSeq(frames.NextSeq()),
+      m_LastPublish(0),
+      m_Stop(false)
+{
+    m_Thread = std::thread(&MqttWorker::Run, this);
+}
+
+MqttWorker::~MqttWorker()
+{
+    m_Stop = true;
+    m_Thread.join();
+}
+
+void MqttWorker::Run()
+{
+    while (! m_Stop) {
+        try {
+            bool missed = false;
+            while (auto frame = m_Frames.Next(m_NextSeq, missed))
+                m_Latest = frame;
+
+            auto now = CurrentMilliseconds();
+            if (m_Latest && m_Publisher.IsConnected()
+                && (now - m_LastPublish) >= static_cast<uint32_t>(m_Interval)) {
+                m_LastPublish = now;
+                PublishFrame(*m_Latest);
+            }
+            // All messages are queued up above and sent together.
+            m_Publisher.Tick();
+        }
+        catch (const std::exception &e) {
+            std::cerr << "MqttWorker: " << e.what() << std::endl;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(POLL_INTERVAL));
+    }
+}
+
+/** Publish the telemetry of all riders in 'frame'.  The topic and payload
+ * are built in m_Topic and m_Payload, which keep their storage, so this does
+ * not allocate once they have grown to the message size. */
+void MqttWorker::PublishFrame(const TelemetryFrame &frame)
+{
+    for (unsigned i = 0; i < frame.riders.size(); ++i) {
+        m_Topic.assign(m_TopicPrefix).append("/");
+        AppendNumber(m_Topic, i);
+        m_Topic.append("/telemetry");
+        m_Payload.clear();
+        AppendTelemetry(m_Payload, frame.riders[i].telemetry);
+        m_Publisher.Publish(m_Topic, m_Payload);
+    }
+}
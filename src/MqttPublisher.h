@@ -0,0 +1,130 @@
+/**
+ *  MqttPublisher -- publish telemetry to an MQTT broker
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "NetTools.h"
+#include "NetworkWorker.h"
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+/** A minimal MQTT 3.1.1 client which can only publish messages with QoS 0.
+ *
+ * The publisher never blocks: the connection to the broker is established
+ * using a non-blocking socket and Tick() advances the connection state,
+ * sends any queued messages and keeps the connection alive.  Messages
+ * published while the broker is not connected are discarded, as are
+ * messages which cannot be sent because the connection is congested (this
+ * is permitted for QoS 0 messages).  When the connection is lost, the
+ * publisher reconnects, waiting longer between each failed attempt.
+ */
+class MqttPublisher
+{
+public:
+    MqttPublisher(const std::string &host, int port, const std::string &client_id);
+    ~MqttPublisher();
+
+    /** Queue a message to 'topic'.  All messages queued between two calls
+     * to Tick() are sent out together. */
+    void Publish(const std::string &topic, const std::string &payload);
+
+    /** Advance the connection state and send any queued messages.  Should be
+     * called once per main loop iteration. */
+    void Tick();
+
+    bool IsConnected() const { return m_State == MQTT_CONNECTED; }
+
+private:
+
+    enum State {
+        MQTT_DISCONNECTED,      // waiting to reconnect
+        MQTT_CONNECTING,        // waiting for the TCP connection
+        MQTT_WAIT_CONNACK,      // CONNECT sent, waiting for CONNACK
+        MQTT_CONNECTED
+    };
+
+    void StartConnect();
+    void CheckConnect();
+    void SendConnect();
+    void ReadPackets();
+    void Flush();
+    void Disconnect(const std::string &reason);
+
+    std::string m_Host;
+    int m_Port;
+    std::string m_ClientId;
+
+    SOCKET m_Socket;
+    State m_State;
+
+    /** Encoded packets waiting to be sent */
+    std::vector<uint8_t> m_Output;
+    /** Data received from the broker, not yet processed */
+    std::vector<uint8_t> m_Input;
+
+    uint32_t m_LastSendTime;
+    uint32_t m_ReconnectTime;
+    uint32_t m_ReconnectDelay;
+};
+
+/** Publish the rider telemetry from the frames in a FrameRing to an MQTT
+ * broker, on a separate thread, so the ANT thread never touches the broker
+ * connection.  The telemetry of each rider is published on the topic
+ * "<prefix>/<rider index>/telemetry" every 'interval' milliseconds, using
+ * the latest frame.
+ */
+class MqttWorker
+{
+public:
+    MqttWorker(const std::string &host, int port, const std::string &client_id,
+               const std::string &topic_prefix, int interval,
+               const FrameRing &frames);
+    ~MqttWorker();
+
+    /** Change the publish interval (milliseconds), can be called from any
+     * thread. */
+    void SetInterval(int interval) { m_Interval = interval; }
+
+private:
+    void Run();
+    void PublishFrame(const TelemetryFrame &frame);
+
+    MqttPublisher m_Publisher;
+    std::string m_TopicPrefix;
+    std::atomic<int> m_Interval;
+    const FrameRing &m_Frames;
+    /** Sequence number of the next frame to read from m_Frames */
+    uint64_t m_NextSeq;
+    /** The last frame read, published at the next interval */
+    std::shared_ptr<const TelemetryFrame> m_Latest;
+    uint32_t m_LastPublish;
+    /** Buffers for the message published for each rider */
+    std::string m_Topic;
+    std::string m_Payload;
+
+    std::atomic<bool> m_Stop;
+    std::thread m_Thread;
+};
+
+/*
+  Local Variables:
+  mode: c++
+  End:
+*/
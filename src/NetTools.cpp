@@ -17,6 +17,7 @@
  */
 #include "stdafx.h"
 #include <ws2tcpip.h>
+#include <mstcpip.h>
 #include "NetTools.h"
 #include "Tools.h"
 #include <sstream>
@@ -93,6 +94,62 @@ SOCKET tcp_accept(SOCKET server)
     return client;
 }
 
+SOCKET tcp_try_accept(SOCKET server)
+{
+    SOCKET client = accept (server, NULL, NULL);
+
+    if (client == INVALID_SOCKET) {
+        auto last_error = WSAGetLastError();
+        if (last_error == WSAEWOULDBLOCK)
+            return INVALID_SOCKET;
+        throw Win32Error ("accept()", last_error);
+    }
+
+    // Accepted sockets inherit the non-blocking mode of the server socket.
+    set_non_blocking(client, false);
+
+    // Disable send delay.
+    unsigned long flag = 1;
+    int r = setsockopt(client, IPPROTO_TCP, TCP_NODELAY,
+                       reinterpret_cast<const char*>(&flag), sizeof(flag));
+    if (r == SOCKET_ERROR)
+        throw Win32Error("setsockopt()", WSAGetLastError());
+
+    return client;
+}
+
+void set_non_blocking(SOCKET s, bool non_blocking)
+{
+    unsigned long mode = non_blocking ? 1 : 0;
+    if (ioctlsocket(s, FIONBIO, &mode) == SOCKET_ERROR)
+        throw Win32Error("ioctlsocket(FIONBIO)", WSAGetLastError());
+}
+
+void set_keepalive(SOCKET s, unsigned long idle, unsigned long interval)
+{
+    struct tcp_keepalive ka;
+    ka.onoff = 1;
+    ka.keepalivetime = idle;
+    ka.keepaliveinterval = interval;
+    DWORD returned = 0;
+    int r = WSAIoctl(s, SIO_KEEPALIVE_VALS, &ka, sizeof(ka),
+                     NULL, 0, &returned, NULL, NULL);
+    if (r == SOCKET_ERROR)
+        throw Win32Error("WSAIoctl(SIO_KEEPALIVE_VALS)", WSAGetLastError());
+}
+
+bool set_max_retransmit_time(SOCKET s, unsigned long seconds)
+{
+#if defined TCP_MAXRT
+    DWORD value = seconds;
+    int r = setsockopt(s, IPPROTO_TCP, TCP_MAXRT,
+                       reinterpret_cast<const char*>(&value), sizeof(value));
+    return r != SOCKET_ERROR;
+#else
+    return false;
+#endif
+}
+
 SOCKET tcp_connect (const std::string &server, int port)
 {
     {
@@ -201,10 +258,18 @@ std::string get_peer_name (SOCKET s)
 // NOTE: timeout is in milliseconds
 std::vector<uint8_t> get_socket_status(const std::vector<SOCKET> &sockets, uint64_t timeout)
 {
-    if (sockets.size() >= FD_SETSIZE)
+    std::vector<uint8_t> result;
+    get_socket_status(sockets, timeout, result);
+    return result;
+}
+
+void get_socket_status(const std::vector<SOCKET> &sockets, uint64_t timeout,
+                       std::vector<uint8_t> &result)
+{
+    if (sockets.size() > FD_SETSIZE)
         throw std::exception("get_socket_status: too many sockets");
 
-    std::vector<uint8_t> result(sockets.size()); // initialized to 0
+    result.assign(sockets.size(), 0);
 
     fd_set read_fds, write_fds, except_fds;
     FD_ZERO (&read_fds);
@@ -234,7 +299,7 @@ std::vector<uint8_t> get_socket_status(const std::vector<SOCKET> &sockets, uint6
     // r == 0 means that no sockets have messages, saves the trouble of
     // checking them individually
     if (r == 0)
-        return result;
+        return;
 
     for (unsigned i = 0; i < sockets.size(); i++) {
         uint8_t val = 0;
@@ -249,6 +314,4 @@ std::vector<uint8_t> get_socket_status(const std::vector<SOCKET> &sockets, uint6
         }
         result[i] = val;
     }
-
-    return std::move (result);
 }
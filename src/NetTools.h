@@ -25,6 +25,21 @@
 
 SOCKET tcp_listen(int port);
 SOCKET tcp_accept(SOCKET server);
+/** Accept a connection on a non-blocking 'server' socket.  Returns
+ * INVALID_SOCKET if there is no pending connection, which can happen when
+ * several threads wait on the same server socket.  The returned socket is in
+ * blocking mode. */
+SOCKET tcp_try_accept(SOCKET server);
+void set_non_blocking(SOCKET s, bool non_blocking);
+/** Enable TCP keepalive on 's': probes are sent after 'idle' milliseconds
+ * without traffic, every 'interval' milliseconds.  Windows gives up after
+ * 10 unanswered probes, after which the socket reports an error. */
+void set_keepalive(SOCKET s, unsigned long idle, unsigned long interval);
+/** Limit the time (seconds) TCP retransmits unacknowledged data before it
+ * drops the connection (TCP_MAXRT).  Returns false if this is not supported
+ * by the operating system, this option is only available since Windows 10.
+ */
+bool set_max_retransmit_time(SOCKET s, unsigned long seconds);
 SOCKET tcp_connect (const std::string &server, int port);
 std::string get_peer_name (SOCKET s);
 
@@ -37,3 +52,7 @@ enum {
 // timeout is in milliseconds
 std::vector<uint8_t>
 get_socket_status(const std::vector<SOCKET> &sockets, uint64_t timeout);
+/** Same as above, but store the status in 'result', to avoid allocating a
+ * new vector on each call. */
+void get_socket_status(const std::vector<SOCKET> &sockets, uint64_t timeout,
+                       std::vector<uint8_t> &result);
@@ -0,0 +1,1078 @@
+/**
+ *  NetworkWorker -- serve telemetry clients on a separate thread
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "NetworkWorker.h"
+#include "Tools.h"
+#include <algorithm>
+#include <cstdio>
+#include <iomanip>
+#include <random>
+#include <sstream>
+
+/** IMPLEMENTATION NOTE
+ *
+ * Windows does not have SO_REUSEPORT, so instead of each worker having its
+ * own listening socket, all workers wait on the same non-blocking server
+ * socket and whichever worker accepts a connection first serves it, the
+ * others get WSAEWOULDBLOCK and continue.  The operating system hands out
+ * pending connections to whichever thread is waiting, which spreads the
+ * clients across the workers.
+ *
+ * Each worker waits on its own sockets with select() with a short timeout
+ * and sends out all the frames published since the previous iteration.
+ * Client sockets are non-blocking, so a worker never waits on one client:
+ * whatever a client sent is appended to its input buffer and only complete
+ * lines are processed, the rest waits for the next read.
+ *
+ * Clients which disappear without closing their connection are found by
+ * TCP keepalive, which makes their socket report an error.  A client which
+ * is connected but does not read its data is evicted once its socket was
+ * not writable for CLIENT_STALL_TIMEOUT.  Closed clients are only marked as
+ * CLIENT_CLOSED while the clients are processed and removed at the end of
+ * Poll(), so the client list does not change while it is being iterated.
+ */
+
+namespace {
+
+enum {
+    // Time (milliseconds) a worker waits for socket activity before checking
+    // for new frames.  Frames are produced about every 10 milliseconds.
+    POLL_TIMEOUT = 10,
+
+    // Time (milliseconds) a session is kept after its client disconnects.
+    SESSION_TIMEOUT = 60000,
+
+    // TCP keepalive settings for client sockets, (milliseconds).  Windows
+    // sends 10 probes, so a peer which disappeared without closing the
+    // connection is detected after about 20 seconds.
+    KEEPALIVE_IDLE = 10000,
+    KEEPALIVE_INTERVAL = 1000,
+
+    // Time (seconds) unacknowledged data is retransmitted before the
+    // connection is dropped.
+    MAX_RETRANSMIT_TIME = 20,
+
+    // Time (milliseconds) a client can go without reading its data before
+    // it is evicted.  Until then, frames are skipped for the client.
+    CLIENT_STALL_TIMEOUT = 30000,
+
+    // Bytes read from a client socket at a time
+    RECEIVE_SIZE = 1024,
+
+    // Longest message (bytes) a client can send, a client which sends more
+    // without a '\n' is disconnected.  Client commands are short.
+    MAX_MESSAGE_SIZE = 4096
+};
+
+std::string MakeSessionToken()
+{
+    static std::mutex mutex;
+    static std::mt19937_64 generator { std::random_device()() };
+    std::lock_guard<std::mutex> guard(mutex);
+    std::ostringstream token;
+    token << std::hex << std::setw(16) << std::setfill('0') << generator();
+    return token.str();
+}
+
+/** Result of sending to, or receiving from a client socket.  Clients go
+ * away at any time, so these are expected and reported as a result rather
+ * than an exception, which would be expensive when many clients disconnect
+ * at once.
+ */
+enum IoStatus {
+    IO_OK,
+    IO_CLOSED,                          // client closed or reset the connection
+    IO_ERROR                            // other socket error
+};
+
+IoStatus SocketErrorStatus(int error)
+{
+    switch (error) {
+    case WSAECONNRESET:
+    case WSAECONNABORTED:
+    case WSAESHUTDOWN:
+    case WSAENOTCONN:
+        return IO_CLOSED;
+    default:
+        return IO_ERROR;
+    }
+}
+
+/** Send 'len' bytes from 'msg' to socket 's'.  For IO_ERROR, 'error' is
+ * set to the WSAGetLastError() code.  The socket is non-blocking, a send
+ * which would block (WSAEWOULDBLOCK) is an IO_ERROR, like a partial send:
+ * the client does not keep up with its data. */
+IoStatus SendMessage(SOCKET s, const char *msg, int len, int &error)
+{
+    int r = send(s, msg, len, 0);
+    if (r == SOCKET_ERROR) {
+        error = WSAGetLastError();
+        return SocketErrorStatus(error);
+    }
+    if (r < len) {
+        // The client is not keeping up and a partial message would corrupt
+        // the stream, it has to be dropped.
+        error = WSAENOBUFS;
+        return IO_ERROR;
+    }
+    return IO_OK;
+}
+
+/** Append the data available on the non-blocking socket 's' to 'input',
+ * without waiting for more.  No data (WSAEWOULDBLOCK) is not an error, the
+ * socket may be reported readable before its data arrives.  For IO_ERROR,
+ * 'error' is set to the WSAGetLastError() code. */
+IoStatus ReadInput(SOCKET s, std::string &input, int &error)
+{
+    char buf[RECEIVE_SIZE];
+    int r = recv(s, &buf[0], sizeof(buf), 0);
+    if (r == 0) // socket was closed
+        return IO_CLOSED;
+    if (r == SOCKET_ERROR) {
+        error = WSAGetLastError();
+        if (error == WSAEWOULDBLOCK) {
+            error = 0;
+            return IO_OK;
+        }
+        return SocketErrorStatus(error);
+    }
+    input.append(&buf[0], r);
+    return IO_OK;
+}
+
+/** Log a socket error for the client at 'peer', 'who' is the failed
+ * operation.  Closed connections are not reported, they are logged when
+ * the client is removed. */
+void ReportIoStatus(const std::string &peer, IoStatus status,
+                    const char *who, int error)
+{
+    if (status == IO_ERROR)
+        std::cerr << peer << ": " << Win32Error(who, error).what() << std::endl;
+}
+
+/** Set up the socket options used to detect dead client connections.  A
+ * client which stops responding would otherwise keep its socket open
+ * until a send fails, which does not happen while frames are skipped for
+ * a client whose socket is not writable. */
+void ConfigureClientSocket(SOCKET s)
+{
+    set_keepalive(s, KEEPALIVE_IDLE, KEEPALIVE_INTERVAL);
+    set_max_retransmit_time(s, MAX_RETRANSMIT_TIME); // best effort
+}
+
+/** Return the peer name of 's', used in log messages.  This is retrieved
+ * once, when the client connects, as it is no longer available once the
+ * client resets the connection. */
+std::string PeerName(SOCKET s)
+{
+    try {
+        return get_peer_name(s);
+    }
+    catch (const std::exception &) {
+        return "unknown client";
+    }
+}
+
+const char *StatusMessage(ServerStatus status)
+{
+    switch (status) {
+    case STATUS_SEARCHING: return "STATUS SEARCHING\n";
+    case STATUS_LIVE: return "STATUS LIVE\n";
+    default: return "STATUS INITIALISING\n";
+    }
+}
+
+};                                      // end anonymous namespace
+
+
+// .......................................................... FrameRing ....
+
+FrameRing::FrameRing()
+    : m_NextSeq(1)
+{
+    // empty
+}
+
+uint64_t FrameRing::NextSeq() const
+{
+    std::lock_guard<std::mutex> guard(m_Mutex);
+    return m_NextSeq;
+}
+
+void FrameRing::Publish(std::shared_ptr<const TelemetryFrame> frame)
+{
+    std::lock_guard<std::mutex> guard(m_Mutex);
+    m_Frames[m_NextSeq % SIZE] = frame;
+    m_NextSeq++;
+}
+
+std::shared_ptr<const TelemetryFrame> FrameRing::Next(uint64_t &seq, bool &missed) const
+{
+    std::lock_guard<std::mutex> guard(m_Mutex);
+    missed = false;
+    if (seq >= m_NextSeq)
+        return nullptr;
+    if (m_NextSeq - seq > SIZE) {
+        seq = m_NextSeq - SIZE;
+        missed = true;
+    }
+    return m_Frames[seq++ % SIZE];
+}
+
+
+// .......................................................... FramePool ....
+
+FramePool::FramePool(int readers)
+    : m_Next(0)
+{
+    // The frames in the ring, two for each reader and the one being filled
+    int size = FrameRing::SIZE + 2 * readers + 1;
+    m_Frames.reserve(size);
+    for (int i = 0; i < size; ++i)
+        m_Frames.push_back(std::make_shared<TelemetryFrame>());
+}
+
+std::shared_ptr<TelemetryFrame> FramePool::Acquire()
+{
+    for (size_t n = 0; n < m_Frames.size(); ++n) {
+        size_t i = (m_Next + n) % m_Frames.size();
+        // Only the pool holds the frame, and no other thread can obtain a
+        // new reference to it, so the count cannot change behind our back.
+        if (m_Frames[i].use_count() == 1) {
+            // Make the last reader's use of the frame visible to this thread.
+            std::atomic_thread_fence(std::memory_order_acquire);
+            m_Next = (i + 1) % m_Frames.size();
+            return m_Frames[i];
+        }
+    }
+    m_Frames.push_back(std::make_shared<TelemetryFrame>());
+    m_Next = 0;
+    return m_Frames.back();
+}
+
+
+// ....................................................... CommandQueue ....
+
+CommandQueue::CommandQueue()
+{
+    m_Commands.reserve(MAX_COMMANDS);
+}
+
+bool CommandQueue::Push(const ServerCommand &command)
+{
+    std::lock_guard<std::mutex> guard(m_Mutex);
+    if (m_Commands.size() >= MAX_COMMANDS)
+        return false;
+    m_Commands.push_back(command);
+    return true;
+}
+
+void CommandQueue::TakeAll(std::vector<ServerCommand> &commands)
+{
+    commands.clear();
+    std::lock_guard<std::mutex> guard(m_Mutex);
+    std::swap(commands, m_Commands);
+}
+
+
+// ........................................................ GroupFrames ....
+
+GroupFrames::GroupFrames()
+{
+    std::fill(&m_Seq[0], &m_Seq[GROUP_MODE_COUNT], 0);
+}
+
+const std::string& GroupFrames::Get(const TelemetryFrame &frame, GroupMode mode)
+{
+    // Frame sequence numbers start at 1, so 0 means nothing was built yet.
+    if (m_Seq[mode] != frame.seq) {
+        Build(frame, mode, m_Text[mode]);
+        m_Seq[mode] = frame.seq;
+    }
+    return m_Text[mode];
+}
+
+/** W/kg of 'rider' in 'frame', or -1 if not available */
+double GroupFrames::Wkg(const TelemetryFrame &frame, int rider) const
+{
+    const auto &r = frame.riders[rider];
+    if (! r.telemetry.Has(Telemetry::PWR) || r.weight <= 0)
+        return -1;
+    return r.telemetry.Get(Telemetry::PWR) / r.weight;
+}
+
+/** Build a GROUP frame containing the current values for all riders.  The
+ * frame is columnar, with one field for each metric, containing a comma
+ * separated list of values, one for each rider, in rider order.  Missing
+ * values are left empty.  For example:
+ *
+ *    GROUP RIDERS: 0,1,2;HR: 142,,156;CAD: 88,92,85;PWR: 210,250,180;...
+ *
+ * For ranked modes, a RANK field contains the indexes of the top riders,
+ * ordered by power or W/kg, highest first.
+ */
+void GroupFrames::Build(const TelemetryFrame &frame, GroupMode mode, std::string &text)
+{
+    const auto &riders = frame.riders;
+    int nriders = static_cast<int>(riders.size());
+
+    text.assign("GROUP RIDERS: ");
+    for (int i = 0; i < nriders; ++i) {
+        if (i > 0)
+            text.push_back(',');
+        AppendNumber(text, i);
+    }
+    const Telemetry::Field fields[] = {
+        Telemetry::HR, Telemetry::CAD, Telemetry::PWR, Telemetry::SPD
+    };
+    for (auto f : fields) {
+        text.push_back(';');
+        text.append(FieldName(f)).append(": ");
+        for (int i = 0; i < nriders; ++i) {
+            if (i > 0)
+                text.push_back(',');
+            AppendFieldValue(text, riders[i].telemetry, f);
+        }
+    }
+    text.append(";WKG: ");
+    for (int i = 0; i < nriders; ++i) {
+        if (i > 0)
+            text.push_back(',');
+        double v = Wkg(frame, i);
+        if (v >= 0) {
+            // Same as the default std::ostream format
+            char number[32];
+            int n = snprintf(number, sizeof(number), "%g", v);
+            text.append(number, n);
+        }
+    }
+
+    if (mode == GROUP_RANK_POWER || mode == GROUP_RANK_WKG) {
+        m_Key.resize(nriders);
+        for (int i = 0; i < nriders; ++i)
+            m_Key[i] = (mode == GROUP_RANK_POWER) ? riders[i].telemetry.Get(Telemetry::PWR) : Wkg(frame, i);
+        m_Rank.resize(nriders);
+        for (int i = 0; i < nriders; ++i)
+            m_Rank[i] = i;
+        // Only the top riders are shown on a group display, so there is no
+        // need to sort the entire list.
+        int count = std::min(frame.group_rank_size, nriders);
+        const auto &key = m_Key;
+        std::partial_sort(m_Rank.begin(), m_Rank.begin() + count, m_Rank.end(),
+                          [&key](int a, int b) { return key[a] > key[b]; });
+        text.append(";RANK: ");
+        for (int i = 0; i < count; ++i) {
+            if (i > 0)
+                text.push_back(',');
+            AppendNumber(text, m_Rank[i]);
+        }
+    }
+
+    text.append(";TS: ");
+    AppendNumber(text, frame.capture_time);
+    text.push_back('\n');
+}
+
+
+
+// ....................................................... SessionTable ....
+
+std::shared_ptr<Session> SessionTable::Create()
+{
+    auto session = std::make_shared<Session>();
+    session->token = MakeSessionToken();
+    std::lock_guard<std::mutex> guard(m_Mutex);
+    m_Sessions.push_back(session);
+    return session;
+}
+
+std::shared_ptr<Session> SessionTable::Restore(const std::string &token, uint64_t next_seq)
+{
+    // The session might still be here, if the clients were moved between
+    // workers of the same server.
+    auto existing = Attach(token);
+    if (existing)
+        return existing;
+
+    auto session = std::make_shared<Session>();
+    session->token = token;
+    session->next_seq = next_seq;
+    std::lock_guard<std::mutex> guard(m_Mutex);
+    m_Sessions.push_back(session);
+    return session;
+}
+
+std::shared_ptr<Session> SessionTable::Attach(const std::string &token)
+{
+    std::lock_guard<std::mutex> guard(m_Mutex);
+    auto session = std::find_if(
+        begin(m_Sessions), end(m_Sessions),
+        [&token](const std::shared_ptr<Session> &s) { return s->token == token; });
+    if (session == end(m_Sessions))
+        return nullptr;
+    // NOTE: a client may reconnect before the server notices that its old
+    // connection is dead, in which case the session is still attached to the
+    // old connection.  The new client takes over the session.
+    Session &s = **session;
+    s.attached = true;
+    std::lock_guard<std::mutex> session_guard(s.mutex);
+    s.generation++;
+    return *session;
+}
+
+void SessionTable::Detach(const std::shared_ptr<Session> &session, uint64_t generation,
+                          int rider, GroupMode group)
+{
+    std::lock_guard<std::mutex> guard(m_Mutex);
+    std::lock_guard<std::mutex> session_guard(session->mutex);
+    if (session->generation != generation)
+        return;                         // another client took over
+    session->rider = rider;
+    session->group = group;
+    session->attached = false;
+    session->detach_time = CurrentMilliseconds();
+}
+
+void SessionTable::Record(const TelemetryFrame &frame)
+{
+    int nriders = static_cast<int>(frame.riders.size());
+
+    std::lock_guard<std::mutex> guard(m_Mutex);
+    for (const auto &s : m_Sessions) {
+        Session &session = *s;
+        std::lock_guard<std::mutex> session_guard(session.mutex);
+        const std::string *message = nullptr;
+        if (session.group != GROUP_NONE) {
+            message = &m_GroupFrames.Get(frame, session.group);
+        } else if (session.rider < nriders) {
+            message = &frame.riders[session.rider].text;
+        }
+        if (! message)
+            continue;
+
+        // The slot strings keep their storage, so recording does not
+        // allocate once the ring has been filled.
+        Session::Frame &slot = session.frames[session.next_seq % Session::REPLAY_FRAMES];
+        slot.frame_seq = frame.seq;
+        slot.text.assign(*message, 0, message->length() - 1);
+        slot.text.append(";SEQ: ");
+        slot.text.append(std::to_string(session.next_seq));
+        slot.text.push_back('\n');
+        session.next_seq++;
+        if (session.recorded < Session::REPLAY_FRAMES)
+            session.recorded++;
+    }
+}
+
+void SessionTable::Expire()
+{
+    auto now = CurrentMilliseconds();
+    std::lock_guard<std::mutex> guard(m_Mutex);
+    auto e = std::remove_if(
+        begin(m_Sessions), end(m_Sessions),
+        [now](const std::shared_ptr<Session> &s) {
+            return ! s->attached && (now - s->detach_time) > SESSION_TIMEOUT;
+        });
+    m_Sessions.erase(e, end(m_Sessions));
+}
+
+
+// ...................................................... NetworkWorker ....
+
+NetworkWorker::NetworkWorker(SOCKET server, FrameRing &frames,
+                             CommandQueue &commands, SessionTable &sessions,
+                             const std::vector<ClientHandover> &clients)
+    : m_Server(server),
+      m_Frames(frames),
+      m_Commands(commands),
+      m_Sessions(sessions),
+      m_NextSeq(frames.NextSeq()),
+      m_Stop(false)
+{
+    m_Clients.reserve(MAX_CLIENTS);
+    m_Sockets.reserve(MAX_CLIENTS + 1);
+    m_SocketStatus.reserve(MAX_CLIENTS + 1);
+    for (const auto &h : clients) {
+        Client client(h.socket, PeerName(h.socket));
+        client.rider = h.rider;
+        client.group = h.group;
+        client.binary = h.binary;
+        client.input = h.input;
+        if (! h.session_token.empty()) {
+            // The client received all frames before 'session_seq'
+            AttachSession(client, m_Sessions.Restore(h.session_token, h.session_seq),
+                          h.session_seq - 1);
+        }
+        AddClient(client);
+    }
+    m_Thread = std::thread(&NetworkWorker::Run, this);
+}
+
+NetworkWorker::~NetworkWorker()
+{
+    if (m_Thread.joinable()) {
+        m_Stop = true;
+        m_Thread.join();
+    }
+    for (auto &c : m_Clients) {
+        CloseClient(c);
+        closesocket(c.socket);
+    }
+}
+
+std::vector<ClientHandover> NetworkWorker::Stop()
+{
+    m_Stop = true;
+    m_Thread.join();
+    RemoveClosedClients();
+
+    std::vector<ClientHandover> clients;
+    for (auto &c : m_Clients) {
+        ClientHandover h;
+        h.socket = c.socket;
+        h.rider = c.rider;
+        h.group = c.group;
+        h.binary = c.binary;
+        h.input = c.input;
+        if (c.session) {
+            h.session_token = c.session->token;
+            h.session_seq = c.session_seq + 1;
+        }
+        CloseClient(c);
+        clients.push_back(h);
+    }
+    m_Clients.clear();
+    return clients;
+}
+
+void NetworkWorker::Run()
+{
+    while (! m_Stop) {
+        try {
+            Poll();
+        }
+        catch (const std::exception &e) {
+            std::cerr << "NetworkWorker: " << e.what() << std::endl;
+        }
+    }
+}
+
+void NetworkWorker::Poll()
+{
+    // NOTE: first item in list is the server socket, a SK_READ flag on it
+    // means there's a client waiting on it
+    m_Sockets.clear();
+    m_Sockets.push_back(m_Server);
+    for (const auto &c : m_Clients)
+        m_Sockets.push_back(c.socket);
+
+    get_socket_status(m_Sockets, POLL_TIMEOUT, m_SocketStatus);
+    const auto &status = m_SocketStatus;
+
+    auto now = CurrentMicroseconds();
+    for (unsigned i = 1; i < status.size(); ++i) {
+        Client &client = m_Clients[i - 1];
+        if (client.session && SessionReplaced(client)) {
+            // The client resumed its session on a new connection, so this
+            // one is dead, even if TCP has not noticed yet.
+            client.session.reset();
+            MarkClosed(client, CLOSE_LOST);
+            continue;
+        }
+        if (status[i] & SK_EXCEPT) {
+            // Out-of-band data, which our clients never send.
+            MarkClosed(client, CLOSE_LOST);
+            continue;
+        }
+        if (status[i] & SK_READ) {
+            auto receive_time = CurrentMicroseconds();
+            int error = 0;
+            auto r = ReadInput(client.socket, client.input, error);
+            if (r != IO_OK) {
+                ReportIoStatus(client.peer, r, "recv()", error);
+                // Only recv() returning 0 is an orderly close, a reset
+                // means the peer went away.
+                MarkClosed(client, r == IO_CLOSED && error == 0 ? CLOSE_PEER : CLOSE_LOST);
+                continue;
+            }
+            ProcessInput(client, receive_time);
+            if (client.state == CLIENT_CLOSED)
+                continue;
+        }
+        UpdateWritable(client, (status[i] & SK_WRITE) != 0, now);
+    }
+
+    while (true) {
+        bool missed = false;
+        auto frame = m_Frames.Next(m_NextSeq, missed);
+        if (! frame)
+            break;
+        if (missed) {
+            // Binary clients cannot decode the stream past the missing
+            // frames.
+            for (auto &c : m_Clients)
+                DesyncBinary(c);
+        }
+        SendFrame(*frame, status);
+        m_Latest = frame;
+    }
+
+    RemoveClosedClients();
+
+    if (status[0] & SK_READ) {
+        auto client = tcp_try_accept(m_Server);
+        if (client != INVALID_SOCKET && m_Clients.size() >= MAX_CLIENTS) {
+            std::cerr << "Rejected connection from " << PeerName(client)
+                      << ": too many clients" << std::endl;
+            closesocket(client);
+        } else if (client != INVALID_SOCKET) {
+            Client c(client, PeerName(client));
+            std::cout << "Accepted connection from " << c.peer << std::endl;
+            AddClient(c);
+            m_Stats.accepted++;
+        }
+    }
+
+    m_Sessions.Expire();
+}
+
+void NetworkWorker::AddClient(Client client)
+{
+    try {
+        // Sockets handed over by another process are blocking
+        set_non_blocking(client.socket, true);
+    }
+    catch (const std::exception &e) {
+        // A blocking socket would stall all the clients of this worker
+        std::cerr << client.peer << ": " << e.what() << std::endl;
+        CloseClient(client);
+        closesocket(client.socket);
+        return;
+    }
+    try {
+        ConfigureClientSocket(client.socket);
+    }
+    catch (const std::exception &e) {
+        // The client still works, but a dead connection is only detected
+        // when a send fails.
+        std::cerr << client.peer << ": " << e.what() << std::endl;
+    }
+    m_Clients.push_back(client);
+    m_Clients.back().input.reserve(RECEIVE_SIZE);
+}
+
+/** Process the complete messages in the input of 'client', the remainder
+ * of the input is kept until the rest of the message arrives.  A client
+ * which sends a message longer than MAX_MESSAGE_SIZE is closed. */
+void NetworkWorker::ProcessInput(Client &client, uint64_t receive_time)
+{
+    std::string &input = client.input;
+    size_t start = 0;
+    while (client.state != CLIENT_CLOSED) {
+        auto end = input.find('\n', start);
+        if (end == std::string::npos)
+            break;
+        m_Message.assign(input, start, end - start);
+        start = end + 1;
+        ProcessMessage(client, m_Message, receive_time);
+    }
+    input.erase(0, start);
+    if (input.size() > MAX_MESSAGE_SIZE && client.state != CLIENT_CLOSED) {
+        std::cerr << client.peer << ": message too long" << std::endl;
+        MarkClosed(client, CLOSE_LOST);
+    }
+}
+
+/** Track whether 'client' keeps up with the data sent to it, 'writable'
+ * is the socket status from the last select().  A client whose socket has
+ * not been writable for CLIENT_STALL_TIMEOUT is evicted: it is either not
+ * reading, or the connection is dead and TCP has not found out yet.
+ */
+void NetworkWorker::UpdateWritable(Client &client, bool writable, uint64_t now)
+{
+    if (writable) {
+        client.state = CLIENT_OPEN;
+    } else if (client.state == CLIENT_OPEN) {
+        client.state = CLIENT_STALLED;
+        client.stalled_since = now;
+    } else if (client.state == CLIENT_STALLED
+               && now - client.stalled_since > CLIENT_STALL_TIMEOUT * 1000ULL) {
+        MarkClosed(client, CLOSE_EVICTED);
+    }
+}
+
+/** Mark 'client' as closed, it will be removed by RemoveClosedClients(). */
+void NetworkWorker::MarkClosed(Client &client, CloseReason reason)
+{
+    if (client.state == CLIENT_CLOSED)
+        return;
+    client.state = CLIENT_CLOSED;
+    const char *what = "closed";
+    switch (reason) {
+    case CLOSE_PEER:
+        m_Stats.closed++;
+        break;
+    case CLOSE_LOST:
+        m_Stats.lost++;
+        what = "lost";
+        break;
+    case CLOSE_EVICTED:
+        m_Stats.evicted++;
+        what = "evicted";
+        break;
+    }
+    std::cout << "Closing socket for " << client.peer << " (" << what
+              << "; accepted " << m_Stats.accepted << ", closed " << m_Stats.closed
+              << ", lost " << m_Stats.lost << ", evicted " << m_Stats.evicted
+              << ")" << std::endl;
+}
+
+void NetworkWorker::RemoveClosedClients()
+{
+    for (auto &c : m_Clients) {
+        if (c.state == CLIENT_CLOSED) {
+            CloseClient(c);
+            closesocket(c.socket);
+        }
+    }
+    auto e = std::remove_if(begin(m_Clients), end(m_Clients),
+                            [](const Client &c) { return c.state == CLIENT_CLOSED; });
+    m_Clients.erase(e, end(m_Clients));
+}
+
+/** Send 'frame' to all clients which are ready to receive data.  Each
+ * message is encoded only once, regardless of how many clients it is sent
+ * to.  Group frames are only encoded if some client needs them.
+ */
+void NetworkWorker::SendFrame(const TelemetryFrame &frame,
+                              const std::vector<uint8_t> &status)
+{
+    int nriders = static_cast<int>(frame.riders.size());
+
+    for (unsigned i = 1; i < status.size(); ++i) {
+        Client &client = m_Clients[i - 1];
+        if (client.state == CLIENT_CLOSED)
+            continue;
+
+        bool binary = client.binary && client.group == GROUP_NONE && client.rider < nriders;
+        // A binary client which misses a frame cannot decode the following
+        // delta frames.
+        if (binary && ! (status[i] & SK_WRITE) && ! frame.riders[client.rider].binary.empty())
+            DesyncBinary(client);
+        if (! (status[i] & SK_WRITE))
+            continue;
+
+        const std::string *message = nullptr;
+        if (client.session && ! binary) {
+            // Session clients receive the frame recorded in their session,
+            // which has a sequence number and can be replayed.
+            message = SessionFrame(client, frame.seq);
+        } else if (binary) {
+            const auto &rider = frame.riders[client.rider];
+            if (! rider.binary.empty() && (client.binary_synced || rider.keyframe)) {
+                message = &rider.binary;
+                client.binary_synced = true;
+            }
+        } else if (client.group != GROUP_NONE) {
+            message = &m_GroupFrames.Get(frame, client.group);
+        } else if (client.rider < nriders) {
+            message = &frame.riders[client.rider].text;
+        }
+
+        // The status is sent when it changes, and to new clients.
+        const char *status = nullptr;
+        if (client.status != frame.status) {
+            status = StatusMessage(frame.status);
+            client.status = frame.status;
+        }
+        const char *busy = nullptr;
+        if (client.keyframe_dropped) {
+            busy = "BUSY KEYFRAME\n";
+            client.keyframe_dropped = false;
+        }
+
+        if (message || status || busy) {
+            int error = 0;
+            IoStatus r = IO_OK;
+            if (status)
+                r = SendMessage(client.socket, status, static_cast<int>(strlen(status)), error);
+            if (r == IO_OK && busy)
+                r = SendMessage(client.socket, busy, static_cast<int>(strlen(busy)), error);
+            if (r == IO_OK && message)
+                r = SendMessage(client.socket, message->c_str(),
+                                static_cast<int>(message->length()), error);
+            if (r != IO_OK) {
+                ReportIoStatus(client.peer, r, "send()", error);
+                MarkClosed(client, CLOSE_LOST);
+            }
+        }
+    }
+}
+
+/** Mark a binary client as needing a keyframe and ask the ANT thread to
+ * produce one. */
+void NetworkWorker::DesyncBinary(Client &client)
+{
+    if (client.binary && client.binary_synced) {
+        client.binary_synced = false;
+        RequestKeyframe(client);
+    }
+}
+
+/** Ask the ANT thread for a keyframe for the rider of 'client'.  If the
+ * command queue is full, the request is dropped and the client is sent a
+ * "BUSY KEYFRAME" message with the next frame, it will decode the stream
+ * again from the next regular keyframe. */
+void NetworkWorker::RequestKeyframe(Client &client)
+{
+    if (! m_Commands.Push(ServerCommand(ServerCommand::FORCE_KEYFRAME, client.rider)))
+        client.keyframe_dropped = true;
+}
+
+/** Detach the session of a client which is being closed.  The client
+ * settings are saved in the session, so they are restored when the client
+ * resumes the session. */
+void NetworkWorker::CloseClient(Client &client)
+{
+    if (client.session) {
+        m_Sessions.Detach(client.session, client.session_generation,
+                          client.rider, client.group);
+        client.session.reset();
+    }
+}
+
+void NetworkWorker::ProcessMessage(Client &client, const std::string &message,
+                                   uint64_t receive_time)
+{
+    //std::cout << "Received message: <" << message << ">\n";
+    std::istringstream input(message);
+    std::string command;
+    input >> command;
+
+    int nriders = m_Latest ? static_cast<int>(m_Latest->riders.size()) : 0;
+
+    if (command == "CURVE") {
+        if (client.rider < nriders)
+            SendReply(client, m_Latest->riders[client.rider].curve);
+    } else if (command == "DEVICE-INFO") {
+        if (client.rider < nriders && ! m_Latest->riders[client.rider].device_info.empty())
+            SendReply(client, m_Latest->riders[client.rider].device_info);
+    } else if (command == "SELECT-RIDER") {
+        // SELECT-RIDER <index> -- telemetry and subsequent commands from
+        // this client refer to this rider.
+        int index = -1;
+        input >> index;
+        if (index >= 0 && index < nriders) {
+            client.rider = index;
+            client.group = GROUP_NONE;
+            SaveSessionSettings(client);
+            client.binary_synced = false;
+            if (client.binary)
+                RequestKeyframe(client);
+        }
+    } else if (command == "SUBSCRIBE-GROUP") {
+        // SUBSCRIBE-GROUP [PWR|WKG] -- receive GROUP frames for all riders,
+        // optionally ranked by power or W/kg
+        std::string ranking;
+        input >> ranking;
+        if (ranking == "PWR")
+            client.group = GROUP_RANK_POWER;
+        else if (ranking == "WKG")
+            client.group = GROUP_RANK_WKG;
+        else
+            client.group = GROUP_UNRANKED;
+        SaveSessionSettings(client);
+    } else if (command == "SET-ENCODING") {
+        // SET-ENCODING BINARY|TEXT -- BINARY sends rider telemetry in the
+        // compact TelemetryEncoder format, GROUP frames and replies to
+        // commands are still sent as text.
+        std::string encoding;
+        input >> encoding;
+        client.binary = (encoding == "BINARY");
+        client.binary_synced = false;
+        if (client.binary)
+            RequestKeyframe(client);
+    } else if (command == "SESSION") {
+        // SESSION -- start a resumable session, the server replies with
+        // "SESSION <token>" and all subsequent TELEMETRY and GROUP frames
+        // have a SEQ field with a sequence number.
+        StartSession(client);
+    } else if (command == "RESUME") {
+        // RESUME <token> <last SEQ received> -- after a reconnect, continue
+        // a session, frames missed since the last SEQ are sent first.
+        std::string token;
+        uint64_t last_seq = 0;
+        input >> token >> last_seq;
+        ResumeSession(client, token, last_seq);
+    } else if (command == "TIME-SYNC") {
+        std::string client_time;
+        input >> client_time;
+        SendTimeSync(client, client_time, receive_time);
+    } else if (! command.empty()) {
+        // Everything else needs the riders, so it is executed by the ANT
+        // thread.  If it is not keeping up, the command is dropped and the
+        // client can send it again later.
+        if (! m_Commands.Push(ServerCommand(ServerCommand::CLIENT_MESSAGE, client.rider, message)))
+            SendReply(client, "BUSY " + command + "\n");
+    }
+}
+
+void NetworkWorker::StartSession(Client &client)
+{
+    if (! client.session) {
+        auto session = m_Sessions.Create();
+        {
+            std::lock_guard<std::mutex> guard(session->mutex);
+            client.session_generation = session->generation;
+            client.session_seq = session->next_seq - 1;
+        }
+        client.session = session;
+        SaveSessionSettings(client);
+    }
+    SendReply(client, "SESSION " + client.session->token + "\n");
+}
+
+/** Attach the session identified by 'token' to 'client', taking it over
+ * from any client still attached to it, and send the frames after
+ * 'last_seq'.  If the session has expired, the client receives a
+ * SESSION-EXPIRED message and should start a new session.
+ */
+void NetworkWorker::ResumeSession(Client &client, const std::string &token, uint64_t last_seq)
+{
+    auto session = m_Sessions.Attach(token);
+    if (! session) {
+        SendReply(client, "SESSION-EXPIRED " + token + "\n");
+        return;
+    }
+
+    // Detach any other session of this client.  If the client resumes its
+    // own session, the detach is ignored, as the session was attached again
+    // above.
+    CloseClient(client);
+    AttachSession(client, session, last_seq);
+}
+
+/** Attach 'session' to 'client', restoring the client settings saved in the
+ * session, and send, in a single write, all the recorded frames after
+ * 'last_seq' which are still available.  Live frames follow with the next
+ * frame.
+ */
+void NetworkWorker::AttachSession(Client &client, const std::shared_ptr<Session> &session,
+                                  uint64_t last_seq)
+{
+    std::string message;
+    {
+        std::lock_guard<std::mutex> guard(session->mutex);
+        client.session_generation = session->generation;
+        client.rider = session->rider;
+        client.group = session->group;
+        uint64_t first_seq = session->next_seq - session->recorded;
+        for (uint64_t seq = std::max(first_seq, last_seq + 1); seq < session->next_seq; ++seq)
+            message.append(session->frames[seq % Session::REPLAY_FRAMES].text);
+        client.session_seq = session->next_seq - 1;
+    }
+    client.session = session;
+    if (! message.empty())
+        SendReply(client, message);
+}
+
+/** Return true if another client took over the session of 'client' */
+bool NetworkWorker::SessionReplaced(Client &client)
+{
+    std::lock_guard<std::mutex> guard(client.session->mutex);
+    return client.session->generation != client.session_generation;
+}
+
+/** Save the client settings in its session, so the frames recorded for the
+ * session follow them. */
+void NetworkWorker::SaveSessionSettings(Client &client)
+{
+    if (! client.session)
+        return;
+    std::lock_guard<std::mutex> guard(client.session->mutex);
+    client.session->rider = client.rider;
+    client.session->group = client.group;
+}
+
+/** Return the message recorded in the session of 'client' for the frame
+ * 'frame_seq', or nullptr if it was not recorded or was already sent to the
+ * client as part of a replay.  Frames recorded before the client changed
+ * its settings still follow the old settings.
+ */
+const std::string* NetworkWorker::SessionFrame(Client &client, uint64_t frame_seq)
+{
+    Session &session = *client.session;
+    std::lock_guard<std::mutex> guard(session.mutex);
+    // The frame is usually the last one recorded, or close to it, as the
+    // ANT thread records frames just before publishing them.
+    uint64_t first_seq = session.next_seq - session.recorded;
+    for (uint64_t seq = session.next_seq; seq > first_seq && seq > client.session_seq + 1; --seq) {
+        const Session::Frame &slot = session.frames[(seq - 1) % Session::REPLAY_FRAMES];
+        if (slot.frame_seq == frame_seq) {
+            m_SessionFrame.assign(slot.text);
+            client.session_seq = seq - 1;
+            return &m_SessionFrame;
+        }
+        if (slot.frame_seq < frame_seq)
+            break;
+    }
+    return nullptr;
+}
+
+/** Reply to a TIME-SYNC request, allowing a client to estimate the offset
+ * between its clock and the server clock, NTP style.  The client sends:
+ *
+ *     TIME-SYNC T1
+ *
+ * where T1 is the client time when the request was sent.  The server
+ * replies with:
+ *
+ *     TIME-SYNC T1 T2 T3
+ *
+ * where T1 is copied from the request, T2 is the server time when the
+ * request was received and T3 is the server time when the reply is sent.
+ * Server times are in microseconds, in the same time base as the TS field of
+ * the TELEMETRY and GROUP messages and the HRTS and FETS sensor sample times
+ * of the TELEMETRY messages, see Telemetry::timestamp.  If the client
+ * receives the reply at T4, the round trip delay is (T4 - T1) - (T3 - T2)
+ * and the server clock offset is ((T2 - T1) + (T3 - T4)) / 2 (assuming the
+ * client also uses microseconds).
+ */
+void NetworkWorker::SendTimeSync(Client &client, const std::string &client_time,
+                                 uint64_t receive_time)
+{
+    std::ostringstream text;
+    text << "TIME-SYNC " << client_time << " " << receive_time << " ";
+    // Take T3 as late as possible, just before the reply is sent.
+    text << CurrentMicroseconds() << "\n";
+    SendReply(client, text.str());
+}
+
+/** Send a reply to a client command, the client is closed if this fails. */
+void NetworkWorker::SendReply(Client &client, const std::string &message)
+{
+    if (client.state == CLIENT_CLOSED)
+        return;
+    int error = 0;
+    auto r = SendMessage(client.socket, message.c_str(),
+                         static_cast<int>(message.length()), error);
+    if (r != IO_OK) {
+        ReportIoStatus(client.peer, r, "send()", error);
+        MarkClosed(client, CLOSE_LOST);
+    }
+}
@@ -0,0 +1,498 @@
+/**
+ *  NetworkWorker -- serve telemetry clients on a separate thread
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "NetTools.h"
+#include "Telemetry.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/** Modes for clients displaying data for all riders. */
+enum GroupMode {
+    GROUP_NONE,                 // not a group display client
+    GROUP_UNRANKED,
+    GROUP_RANK_POWER,
+    GROUP_RANK_WKG,
+    GROUP_MODE_COUNT
+};
+
+/** Server status, reported to clients with a STATUS message whenever it
+ * changes. */
+enum ServerStatus {
+    STATUS_INITIALISING,        // no ANT stick, or the stick is being set up
+    STATUS_SEARCHING,           // searching for the sensors
+    STATUS_LIVE                 // receiving data from sensors
+};
+
+
+// ..................................................... TelemetryFrame ....
+
+/** Data for all riders, produced by the ANT thread once per Tick() and sent
+ * out by the network workers.  Frames are not modified once published, so
+ * they are shared between threads without locking, until they are reused
+ * by the FramePool, when no other thread holds them.
+ */
+struct TelemetryFrame
+{
+    struct RiderData {
+        RiderData() : weight(0), keyframe(false) {}
+        Telemetry telemetry;
+        double weight;
+        /** Encoded TELEMETRY message, '\n' terminated */
+        std::string text;
+        /** TelemetryEncoder frame, empty if nothing changed */
+        std::string binary;
+        bool keyframe;
+        /** Encoded CURVE message, '\n' terminated */
+        std::string curve;
+        /** Encoded DEVICE-INFO messages, one line for each sensor */
+        std::string device_info;
+    };
+
+    TelemetryFrame()
+        : seq(0), capture_time(0), status(STATUS_INITIALISING), group_rank_size(0) {}
+    uint64_t seq;
+    uint64_t capture_time;
+    ServerStatus status;
+    /** Number of riders included in the RANK field of group frames. */
+    int group_rank_size;
+    std::vector<RiderData> riders;
+};
+
+
+// .......................................................... FrameRing ....
+
+/** Broadcast ring holding the most recent frames.  Frames are published by
+ * the ANT thread and each network worker reads them at its own pace.  A
+ * worker which falls behind by more than SIZE frames misses some frames.
+ */
+class FrameRing
+{
+public:
+#if defined LOW_FOOTPRINT
+    enum { SIZE = 16 };
+#else
+    enum { SIZE = 64 };
+#endif
+
+    FrameRing();
+
+    /** Sequence number the next published frame must have */
+    uint64_t NextSeq() const;
+
+    void Publish(std::shared_ptr<const TelemetryFrame> frame);
+
+    /** Return the frame with sequence number 'seq' and advance 'seq', or
+     * return nullptr if there are no new frames.  If the frame was already
+     * overwritten, the oldest available frame is returned instead and
+     * 'missed' is set to true. */
+    std::shared_ptr<const TelemetryFrame> Next(uint64_t &seq, bool &missed) const;
+
+private:
+    mutable std::mutex m_Mutex;
+    std::shared_ptr<const TelemetryFrame> m_Frames[SIZE];
+    uint64_t m_NextSeq;
+};
+
+
+// .......................................................... FramePool ....
+
+/** The frames published by the ANT thread, which are reused instead of
+ * allocating a new frame on each Tick().  A frame can be reused once no
+ * other thread holds it, that is once it was dropped from the FrameRing and
+ * every reader moved past it, at which point the pool holds the only
+ * reference to it.  A reused frame keeps the storage of its strings, so
+ * filling it in does not allocate either, once the frames have grown to the
+ * size of the messages.
+ *
+ * The FrameRing holds SIZE frames and each reader (a network worker or the
+ * MQTT worker) at most two more: the frame it is sending and the latest
+ * frame, so the pool is created with enough frames for these.  If all frames
+ * are still in use, a new frame is added to the pool, so the pool size is
+ * the largest number of frames ever in use.
+ */
+class FramePool
+{
+public:
+    /** Create a pool for a FrameRing read by 'readers' threads */
+    explicit FramePool(int readers);
+
+    /** Return a frame which is not used by any other thread.  Only the
+     * thread publishing the frames may call this. */
+    std::shared_ptr<TelemetryFrame> Acquire();
+
+    /** Number of frames in the pool */
+    int Size() const { return static_cast<int>(m_Frames.size()); }
+
+private:
+    std::vector<std::shared_ptr<TelemetryFrame>> m_Frames;
+    /** Where Acquire() starts looking, the frames are reused in the order
+     * they were published, so this is usually the oldest frame. */
+    size_t m_Next;
+};
+
+
+// ....................................................... CommandQueue ....
+
+/** A request from a network worker to the ANT thread. */
+struct ServerCommand
+{
+    enum Kind {
+        CLIENT_MESSAGE,         // a command sent by a client, in 'message'
+        FORCE_KEYFRAME          // a binary client needs a keyframe
+    };
+    ServerCommand(Kind k, int r, const std::string &m = std::string())
+        : kind(k), rider(r), message(m) {}
+    Kind kind;
+    /** The rider selected by the client */
+    int rider;
+    std::string message;
+};
+
+/** Commands sent by the network workers to the ANT thread, which is the only
+ * one allowed to touch the riders and the ANT channels.  The queue holds at
+ * most MAX_COMMANDS, so clients flooding the server with commands cannot
+ * make it grow without bounds.
+ */
+class CommandQueue
+{
+public:
+#if defined LOW_FOOTPRINT
+    enum { MAX_COMMANDS = 64 };
+#else
+    enum { MAX_COMMANDS = 256 };
+#endif
+
+    CommandQueue();
+
+    /** Queue 'command', returns false if the queue is full and the command
+     * was dropped. */
+    bool Push(const ServerCommand &command);
+    /** Move all queued commands into 'commands', in the order they were
+     * pushed.  The previous contents of 'commands' are discarded, but its
+     * storage is reused by the queue, so passing the same vector each time
+     * avoids allocations. */
+    void TakeAll(std::vector<ServerCommand> &commands);
+
+private:
+    std::mutex m_Mutex;
+    std::vector<ServerCommand> m_Commands;
+};
+
+
+// ........................................................ GroupFrames ....
+
+/** Build the GROUP messages for group display clients, see GroupMode.  A
+ * message is built at most once for each frame and mode, and the buffers
+ * are kept between frames, so building does not allocate once they have
+ * grown to the size of the messages.
+ */
+class GroupFrames
+{
+public:
+    GroupFrames();
+
+    /** Return the GROUP message for 'frame' in 'mode', which must not be
+     * GROUP_NONE.  The message is valid until the next call with a
+     * different frame. */
+    const std::string& Get(const TelemetryFrame &frame, GroupMode mode);
+
+private:
+    void Build(const TelemetryFrame &frame, GroupMode mode, std::string &text);
+    double Wkg(const TelemetryFrame &frame, int rider) const;
+
+    /** The message for each mode and the frame it was built for */
+    std::string m_Text[GROUP_MODE_COUNT];
+    uint64_t m_Seq[GROUP_MODE_COUNT];
+    /** Sort keys and rider indexes used for the RANK field */
+    std::vector<double> m_Key;
+    std::vector<int> m_Rank;
+};
+
+
+// ....................................................... SessionTable ....
+
+/** A client session allows a client to reconnect and receive the frames it
+ * missed while it was disconnected.  Sessions are created by the SESSION
+ * command and outlive the client connection for a while.  Frames are
+ * recorded in the session by the ANT thread, whether or not a client is
+ * attached, see SessionTable::Record(), and sent by the worker whose client
+ * is attached to the session.
+ */
+struct Session
+{
+    /** Number of frames kept for replay.  Frames are recorded at most once
+     * per Tick(), so this covers at least 5 seconds of disconnection, or
+     * 1.25 seconds in the LOW_FOOTPRINT build. */
+#if defined LOW_FOOTPRINT
+    enum { REPLAY_FRAMES = 128 };
+#else
+    enum { REPLAY_FRAMES = 512 };
+#endif
+
+    struct Frame {
+        Frame() : frame_seq(0) {}
+        /** TelemetryFrame::seq of the frame this was recorded from */
+        uint64_t frame_seq;
+        /** The message, including its SEQ field, '\n' terminated */
+        std::string text;
+    };
+
+    Session() : attached(true), detach_time(0), next_seq(1), recorded(0),
+                frames(REPLAY_FRAMES), rider(0), group(GROUP_NONE),
+                generation(1) {}
+    std::string token;
+    /** Protected by the SessionTable mutex */
+    bool attached;
+    uint32_t detach_time;
+
+    /** Protects the fields below, which are used by the ANT thread and the
+     * worker of the attached client. */
+    std::mutex mutex;
+    /** Sequence number of the next frame recorded in this session */
+    uint64_t next_seq;
+    /** Ring of recorded frames, indexed by sequence number: frame 'seq' is
+     * in frames[seq % REPLAY_FRAMES].  The last 'recorded' frames before
+     * next_seq are valid. */
+    uint64_t recorded;
+    std::vector<Frame> frames;
+    /** Settings of the attached client, or of the last client if detached,
+     * which determine the frames recorded. */
+    int rider;
+    GroupMode group;
+    /** Incremented each time a client attaches to the session.  A client
+     * whose generation no longer matches was replaced by a client which
+     * resumed the session on a new connection. */
+    uint64_t generation;
+};
+
+/** The sessions of all clients, shared by all network workers, since a
+ * client can reconnect to a different worker. */
+class SessionTable
+{
+public:
+    std::shared_ptr<Session> Create();
+    /** Attach the session with an existing token, creating it if needed,
+     * for a client handed over from another worker or server process. */
+    std::shared_ptr<Session> Restore(const std::string &token, uint64_t next_seq);
+    /** Attach a new client to the session with 'token', returns nullptr if
+     * there is no such session.  If a client is still attached to the
+     * session, it is replaced: Session::generation is incremented and the
+     * worker of the old client closes it. */
+    std::shared_ptr<Session> Attach(const std::string &token);
+    /** Detach 'session' from its client, saving the client settings.  Does
+     * nothing if the client, identified by 'generation', was already
+     * replaced by another one. */
+    void Detach(const std::shared_ptr<Session> &session, uint64_t generation,
+                int rider, GroupMode group);
+    /** Record 'frame' in all sessions, using the settings of each session
+     * to select the message.  Called by the ANT thread before the frame is
+     * published, so the workers find each frame already recorded. */
+    void Record(const TelemetryFrame &frame);
+    /** Discard sessions whose clients have not reconnected in time. */
+    void Expire();
+
+private:
+    std::mutex m_Mutex;
+    std::vector<std::shared_ptr<Session>> m_Sessions;
+    /** Used by Record(), protected by m_Mutex */
+    GroupFrames m_GroupFrames;
+};
+
+
+// ...................................................... NetworkWorker ....
+
+/** A client connection and its settings, used to move clients between
+ * workers or between server processes, see Handover. */
+struct ClientHandover
+{
+    ClientHandover()
+        : socket(INVALID_SOCKET), rider(0), group(GROUP_NONE),
+          binary(false), session_seq(0) {}
+    SOCKET socket;
+    int rider;
+    GroupMode group;
+    bool binary;
+    /** Session token, empty if the client did not start a session */
+    std::string session_token;
+    uint64_t session_seq;
+    /** Start of a message received from the client, but not processed
+     * yet.  Only passed between workers, not to a new process. */
+    std::string input;
+};
+
+/** Serve a set of telemetry clients on a separate thread.  All workers
+ * accept connections from the same (non-blocking) server socket, each
+ * connection is served by the worker that accepted it.  Workers read frames
+ * from a FrameRing and send any commands that need the riders to the ANT
+ * thread via a CommandQueue, so the ANT thread never touches a client
+ * socket.
+ */
+class NetworkWorker
+{
+public:
+    NetworkWorker(SOCKET server, FrameRing &frames,
+                  CommandQueue &commands, SessionTable &sessions,
+                  const std::vector<ClientHandover> &clients = std::vector<ClientHandover>());
+    ~NetworkWorker();
+
+    /** Stop the worker thread and return its clients.  The client sockets
+     * are not closed, they are owned by the caller from now on. */
+    std::vector<ClientHandover> Stop();
+
+private:
+
+    /** Connection state of a client */
+    enum ClientState {
+        /** Connected, frames are sent whenever the socket is writable */
+        CLIENT_OPEN,
+        /** The client does not read its data, so its socket was not
+         * writable since 'stalled_since'.  Frames are skipped until it
+         * catches up, or it is evicted after CLIENT_STALL_TIMEOUT. */
+        CLIENT_STALLED,
+        /** The connection has ended, the client is removed at the end of
+         * Poll() and no more data is sent to it. */
+        CLIENT_CLOSED
+    };
+
+    /** Why a client was closed, see ConnectionStats */
+    enum CloseReason {
+        CLOSE_PEER,
+        CLOSE_LOST,
+        CLOSE_EVICTED
+    };
+
+    /** Number of connections handled by this worker, by the way they
+     * ended.  These are reported each time a client is closed. */
+    struct ConnectionStats {
+        ConnectionStats() : accepted(0), closed(0), lost(0), evicted(0) {}
+        int accepted;
+        /** Clients which closed their connection */
+        int closed;
+        /** Connections which failed, or were found to be dead by TCP
+         * keepalive or the retransmit timeout (the peer disappeared without
+         * closing the connection). */
+        int lost;
+        /** Clients evicted because they stopped reading data */
+        int evicted;
+    };
+
+    struct Client {
+        Client(SOCKET s, const std::string &peer)
+            : socket(s), peer(peer), state(CLIENT_OPEN), stalled_since(0),
+              rider(0), group(GROUP_NONE),
+              binary(false), binary_synced(false), keyframe_dropped(false),
+              status(-1),
+              session_generation(0), session_seq(0) {}
+        SOCKET socket;
+        /** Peer address, for log messages */
+        std::string peer;
+        ClientState state;
+        /** Time (microseconds) when the client stopped being writable, only
+         * valid in the CLIENT_STALLED state */
+        uint64_t stalled_since;
+        /** The rider whose telemetry is sent to this client and to which
+         * commands from the client apply. */
+        int rider;
+        GroupMode group;
+        /** Rider telemetry is sent using the TelemetryEncoder binary
+         * format. */
+        bool binary;
+        /** The client received all binary frames since the last keyframe,
+         * if not, it has to wait for the next keyframe. */
+        bool binary_synced;
+        /** A keyframe request for this client was dropped because the
+         * command queue was full, see RequestKeyframe() */
+        bool keyframe_dropped;
+        /** The last ServerStatus sent to the client, -1 if none was sent */
+        int status;
+        /** Session for this client, if the client requested one, see
+         * Session::generation */
+        std::shared_ptr<Session> session;
+        uint64_t session_generation;
+        /** Sequence number of the last session frame sent to the client */
+        uint64_t session_seq;
+        /** Data received from the client, which does not end in a complete
+         * message yet, see ProcessInput() */
+        std::string input;
+    };
+
+    /** Clients served by one worker, select() can wait on at most
+     * FD_SETSIZE sockets, including the server socket. */
+    enum { MAX_CLIENTS = FD_SETSIZE - 1 };
+
+    void Run();
+    void Poll();
+    void SendFrame(const TelemetryFrame &frame, const std::vector<uint8_t> &status);
+    void AddClient(Client client);
+    void UpdateWritable(Client &client, bool writable, uint64_t now);
+    void MarkClosed(Client &client, CloseReason reason);
+    void RemoveClosedClients();
+    void DesyncBinary(Client &client);
+    void RequestKeyframe(Client &client);
+    void CloseClient(Client &client);
+    void ProcessInput(Client &client, uint64_t receive_time);
+    void ProcessMessage(Client &client, const std::string &message,
+                        uint64_t receive_time);
+    void StartSession(Client &client);
+    void ResumeSession(Client &client, const std::string &token, uint64_t last_seq);
+    void AttachSession(Client &client, const std::shared_ptr<Session> &session,
+                       uint64_t last_seq);
+    bool SessionReplaced(Client &client);
+    void SaveSessionSettings(Client &client);
+    const std::string* SessionFrame(Client &client, uint64_t frame_seq);
+    void SendTimeSync(Client &client, const std::string &client_time,
+                      uint64_t receive_time);
+    void SendReply(Client &client, const std::string &message);
+
+    SOCKET m_Server;
+    FrameRing &m_Frames;
+    CommandQueue &m_Commands;
+    SessionTable &m_Sessions;
+
+    std::vector<Client> m_Clients;
+    /** Sockets and their status for the select() call in Poll(), kept
+     * between calls so they are not allocated each time. */
+    std::vector<SOCKET> m_Sockets;
+    std::vector<uint8_t> m_SocketStatus;
+    /** Sequence number of the next frame to read from m_Frames */
+    uint64_t m_NextSeq;
+    /** The last frame read, used to answer client queries */
+    std::shared_ptr<const TelemetryFrame> m_Latest;
+    /** Buffer for the message taken from a client input, reused to avoid an
+     * allocation for each message */
+    std::string m_Message;
+    /** Buffer for the session frame sent to a client, see SessionFrame() */
+    std::string m_SessionFrame;
+    /** GROUP messages sent to group display clients, see SendFrame() */
+    GroupFrames m_GroupFrames;
+    ConnectionStats m_Stats;
+
+    std::atomic<bool> m_Stop;
+    std::thread m_Thread;
+};
+
+/*
+  Local Variables:
+  mode: c++
+  End:
+*/
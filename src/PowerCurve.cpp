@@ -0,0 +1,133 @@
+/**
+ *  PowerCurve -- incremental mean maximal power curve
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "PowerCurve.h"
+#include <algorithm>
+
+namespace {
+
+// Durations (in seconds) tracked by the power curve, roughly log-spaced
+// between 1 second and 60 minutes.
+const int g_Durations[] = {
+    1, 2, 3, 5, 7, 10, 15, 20, 30, 45, 60, 90, 120, 180,
+    300, 420, 600, 900, 1200, 1800, 2700, 3600
+};
+
+const int g_NumDurations = sizeof(g_Durations) / sizeof(g_Durations[0]);
+
+// The ring buffer needs one more entry than the longest duration, so we
+// have the cumulative energy at both ends of it.
+const int g_RingSize = 3600 + 1;
+
+enum {
+    // Maximum amount of time (milliseconds) a power value is held for when
+    // no new sample is received, after that power is considered to be 0.
+    MAX_HOLD = 2000
+};
+
+};                                      // end anonymous namespace
+
+PowerCurve::PowerCurve()
+    : m_Energy(g_RingSize),
+      m_Best(g_NumDurations),
+      m_Updates(0)
+{
+    Reset();
+}
+
+int PowerCurve::Duration(int index) const
+{
+    return g_Durations[index];
+}
+
+void PowerCurve::AddPower(uint32_t timestamp, double power)
+{
+    if (! m_HaveLast) {
+        m_HaveLast = true;
+        m_LastTimestamp = timestamp;
+        m_LastPower = power;
+        m_SecondStart = timestamp;
+        m_SecondEnergy = 0;
+        return;
+    }
+
+    // Timestamps going backwards are not expected, discard such samples.
+    if (static_cast<int32_t>(timestamp - m_LastTimestamp) < 0)
+        return;
+
+    // Distribute the energy produced since the last sample into the one
+    // second buckets, holding the last power value for at most MAX_HOLD
+    // milliseconds.
+    uint32_t hold_end = m_LastTimestamp + std::min(timestamp - m_LastTimestamp,
+                                                   static_cast<uint32_t>(MAX_HOLD));
+    uint32_t t = m_LastTimestamp;
+    while (timestamp - m_SecondStart >= 1000) {
+        uint32_t second_end = m_SecondStart + 1000;
+        if (static_cast<int32_t>(hold_end - t) > 0) {
+            uint32_t end = (static_cast<int32_t>(hold_end - second_end) < 0) ? hold_end : second_end;
+            m_SecondEnergy += m_LastPower * (end - t) / 1000.0;
+        }
+        CompleteSecond(m_SecondEnergy);
+        m_SecondEnergy = 0;
+        m_SecondStart = second_end;
+        t = second_end;
+    }
+    if (static_cast<int32_t>(hold_end - t) > 0)
+        m_SecondEnergy += m_LastPower * (hold_end - t) / 1000.0;
+
+    m_LastTimestamp = timestamp;
+    m_LastPower = power;
+}
+
+/** Add a new complete second with 'energy' Joules (i.e. average power) to
+ * the ring buffer and update the best power for every duration that ends in
+ * this second. */
+void PowerCurve::CompleteSecond(double energy)
+{
+    double previous = m_Energy[m_Seconds % g_RingSize];
+    m_Seconds++;
+    double current = previous + energy;
+    m_Energy[m_Seconds % g_RingSize] = current;
+
+    bool updated = false;
+    for (int i = 0; i < g_NumDurations; ++i) {
+        uint32_t d = g_Durations[i];
+        if (d > m_Seconds)
+            break;                      // durations are sorted
+        double avg = (current - m_Energy[(m_Seconds - d) % g_RingSize]) / d;
+        if (avg > m_Best[i]) {
+            m_Best[i] = avg;
+            updated = true;
+        }
+    }
+    if (updated)
+        m_Updates++;
+}
+
+void PowerCurve::Reset()
+{
+    std::fill(m_Energy.begin(), m_Energy.end(), 0.0);
+    m_Seconds = 0;
+    std::fill(m_Best.begin(), m_Best.end(), -1.0);
+    m_HaveLast = false;
+    m_LastTimestamp = 0;
+    m_LastPower = 0;
+    m_SecondStart = 0;
+    m_SecondEnergy = 0;
+    m_Updates++;
+}
@@ -0,0 +1,85 @@
+/**
+ *  PowerCurve -- incremental mean maximal power curve
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <vector>
+#include <stdint.h>
+
+/** Maintain the mean maximal power curve (best average power for a set of
+ * durations) for a session, updated incrementally as power samples arrive.
+ *
+ * Power samples are resampled into one second buckets and the cumulative
+ * energy for the last hour is kept in a ring buffer.  When a second is
+ * completed, the average power for each tracked duration ending at that
+ * second is calculated from two entries in the ring buffer, so the cost per
+ * second is proportional to the number of tracked durations, not to the
+ * length of the session.
+ */
+class PowerCurve
+{
+public:
+    PowerCurve();
+
+    /** Record a new power reading received at 'timestamp' (milliseconds, as
+     * returned by CurrentMilliseconds()). */
+    void AddPower(uint32_t timestamp, double power);
+
+    /** Number of durations tracked by the curve. */
+    int Count() const { return static_cast<int>(m_Best.size()); }
+
+    /** Duration, in seconds, for the point at 'index' */
+    int Duration(int index) const;
+
+    /** Best average power for the duration at 'index', or -1 if the session
+     * is shorter than that duration. */
+    double BestPower(int index) const { return m_Best[index]; }
+
+    /** Incremented each time a best power changes or the curve is reset, so
+     * users can detect changes without comparing the curve contents. */
+    int Updates() const { return m_Updates; }
+
+    void Reset();
+
+private:
+
+    void CompleteSecond(double energy);
+
+    /** Cumulative energy (Joules) at the end of each of the last seconds,
+     * indexed by the second number modulo the ring size. */
+    std::vector<double> m_Energy;
+    /** Number of complete seconds in the session */
+    uint32_t m_Seconds;
+
+    std::vector<double> m_Best;
+    int m_Updates;
+
+    bool m_HaveLast;
+    uint32_t m_LastTimestamp;
+    double m_LastPower;
+
+    /** Start of the second currently being accumulated and the energy
+     * accumulated so far for it. */
+    uint32_t m_SecondStart;
+    double m_SecondEnergy;
+};
+
+/*
+  Local Variables:
+  mode: c++
+  End:
+*/
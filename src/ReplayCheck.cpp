@@ -0,0 +1,124 @@
+/**
+ *  ReplayCheck -- check the sensor decoders against a recorded ANT trace
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "ReplayCheck.h"
+#include "AntTrace.h"
+#include "TelemetryServer.h"
+#include "Tools.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <sstream>
+
+namespace {
+
+const char NS_PER_MESSAGE_HEADER[] = "# ns-per-message ";
+
+};                                      // end anonymous namespace
+
+ReplaySamples ReplayTrace(std::istream &trace_input, double rider_weight)
+{
+    EnableVirtualClock();
+    TraceReplay trace(trace_input);
+
+    AntStick stick(trace.CreateTransport());
+    stick.SetNetworkKey(AntStick::g_AntPlusNetworkKey);
+    // Each rider opens an HRM and an FE-C channel, in this order, as the
+    // riders created by the server.
+    std::vector<std::unique_ptr<Rider>> riders;
+    for (int i = 0; i < (trace.ChannelCount() + 1) / 2; ++i)
+        riders.push_back(std::unique_ptr<Rider>(
+            new Rider(&stick, 0, 0, rider_weight)));
+
+    ReplaySamples result;
+    std::vector<std::string> last_sample(riders.size());
+    std::ostringstream sample;
+    // The virtual clock may have been used before, sample times are relative
+    // to the start of the replay, so they are the same in every run.
+    uint32_t start_time = CurrentMilliseconds();
+    auto start = std::chrono::steady_clock::now();
+    while (trace.NextMessage()) {
+        while (trace.HasPending())
+            stick.Tick();
+        for (unsigned i = 0; i < riders.size(); ++i) {
+            Rider &rider = *riders[i];
+            rider.CheckSensorHealth();
+            rider.UpdateStatistics();
+            rider.CollectTelemetry(0);  // no timestamps in the sample
+            rider.telemetry.hr_timestamp = 0;
+            rider.telemetry.fec_timestamp = 0;
+            sample.str("");
+            sample << rider.telemetry;
+            if (sample.str() != last_sample[i]) {
+                last_sample[i] = sample.str();
+                std::ostringstream line;
+                line << CurrentMilliseconds() - start_time << " " << i << " "
+                     << last_sample[i];
+                result.samples.push_back(line.str());
+            }
+        }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    result.messages = trace.MessageCount();
+    result.ns_per_message =
+        std::chrono::duration<double, std::nano>(elapsed).count()
+        / std::max(trace.MessageCount(), 1);
+    return result;
+}
+
+void WriteGolden(std::ostream &out, const ReplaySamples &samples)
+{
+    out << NS_PER_MESSAGE_HEADER << samples.ns_per_message << "\n";
+    for (const auto &s : samples.samples)
+        out << s << "\n";
+}
+
+ReplaySamples ReadGolden(std::istream &in)
+{
+    const std::string header = NS_PER_MESSAGE_HEADER;
+    ReplaySamples golden;
+    std::string line;
+    while (std::getline(in, line)) {
+        // Golden files checked out on Windows may have CRLF line endings
+        if (! line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.compare(0, header.size(), header) == 0)
+            golden.ns_per_message = std::stod(line.substr(header.size()));
+        else if (! line.empty() && line[0] != '#')
+            golden.samples.push_back(line);
+    }
+    return golden;
+}
+
+int CompareSamples(const ReplaySamples &expected, const ReplaySamples &actual,
+                   std::ostream &log, int max_reported)
+{
+    int mismatches = 0;
+    auto count = std::max(expected.samples.size(), actual.samples.size());
+    for (unsigned i = 0; i < count; ++i) {
+        const std::string none = "<none>";
+        const std::string &e = i < expected.samples.size() ? expected.samples[i] : none;
+        const std::string &a = i < actual.samples.size() ? actual.samples[i] : none;
+        if (e != a && mismatches++ < max_reported) {
+            log << "sample " << i + 1 << ":\n  expected: " << e
+                << "\n  actual:   " << a << "\n";
+        }
+    }
+    return mismatches;
+}
@@ -0,0 +1,65 @@
+/**
+ *  ReplayCheck -- check the sensor decoders against a recorded ANT trace
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+/** The telemetry samples produced by replaying a trace, see ReplayTrace(),
+ * and the decode time per message.  This is also the contents of a golden
+ * file. */
+struct ReplaySamples
+{
+    ReplaySamples() : messages(0), ns_per_message(0) {}
+    /** "TIME RIDER TELEMETRY" lines, TIME is in milliseconds since the
+     * start of the replay */
+    std::vector<std::string> samples;
+    /** Number of messages replayed, not stored in golden files */
+    int messages;
+    double ns_per_message;
+};
+
+/** Replay the ANT trace in 'trace' through the sensor decoders and the
+ * rider statistics as fast as possible.  A sample is produced each time the
+ * telemetry of a rider changes.  Each rider in the trace is assumed to have
+ * its HRM and FE-C channels opened in this order, as the server does.
+ *
+ * The trace is replayed on the virtual clock (see EnableVirtualClock()), so
+ * staleness checks and statistics see the recorded timing.  Throws
+ * std::runtime_error if the trace is invalid.
+ */
+ReplaySamples ReplayTrace(std::istream &trace, double rider_weight);
+
+/** Write 'samples' in the golden file format: a "# ns-per-message N"
+ * line, followed by one line for each sample. */
+void WriteGolden(std::ostream &out, const ReplaySamples &samples);
+
+/** Read a golden file written by WriteGolden() */
+ReplaySamples ReadGolden(std::istream &in);
+
+/** Compare the 'actual' samples with the 'expected' ones and return the
+ * number of samples which differ.  The first 'max_reported' differences
+ * are written to 'log'. */
+int CompareSamples(const ReplaySamples &expected, const ReplaySamples &actual,
+                   std::ostream &log, int max_reported);
+
+/*
+  Local Variables:
+  mode: c++
+  End:
+*/
@@ -0,0 +1,322 @@
+/**
+ *  RiderStatistics -- running power and heart rate statistics for a rider
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "RiderStatistics.h"
+#include <algorithm>
+#include <cmath>
+
+/** IMPLEMENTATION NOTE
+ *
+ * Timestamps are the 32 bit millisecond values returned by
+ * CurrentMilliseconds(), which wrap around after about 49 days.  All
+ * timestamp comparisons are done on the difference between two timestamps,
+ * cast to a signed value, so they work across the wrap around.
+ *
+ * Normalized Power, Intensity Factor and Training Stress Score are
+ * calculated as described by A. Coggan: NP is the fourth root of the mean of
+ * the 4th power of the 30 second rolling average power (sampled every
+ * second), IF is NP / FTP and TSS is (seconds * NP * IF) / (FTP * 3600) * 100.
+ */
+
+namespace {
+
+enum {
+    // Maximum amount of time (milliseconds) a sample value is held for when
+    // no new sample is received.  FE-C trainers send power at about 4Hz,
+    // HRMs send data at about 4Hz as well, so this covers a few missed
+    // broadcasts, but not a sensor dropout.
+    MAX_HOLD = 2000,
+
+    // Interval (milliseconds) at which the 30 second average is sampled for
+    // the Normalized Power calculation.
+    NP_SAMPLE_INTERVAL = 1000,
+
+    // Initial size of the SlidingWindow sample ring, enough for a 30 second
+    // window at 4Hz.
+    MIN_WINDOW_SAMPLES = 128
+};
+
+// Power zones, as a fraction of FTP (upper bound for each zone, except the
+// last one).  These are the 7 zones defined by A. Coggan.
+const double g_PowerZones[] = { 0.55, 0.75, 0.90, 1.05, 1.20, 1.50 };
+
+// Heart rate zones, as a fraction of the maximum heart rate, 5 zones.
+const double g_HeartRateZones[] = { 0.60, 0.70, 0.80, 0.90 };
+
+// Return true if timestamp 'a' is before timestamp 'b'
+inline bool IsBefore(uint32_t a, uint32_t b)
+{
+    return static_cast<int32_t>(a - b) < 0;
+}
+
+};                                      // end anonymous namespace
+
+
+// ...................................................... SlidingWindow ....
+
+SlidingWindow::SlidingWindow(uint32_t window, uint32_t max_hold)
+    : m_Window(window),
+      m_MaxHold(max_hold),
+      m_First(0),
+      m_Count(0),
+      m_Sum(0),
+      m_Duration(0),
+      m_HaveLast(false)
+{
+    m_Last.timestamp = 0;
+    m_Last.duration = 0;
+    m_Last.value = 0;
+}
+
+void SlidingWindow::Add(uint32_t timestamp, double value)
+{
+    if (m_HaveLast) {
+        // The previous sample held its value until now
+        m_Last.duration = std::min(timestamp - m_Last.timestamp, m_MaxHold);
+        if (m_Last.duration > 0) {
+            PushSample(m_Last);
+            m_Sum += m_Last.value * m_Last.duration;
+            m_Duration += m_Last.duration;
+        }
+    }
+
+    m_Last.timestamp = timestamp;
+    m_Last.duration = 0;
+    m_Last.value = value;
+    m_HaveLast = true;
+
+    Expire(timestamp);
+}
+
+double SlidingWindow::Average(uint32_t now)
+{
+    Expire(now);
+
+    uint32_t window_start = now - m_Window;
+    double sum = m_Sum;
+    double duration = static_cast<double>(m_Duration);
+
+    // The first sample might be only partially inside the window, remove the
+    // part that is outside of it.
+    if (m_Count > 0 && IsBefore(FrontSample().timestamp, window_start)) {
+        const Sample &s = FrontSample();
+        uint32_t excess = window_start - s.timestamp;
+        sum -= s.value * excess;
+        duration -= excess;
+    }
+
+    // The last sample holds its value until 'now', subject to the maximum
+    // hold time.
+    if (m_HaveLast && ! IsBefore(now, m_Last.timestamp)) {
+        uint32_t begin = IsBefore(m_Last.timestamp, window_start)
+            ? window_start : m_Last.timestamp;
+        uint32_t end = m_Last.timestamp + std::min(now - m_Last.timestamp, m_MaxHold);
+        if (IsBefore(begin, end)) {
+            sum += m_Last.value * (end - begin);
+            duration += (end - begin);
+        }
+    }
+
+    if (duration <= 0)
+        return -1;
+
+    return sum / duration;
+}
+
+void SlidingWindow::Clear()
+{
+    m_First = 0;
+    m_Count = 0;
+    m_Sum = 0;
+    m_Duration = 0;
+    m_HaveLast = false;
+}
+
+/** Remove all samples which end before the start of the window ending at
+ * 'now'. */
+void SlidingWindow::Expire(uint32_t now)
+{
+    uint32_t window_start = now - m_Window;
+
+    while (m_Count > 0) {
+        const Sample &s = FrontSample();
+        if (IsBefore(window_start, s.timestamp + s.duration))
+            break;
+        m_Sum -= s.value * s.duration;
+        m_Duration -= s.duration;
+        PopSample();
+    }
+
+    // Avoid accumulating floating point errors in the running sum.
+    if (m_Count == 0)
+        m_Sum = 0;
+}
+
+void SlidingWindow::PushSample(const Sample &s)
+{
+    if (m_Count == m_Samples.size()) {
+        // Full, move the samples to a larger ring, oldest first
+        std::vector<Sample> samples;
+        samples.reserve(std::max<size_t>(2 * m_Count, MIN_WINDOW_SAMPLES));
+        for (size_t i = 0; i < m_Count; ++i)
+            samples.push_back(m_Samples[(m_First + i) % m_Samples.size()]);
+        samples.resize(samples.capacity());
+        m_Samples.swap(samples);
+        m_First = 0;
+    }
+    m_Samples[(m_First + m_Count) % m_Samples.size()] = s;
+    m_Count++;
+}
+
+void SlidingWindow::PopSample()
+{
+    m_First = (m_First + 1) % m_Samples.size();
+    m_Count--;
+}
+
+
+// .................................................... RiderStatistics ....
+
+RiderStatistics::RiderStatistics()
+    : m_Ftp(0),
+      m_Power3s(3000, MAX_HOLD),
+      m_Power10s(10000, MAX_HOLD),
+      m_Power30s(30000, MAX_HOLD),
+      m_HeartRate30s(30000, MAX_HOLD)
+{
+    Reset();
+}
+
+void RiderStatistics::SetFtp(double ftp)
+{
+    m_Ftp = ftp;
+    if (ftp > 0) {
+        const int count = sizeof(g_PowerZones) / sizeof(g_PowerZones[0]);
+        double bounds[count];
+        for (int i = 0; i < count; ++i)
+            bounds[i] = g_PowerZones[i] * ftp;
+        m_PowerZones.SetZones(bounds, count);
+    }
+}
+
+void RiderStatistics::SetMaxHeartRate(double max_hr)
+{
+    if (max_hr > 0) {
+        const int count = sizeof(g_HeartRateZones) / sizeof(g_HeartRateZones[0]);
+        double bounds[count];
+        for (int i = 0; i < count; ++i)
+            bounds[i] = g_HeartRateZones[i] * max_hr;
+        m_HeartRateZones.SetZones(bounds, count);
+    }
+}
+
+void RiderStatistics::SetCriticalPower(double cp, double wprime)
+{
+    m_WBalance.SetParameters(cp, wprime);
+}
+
+void RiderStatistics::AddPower(uint32_t timestamp, double power)
+{
+    m_Power3s.Add(timestamp, power);
+    m_Power10s.Add(timestamp, power);
+    m_Power30s.Add(timestamp, power);
+
+    if (! m_NpStarted) {
+        m_NpStarted = true;
+        m_NpNextSample = timestamp + NP_SAMPLE_INTERVAL;
+    }
+
+    m_MaxPower = std::max(m_MaxPower, power);
+    m_WBalance.AddPower(timestamp, power);
+    m_PowerZones.Add(timestamp, power);
+    m_PowerCurve.AddPower(timestamp, power);
+}
+
+void RiderStatistics::AddHeartRate(uint32_t timestamp, double hr)
+{
+    m_HeartRate30s.Add(timestamp, hr);
+    m_HeartRateZones.Add(timestamp, hr);
+    m_MaxHeartRate = std::max(m_MaxHeartRate, hr);
+}
+
+void RiderStatistics::Update(uint32_t now)
+{
+    m_AvgPower3s = m_Power3s.Average(now);
+    m_AvgPower10s = m_Power10s.Average(now);
+    m_AvgPower30s = m_Power30s.Average(now);
+    m_AvgHeartRate30s = m_HeartRate30s.Average(now);
+
+    if (m_NpStarted) {
+        while (! IsBefore(now, m_NpNextSample)) {
+            // Seconds where there is no power data at all (sensor dropout)
+            // do not contribute to NP.
+            if (m_AvgPower30s >= 0) {
+                double p2 = m_AvgPower30s * m_AvgPower30s;
+                m_NpSum += p2 * p2;
+                m_NpCount++;
+            }
+            m_NpNextSample += NP_SAMPLE_INTERVAL;
+        }
+    }
+}
+
+double RiderStatistics::NormalizedPower() const
+{
+    if (m_NpCount == 0)
+        return -1;
+    return std::pow(m_NpSum / m_NpCount, 0.25);
+}
+
+double RiderStatistics::IntensityFactor() const
+{
+    double np = NormalizedPower();
+    if (np < 0 || m_Ftp <= 0)
+        return -1;
+    return np / m_Ftp;
+}
+
+double RiderStatistics::TrainingStressScore() const
+{
+    double np = NormalizedPower();
+    if (np < 0 || m_Ftp <= 0)
+        return -1;
+    double intensity = np / m_Ftp;
+    return (m_NpCount * np * intensity) / (m_Ftp * 3600.0) * 100.0;
+}
+
+void RiderStatistics::Reset()
+{
+    m_Power3s.Clear();
+    m_Power10s.Clear();
+    m_Power30s.Clear();
+    m_HeartRate30s.Clear();
+    m_AvgPower3s = -1;
+    m_AvgPower10s = -1;
+    m_AvgPower30s = -1;
+    m_AvgHeartRate30s = -1;
+    m_NpStarted = false;
+    m_NpNextSample = 0;
+    m_NpSum = 0;
+    m_NpCount = 0;
+    m_MaxHeartRate = -1;
+    m_MaxPower = -1;
+    m_WBalance.Reset();
+    m_PowerZones.Reset();
+    m_HeartRateZones.Reset();
+    m_PowerCurve.Reset();
+}
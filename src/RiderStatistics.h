@@ -0,0 +1,182 @@
+/**
+ *  RiderStatistics -- running power and heart rate statistics for a rider
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "PowerCurve.h"
+#include "TrainingLoad.h"
+#include <vector>
+#include <stdint.h>
+
+// ...................................................... SlidingWindow ....
+
+/** Time weighted average of a value over a sliding time window.
+ *
+ * Each sample is assumed to hold its value from its timestamp until the next
+ * sample arrives, but no longer than a maximum hold time, so a sensor dropout
+ * does not stretch the last value received over the entire gap.  Time not
+ * covered by any sample is excluded from the average.
+ *
+ * Samples are kept in a queue together with a running sum, so adding a
+ * sample and obtaining the average are both O(1) (amortized, as old samples
+ * are removed from the front of the queue as they leave the window).  The
+ * queue is a ring which only grows when it is full, so once it is large
+ * enough for the samples in a window, adding samples does not allocate.
+ */
+class SlidingWindow
+{
+public:
+    SlidingWindow(uint32_t window, uint32_t max_hold);
+
+    /** Add a new sample, 'timestamp' is in milliseconds, as returned by
+     * CurrentMilliseconds().  Timestamps must not go backwards. */
+    void Add(uint32_t timestamp, double value);
+
+    /** Return the time weighted average of the samples in the window ending
+     * at 'now', or -1 if no samples are available. */
+    double Average(uint32_t now);
+
+    void Clear();
+
+private:
+
+    void Expire(uint32_t now);
+
+    struct Sample {
+        uint32_t timestamp;
+        uint32_t duration;
+        double value;
+    };
+
+    void PushSample(const Sample &s);
+    const Sample& FrontSample() const { return m_Samples[m_First]; }
+    void PopSample();
+
+    uint32_t m_Window;
+    uint32_t m_MaxHold;
+
+    /** Samples whose duration is known, a ring of m_Count samples starting
+     * at m_First, oldest first. */
+    std::vector<Sample> m_Samples;
+    size_t m_First;
+    size_t m_Count;
+    /** Sum of value * duration for all samples in m_Samples */
+    double m_Sum;
+    /** Sum of durations for all samples in m_Samples */
+    uint64_t m_Duration;
+
+    /** The most recent sample, its duration is determined when the next
+     * sample arrives (or by 'now' when the average is computed). */
+    bool m_HaveLast;
+    Sample m_Last;
+};
+
+
+// .................................................... RiderStatistics ....
+
+/** Keep running power and heart rate statistics for a rider: rolling power
+ * averages, normalized power, intensity factor, training stress score,
+ * maximum heart rate and power, W' balance, time in power and heart rate
+ * zones and the mean maximal power curve.  All updates are O(1), so they can
+ * be run on every sample received from the sensors.
+ */
+class RiderStatistics
+{
+public:
+    RiderStatistics();
+
+    /** Set the Functional Threshold Power for the rider, used to calculate
+     * IF, TSS and the power zones.  A value of 0 means that FTP is not known
+     * and these values will not be calculated. */
+    void SetFtp(double ftp);
+    double Ftp() const { return m_Ftp; }
+
+    /** Set the maximum heart rate for the rider, used to define the heart
+     * rate zones. */
+    void SetMaxHeartRate(double max_hr);
+
+    /** Set the Critical Power (Watts) and W' (Joules) used to calculate the
+     * W' balance. */
+    void SetCriticalPower(double cp, double wprime);
+
+    /** Record a new power reading received at 'timestamp' (milliseconds) */
+    void AddPower(uint32_t timestamp, double power);
+    /** Record a new heart rate reading received at 'timestamp' (milliseconds) */
+    void AddHeartRate(uint32_t timestamp, double hr);
+
+    /** Advance the internal clock to 'now'.  This should be called
+     * periodically, even when no samples are received, as Normalized Power is
+     * calculated on a one second grid. */
+    void Update(uint32_t now);
+
+    // NOTE: the values below return -1 if they are not available.
+
+    double AveragePower3s() const { return m_AvgPower3s; }
+    double AveragePower10s() const { return m_AvgPower10s; }
+    double AveragePower30s() const { return m_AvgPower30s; }
+    double AverageHeartRate30s() const { return m_AvgHeartRate30s; }
+    double NormalizedPower() const;
+    double IntensityFactor() const;
+    double TrainingStressScore() const;
+    double MaxHeartRate() const { return m_MaxHeartRate; }
+    double MaxPower() const { return m_MaxPower; }
+
+    double WBalance() const { return m_WBalance.Balance(); }
+    const ZoneAccumulator& PowerZones() const { return m_PowerZones; }
+    const ZoneAccumulator& HeartRateZones() const { return m_HeartRateZones; }
+
+    const PowerCurve& GetPowerCurve() const { return m_PowerCurve; }
+
+    void Reset();
+
+private:
+    double m_Ftp;
+
+    SlidingWindow m_Power3s;
+    SlidingWindow m_Power10s;
+    SlidingWindow m_Power30s;
+    SlidingWindow m_HeartRate30s;
+
+    double m_AvgPower3s;
+    double m_AvgPower10s;
+    double m_AvgPower30s;
+    double m_AvgHeartRate30s;
+
+    /** Timestamp of the next one second point where the 30 second average is
+     * sampled for the Normalized Power calculation. */
+    bool m_NpStarted;
+    uint32_t m_NpNextSample;
+    /** Sum of 4th powers of the 30 second rolling average and the number of
+     * seconds (samples) that went into it. */
+    double m_NpSum;
+    uint32_t m_NpCount;
+
+    double m_MaxHeartRate;
+    double m_MaxPower;
+
+    WPrimeBalance m_WBalance;
+    ZoneAccumulator m_PowerZones;
+    ZoneAccumulator m_HeartRateZones;
+
+    PowerCurve m_PowerCurve;
+};
+
+/*
+  Local Variables:
+  mode: c++
+  End:
+*/
@@ -0,0 +1,169 @@
+/**
+ *  ServerConfig -- server configuration file
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "ServerConfig.h"
+#include "Tools.h"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+std::string Trim(const std::string &s)
+{
+    const char *blanks = " \t\r\n";
+    auto start = s.find_first_not_of(blanks);
+    if (start == std::string::npos)
+        return std::string();
+    auto end = s.find_last_not_of(blanks);
+    return s.substr(start, end - start + 1);
+}
+
+/** Parse 'text' as a value of type T, the whole text must be used. */
+template <typename T>
+T ParseValue(const std::string &text)
+{
+    std::istringstream input(text);
+    T value;
+    input >> value;
+    if (input.fail() || ! (input >> std::ws).eof())
+        throw std::runtime_error("bad value: " + text);
+    return value;
+}
+
+/** Return the directory part of 'file_name', "." if it has none. */
+std::string DirectoryName(const std::string &file_name)
+{
+    auto pos = file_name.find_last_of("\\/");
+    if (pos == std::string::npos)
+        return ".";
+    return file_name.substr(0, pos + 1);
+}
+
+};                                      // end anonymous namespace
+
+ServerConfig ReadServerConfig(const std::string &file_name)
+{
+    std::ifstream input(file_name);
+    if (! input)
+        throw std::runtime_error("cannot open " + file_name);
+
+    ServerConfig config;
+    std::string line;
+    int line_number = 0;
+    while (std::getline(input, line)) {
+        line_number++;
+        line = Trim(line);
+        if (line.empty() || line[0] == '#')
+            continue;
+        try {
+            auto eq = line.find('=');
+            if (eq == std::string::npos)
+                throw std::runtime_error("expecting key = value");
+            std::string key = Trim(line.substr(0, eq));
+            std::string value = Trim(line.substr(eq + 1));
+
+            if (key == "port") {
+                config.port = ParseValue<int>(value);
+            } else if (key == "bike_weight") {
+                config.bike_weight = ParseValue<double>(value);
+            } else if (key == "wheel_diameter") {
+                config.wheel_diameter = ParseValue<double>(value);
+            } else if (key == "mqtt_interval") {
+                config.mqtt_interval = ParseValue<int>(value);
+            } else if (key == "group_rank_size") {
+                config.group_rank_size = ParseValue<int>(value);
+            } else if (key == "rider") {
+                std::istringstream fields(value);
+                ServerConfig::RiderConfig rider;
+                fields >> rider.hrm_device_number >> rider.fec_device_number >> rider.weight;
+                if (fields.fail() || ! (fields >> std::ws).eof())
+                    throw std::runtime_error("expecting rider = HRM FEC WEIGHT");
+                config.riders.push_back(rider);
+            } else {
+                throw std::runtime_error("unknown key: " + key);
+            }
+        }
+        catch (const std::exception &e) {
+            std::ostringstream msg;
+            msg << file_name << ":" << line_number << ": " << e.what();
+            throw std::runtime_error(msg.str());
+        }
+    }
+
+    // Check the values here, so an invalid file is rejected before any of it
+    // is applied.
+    if (config.port <= 0 || config.port > 0xFFFF)
+        throw std::runtime_error(file_name + ": bad port number");
+    if (config.bike_weight < 0 || config.wheel_diameter < 0)
+        throw std::runtime_error(file_name + ": bad bike weight or wheel diameter");
+    if (config.mqtt_interval <= 0)
+        throw std::runtime_error(file_name + ": bad mqtt_interval");
+    if (config.group_rank_size < 0)
+        throw std::runtime_error(file_name + ": bad group_rank_size");
+    for (const auto &r : config.riders) {
+        if (r.weight < 0)
+            throw std::runtime_error(file_name + ": bad rider weight");
+    }
+    return config;
+}
+
+
+// ...................................................... ConfigWatcher ....
+
+ConfigWatcher::ConfigWatcher(const std::string &file_name)
+    : m_FileName(file_name),
+      m_Notification(INVALID_HANDLE_VALUE),
+      m_LastWriteTime(0)
+{
+    m_Notification = FindFirstChangeNotificationA(
+        DirectoryName(file_name).c_str(), FALSE,
+        FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+    if (m_Notification == INVALID_HANDLE_VALUE)
+        throw Win32Error("FindFirstChangeNotification()", GetLastError());
+    m_LastWriteTime = LastWriteTime();
+}
+
+ConfigWatcher::~ConfigWatcher()
+{
+    FindCloseChangeNotification(m_Notification);
+}
+
+bool ConfigWatcher::Changed()
+{
+    if (WaitForSingleObject(m_Notification, 0) != WAIT_OBJECT_0)
+        return false;
+    FindNextChangeNotification(m_Notification);
+
+    // The notification is for any file in the directory, check that our
+    // file was actually written.
+    auto t = LastWriteTime();
+    if (t == m_LastWriteTime)
+        return false;
+    m_LastWriteTime = t;
+    return true;
+}
+
+uint64_t ConfigWatcher::LastWriteTime() const
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (! GetFileAttributesExA(m_FileName.c_str(), GetFileExInfoStandard, &data))
+        return 0;                       // file was removed, or being replaced
+    return (static_cast<uint64_t>(data.ftLastWriteTime.dwHighDateTime) << 32)
+        | data.ftLastWriteTime.dwLowDateTime;
+}
@@ -0,0 +1,94 @@
+/**
+ *  ServerConfig -- server configuration file
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/** Server settings which can be changed while the server is running, see
+ * ReadServerConfig() for the file format.  A value of 0 for weights and
+ * wheel diameter means that the trainer defaults are used.
+ */
+struct ServerConfig
+{
+    struct RiderConfig {
+        RiderConfig() : hrm_device_number(0), fec_device_number(0), weight(0) {}
+        uint32_t hrm_device_number;     // 0 means search for any device
+        uint32_t fec_device_number;     // 0 means search for any device
+        double weight;
+    };
+
+    ServerConfig()
+        : port(7500), bike_weight(0), wheel_diameter(0),
+          mqtt_interval(250), group_rank_size(10) {}
+
+    int port;
+    double bike_weight;                 // kg
+    double wheel_diameter;              // meters
+    /** Interval (milliseconds) at which telemetry is published to MQTT */
+    int mqtt_interval;
+    /** Number of riders included in the RANK field of group frames. */
+    int group_rank_size;
+    /** The riders, if empty, a single rider using any HRM and trainer */
+    std::vector<RiderConfig> riders;
+};
+
+/** Read the configuration from 'file_name'.  Throws std::runtime_error if
+ * the file cannot be read or contains invalid entries.  The file contains
+ * "key = value" lines, lines starting with '#' are comments:
+ *
+ *    port = 7500
+ *    bike_weight = 10
+ *    wheel_diameter = 0.668
+ *    mqtt_interval = 250
+ *    group_rank_size = 10
+ *    # rider = <hrm device number> <fec device number> <weight>
+ *    rider = 0 0 75
+ */
+ServerConfig ReadServerConfig(const std::string &file_name);
+
+/** Detect changes to a configuration file, without blocking.  Uses a
+ * directory change notification, so the file is only checked when something
+ * in its directory was written.
+ */
+class ConfigWatcher
+{
+public:
+    ConfigWatcher(const std::string &file_name);
+    ~ConfigWatcher();
+
+    const std::string& FileName() const { return m_FileName; }
+
+    /** Return true if the file was modified since the last call. */
+    bool Changed();
+
+private:
+    uint64_t LastWriteTime() const;
+
+    std::string m_FileName;
+    HANDLE m_Notification;
+    uint64_t m_LastWriteTime;
+};
+
+/*
+  Local Variables:
+  mode: c++
+  End:
+*/
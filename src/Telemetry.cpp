@@ -0,0 +1,188 @@
+/**
+ *  Telemetry -- rider data sent to clients
+ *  Copyright (C) 2017, 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "Telemetry.h"
+#include <cmath>
+
+namespace {
+
+struct FieldInfo {
+    const char *name;
+    int32_t scale;                      // fixed-point units per natural unit
+    int decimals;                       // decimals needed to print one unit
+    bool is_signed;
+};
+
+const FieldInfo g_Fields[Telemetry::FIELD_COUNT] = {
+    { "HR", 1, 0, false },
+    { "CAD", 1, 0, false },
+    { "PWR", 4, 2, false },
+    { "SPD", 1000, 3, false },
+    { "PWR3S", 10, 1, false },
+    { "PWR10S", 10, 1, false },
+    { "PWR30S", 10, 1, false },
+    { "HR30S", 10, 1, false },
+    { "NP", 10, 1, false },
+    { "IF", 1000, 3, false },
+    { "TSS", 10, 1, false },
+    { "MAXHR", 1, 0, false },
+    { "MAXPWR", 1, 0, false },
+    { "WBAL", 1, 0, false },
+    { "SR", 1, 0, false },
+    { "PACE", 10, 1, false },
+    { "INCL", 100, 2, true }
+};
+
+const int32_t g_PowersOfTen[] = { 1, 10, 100, 1000 };
+
+};                                      // end anonymous namespace
+
+double Telemetry::Get(Field f) const
+{
+    if (! Has(f))
+        return -1;
+    return static_cast<double>(value[f]) / g_Fields[f].scale;
+}
+
+void Telemetry::Set(Field f, double v)
+{
+    if (v < 0 && ! g_Fields[f].is_signed) {
+        present &= ~(1u << f);
+        value[f] = 0;
+    } else {
+        present |= 1u << f;
+        value[f] = static_cast<int32_t>(std::floor(v * g_Fields[f].scale + 0.5));
+    }
+}
+
+const char* FieldName(Telemetry::Field f)
+{
+    return g_Fields[f].name;
+}
+
+int32_t FieldScale(Telemetry::Field f)
+{
+    return g_Fields[f].scale;
+}
+
+bool FieldIsSigned(Telemetry::Field f)
+{
+    return g_Fields[f].is_signed;
+}
+
+void PutFieldValue(std::ostream &out, const Telemetry &t, Telemetry::Field f)
+{
+    std::string value;
+    AppendFieldValue(value, t, f);
+    out << value;
+}
+
+void AppendNumber(std::string &out, uint64_t v)
+{
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = static_cast<char>('0' + v % 10);
+        v /= 10;
+    } while (v > 0);
+    while (n > 0)
+        out.push_back(digits[--n]);
+}
+
+void AppendFieldValue(std::string &out, const Telemetry &t, Telemetry::Field f)
+{
+    if (! t.Has(f))
+        return;
+    const FieldInfo &info = g_Fields[f];
+    int64_t v = t.value[f];
+    if (v < 0) {
+        out.push_back('-');
+        v = -v;
+    }
+    AppendNumber(out, v / info.scale);
+    int32_t fraction = static_cast<int32_t>(v % info.scale);
+    if (fraction == 0)
+        return;
+    // Convert the fraction to decimal digits and drop trailing zeroes, so
+    // 250.5 W is printed as "250.5" not "250.50".
+    int decimals = info.decimals;
+    fraction = fraction * g_PowersOfTen[decimals] / info.scale;
+    while (fraction % 10 == 0) {
+        fraction /= 10;
+        decimals--;
+    }
+    char digits[8];
+    for (int i = decimals - 1; i >= 0; --i) {
+        digits[i] = static_cast<char>('0' + fraction % 10);
+        fraction /= 10;
+    }
+    out.push_back('.');
+    out.append(digits, decimals);
+}
+
+void AppendTelemetry(std::string &out, const Telemetry &t)
+{
+    const char *separator = "";
+    for (int i = 0; i < Telemetry::FIELD_COUNT; ++i) {
+        auto f = static_cast<Telemetry::Field>(i);
+        if (t.Has(f)) {
+            out.append(separator).append(g_Fields[i].name).append(": ");
+            AppendFieldValue(out, t, f);
+            separator = ";";
+        }
+    }
+    if (t.npzones > 0) {
+        out.append(separator).append("PZONES: ");
+        for (int i = 0; i < t.npzones; ++i) {
+            if (i > 0)
+                out.push_back(',');
+            AppendNumber(out, t.pzones[i]);
+        }
+        separator = ";";
+    }
+    if (t.nhrzones > 0) {
+        out.append(separator).append("HRZONES: ");
+        for (int i = 0; i < t.nhrzones; ++i) {
+            if (i > 0)
+                out.push_back(',');
+            AppendNumber(out, t.hrzones[i]);
+        }
+        separator = ";";
+    }
+    if (t.hr_timestamp > 0) {
+        out.append(separator).append("HRTS: ");
+        AppendNumber(out, t.hr_timestamp);
+        separator = ";";
+    }
+    if (t.fec_timestamp > 0) {
+        out.append(separator).append("FETS: ");
+        AppendNumber(out, t.fec_timestamp);
+        separator = ";";
+    }
+    if (t.timestamp > 0) {
+        out.append(separator).append("TS: ");
+        AppendNumber(out, t.timestamp);
+    }
+}
+
+std::ostream& operator<<(std::ostream &out, const Telemetry &t)
+{
+    std::string text;
+    AppendTelemetry(text, t);
+    return out << text;
+}
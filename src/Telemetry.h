@@ -0,0 +1,126 @@
+/**
+ *  Telemetry -- rider data sent to clients
+ *  Copyright (C) 2017, 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <iostream>
+#include <string>
+#include <stdint.h>
+#include "TrainingLoad.h"
+
+// Hold information about a "current" reading from the trainer.  We quote
+// "current" because data comes from different sources and might not be
+// completely in sync.
+//
+// Values are stored as fixed-point integers, in the units listed for each
+// Field, and the 'present' bitmap records which values are available.  The
+// record is copied into every published frame, so it is kept small, and the
+// text and binary encoders can use the integer values directly.
+struct Telemetry
+{
+    enum Field {
+        HR,                             // bpm
+        CAD,                            // rpm
+        PWR,                            // 0.25 W
+        SPD,                            // mm/s
+        // Statistics calculated by the server, see RiderStatistics
+        PWR3S,                          // 0.1 W
+        PWR10S,                         // 0.1 W
+        PWR30S,                         // 0.1 W
+        HR30S,                          // 0.1 bpm
+        NP,                             // 0.1 W
+        IF,                             // 0.001
+        TSS,                            // 0.1
+        MAXHR,                          // bpm
+        MAXPWR,                         // W
+        WBAL,                           // J
+        // Treadmill, elliptical, rower, climber and nordic skier data
+        SR,                             // strokes or strides per minute
+        PACE,                           // 0.1 s/km
+        INCL,                           // 0.01 %, can be negative
+        FIELD_COUNT
+    };
+
+    Telemetry()
+        : seq(0), timestamp(0), hr_timestamp(0), fec_timestamp(0),
+          present(0), value(), npzones(0), nhrzones(0) {}
+
+    bool Has(Field f) const { return (present & (1u << f)) != 0; }
+
+    /** Value of 'f' in its natural unit (W, bpm, m/s, ...), or -1 if the
+     * value is not available.  Use Has() for signed fields. */
+    double Get(Field f) const;
+
+    /** Set 'f' from a value in its natural unit, rounding it to the field
+     * resolution.  A negative value marks the field as not available,
+     * unless the field is signed, see FieldIsSigned(). */
+    void Set(Field f, double value);
+
+    /** Sequence number of the frame this record was published in */
+    uint64_t seq;
+    /** Server time when this record was put together (the TS field), in
+     * microseconds, as returned by CurrentMicroseconds(), see also the
+     * TIME-SYNC command.  This is the same for all riders in a frame. */
+    uint64_t timestamp;
+    /** Server time when the HR and trainer values were received from the
+     * sensors (the HRTS and FETS fields), see
+     * AntChannel::LastMessageTime().  Use these to align the sensor values
+     * with other data, rather than 'timestamp'.  0 if no data was received
+     * from the sensor. */
+    uint64_t hr_timestamp;
+    uint64_t fec_timestamp;
+    /** Bit N is set if value[N] is available */
+    uint32_t present;
+    int32_t value[FIELD_COUNT];
+    // Time in zone, in seconds, only the first npzones/nhrzones entries are
+    // valid.
+    uint8_t npzones;
+    uint8_t nhrzones;
+    uint32_t pzones[ZoneAccumulator::MAX_ZONES];
+    uint32_t hrzones[ZoneAccumulator::MAX_ZONES];
+};
+
+/** Name of 'f' as used in TELEMETRY messages */
+const char* FieldName(Telemetry::Field f);
+
+/** Number of fixed-point units in one natural unit of 'f', e.g. 4 for PWR */
+int32_t FieldScale(Telemetry::Field f);
+
+/** Return true if 'f' can have negative values, e.g. INCL */
+bool FieldIsSigned(Telemetry::Field f);
+
+/** Write the value of 'f' in its natural unit, without using floating
+ * point formatting.  Nothing is written if the value is not available. */
+void PutFieldValue(std::ostream &out, const Telemetry &t, Telemetry::Field f);
+
+/** Same as PutFieldValue(), but the value is appended to 'out' */
+void AppendFieldValue(std::string &out, const Telemetry &t, Telemetry::Field f);
+
+/** Append the decimal digits of 'v' to 'out' */
+void AppendNumber(std::string &out, uint64_t v);
+
+/** Append 't' to 'out', in the same format as operator<<.  This is used to
+ * build the messages sent to clients: unlike a std::ostringstream, it does
+ * not allocate once 'out' has grown to the message size. */
+void AppendTelemetry(std::string &out, const Telemetry &t);
+
+std::ostream& operator<<(std::ostream &out, const Telemetry &t);
+
+/*
+  Local Variables:
+  mode: c++
+  End:
+*/
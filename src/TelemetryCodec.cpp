@@ -0,0 +1,284 @@
+/**
+ *  TelemetryCodec -- compact binary encoding for telemetry frames
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "TelemetryCodec.h"
+#include <algorithm>
+#include <stdexcept>
+
+/** IMPLEMENTATION NOTE
+ *
+ * Binary frames are sent on the same connection as the text messages (CURVE,
+ * TIME-SYNC replies, etc).  A binary frame starts with a 0x00 byte, which
+ * never starts a text message, followed by:
+ *
+ *   - the length of the rest of the frame, as a varint
+ *   - a flags byte, bit 0 is set for keyframes
+ *   - a field mask, as a varint, bit N set means field N is present
+ *   - for each field present, in increasing field order, the difference
+ *     between the field value and its value in the previous frame, zig-zag
+ *     encoded as a varint.  In a keyframe, all fields are present and the
+ *     previous values are taken as 0.
+ *
+ * Varints are unsigned, little endian base 128: 7 bits per byte, the high
+ * bit is set on all bytes except the last one.  Zig-zag encoding maps signed
+ * values to unsigned ones so small negative values are small as well: 0, -1,
+ * 1, -2, 2, ... map to 0, 1, 2, 3, 4, ...
+ *
+ * Field values are the Telemetry fixed-point values, in the same units (for
+ * example, SPD is in mm/s), except for PWR.  Field 0 is the TS field, in
+ * microseconds, and it is present in every frame.  Fields 1 - 14 are
+ * Telemetry::HR to Telemetry::WBAL, fields 15 - 22 are the times in power
+ * zones and 23 - 30 are the times in heart rate zones, in seconds, zones not
+ * defined are -1.  Fields 31 - 33 are Telemetry::SR to Telemetry::INCL, they
+ * were added later and are placed after the zones so the numbers of the
+ * older fields did not change.  Fields 34 and 35 are the HRTS and FETS
+ * sensor sample times, in microseconds like TS, 0 if no data was received
+ * from the sensor.  Field 3, PWR, is sent in whole watts, as it always was,
+ * and field 36 is the same power in 0.25 W, the resolution of the trainer
+ * data.  Decoders ignore mask bits for fields they do not know about, these
+ * are always the last fields in a frame, so older decoders keep reading the
+ * power from field 3.  A decoder should only use field 36 if it rounds to
+ * the field 3 value, a stream from an older server never sends it.
+ *
+ * A value of -1 means the value is not available, as all valid values are
+ * positive, except for signed fields (see FieldIsSigned()), which use
+ * -2147483649 (INT32_MIN - 1) instead, so every 32 bit value can be sent.
+ *
+ * A delta frame is only produced if some field other than TS has changed
+ * and a keyframe is sent every KEYFRAME_INTERVAL frames.
+ */
+
+namespace {
+
+enum {
+    KEYFRAME_INTERVAL = 50,
+    FRAME_MARKER = 0x00,
+    FLAG_KEYFRAME = 0x01,
+    MAX_VARINT_SIZE = 10,               // bytes for a 64 bit value
+    FIRST_FIELD = 1,
+    FIRST_PZONE = FIRST_FIELD + Telemetry::SR,
+    FIRST_HRZONE = FIRST_PZONE + ZoneAccumulator::MAX_ZONES,
+    FIRST_LATE_FIELD = FIRST_HRZONE + ZoneAccumulator::MAX_ZONES,
+    HR_TIMESTAMP = FIRST_LATE_FIELD + (Telemetry::FIELD_COUNT - Telemetry::SR),
+    FEC_TIMESTAMP = HR_TIMESTAMP + 1,
+    FINE_POWER = FEC_TIMESTAMP + 1
+};
+
+/** Return the PWR value 'v', in 0.25 W, rounded to whole watts */
+inline int64_t WholeWatts(int64_t v)
+{
+    return (v + 2) / 4;
+}
+
+/** Return the frame field number for Telemetry::Field 'f' */
+inline int FieldIndex(int f)
+{
+    return f < Telemetry::SR
+        ? FIRST_FIELD + f
+        : FIRST_LATE_FIELD + (f - Telemetry::SR);
+}
+
+/** Return the frame value which means 'f' is not available */
+inline int64_t MissingValue(int f)
+{
+    return FieldIsSigned(static_cast<Telemetry::Field>(f))
+        ? static_cast<int64_t>(INT32_MIN) - 1
+        : -1;
+}
+
+void ToFields(const Telemetry &t, int64_t *fields)
+{
+    fields[0] = static_cast<int64_t>(t.timestamp);
+    for (int i = 0; i < Telemetry::FIELD_COUNT; ++i) {
+        fields[FieldIndex(i)] =
+            t.Has(static_cast<Telemetry::Field>(i)) ? t.value[i] : MissingValue(i);
+    }
+    for (int i = 0; i < ZoneAccumulator::MAX_ZONES; ++i) {
+        fields[FIRST_PZONE + i] = i < t.npzones ? static_cast<int64_t>(t.pzones[i]) : -1;
+        fields[FIRST_HRZONE + i] = i < t.nhrzones ? static_cast<int64_t>(t.hrzones[i]) : -1;
+    }
+    fields[HR_TIMESTAMP] = static_cast<int64_t>(t.hr_timestamp);
+    fields[FEC_TIMESTAMP] = static_cast<int64_t>(t.fec_timestamp);
+    int pwr = FieldIndex(Telemetry::PWR);
+    fields[FINE_POWER] = fields[pwr];
+    if (fields[pwr] >= 0)
+        fields[pwr] = WholeWatts(fields[pwr]);
+}
+
+void FromFields(const int64_t *fields, Telemetry &t)
+{
+    t.timestamp = static_cast<uint64_t>(fields[0]);
+    t.present = 0;
+    for (int i = 0; i < Telemetry::FIELD_COUNT; ++i) {
+        int64_t v = fields[FieldIndex(i)];
+        bool present = v != MissingValue(i)
+            && (v >= 0 || FieldIsSigned(static_cast<Telemetry::Field>(i)));
+        t.value[i] = present ? static_cast<int32_t>(v) : 0;
+        if (present)
+            t.present |= 1u << i;
+    }
+    if (t.Has(Telemetry::PWR)) {
+        int64_t fine = fields[FINE_POWER];
+        t.value[Telemetry::PWR] = fine >= 0 && WholeWatts(fine) == t.value[Telemetry::PWR]
+            ? static_cast<int32_t>(fine)
+            : t.value[Telemetry::PWR] * 4;
+    }
+    t.npzones = 0;
+    t.nhrzones = 0;
+    for (int i = 0; i < ZoneAccumulator::MAX_ZONES; ++i) {
+        if (fields[FIRST_PZONE + i] >= 0 && t.npzones == i)
+            t.pzones[t.npzones++] = static_cast<uint32_t>(fields[FIRST_PZONE + i]);
+        if (fields[FIRST_HRZONE + i] >= 0 && t.nhrzones == i)
+            t.hrzones[t.nhrzones++] = static_cast<uint32_t>(fields[FIRST_HRZONE + i]);
+    }
+    t.hr_timestamp = static_cast<uint64_t>(fields[HR_TIMESTAMP]);
+    t.fec_timestamp = static_cast<uint64_t>(fields[FEC_TIMESTAMP]);
+}
+
+void PutVarint(std::string &out, uint64_t value)
+{
+    do {
+        uint8_t b = value & 0x7F;
+        value >>= 7;
+        if (value > 0)
+            b |= 0x80;
+        out.push_back(static_cast<char>(b));
+    } while (value > 0);
+}
+
+uint64_t GetVarint(const std::string &in, size_t &pos)
+{
+    uint64_t value = 0;
+    int shift = 0;
+    while (pos < in.size() && shift < 64) {
+        uint8_t b = static_cast<uint8_t>(in[pos++]);
+        value |= static_cast<uint64_t>(b & 0x7F) << shift;
+        if ((b & 0x80) == 0)
+            return value;
+        shift += 7;
+    }
+    throw std::runtime_error("TelemetryDecoder: bad varint");
+}
+
+inline uint64_t ZigZag(int64_t v)
+{
+    return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+
+inline int64_t UnZigZag(uint64_t v)
+{
+    return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+}
+
+};                                      // end anonymous namespace
+
+
+// ................................................... TelemetryEncoder ....
+
+TelemetryEncoder::TelemetryEncoder()
+    : m_FramesSinceKeyframe(0),
+      m_ForceKeyframe(true),
+      m_LastWasKeyframe(false)
+{
+    std::fill(&m_Previous[0], &m_Previous[FIELD_COUNT], 0);
+    // flags, mask and a value for each field
+    m_Body.reserve(1 + MAX_VARINT_SIZE * (1 + FIELD_COUNT));
+}
+
+std::string TelemetryEncoder::Encode(const Telemetry &t)
+{
+    std::string frame;
+    Encode(t, frame);
+    return frame;
+}
+
+void TelemetryEncoder::Encode(const Telemetry &t, std::string &frame)
+{
+    frame.clear();
+    int64_t fields[FIELD_COUNT];
+    ToFields(t, fields);
+
+    bool keyframe = m_ForceKeyframe || m_FramesSinceKeyframe >= KEYFRAME_INTERVAL;
+    uint64_t mask = 0;
+    if (keyframe) {
+        std::fill(&m_Previous[0], &m_Previous[FIELD_COUNT], 0);
+        mask = (1ULL << FIELD_COUNT) - 1;
+    } else {
+        for (int i = 1; i < FIELD_COUNT; ++i) {
+            if (fields[i] != m_Previous[i])
+                mask |= 1ULL << i;
+        }
+        if (mask == 0)
+            return;
+        mask |= 1;                      // TS is always sent
+    }
+
+    m_Body.clear();
+    m_Body.push_back(static_cast<char>(keyframe ? FLAG_KEYFRAME : 0));
+    PutVarint(m_Body, mask);
+    for (int i = 0; i < FIELD_COUNT; ++i) {
+        if (mask & (1ULL << i)) {
+            PutVarint(m_Body, ZigZag(fields[i] - m_Previous[i]));
+            m_Previous[i] = fields[i];
+        }
+    }
+
+    frame.push_back(static_cast<char>(FRAME_MARKER));
+    PutVarint(frame, m_Body.size());
+    frame.append(m_Body);
+
+    m_ForceKeyframe = false;
+    m_LastWasKeyframe = keyframe;
+    m_FramesSinceKeyframe = keyframe ? 0 : m_FramesSinceKeyframe + 1;
+}
+
+
+// ................................................... TelemetryDecoder ....
+
+TelemetryDecoder::TelemetryDecoder()
+    : m_HaveKeyframe(false)
+{
+    std::fill(&m_Previous[0], &m_Previous[TelemetryEncoder::FIELD_COUNT], 0);
+}
+
+bool TelemetryDecoder::Decode(const std::string &frame, Telemetry &t)
+{
+    size_t pos = 0;
+    if (frame.empty() || frame[pos++] != FRAME_MARKER)
+        throw std::runtime_error("TelemetryDecoder: not a binary frame");
+    uint64_t length = GetVarint(frame, pos);
+    if (length == 0 || frame.size() - pos != length)
+        throw std::runtime_error("TelemetryDecoder: bad frame length");
+
+    bool keyframe = (frame[pos++] & FLAG_KEYFRAME) != 0;
+    if (! keyframe && ! m_HaveKeyframe)
+        return false;
+    if (keyframe) {
+        std::fill(&m_Previous[0], &m_Previous[TelemetryEncoder::FIELD_COUNT], 0);
+        m_HaveKeyframe = true;
+    }
+
+    uint64_t mask = GetVarint(frame, pos);
+    for (int i = 0; i < TelemetryEncoder::FIELD_COUNT; ++i) {
+        if (mask & (1ULL << i))
+            m_Previous[i] += UnZigZag(GetVarint(frame, pos));
+    }
+
+    FromFields(m_Previous, t);
+    return true;
+}
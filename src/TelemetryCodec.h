@@ -0,0 +1,93 @@
+/**
+ *  TelemetryCodec -- compact binary encoding for telemetry frames
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "Telemetry.h"
+#include <string>
+#include <stdint.h>
+
+/** Encode a sequence of Telemetry values for a rider into a compact binary
+ * stream, for clients on slow or metered links.  Only fields which changed
+ * since the previous frame are sent, as deltas, with periodic keyframes
+ * which contain all fields.  See TelemetryCodec.cpp for the format.
+ *
+ * The encoder keeps the state of the stream, so all clients receiving the
+ * stream for a rider share a single encoder and the frames are encoded only
+ * once.  A client can only start decoding the stream at a keyframe.
+ */
+class TelemetryEncoder
+{
+public:
+    TelemetryEncoder();
+
+    /** Encode 't' as the next frame in the stream.  Returns an empty string
+     * if nothing except the timestamp changed since the previous frame, in
+     * which case nothing needs to be sent. */
+    std::string Encode(const Telemetry &t);
+
+    /** Same as Encode() above, but the frame is written to 'frame', which
+     * is cleared first.  The server passes the buffers of a reused
+     * TelemetryFrame, so encoding does not allocate once these have grown
+     * to the frame size. */
+    void Encode(const Telemetry &t, std::string &frame);
+
+    /** True if the last non-empty frame returned by Encode() was a
+     * keyframe. */
+    bool IsKeyframe() const { return m_LastWasKeyframe; }
+
+    /** Make the next frame a keyframe, for example when a new client
+     * subscribes to the stream. */
+    void ForceKeyframe() { m_ForceKeyframe = true; }
+
+    /** TS, the Telemetry fields, the power and heart rate zones, the HRTS
+     * and FETS sensor sample times and the power in 0.25 W */
+    enum { FIELD_COUNT = 1 + Telemetry::FIELD_COUNT + 2 * ZoneAccumulator::MAX_ZONES + 3 };
+
+private:
+    int64_t m_Previous[FIELD_COUNT];
+    /** Buffer for the frame body, kept between frames */
+    std::string m_Body;
+    int m_FramesSinceKeyframe;
+    bool m_ForceKeyframe;
+    bool m_LastWasKeyframe;
+};
+
+/** Reference decoder for the TelemetryEncoder stream, this documents the
+ * format in code and can be used to check client implementations.
+ */
+class TelemetryDecoder
+{
+public:
+    TelemetryDecoder();
+
+    /** Decode a complete frame, as produced by TelemetryEncoder::Encode(),
+     * updating 't'.  Returns false if the frame is a delta frame and no
+     * keyframe was seen yet.  Throws std::runtime_error if the frame is
+     * malformed. */
+    bool Decode(const std::string &frame, Telemetry &t);
+
+private:
+    int64_t m_Previous[TelemetryEncoder::FIELD_COUNT];
+    bool m_HaveKeyframe;
+};
+
+/*
+  Local Variables:
+  mode: c++
+  End:
+*/
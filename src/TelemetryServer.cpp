@@ -17,189 +17,1041 @@
  */
 #include "stdafx.h"
 #include "TelemetryServer.h"
+#include "TelemetryCodec.h"
 #include "Tools.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+#include <thread>
 
-std::ostream& operator<<(std::ostream &out, const Telemetry &t)
+/** IMPLEMENTATION NOTE
+ *
+ * The server runs on three kinds of threads: the ANT thread, which calls
+ * Tick() and is the only one which touches the ANT stick and the riders, the
+ * network workers (see NetworkWorker), which own the client sockets, and the
+ * MqttWorker, which owns the MQTT broker connection.  The ANT thread never
+ * touches a socket.  Once per Tick(), it builds a TelemetryFrame with all
+ * the messages for the clients already encoded and publishes it in a
+ * FrameRing, from where the workers pick it up.  Client commands which need
+ * the riders come back through a CommandQueue and are executed at the start
+ * of the next Tick().
+ */
+
+namespace {
+
+enum {
+    // Duration (milliseconds) of a Tick() when there is no ANT stick, about
+    // the time TickAntStick() waits for USB events.
+    IDLE_TICK_INTERVAL = 10
+};
+
+/** Encode the current mean maximal power curve as a "CURVE" message
+ * containing DURATION:POWER pairs, with the duration in seconds.  Durations
+ * longer than the current session are not included.  The message is written
+ * to 'text', reusing its storage.
+ */
+void MakeCurveMessage(const PowerCurve &curve, std::string &text)
 {
-    if (t.hr >= 0)
-        out << "HR: " << t.hr;
-    if (t.cad >= 0)
-        out << ";CAD: " << t.cad;
-    if (t.pwr >= 0)
-        out << ";PWR: " << t.pwr;
-    if (t.spd >= 0)
-        out << ";SPD: " << t.spd;
-    return out;
+    text.assign("CURVE ");
+    const char *separator = "";
+    for (int i = 0; i < curve.Count(); ++i) {
+        double power = curve.BestPower(i);
+        if (power >= 0) {
+            text.append(separator);
+            AppendNumber(text, curve.Duration(i));
+            // Same as the default std::ostream format
+            char number[32];
+            int n = snprintf(number, sizeof(number), ":%g", power);
+            text.append(number, n);
+            separator = ";";
+        }
+    }
+    text.push_back('\n');
 }
 
-bool SendMessage(SOCKET s, const char *msg, int len)
+};                                      // end anonymous namespace
+
+// ............................................................... Rider ....
+
+Rider::Rider(AntStick *stick,
+             uint32_t hrm_device_number,
+             uint32_t fec_device_number,
+             double weight,
+             double bike_weight,
+             double wheel_diameter)
+    : stick(stick),
+      weight(weight),
+      bike_weight(bike_weight),
+      wheel_diameter(wheel_diameter),
+      hrm(nullptr),
+      fec(nullptr),
+      hrm_device(hrm_device_number),
+      fec_device(fec_device_number),
+      last_hr_timestamp(0),
+      last_power_timestamp(0),
+      hrm_info_updates(-1),
+      fec_info_updates(-1),
+      hrm_battery(AntChannel::BATTERY_UNKNOWN),
+      fec_battery(AntChannel::BATTERY_UNKNOWN),
+      curve_updates(-1),
+      last_beat_count(-1),
+      last_beat_timestamp(0),
+      last_target_power(-1)
 {
-    int r = send(s, msg, len, 0);
-    if (r == SOCKET_ERROR) {
-        auto last_error = WSAGetLastError();
-        if (WSAECONNRESET == last_error)
-            return false;
-        throw Win32Error("send()", last_error);
+    try {
+        CreateHrm(hrm_device_number);
+        CreateFec(fec_device_number);
     }
-    if (r < len) {
-        throw std::runtime_error("send_data: short write to server");
+    catch (...) {
+        delete hrm;
+        delete fec;
+        throw;
     }
-    return true;
 }
 
-// read a '\n' terminated message from socket s
-std::string ReadMessage(SOCKET s)
+Rider::~Rider()
+{
+    delete hrm;
+    delete fec;
+}
+
+Rider::NewChannels Rider::OpenChannels(uint32_t hrm_device_number,
+                                       uint32_t fec_device_number) const
 {
-    std::string message;
-    // NOTE: we are very inefficient, as we are reading bytes one-by-one. To
-    // improve this, we need to associate a receive buffer with a socket,
-    // because we can't put things back and we don't know how much to read...
-    while (true) {
-        char buf[1];
-        int len = sizeof(buf);
-        int r = recv(s, &buf[0], len, 0);
-        if (r == 0) // socket was closed
-            return message;
-        if (r == SOCKET_ERROR)
-            throw Win32Error("recv()", WSAGetLastError());
-        if (buf[0] == '\n')
-            return message;
-        message.push_back(buf[0]);
+    NewChannels channels;
+    // Without a stick, the channels are opened by AttachChannels()
+    if (! stick)
+        return channels;
+    if (hrm_device_number != 0
+        && (! hrm || hrm->ChannelId().DeviceNumber != hrm_device_number)) {
+        channels.hrm.reset(
+            new HeartRateMonitor (stick, hrm_device_number, hrm_search));
     }
+    if (fec_device_number != 0
+        && (! fec || fec->ChannelId().DeviceNumber != fec_device_number)) {
+        channels.fec.reset(
+            new FitnessEquipmentControl (stick, fec_device_number, fec_search));
+    }
+    return channels;
 }
 
-TelemetryServer::TelemetryServer (AntStick *stick, int port)
-    : m_AntStick (stick),
-      m_Hrm (nullptr),
-      m_Fec (nullptr)
+void Rider::Reconfigure(NewChannels channels,
+                        uint32_t hrm_device_number,
+                        uint32_t fec_device_number,
+                        double new_weight,
+                        double new_bike_weight,
+                        double new_wheel_diameter)
 {
-    try {
-        auto server = tcp_listen(port);
-        std::cout << "Started server on port " << port << std::endl;
-        m_Clients.push_back(server);
-        m_Hrm = new HeartRateMonitor (m_AntStick);
-        m_Fec = new FitnessEquipmentControl (m_AntStick);
+    bool params_changed = false;
+    if (new_weight > 0 && new_weight != weight) {
+        weight = new_weight;
+        params_changed = true;
     }
-    catch (...) {
-        if (m_Clients.size() > 0)
-            closesocket(m_Clients.front());
-        delete m_Hrm;
-        delete m_Fec;
+    if (new_bike_weight > 0 && new_bike_weight != bike_weight) {
+        bike_weight = new_bike_weight;
+        params_changed = true;
+    }
+    if (new_wheel_diameter > 0 && new_wheel_diameter != wheel_diameter) {
+        wheel_diameter = new_wheel_diameter;
+        params_changed = true;
+    }
+
+    if (! stick) {
+        // The channels are opened with these sensors by AttachChannels()
+        if (hrm_device_number != 0)
+            hrm_device = hrm_device_number;
+        if (fec_device_number != 0)
+            fec_device = fec_device_number;
+        return;
+    }
+
+    if (channels.hrm) {
+        std::cout << "Switching to HRM " << hrm_device_number << std::endl;
+        UseHrm(std::move(channels.hrm), hrm_search);
+    }
+
+    if (channels.fec) {
+        std::cout << "Switching to FE-C " << fec_device_number << std::endl;
+        UseFec(std::move(channels.fec), fec_search); // also sends the user params
+    } else if (params_changed && fec) {
+        ApplyUserParams();
     }
 }
 
-TelemetryServer::~TelemetryServer()
+void Rider::DetachChannels()
 {
-    for (auto i = begin (m_Clients); i != end (m_Clients); ++i)
-        closesocket (*i);
-    delete m_Hrm;
-    delete m_Fec;
+    hrm_device = HrmDeviceNumber();
+    fec_device = FecDeviceNumber();
+    delete hrm;
+    hrm = nullptr;
+    delete fec;
+    fec = nullptr;
+    stick = nullptr;
 }
 
-void TelemetryServer::Tick()
+void Rider::AttachChannels(AntStick *new_stick)
+{
+    stick = new_stick;
+    CreateHrm(hrm_device);
+    CreateFec(fec_device);
+    // Beat counts from the new channel are unrelated to the old ones
+    last_beat_count = -1;
+}
+
+uint32_t Rider::HrmDeviceNumber() const
+{
+    return hrm ? hrm->ChannelId().DeviceNumber : hrm_device;
+}
+
+uint32_t Rider::FecDeviceNumber() const
+{
+    return fec ? fec->ChannelId().DeviceNumber : fec_device;
+}
+
+/** Change the search restrictions for the HRM or the FE-C channel.  If the
+ * channel is still searching, it is re-opened so the new restrictions apply,
+ * a channel which is already paired is not affected.  If the channel cannot
+ * be re-opened, this throws and the current channel and restrictions are
+ * kept. */
+void Rider::SetSearchConfig(bool for_hrm, const AntChannel::SearchConfig &search)
+{
+    if (for_hrm) {
+        if (hrm && hrm->ChannelId().DeviceNumber == 0)
+            CreateHrm(0, search);
+        else
+            hrm_search = search;
+    } else {
+        if (fec && fec->ChannelId().DeviceNumber == 0)
+            CreateFec(0, search);
+        else
+            fec_search = search;
+    }
+}
+
+/** Open a new HRM channel and replace the current one with it.  The current
+ * channel is only closed once the new one was opened successfully, if that
+ * fails, the exception is propagated and the rider keeps the current
+ * channel.  Note that the new channel needs a free channel on the stick
+ * while it is being opened.  'search' becomes the HRM search configuration
+ * once the channel is open. */
+void Rider::CreateHrm(uint32_t device_number,
+                      const AntChannel::SearchConfig &search)
+{
+    UseHrm(std::unique_ptr<HeartRateMonitor>(
+               new HeartRateMonitor (stick, device_number, search)),
+           search);
+}
+
+/** Open a new FE-C channel and replace the current one with it, see
+ * CreateHrm(). */
+void Rider::CreateFec(uint32_t device_number,
+                      const AntChannel::SearchConfig &search)
+{
+    UseFec(std::unique_ptr<FitnessEquipmentControl>(
+               new FitnessEquipmentControl (stick, device_number, search)),
+           search);
+}
+
+/** Replace the current HRM channel with 'channel', which was opened with
+ * the search configuration 'search'. */
+void Rider::UseHrm(std::unique_ptr<HeartRateMonitor> channel,
+                   const AntChannel::SearchConfig &search)
+{
+    delete hrm;
+    hrm = channel.release();
+    hrm_search = search;
+    hrm_info_updates = -1;
+    last_hr_timestamp = hrm->InstantHeartRateTimestamp();
+}
+
+/** Replace the current FE-C channel with 'channel', see UseHrm(). */
+void Rider::UseFec(std::unique_ptr<FitnessEquipmentControl> channel,
+                   const AntChannel::SearchConfig &search)
+{
+    delete fec;
+    fec = channel.release();
+    fec_search = search;
+    fec_info_updates = -1;
+    ApplyUserParams();
+    last_power_timestamp = fec->InstantPowerTimestamp();
+    last_target_power = -1;
+    if (gearing)
+        fec->SetGearRatio(gearing->RatioFactor());
+}
+
+/** Send the rider and bike parameters to the trainer.  Values of 0 mean
+ * that the trainer defaults are used. */
+void Rider::ApplyUserParams()
+{
+    if (weight > 0 || bike_weight > 0 || wheel_diameter > 0) {
+        fec->SetUserParams(
+            weight > 0 ? weight : fec->UserWeight(),
+            bike_weight > 0 ? bike_weight : fec->BikeWeight(),
+            wheel_diameter > 0 ? wheel_diameter : fec->BikeWheelDiameter());
+    }
+    if (weight <= 0)
+        weight = fec->UserWeight();
+}
+
+void Rider::CheckSensorHealth()
 {
-#if 1
-    TickAntStick (m_AntStick);
-    CheckSensorHealth();
-#endif
-    Telemetry t;
-#if 1
-    CollectTelemetry (t);
-#else
-    t.cad = 78;
-    t.hr = 146;
-    t.spd = 4.2;
-    t.pwr = 214;
-#endif
-    ProcessClients (t);
-}
-
-void TelemetryServer::CheckSensorHealth()
-{
-    if (m_Hrm && m_Hrm->ChannelState() == AntChannel::CH_CLOSED) {
+    if (hrm && hrm->ChannelState() == AntChannel::CH_CLOSED) {
         std::cout << "Creating new HRM channel" << std::endl;
-        auto device_number = m_Hrm->ChannelId().DeviceNumber;
-        delete m_Hrm;
-        m_Hrm = nullptr;
+        auto device_number = hrm->ChannelId().DeviceNumber;
+        delete hrm;
+        hrm = nullptr;
         // Try to connect again, but we now look for the same device, don't
         // change HRM sensors mid-simulation.
-        m_Hrm = new HeartRateMonitor (m_AntStick, device_number);
+        CreateHrm(device_number);
     }
 
-    if (m_Fec && m_Fec->ChannelState() == AntChannel::CH_CLOSED) {
-        auto device_number = m_Fec->ChannelId().DeviceNumber;
-        delete m_Fec;
-        m_Fec = nullptr;
-        m_Fec = new FitnessEquipmentControl (m_AntStick, device_number);
+    if (fec && fec->ChannelState() == AntChannel::CH_CLOSED) {
+        auto device_number = fec->ChannelId().DeviceNumber;
+        delete fec;
+        fec = nullptr;
+        CreateFec(device_number);
+    }
+}
+
+/** Start, update or stop the heart rate control, see HeartRateController.
+ * The parameters are kept in 'hr_params' even when the control is stopped,
+ * so the gains set with SET-HR-PID apply the next time it is started.
+ */
+void Rider::SetHeartRateControl(const HeartRateController::Params &params)
+{
+    hr_params = params;
+    if (params.target_hr <= 0) {
+        hr_control.reset();
+    } else if (hr_control) {
+        hr_control->SetParams(params);
+    } else {
+        // Start from the power the rider is currently doing, so enabling
+        // the control does not change the effort abruptly.
+        double power = (fec && fec->ChannelState() == AntChannel::CH_OPEN)
+            ? fec->InstantPower() : params.min_power;
+        hr_control.reset(new HeartRateController(params, power));
+        last_beat_count = -1;
+        last_target_power = -1;
     }
 }
 
-void TelemetryServer::CollectTelemetry (Telemetry &out)
+/** Update the heart rate controller when a new heart beat was received
+ * and send the new target power to the trainer if it changed.  The update
+ * uses the R-R interval measured by the HRM as the time step, so the
+ * control does not depend on the timing of the ANT messages.  The trainer
+ * keeps the last target power while the HRM is not sending data.
+ */
+void Rider::UpdateHeartRateControl()
 {
-    if (m_Hrm && m_Hrm->ChannelState() == AntChannel::CH_OPEN)
-        out.hr = m_Hrm->InstantHeartRate();
+    if (! hr_control || ! hrm || ! fec
+        || hrm->ChannelState() != AntChannel::CH_OPEN
+        || fec->ChannelState() != AntChannel::CH_OPEN)
+        return;
+
+    int beats = hrm->HeartBeatCount();
+    if (beats == last_beat_count)
+        return;
+
+    uint32_t now = CurrentMilliseconds();
+    if (last_beat_count >= 0) {
+        double dt = (now - last_beat_timestamp) / 1000.0;
+        if (beats - last_beat_count == 1 && hrm->RRInterval() > 0)
+            dt = hrm->RRInterval() / 1000.0;
+        double power = hr_control->Update(hrm->InstantHeartRate(), dt);
+        // The trainer resolution is 0.25 watts, but there is no point in
+        // sending changes smaller than 1 watt.
+        if (last_target_power < 0 || std::abs(power - last_target_power) >= 1.0) {
+            fec->SetTargetPower(power);
+            last_target_power = power;
+        }
+    }
+    last_beat_count = beats;
+    last_beat_timestamp = now;
+}
+
+/** Pass any new sensor readings on to the rider statistics.  This is done
+ * once per Tick(), right after the ANT messages are decoded, so statistics
+ * are updated for every sample received, not for every telemetry message
+ * sent out.
+ */
+void Rider::UpdateStatistics()
+{
+    if (hrm && hrm->ChannelState() == AntChannel::CH_OPEN) {
+        auto ts = hrm->InstantHeartRateTimestamp();
+        if (ts != last_hr_timestamp) {
+            stats.AddHeartRate(ts, hrm->InstantHeartRate());
+            last_hr_timestamp = ts;
+        }
+    }
+
+    if (fec && fec->ChannelState() == AntChannel::CH_OPEN) {
+        auto ts = fec->InstantPowerTimestamp();
+        if (ts != last_power_timestamp) {
+            stats.AddPower(ts, fec->InstantPower());
+            last_power_timestamp = ts;
+        }
+    }
+
+    stats.Update(CurrentMilliseconds());
+}
+
+void Rider::CollectTelemetry (uint64_t capture_time)
+{
+    Telemetry &out = telemetry;
+    out = Telemetry();
+    out.timestamp = capture_time;
+
+    if (hrm && hrm->ChannelState() == AntChannel::CH_OPEN) {
+        out.Set(Telemetry::HR, hrm->InstantHeartRate());
+        out.hr_timestamp = hrm->LastMessageTime();
+    }
     
-    if (m_Fec && m_Fec->ChannelState() == AntChannel::CH_OPEN) {
-        out.cad = m_Fec->InstantCadence();
-        out.pwr = m_Fec->InstantPower();
-        out.spd = m_Fec->InstantSpeed();
+    if (fec && fec->ChannelState() == AntChannel::CH_OPEN) {
+        out.fec_timestamp = fec->LastMessageTime();
+        out.Set(Telemetry::CAD, fec->InstantCadence());
+        out.Set(Telemetry::PWR, fec->InstantPower());
+        out.Set(Telemetry::SPD, fec->InstantSpeed());
+        out.Set(Telemetry::SR, fec->StrokeRate());
+        out.Set(Telemetry::PACE, fec->Pace());
+        if (fec->HasIncline())
+            out.Set(Telemetry::INCL, fec->Incline());
     }
+
+    out.Set(Telemetry::PWR3S, stats.AveragePower3s());
+    out.Set(Telemetry::PWR10S, stats.AveragePower10s());
+    out.Set(Telemetry::PWR30S, stats.AveragePower30s());
+    out.Set(Telemetry::HR30S, stats.AverageHeartRate30s());
+    out.Set(Telemetry::NP, stats.NormalizedPower());
+    out.Set(Telemetry::IF, stats.IntensityFactor());
+    out.Set(Telemetry::TSS, stats.TrainingStressScore());
+    out.Set(Telemetry::MAXHR, stats.MaxHeartRate());
+    out.Set(Telemetry::MAXPWR, stats.MaxPower());
+    out.Set(Telemetry::WBAL, stats.WBalance());
+
+    const ZoneAccumulator &pz = stats.PowerZones();
+    out.npzones = static_cast<uint8_t>(pz.ZoneCount());
+    for (int i = 0; i < out.npzones; ++i)
+        out.pzones[i] = static_cast<uint32_t>(pz.TimeInZone(i));
+
+    const ZoneAccumulator &hrz = stats.HeartRateZones();
+    out.nhrzones = static_cast<uint8_t>(hrz.ZoneCount());
+    for (int i = 0; i < out.nhrzones; ++i)
+        out.hrzones[i] = static_cast<uint32_t>(hrz.TimeInZone(i));
 }
 
-void TelemetryServer::ProcessClients(const Telemetry &t)
+
+/** Rebuild the DEVICE-INFO messages if the device info of a sensor has
+ * changed and report sensors whose battery became low.  Since all sensors
+ * decode the ANT+ common pages the same way, see AntChannel::DeviceInfo,
+ * battery alerts for all riders come from this one place.
+ */
+void Rider::UpdateDeviceInfo(int index)
 {
+    int hrm_updates = hrm ? hrm->DeviceInfoUpdates() : -1;
+    int fec_updates = fec ? fec->DeviceInfoUpdates() : -1;
+    if (hrm_updates == hrm_info_updates && fec_updates == fec_info_updates)
+        return;
+    hrm_info_updates = hrm_updates;
+    fec_info_updates = fec_updates;
+
     std::ostringstream text;
-    text << "TELEMETRY " << t << "\n";
-    std::string message = text.str();
+    auto sensor = [&](const char *name, const AntChannel *channel,
+                      AntChannel::BatteryStatus &last_battery) {
+        if (! channel || channel->ChannelId().DeviceNumber == 0)
+            return;
+        const auto &info = channel->GetDeviceInfo();
+        text << "DEVICE-INFO SENSOR: " << name
+             << ";DEVICE: " << channel->ChannelId().DeviceNumber;
+        std::ostringstream fields;
+        fields << info;
+        if (! fields.str().empty())
+            text << ";" << fields.str();
+        text << "\n";
+
+        if (info.Battery != last_battery
+            && (info.Battery == AntChannel::BATTERY_LOW
+                || info.Battery == AntChannel::BATTERY_CRITICAL)) {
+            std::cout << "Rider " << index << ": " << name << " "
+                      << channel->ChannelId().DeviceNumber << " battery "
+                      << BatteryStatusAsString(info.Battery) << std::endl;
+        }
+        last_battery = info.Battery;
+    };
+    sensor("HRM", hrm, hrm_battery);
+    sensor("FEC", fec, fec_battery);
+    device_info = text.str();
+}
+
+/** Rebuild the CURVE message if the power curve has changed.  The curve
+ * changes at most once a second, while frames are published on every
+ * Tick(). */
+void Rider::UpdateCurve()
+{
+    const PowerCurve &pc = stats.GetPowerCurve();
+    if (pc.Updates() == curve_updates)
+        return;
+    curve_updates = pc.Updates();
+    MakeCurveMessage(pc, curve);
+}
+
 
-    auto status = get_socket_status(m_Clients, 10);
-    // NOTE: first item in list is the server socket, a SK_READ flag on it
-    // means there's a client waiting on it
-    if (status[0] & SK_READ) {
-        auto client = tcp_accept(m_Clients[0]);
-        std::cout << "Accepted connection from " << get_peer_name(client) << std::endl;
-        m_Clients.push_back(client);
+// ..................................................... TelemetryServer ....
+
+TelemetryServer::TelemetryServer (const ServerConfig &config,
+                                  int workers, const HandoverState *handover)
+    : m_Server (INVALID_SOCKET),
+      m_Port (config.port),
+      m_AntStick (nullptr),
+      m_CaptureTime (0),
+      m_GroupRankSize (config.group_rank_size),
+      m_BikeWeight (config.bike_weight),
+      m_WheelDiameter (config.wheel_diameter),
+      m_WorkerCount (std::max(workers, 1)),
+      m_FramePool (m_WorkerCount + 1),  // the workers and the MQTT worker
+      m_HandedOver (false),
+      m_MqttInterval (config.mqtt_interval)
+{
+    if (handover) {
+        m_Server = handover->server;
+        std::cout << "Continuing server on port " << m_Port << std::endl;
+    } else {
+        m_Server = tcp_listen(m_Port);
+        std::cout << "Started server on port " << m_Port << std::endl;
+    }
+    // The riders are created when an ANT stick is attached.
+    if (handover) {
+        // Open the channels directly to the sensors used by the previous
+        // server, this avoids a search.
+        for (const auto &r : handover->riders)
+            AddRider(r.hrm_device_number, r.fec_device_number, r.weight);
+    } else if (! config.riders.empty()) {
+        m_PendingRiders = config.riders;
+    } else {
+        // The first rider searches for any HRM and trainer, additional
+        // riders are added with the ADD-RIDER command.
+        AddRider(0, 0, 0);
     }
 
-    std::vector<SOCKET> closed_sockets;
+    try {
+        // All workers accept connections from the same server socket, which
+        // needs to be non-blocking, see NetworkWorker.
+        set_non_blocking(m_Server, true);
+        StartWorkers(handover ? handover->clients : std::vector<ClientHandover>());
 
-    // for the remaining clients, just send some data if they are ready
-    for (unsigned i = 1; i < status.size(); ++i) {
-        if (status[i] & SK_WRITE) {
-            try {
-                if (!SendMessage(m_Clients[i], message.c_str(), message.length())) {
-                    closed_sockets.push_back(m_Clients[i]);
-                }
-            }
-            catch (const std::exception &e) {
-                std::cerr << get_peer_name(m_Clients[i]) << ": " << e.what() << std::endl;
-                closed_sockets.push_back(m_Clients[i]);
-            }
+        m_Handover = std::unique_ptr<HandoverListener>(new HandoverListener(m_Port));
+    }
+    catch (...) {
+        m_Workers.clear();
+        closesocket(m_Server);
+        throw;
+    }
+}
+
+TelemetryServer::~TelemetryServer()
+{
+    // Stop the workers before closing the server socket they use.
+    m_Workers.clear();
+    DetachStick();
+    if (m_Server != INVALID_SOCKET)
+        closesocket (m_Server);
+}
+
+/** Start using 'stick', open the channels of the existing riders on it and
+ * create the pending ones.  The server runs without a stick until this is
+ * called, so clients can connect while the stick is initialised, see
+ * DetachStick(). */
+void TelemetryServer::AttachStick(AntStick *stick)
+{
+    m_AntStick = stick;
+    auto riders = m_PendingRiders;
+    auto rider_count = m_Riders.size();
+    m_PendingRiders.clear();
+    try {
+        for (auto &rider : m_Riders)
+            rider->AttachChannels(stick);
+        for (const auto &r : riders)
+            AddRider(r.hrm_device_number, r.fec_device_number, r.weight);
+    }
+    catch (...) {
+        DetachStick();
+        // The pending riders are created again by the next AttachStick()
+        m_Riders.resize(rider_count);
+        m_Encoders.resize(rider_count);
+        m_PendingRiders = riders;
+        throw;
+    }
+}
+
+/** Stop using the ANT stick, for example because it failed.  Only the
+ * sensor channels are closed, the riders keep their statistics, settings
+ * and sensors, and clients keep receiving their (sensor-less) telemetry
+ * until a stick is attached again. */
+void TelemetryServer::DetachStick()
+{
+    if (! m_AntStick)
+        return;
+    for (auto &rider : m_Riders)
+        rider->DetachChannels();
+    m_AntStick = nullptr;
+}
+
+/** Return the sensors and weight of each rider, including the ones not
+ * created yet.  A device number of 0 (not paired yet) means that the sensor
+ * is still searched for. */
+std::vector<ServerConfig::RiderConfig> TelemetryServer::CurrentRiders() const
+{
+    std::vector<ServerConfig::RiderConfig> riders;
+    for (const auto &rider : m_Riders) {
+        ServerConfig::RiderConfig r;
+        r.hrm_device_number = rider->HrmDeviceNumber();
+        r.fec_device_number = rider->FecDeviceNumber();
+        r.weight = rider->weight;
+        riders.push_back(r);
+    }
+    riders.insert(riders.end(), m_PendingRiders.begin(), m_PendingRiders.end());
+    return riders;
+}
+
+/** The status reported to clients, see ServerStatus */
+ServerStatus TelemetryServer::CurrentStatus() const
+{
+    if (! m_AntStick)
+        return STATUS_INITIALISING;
+    for (const auto &rider : m_Riders) {
+        if ((rider->hrm && rider->hrm->ChannelState() == AntChannel::CH_OPEN)
+            || (rider->fec && rider->fec->ChannelState() == AntChannel::CH_OPEN))
+            return STATUS_LIVE;
+    }
+    return STATUS_SEARCHING;
+}
+
+/** Start the network workers, 'clients' are existing client connections
+ * which are distributed between the workers. */
+void TelemetryServer::StartWorkers(const std::vector<ClientHandover> &clients)
+{
+    std::vector<std::vector<ClientHandover>> worker_clients(m_WorkerCount);
+    for (unsigned i = 0; i < clients.size(); ++i)
+        worker_clients[i % m_WorkerCount].push_back(clients[i]);
+
+    for (int i = 0; i < m_WorkerCount; ++i) {
+        m_Workers.push_back(std::unique_ptr<NetworkWorker>(
+            new NetworkWorker(m_Server, m_Frames, m_Commands, m_Sessions,
+                              worker_clients[i])));
+    }
+}
+
+/** Pass the server sockets and the rider sensors to a new server process.
+ * If this fails, the server continues running with the same clients.  Each
+ * step of the exchange is limited to the handover timeout, see
+ * HandoverListener, so a new process which stops responding only delays
+ * the ANT thread.
+ */
+void TelemetryServer::HandOver()
+{
+    std::cout << "Handing over to new server process" << std::endl;
+
+    // The workers keep serving the clients until the new process has sent
+    // its request, so a process which connects and never sends anything
+    // does not disturb them.
+    if (! m_Handover->ReadRequest()) {
+        std::cerr << "Handover failed: " << m_Handover->Error() << std::endl;
+        return;
+    }
+
+    HandoverState state;
+    state.server = m_Server;
+    for (const auto &rider : CurrentRiders()) {
+        HandoverState::RiderState r;
+        r.hrm_device_number = rider.hrm_device_number;
+        r.fec_device_number = rider.fec_device_number;
+        r.weight = rider.weight;
+        state.riders.push_back(r);
+    }
+    for (auto &w : m_Workers) {
+        auto clients = w->Stop();
+        state.clients.insert(state.clients.end(), clients.begin(), clients.end());
+    }
+    m_Workers.clear();
+
+    if (! m_Handover->Send(state)) {
+        std::cerr << "Handover failed: " << m_Handover->Error() << std::endl;
+        StartWorkers(state.clients);
+        return;
+    }
+
+    for (const auto &c : state.clients)
+        closesocket(c.socket);
+    closesocket(m_Server);
+    m_Server = INVALID_SOCKET;
+    m_HandedOver = true;
+}
+
+void TelemetryServer::WatchConfig(const std::string &file_name)
+{
+    m_ConfigWatcher = std::unique_ptr<ConfigWatcher>(new ConfigWatcher(file_name));
+}
+
+/** Re-read the configuration file after it changed.  An invalid file is
+ * reported and ignored, the server continues with the previous settings,
+ * editors often write a file in several steps, so this is expected.
+ */
+void TelemetryServer::ReloadConfig()
+{
+    try {
+        ServerConfig config = ReadServerConfig(m_ConfigWatcher->FileName());
+        std::cout << "Reloading configuration from "
+                  << m_ConfigWatcher->FileName() << std::endl;
+        ApplyConfig(config);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Configuration not reloaded, keeping the previous settings: "
+                  << e.what() << std::endl;
+    }
+}
+
+/** Apply a changed configuration to the running server.  Only settings
+ * which differ from the current ones are applied, so channels of sensors
+ * which did not change are not disturbed.  The configuration is applied
+ * completely or not at all: everything which can fail (the sensor channels
+ * of changed and new riders, the server socket for a new port) is opened
+ * first, and if that throws, the server is left unchanged.  Note that this
+ * needs a free channel on the stick for each channel being replaced, as the
+ * old channels are only closed once all new ones are open.
+ */
+void TelemetryServer::ApplyConfig(const ServerConfig &config)
+{
+    // Open everything which can fail, nothing is changed until all of it
+    // succeeded.
+
+    unsigned reconfigured = std::min(config.riders.size(), m_Riders.size());
+    std::vector<Rider::NewChannels> channels;
+    channels.reserve(reconfigured);
+    for (unsigned i = 0; i < reconfigured; ++i) {
+        const auto &r = config.riders[i];
+        channels.push_back(m_Riders[i]->OpenChannels(
+                               r.hrm_device_number, r.fec_device_number));
+    }
+
+    // Riders not created yet are replaced by the ones in the new
+    // configuration.  Without a stick, the new riders become pending ones.
+    std::vector<std::unique_ptr<Rider>> new_riders;
+    std::vector<ServerConfig::RiderConfig> pending_riders = m_PendingRiders;
+    if (! config.riders.empty())
+        pending_riders.clear();
+    for (unsigned i = reconfigured; i < config.riders.size(); ++i) {
+        const auto &r = config.riders[i];
+        if (m_AntStick) {
+            new_riders.push_back(std::unique_ptr<Rider>(
+                new Rider (m_AntStick, r.hrm_device_number, r.fec_device_number,
+                           r.weight, config.bike_weight, config.wheel_diameter)));
+        } else {
+            pending_riders.push_back(r);
+        }
+    }
+    m_Riders.reserve(m_Riders.size() + new_riders.size());
+    m_Encoders.reserve(m_Encoders.size() + new_riders.size());
+    std::vector<std::unique_ptr<TelemetryEncoder>> new_encoders;
+    for (unsigned i = 0; i < new_riders.size(); ++i)
+        new_encoders.push_back(std::unique_ptr<TelemetryEncoder>(new TelemetryEncoder()));
+
+    SOCKET server = INVALID_SOCKET;
+    std::unique_ptr<HandoverListener> handover;
+    if (config.port != m_Port) {
+        server = tcp_listen(config.port);
+        try {
+            set_non_blocking(server, true);
+            handover = std::unique_ptr<HandoverListener>(
+                new HandoverListener(config.port));
         }
-        if (status[i] & SK_READ) {
-            auto message = ReadMessage(m_Clients[i]);
-            ProcessMessage(message);
+        catch (...) {
+            closesocket(server);
+            throw;
         }
     }
 
-    // remove any closed sockets from the list
-    auto e = end(m_Clients);
-    for (auto i = begin(closed_sockets); i != end(closed_sockets); i++) {
-        std::cout << "Closing socket for " << get_peer_name(*i) << std::endl;
-        e = std::remove(begin(m_Clients), e, *i);
-        closesocket(*i);
+    // Apply the configuration, the channels and sockets are already open,
+    // so none of this fails.
+
+    m_GroupRankSize = config.group_rank_size;
+    m_MqttInterval = config.mqtt_interval;
+    if (m_Mqtt)
+        m_Mqtt->SetInterval(m_MqttInterval);
+    m_BikeWeight = config.bike_weight;
+    m_WheelDiameter = config.wheel_diameter;
+
+    for (unsigned i = 0; i < reconfigured; ++i) {
+        const auto &r = config.riders[i];
+        m_Riders[i]->Reconfigure(std::move(channels[i]),
+                                 r.hrm_device_number, r.fec_device_number,
+                                 r.weight, m_BikeWeight, m_WheelDiameter);
+    }
+    for (unsigned i = 0; i < new_riders.size(); ++i) {
+        m_Riders.push_back(std::move(new_riders[i]));
+        m_Encoders.push_back(std::move(new_encoders[i]));
+        std::cout << "Added rider " << m_Riders.size() - 1 << std::endl;
+    }
+    m_PendingRiders.swap(pending_riders);
+
+    // Clients refer to riders by index, so removing riders would change the
+    // rider each client is subscribed to.
+    if (! config.riders.empty() && config.riders.size() < m_Riders.size())
+        std::cerr << "Riders cannot be removed while the server is running" << std::endl;
+
+    if (server != INVALID_SOCKET)
+        SetPort(server, config.port, std::move(handover));
+}
+
+/** Move the server to 'port', using the already listening 'server' socket
+ * and 'handover' listener for that port.  Existing clients stay connected,
+ * only new connections use the new port. */
+void TelemetryServer::SetPort(SOCKET server, int port,
+                              std::unique_ptr<HandoverListener> handover)
+{
+    std::vector<ClientHandover> clients;
+    for (auto &w : m_Workers) {
+        auto c = w->Stop();
+        clients.insert(clients.end(), c.begin(), c.end());
     }
-    m_Clients.erase(e, end(m_Clients));
+    m_Workers.clear();
+    closesocket(m_Server);
+    m_Server = server;
+    m_Port = port;
+    m_Handover = std::move(handover);
+    StartWorkers(clients);
+    std::cout << "Moved server to port " << port << std::endl;
 }
 
-void TelemetryServer::ProcessMessage(const std::string &message)
+int TelemetryServer::AddRider(uint32_t hrm_device_number,
+                              uint32_t fec_device_number,
+                              double weight)
+{
+    if (! m_AntStick) {
+        ServerConfig::RiderConfig r;
+        r.hrm_device_number = hrm_device_number;
+        r.fec_device_number = fec_device_number;
+        r.weight = weight;
+        m_PendingRiders.push_back(r);
+        return static_cast<int>(m_Riders.size() + m_PendingRiders.size() - 1);
+    }
+
+    auto rider = std::unique_ptr<Rider>(
+        new Rider (m_AntStick, hrm_device_number, fec_device_number, weight,
+                   m_BikeWeight, m_WheelDiameter));
+    m_Riders.push_back(std::move(rider));
+    m_Encoders.push_back(std::unique_ptr<TelemetryEncoder>(new TelemetryEncoder()));
+    return static_cast<int>(m_Riders.size() - 1);
+}
+
+void TelemetryServer::EnableMqtt(const std::string &host, int port,
+                                 const std::string &topic_prefix)
+{
+    std::ostringstream client_id;
+    client_id << "TrainerControl-" << m_Port;
+    m_Mqtt = std::unique_ptr<MqttWorker>(
+        new MqttWorker (host, port, client_id.str(), topic_prefix,
+                        m_MqttInterval, m_Frames));
+}
+
+void TelemetryServer::Tick()
+{
+    if (m_Handover->Poll()) {
+        HandOver();
+        if (m_HandedOver)
+            return;
+    }
+
+    if (m_ConfigWatcher && m_ConfigWatcher->Changed())
+        ReloadConfig ();
+
+    if (m_AntStick) {
+        TickAntStick (m_AntStick);
+        // The riders continue without sensors until the stick is opened
+        // again, see AntStick::Failed().
+        if (m_AntStick->Failed())
+            DetachStick();
+    } else {
+        // TickAntStick() paces the loop when there is a stick
+        std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_TICK_INTERVAL));
+    }
+    ProcessCommands ();
+    // All riders are timestamped with the same capture time, as their data
+    // was decoded in the same Tick.
+    m_CaptureTime = CurrentMicroseconds();
+    for (unsigned i = 0; i < m_Riders.size(); ++i) {
+        Rider &rider = *m_Riders[i];
+        rider.CheckSensorHealth();
+        rider.UpdateStatistics();
+        rider.UpdateHeartRateControl();
+        rider.CollectTelemetry(m_CaptureTime);
+        rider.UpdateDeviceInfo(i);
+        rider.UpdateCurve();
+    }
+    PublishFrame ();
+}
+
+/** Encode the telemetry for all riders and publish it to the network
+ * workers.  Each message is encoded only once, regardless of how many
+ * clients it is sent to.  The frame comes from m_FramePool and the messages
+ * are written into the strings it already has, so publishing does not
+ * allocate once the pool frames have grown to the size of the messages.
+ */
+void TelemetryServer::PublishFrame()
+{
+    auto frame = m_FramePool.Acquire();
+    frame->seq = m_Frames.NextSeq();
+    frame->capture_time = m_CaptureTime;
+    frame->group_rank_size = m_GroupRankSize;
+    frame->status = CurrentStatus();
+    frame->riders.resize(m_Riders.size());
+    for (unsigned i = 0; i < m_Riders.size(); ++i) {
+        const Rider &rider = *m_Riders[i];
+        TelemetryFrame::RiderData &data = frame->riders[i];
+        data.telemetry = rider.telemetry;
+        data.telemetry.seq = frame->seq;
+        data.weight = rider.weight;
+        data.text.assign("TELEMETRY ");
+        AppendTelemetry(data.text, data.telemetry);
+        data.text.push_back('\n');
+        m_Encoders[i]->Encode(data.telemetry, data.binary);
+        data.keyframe = m_Encoders[i]->IsKeyframe();
+        data.curve = rider.curve;
+        data.device_info = rider.device_info;
+    }
+    // Sessions record the frame even when their client is disconnected, so
+    // it can be replayed when the client resumes.
+    m_Sessions.Record(*frame);
+    m_Frames.Publish(frame);
+}
+
+/** Execute the commands received by the network workers since the last
+ * Tick(). */
+void TelemetryServer::ProcessCommands()
+{
+    m_Commands.TakeAll(m_PendingCommands);
+    for (const auto &command : m_PendingCommands) {
+        if (command.rider >= static_cast<int>(m_Riders.size()))
+            continue;
+        if (command.kind == ServerCommand::FORCE_KEYFRAME)
+            m_Encoders[command.rider]->ForceKeyframe();
+        else
+            ProcessMessage(*m_Riders[command.rider], command.message);
+    }
+}
+
+void TelemetryServer::ProcessMessage(Rider &rider, const std::string &message)
 {
-    //std::cout << "Received message: <" << message << ">\n";
     std::istringstream input(message);
     std::string command;
-    double param;
-    input >> command >> param;
-    if(command == "SET-SLOPE" && m_Fec) {
-        m_Fec->SetSlope(param);
+    input >> command;
+
+    if(command == "SET-SLOPE" && rider.fec) {
+        double slope = 0;
+        input >> slope;
+        // Setting a slope takes the trainer out of target power mode, the
+        // heart rate control is stopped, but keeps its settings.
+        auto params = rider.hr_params;
+        params.target_hr = 0;
+        rider.SetHeartRateControl(params);
+        rider.fec->SetSlope(slope);
+    } else if (command == "SET-HR-TARGET") {
+        // SET-HR-TARGET <bpm> [<band> <min power> <max power>] -- adjust
+        // trainer power to hold the heart rate, a target of 0 stops this.
+        auto params = rider.hr_params;
+        input >> params.target_hr;
+        double band, min_power, max_power;
+        if (input >> band >> min_power >> max_power) {
+            params.band = band;
+            params.min_power = min_power;
+            params.max_power = max_power;
+        }
+        rider.SetHeartRateControl(params);
+    } else if (command == "SET-GEARS") {
+        // SET-GEARS [<chainring,...> <cog,...> [<reference ratio>]] --
+        // enable virtual gearing with the specified chainring and cog
+        // sizes, without arguments, virtual gearing is disabled.
+        std::string chainrings, cogs;
+        double reference_ratio = 0;
+        input >> chainrings >> cogs >> reference_ratio;
+        auto parse_list = [](const std::string &text) {
+            std::vector<int> sizes;
+            std::istringstream items(text);
+            std::string item;
+            while (std::getline(items, item, ','))
+                sizes.push_back(std::atoi(item.c_str()));
+            return sizes;
+        };
+        if (chainrings.empty()) {
+            rider.gearing.reset();
+        } else {
+            try {
+                rider.gearing.reset(new VirtualGearing(
+                    parse_list(chainrings), parse_list(cogs), reference_ratio));
+            }
+            catch (const std::exception &e) {
+                std::cerr << "SET-GEARS: " << e.what() << std::endl;
+                return;
+            }
+        }
+        if (rider.fec)
+            rider.fec->SetGearRatio(rider.gearing ? rider.gearing->RatioFactor() : 1.0);
+    } else if (command == "SHIFT" && rider.gearing) {
+        // SHIFT <rear> [<front>] -- change the virtual gear, positive values
+        // shift to harder gears.
+        int rear = 0, front = 0;
+        input >> rear >> front;
+        if (rider.gearing->Shift(rear, front) && rider.fec)
+            rider.fec->SetGearRatio(rider.gearing->RatioFactor());
+    } else if (command == "SET-HR-PID") {
+        // SET-HR-PID <kp> <ki> <kd> <max watts per second>
+        auto params = rider.hr_params;
+        input >> params.kp >> params.ki >> params.kd >> params.max_rate;
+        if (! input.fail())
+            rider.SetHeartRateControl(params);
+    } else if (command == "SET-FTP") {
+        double ftp = 0;
+        input >> ftp;
+        rider.stats.SetFtp(ftp);
+    } else if (command == "SET-MAX-HR") {
+        double max_hr = 0;
+        input >> max_hr;
+        rider.stats.SetMaxHeartRate(max_hr);
+    } else if (command == "SET-CP") {
+        // SET-CP <critical power> <W' in Joules>
+        double cp = 0, wprime = 0;
+        input >> cp >> wprime;
+        rider.stats.SetCriticalPower(cp, wprime);
+    } else if (command == "SET-SEARCH") {
+        // SET-SEARCH HRM|FEC <proximity bin> [INCLUDE|EXCLUDE <device number> ...]
+        // -- restrict the devices a searching sensor channel can pair with,
+        // a proximity bin of 0 disables proximity search.
+        std::string sensor, list_kind;
+        AntChannel::SearchConfig search;
+        input >> sensor >> search.ProximityBin >> list_kind;
+        search.Exclude = (list_kind == "EXCLUDE");
+        uint32_t device_number = 0;
+        while (input >> device_number)
+            search.DeviceList.push_back(device_number);
+        if (sensor == "HRM" || sensor == "FEC") {
+            try {
+                rider.SetSearchConfig(sensor == "HRM", search);
+            }
+            catch (const std::exception &e) {
+                std::cerr << "SET-SEARCH: " << e.what() << std::endl;
+            }
+        }
+    } else if (command == "ADD-RIDER") {
+        // ADD-RIDER <hrm device number> <fec device number> <weight>
+        uint32_t hrm_device = 0, fec_device = 0;
+        double weight = 0;
+        input >> hrm_device >> fec_device >> weight;
+        try {
+            int index = AddRider(hrm_device, fec_device, weight);
+            std::cout << "Added rider " << index << std::endl;
+        }
+        catch (const std::exception &e) {
+            std::cerr << "ADD-RIDER: " << e.what() << std::endl;
+        }
     }
 }
@@ -17,41 +17,255 @@
  */
 #pragma once
 #include <iostream>
+#include <memory>
 #include "FitnessEquipmentControl.h"
+#include "Handover.h"
+#include "HeartRateController.h"
 #include "HeartRateMonitor.h"
+#include "MqttPublisher.h"
 #include "NetTools.h"
+#include "NetworkWorker.h"
+#include "RiderStatistics.h"
+#include "ServerConfig.h"
+#include "Telemetry.h"
+#include "VirtualGearing.h"
 
-// Hold information about a "current" reading from the trainer.  We quote
-// "current" because data comes from different sources and might not be
-// completely in sync.
-struct Telemetry
+class TelemetryEncoder;
+
+/** A rider managed by the telemetry server: the sensors used by the rider
+ * and the statistics calculated from them.  Riders are identified by their
+ * index in the server's rider list.
+ */
+struct Rider
 {
-    Telemetry()
-        : hr(-1), cad(-1), spd(-1), pwr(-1) {}
-    double hr;
-    double cad;
-    double spd;
-    double pwr;
-};
+    Rider(AntStick *stick,
+          uint32_t hrm_device_number,
+          uint32_t fec_device_number,
+          double weight,
+          double bike_weight = 0,
+          double wheel_diameter = 0);
+    ~Rider();
+
+    /** Sensor channels opened for a changed rider configuration, but not
+     * used by the rider yet, see OpenChannels(). */
+    struct NewChannels {
+        std::unique_ptr<HeartRateMonitor> hrm;
+        std::unique_ptr<FitnessEquipmentControl> fec;
+    };
+
+    /** Open the sensor channels needed to switch to the HRM and FE-C
+     * devices 'hrm_device_number' and 'fec_device_number'.  A channel is
+     * only opened if a different device is requested, a device number of 0
+     * keeps the current device.  Throws if a channel cannot be opened, the
+     * rider itself is not changed. */
+    NewChannels OpenChannels(uint32_t hrm_device_number,
+                             uint32_t fec_device_number) const;
+
+    /** Apply a changed rider configuration, replacing the sensor channels
+     * with the ones in 'channels', which were opened by OpenChannels() with
+     * the same device numbers.  A weight of 0 keeps the current value.
+     * This does not throw, so a configuration can be prepared for several
+     * riders and applied to all of them. */
+    void Reconfigure(NewChannels channels,
+                     uint32_t hrm_device_number,
+                     uint32_t fec_device_number,
+                     double weight,
+                     double bike_weight,
+                     double wheel_diameter);
+
+    /** Close the sensor channels because the stick is going away.  Only
+     * the channels are closed, the statistics and all other rider settings
+     * are kept, and the paired sensors are remembered so AttachChannels()
+     * re-opens the channels to the same devices. */
+    void DetachChannels();
+    /** Open the sensor channels on 'new_stick', see DetachChannels().
+     * Throws if a channel cannot be opened. */
+    void AttachChannels(AntStick *new_stick);
+
+    /** Device number of the HRM and FE-C sensors, 0 if the channel is still
+     * searching. */
+    uint32_t HrmDeviceNumber() const;
+    uint32_t FecDeviceNumber() const;
 
-std::ostream& operator<<(std::ostream &out, const Telemetry &t);
+    /** Restrict the devices the HRM ('for_hrm' is true) or the FE-C channel
+     * can pair with, see AntChannel::SearchConfig. */
+    void SetSearchConfig(bool for_hrm, const AntChannel::SearchConfig &search);
+
+    /** Hold the rider's heart rate at 'params.target_hr' by adjusting the
+     * trainer power, see HeartRateController.  A target of 0 stops the
+     * control, leaving the trainer at the last target power. */
+    void SetHeartRateControl(const HeartRateController::Params &params);
+
+    void CheckSensorHealth();
+    void UpdateStatistics();
+    void UpdateHeartRateControl();
+    void CollectTelemetry(uint64_t capture_time);
+    void UpdateDeviceInfo(int index);
+    void UpdateCurve();
+
+    AntStick *stick;
+    /** Rider weight in kg, used for the trainer user configuration and W/kg
+     * calculations. */
+    double weight;
+    /** Bike weight (kg) and wheel diameter (meters) for the trainer user
+     * configuration, 0 means use the trainer defaults. */
+    double bike_weight;
+    double wheel_diameter;
+    HeartRateMonitor *hrm;
+    FitnessEquipmentControl *fec;
+    /** Sensors to pair with when the channels are opened by
+     * AttachChannels(), only used while the rider has no stick. */
+    uint32_t hrm_device;
+    uint32_t fec_device;
+    /** Search restrictions used when the channels search for a device */
+    AntChannel::SearchConfig hrm_search;
+    AntChannel::SearchConfig fec_search;
+    RiderStatistics stats;
+    /** Timestamps of the last sensor readings passed on to 'stats', used to
+     * determine when new readings have been received. */
+    uint32_t last_hr_timestamp;
+    uint32_t last_power_timestamp;
+    /** Telemetry collected in the current Tick() */
+    Telemetry telemetry;
+    /** DEVICE-INFO messages for the sensors, rebuilt when the device info
+     * of a sensor changes, see AntChannel::DeviceInfoUpdates() */
+    std::string device_info;
+    int hrm_info_updates;
+    int fec_info_updates;
+    AntChannel::BatteryStatus hrm_battery;
+    AntChannel::BatteryStatus fec_battery;
+    /** CURVE message for the power curve in 'stats', rebuilt when the curve
+     * changes, see PowerCurve::Updates() */
+    std::string curve;
+    int curve_updates;
+    /** Heart rate control, if enabled.  The controller is updated once for
+     * each heart beat received from the HRM. */
+    HeartRateController::Params hr_params;
+    std::unique_ptr<HeartRateController> hr_control;
+    int last_beat_count;
+    uint32_t last_beat_timestamp;
+    /** Target power last sent to the trainer, -1 if none was sent */
+    double last_target_power;
+    /** Virtual gears, if enabled, see FitnessEquipmentControl::SetGearRatio() */
+    std::unique_ptr<VirtualGearing> gearing;
+
+private:
+    void CreateHrm(uint32_t device_number)
+    {
+        CreateHrm(device_number, hrm_search);
+    }
+    void CreateHrm(uint32_t device_number, const AntChannel::SearchConfig &search);
+    void CreateFec(uint32_t device_number)
+    {
+        CreateFec(device_number, fec_search);
+    }
+    void CreateFec(uint32_t device_number, const AntChannel::SearchConfig &search);
+    void UseHrm(std::unique_ptr<HeartRateMonitor> channel,
+                const AntChannel::SearchConfig &search);
+    void UseFec(std::unique_ptr<FitnessEquipmentControl> channel,
+                const AntChannel::SearchConfig &search);
+    void ApplyUserParams();
+};
 
 class TelemetryServer {
 public:
-    TelemetryServer (AntStick *stick, int port = 7500);
+    /** Start a server using the settings in 'config', with 'workers'
+     * network worker threads serving the clients.  If 'handover' is not
+     * null, the server continues from the state passed on by a previous
+     * server process, see TakeOver().  The server accepts clients right
+     * away, riders are only created once an ANT stick is attached with
+     * AttachStick(). */
+    TelemetryServer (const ServerConfig &config = ServerConfig(),
+                     int workers = 1,
+                     const HandoverState *handover = nullptr);
     ~TelemetryServer();
 
+    /** Open the sensor channels of the riders on 'stick'.  Throws if the
+     * sensor channels cannot be opened, in which case the stick is not
+     * used. */
+    void AttachStick(AntStick *stick);
+    /** Close the sensor channels of the riders, this must be called before
+     * the stick is destroyed.  The riders are kept, with their statistics
+     * and settings, and continue on the same sensors with the next
+     * AttachStick(). */
+    void DetachStick();
+
+    /** Add a new rider using the HRM and FE-C trainer with the specified
+     * device numbers (0 means search for any device).  Returns the rider
+     * index.  Without an ANT stick, the rider is created when a stick is
+     * attached. */
+    int AddRider(uint32_t hrm_device_number,
+                 uint32_t fec_device_number,
+                 double weight);
+
+    /** Publish rider telemetry to the MQTT broker at 'host' and 'port', on
+     * the topics "<prefix>/<rider index>/telemetry". */
+    void EnableMqtt(const std::string &host, int port,
+                    const std::string &topic_prefix = "trainer");
+
+    /** Re-read the configuration from 'file_name' whenever it changes and
+     * apply the changes without restarting the server. */
+    void WatchConfig(const std::string &file_name);
+
     void Tick();
+
+    /** True if the server was handed over to a new process, in which case
+     * this process should exit. */
+    bool HandedOver() const { return m_HandedOver; }
     
 private:
 
-    void CheckSensorHealth();
-    void CollectTelemetry (Telemetry &out);
-    void ProcessClients (const Telemetry &t);
-    void ProcessMessage(const std::string &message);
-    
-    std::vector<SOCKET> m_Clients;
+    std::vector<ServerConfig::RiderConfig> CurrentRiders () const;
+    ServerStatus CurrentStatus () const;
+    void StartWorkers (const std::vector<ClientHandover> &clients);
+    void HandOver ();
+    void ReloadConfig ();
+    void ApplyConfig (const ServerConfig &config);
+    void SetPort (SOCKET server, int port,
+                  std::unique_ptr<HandoverListener> handover);
+    void PublishFrame ();
+    void ProcessCommands ();
+    void ProcessMessage(Rider &rider, const std::string &message);
+
+    SOCKET m_Server;
+    int m_Port;
     AntStick *m_AntStick;
-    HeartRateMonitor *m_Hrm;
-    FitnessEquipmentControl *m_Fec;
+    std::vector<std::unique_ptr<Rider>> m_Riders;
+    /** Riders to create when a stick is attached, these come after the
+     * riders in m_Riders. */
+    std::vector<ServerConfig::RiderConfig> m_PendingRiders;
+    /** Binary telemetry encoders, one for each rider, shared by all binary
+     * clients for that rider. */
+    std::vector<std::unique_ptr<TelemetryEncoder>> m_Encoders;
+    /** Time when the current telemetry was collected, microseconds */
+    uint64_t m_CaptureTime;
+
+    /** Number of riders included in the RANK field of group frames. */
+    int m_GroupRankSize;
+
+    /** Used for new riders, see Rider::bike_weight */
+    double m_BikeWeight;
+    double m_WheelDiameter;
+
+    std::unique_ptr<ConfigWatcher> m_ConfigWatcher;
+
+    FrameRing m_Frames;
+    CommandQueue m_Commands;
+    /** Commands taken from m_Commands, kept to reuse its storage */
+    std::vector<ServerCommand> m_PendingCommands;
+    SessionTable m_Sessions;
+    int m_WorkerCount;
+    std::vector<std::unique_ptr<NetworkWorker>> m_Workers;
+    /** Frames published to m_Frames, declared after m_WorkerCount, which
+     * determines its size. */
+    FramePool m_FramePool;
+
+    std::unique_ptr<HandoverListener> m_Handover;
+    bool m_HandedOver;
+
+    /** Publishes the frames in m_Frames to the MQTT broker, declared after
+     * m_Frames, so it is stopped before the frames are destroyed. */
+    std::unique_ptr<MqttWorker> m_Mqtt;
+    /** Interval (milliseconds) at which telemetry is published */
+    int m_MqttInterval;
 };
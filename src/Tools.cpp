@@ -23,6 +23,8 @@
 #include <libusb-1.0/libusb.h>
 #pragma warning (pop)
 
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <iomanip>
 #include <locale>
@@ -171,11 +173,41 @@ void DumpData (const unsigned char *data, int size, std::ostream &o)
     o.flags (saved);
 }
 
+namespace {
+
+std::atomic<bool> g_VirtualClock(false);
+std::atomic<uint64_t> g_VirtualMicroseconds(0);
+
+};                                      // end anonymous namespace
+
 uint32_t CurrentMilliseconds()
 {
+    if (g_VirtualClock)
+        return static_cast<uint32_t>(g_VirtualMicroseconds / 1000);
     return timeGetTime();
 }
 
+uint64_t CurrentMicroseconds()
+{
+    if (g_VirtualClock)
+        return g_VirtualMicroseconds;
+    using namespace std::chrono;
+    // NOTE: steady_clock is implemented using QueryPerformanceCounter() on
+    // Windows, so it has sub-microsecond resolution.
+    auto now = steady_clock::now().time_since_epoch();
+    return duration_cast<microseconds>(now).count();
+}
+
+void EnableVirtualClock()
+{
+    g_VirtualClock = true;
+}
+
+void AdvanceVirtualClock(uint32_t milliseconds)
+{
+    g_VirtualMicroseconds += static_cast<uint64_t>(milliseconds) * 1000;
+}
+
 #if 0
 void PutTimestamp(std::ostream &o)
 {
@@ -90,6 +90,24 @@ void DumpData (const unsigned char *data, int size, std::ostream &o);
  */
 uint32_t CurrentMilliseconds();
 
+/** Return a monotonic timestamp in microseconds from an unspecified epoch.
+ * Unlike CurrentMilliseconds(), this has a high resolution and does not wrap
+ * around, so it can be used to timestamp data sent to clients and to
+ * measure network round trip times.
+ */
+uint64_t CurrentMicroseconds();
+
+/** Make CurrentMilliseconds() and CurrentMicroseconds() return a virtual
+ * time, which starts at 0 and only moves when AdvanceVirtualClock() is
+ * called.  Used to run simulations faster than real time and to make them
+ * repeatable, see AntSimulator.h.  There is no way to go back to the real
+ * clock.
+ */
+void EnableVirtualClock();
+
+/** Advance the virtual clock by 'milliseconds'. */
+void AdvanceVirtualClock(uint32_t milliseconds);
+
 #if 0
 /** Put the current time on the output stream o. */
 void PutTimestamp(std::ostream &o);
@@ -0,0 +1,141 @@
+/**
+ *  TrainingLoad -- W' balance and time in zone accumulators
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "TrainingLoad.h"
+#include <algorithm>
+
+/** IMPLEMENTATION NOTE
+ *
+ * The W' balance uses the differential form of the Skiba model, as
+ * described in "Intramuscular determinants of the ability to recover work
+ * capacity above critical power", Skiba et al, 2015:
+ *
+ *     P >= CP:  dW'bal/dt = -(P - CP)
+ *     P <  CP:  dW'bal/dt = (W' - W'bal) * (CP - P) / W'
+ *
+ * Each power value is applied for the time until the next sample arrives,
+ * but for no longer than MAX_HOLD, so sensor dropouts are not counted as
+ * either effort or recovery.  The same rule applies to time in zone.
+ */
+
+namespace {
+
+enum {
+    MAX_HOLD = 2000
+};
+
+};                                      // end anonymous namespace
+
+
+// ...................................................... WPrimeBalance ....
+
+WPrimeBalance::WPrimeBalance()
+    : m_Cp(0),
+      m_WPrime(0),
+      m_Balance(0)
+{
+    Reset();
+}
+
+void WPrimeBalance::SetParameters(double cp, double wprime)
+{
+    m_Cp = cp;
+    m_WPrime = wprime;
+    Reset();
+}
+
+void WPrimeBalance::AddPower(uint32_t timestamp, double power)
+{
+    if (m_HaveLast && m_Cp > 0 && m_WPrime > 0) {
+        uint32_t elapsed = std::min(timestamp - m_LastTimestamp,
+                                    static_cast<uint32_t>(MAX_HOLD));
+        double dt = elapsed / 1000.0;
+        if (m_LastPower >= m_Cp) {
+            m_Balance -= (m_LastPower - m_Cp) * dt;
+        } else {
+            m_Balance += (m_WPrime - m_Balance) * (m_Cp - m_LastPower) * dt / m_WPrime;
+        }
+    }
+
+    m_HaveLast = true;
+    m_LastTimestamp = timestamp;
+    m_LastPower = power;
+}
+
+double WPrimeBalance::Balance() const
+{
+    if (m_Cp <= 0 || m_WPrime <= 0)
+        return -1;
+    // W' balance can go negative if CP or W' are underestimated, but we use
+    // -1 to mean "not available", so report 0 instead.
+    return std::max(m_Balance, 0.0);
+}
+
+void WPrimeBalance::Reset()
+{
+    m_Balance = m_WPrime;
+    m_HaveLast = false;
+    m_LastTimestamp = 0;
+    m_LastPower = 0;
+}
+
+
+// .................................................... ZoneAccumulator ....
+
+ZoneAccumulator::ZoneAccumulator()
+    : m_ZoneCount(0)
+{
+    std::fill(&m_UpperBounds[0], &m_UpperBounds[MAX_ZONES - 1], 0.0);
+    Reset();
+}
+
+void ZoneAccumulator::SetZones(const double *upper_bounds, int count)
+{
+    count = std::min(count, static_cast<int>(MAX_ZONES) - 1);
+    std::copy(upper_bounds, upper_bounds + count, &m_UpperBounds[0]);
+    m_ZoneCount = count + 1;
+}
+
+void ZoneAccumulator::Add(uint32_t timestamp, double value)
+{
+    if (m_HaveLast && m_ZoneCount > 0) {
+        uint32_t elapsed = std::min(timestamp - m_LastTimestamp,
+                                    static_cast<uint32_t>(MAX_HOLD));
+        m_Time[FindZone(m_LastValue)] += elapsed;
+    }
+
+    m_HaveLast = true;
+    m_LastTimestamp = timestamp;
+    m_LastValue = value;
+}
+
+void ZoneAccumulator::Reset()
+{
+    std::fill(&m_Time[0], &m_Time[MAX_ZONES], 0);
+    m_HaveLast = false;
+    m_LastTimestamp = 0;
+    m_LastValue = 0;
+}
+
+int ZoneAccumulator::FindZone(double value) const
+{
+    int zone = 0;
+    while (zone < m_ZoneCount - 1 && value >= m_UpperBounds[zone])
+        zone++;
+    return zone;
+}
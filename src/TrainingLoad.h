@@ -0,0 +1,105 @@
+/**
+ *  TrainingLoad -- W' balance and time in zone accumulators
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <stdint.h>
+
+// ...................................................... WPrimeBalance ....
+
+/** Track the W' balance (the remaining anaerobic work capacity) of a rider
+ * using the differential model: when power is above Critical Power, W' is
+ * depleted by the work done above CP, when it is below CP, W' recovers at a
+ * rate proportional to both the amount W' is depleted and the difference
+ * between CP and the current power.
+ */
+class WPrimeBalance
+{
+public:
+    WPrimeBalance();
+
+    /** Set the Critical Power (Watts) and W' (Joules) for the rider.  This
+     * resets the balance to a full W'. */
+    void SetParameters(double cp, double wprime);
+
+    /** Record a new power reading received at 'timestamp' (milliseconds) */
+    void AddPower(uint32_t timestamp, double power);
+
+    /** Return the current W' balance in Joules, or -1 if CP and W' have not
+     * been set. */
+    double Balance() const;
+
+    void Reset();
+
+private:
+    double m_Cp;
+    double m_WPrime;
+    double m_Balance;
+
+    bool m_HaveLast;
+    uint32_t m_LastTimestamp;
+    double m_LastPower;
+};
+
+
+// .................................................... ZoneAccumulator ....
+
+/** Accumulate the time spent in each zone for a value, such as power or
+ * heart rate.  Zones are defined by their upper boundaries and the last zone
+ * is open ended.  Uses a fixed amount of memory.
+ */
+class ZoneAccumulator
+{
+public:
+    enum { MAX_ZONES = 8 };
+
+    ZoneAccumulator();
+
+    /** Define the zones: there will be 'count' + 1 zones, 'upper_bounds' has
+     * the upper limit for each zone except the last one, in increasing
+     * order.  Accumulated times are kept when zones are redefined. */
+    void SetZones(const double *upper_bounds, int count);
+
+    /** Record a new value received at 'timestamp' (milliseconds) */
+    void Add(uint32_t timestamp, double value);
+
+    /** Number of zones, 0 if zones have not been defined */
+    int ZoneCount() const { return m_ZoneCount; }
+
+    /** Time spent in 'zone', in seconds */
+    double TimeInZone(int zone) const { return m_Time[zone] / 1000.0; }
+
+    void Reset();
+
+private:
+    int FindZone(double value) const;
+
+    int m_ZoneCount;
+    double m_UpperBounds[MAX_ZONES - 1];
+    /** Time (milliseconds) spent in each zone */
+    uint64_t m_Time[MAX_ZONES];
+
+    bool m_HaveLast;
+    uint32_t m_LastTimestamp;
+    double m_LastValue;
+};
+
+/*
+  Local Variables:
+  mode: c++
+  End:
+*/
@@ -0,0 +1,75 @@
+/**
+ *  VirtualGearing -- virtual shifting for fixed gear smart trainers
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "VirtualGearing.h"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <stdexcept>
+
+VirtualGearing::VirtualGearing(const std::vector<int> &chainrings,
+                               const std::vector<int> &cogs,
+                               double reference_ratio)
+    : m_Chainrings(chainrings),
+      m_Cogs(cogs),
+      m_ReferenceRatio(reference_ratio),
+      m_Front(0),
+      m_Rear(0)
+{
+    auto is_bad = [](int teeth) { return teeth <= 0; };
+    if (m_Chainrings.empty() || m_Cogs.empty()
+        || std::any_of(m_Chainrings.begin(), m_Chainrings.end(), is_bad)
+        || std::any_of(m_Cogs.begin(), m_Cogs.end(), is_bad))
+        throw std::invalid_argument("VirtualGearing: bad chainring or cog sizes");
+
+    std::sort(m_Chainrings.begin(), m_Chainrings.end());
+    std::sort(m_Cogs.begin(), m_Cogs.end(), std::greater<int>());
+
+    if (m_ReferenceRatio <= 0) {
+        m_ReferenceRatio = static_cast<double>(m_Chainrings.back())
+            / m_Cogs[m_Cogs.size() / 2];
+    }
+
+    // Start in the gear closest to the reference gear, so enabling virtual
+    // gearing does not change the resistance much.
+    double best = -1;
+    for (int f = 0; f < static_cast<int>(m_Chainrings.size()); ++f) {
+        for (int r = 0; r < static_cast<int>(m_Cogs.size()); ++r) {
+            double diff = std::abs(
+                static_cast<double>(m_Chainrings[f]) / m_Cogs[r] - m_ReferenceRatio);
+            if (best < 0 || diff < best) {
+                best = diff;
+                m_Front = f;
+                m_Rear = r;
+            }
+        }
+    }
+}
+
+bool VirtualGearing::Shift(int rear, int front)
+{
+    int old_front = m_Front, old_rear = m_Rear;
+    m_Rear = std::max(0, std::min(static_cast<int>(m_Cogs.size()) - 1, m_Rear + rear));
+    m_Front = std::max(0, std::min(static_cast<int>(m_Chainrings.size()) - 1, m_Front + front));
+    return m_Front != old_front || m_Rear != old_rear;
+}
+
+double VirtualGearing::RatioFactor() const
+{
+    return static_cast<double>(Chainring()) / Cog() / m_ReferenceRatio;
+}
@@ -0,0 +1,71 @@
+/**
+ *  VirtualGearing -- virtual shifting for fixed gear smart trainers
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <string>
+#include <vector>
+
+/** A set of virtual chainrings and cogs, and the gear currently selected.
+ *
+ * The bike on the trainer stays in one gear, the "reference" gear.  When
+ * the rider selects a virtual gear with a ratio R times the reference
+ * ratio, the same cadence corresponds to R times the speed, so the trainer
+ * resistance is scaled to match, see
+ * FitnessEquipmentControl::SetGearRatio().
+ */
+class VirtualGearing
+{
+public:
+    /** Create a gearing with the chainring and cog sizes (number of teeth)
+     * in 'chainrings' and 'cogs', in any order.  'reference_ratio' is the
+     * ratio of the gear the bike on the trainer is actually in, 0 means use
+     * the largest chainring and the middle cog.  The starting gear is the
+     * one closest to the reference ratio.  Throws std::invalid_argument if
+     * either list is empty or contains non-positive sizes.
+     */
+    VirtualGearing(const std::vector<int> &chainrings,
+                   const std::vector<int> &cogs,
+                   double reference_ratio = 0);
+
+    /** Shift 'rear' cogs (positive values select smaller cogs, a harder
+     * gear) and 'front' chainrings (positive values select larger rings).
+     * Shifting past the end of the cassette or chainrings stays in the
+     * last gear.  Returns true if the gear changed. */
+    bool Shift(int rear, int front = 0);
+
+    int Chainring() const { return m_Chainrings[m_Front]; }
+    int Cog() const { return m_Cogs[m_Rear]; }
+
+    /** Ratio of the current virtual gear divided by the reference ratio,
+     * 1.0 when the virtual gear matches the real one. */
+    double RatioFactor() const;
+
+private:
+    /** Sorted, smallest first */
+    std::vector<int> m_Chainrings;
+    /** Sorted, largest first, so larger indexes are harder gears */
+    std::vector<int> m_Cogs;
+    double m_ReferenceRatio;
+    int m_Front;
+    int m_Rear;
+};
+
+/*
+  Local Variables:
+  mode: c++
+  End:
+*/
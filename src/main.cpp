@@ -16,67 +16,356 @@
  * with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "stdafx.h"
+#include "AntSimulator.h"
 #include "AntStick.h"
+#include "AntTrace.h"
+#include "Handover.h"
 #include "NetTools.h"
+#include "ReplayCheck.h"
+#include "ServerConfig.h"
 #include "TelemetryServer.h"
 #include "Tools.h"
 #include <algorithm>
+#include <chrono>
 #include <ctime>
+#include <fstream>
+#include <future>
 #include <iomanip>
 #include <iostream>
 #include <iostream>
+#include <memory>
+#include <sstream>
+#include <thread>
 
-void ProcessChannels(AntStick &s, std::ostream &log)
-{
-    try {
-        TelemetryServer server (&s);
-        while (true) {
-            server.Tick();
-        }
+enum {
+    // Time (seconds) to wait before looking for an ANT stick again, when
+    // none was found.
+    STICK_RETRY_DELAY = 5,
+    // Time (milliseconds) it takes to open a simulated ANT stick again
+    // after it failed, about the time it takes for a real one.
+    SIMULATED_STICK_REOPEN_DELAY = 2000,
+    // Weight (kg) of the simulated or replayed riders
+    SIMULATED_RIDER_WEIGHT = 75,
+    // Default for -max-slowdown, percent
+    DEFAULT_MAX_SLOWDOWN = 25,
+    // Number of mismatched samples printed by a trace replay
+    MAX_REPORTED_MISMATCHES = 10
+};
+
+/** Options specified on the command line */
+struct Options {
+    Options()
+        : mqtt_port(1883), workers(DefaultWorkerCount()), takeover(false),
+          update_golden(false), max_slowdown(DEFAULT_MAX_SLOWDOWN) {}
+    std::string mqtt_host;              // empty means MQTT is disabled
+    int mqtt_port;
+    int workers;                        // number of network worker threads
+    bool takeover;                      // take over from a running server
+    std::string config_file;            // empty means use the defaults
+    std::string scenario_file;          // run a simulation, see AntSimulator.h
+    std::string record_file;            // record ANT messages, see AntTrace.h
+    std::string replay_file;            // replay an ANT trace, see RunReplay()
+    std::string golden_file;            // expected replay output
+    bool update_golden;                 // write golden_file instead of checking it
+    int max_slowdown;                   // percent
+
+    static int DefaultWorkerCount()
+    {
+        // Leave one core for the ANT thread.
+        int cores = static_cast<int>(std::thread::hardware_concurrency());
+        return std::max(cores - 1, 1);
     }
-    catch (std::exception &e) {
-        log << e.what() << std::endl;
+};
+
+/** Read the server configuration file, if one was specified. */
+ServerConfig LoadConfig(const Options &options)
+{
+    if (options.config_file.empty())
+        return ServerConfig();
+    return ReadServerConfig(options.config_file);
+}
+
+void PutTimestamp(std::ostream &log)
+{
+    auto t = std::time(nullptr);
+    auto tm = *std::localtime(&t);
+    log << std::put_time(&tm, "%c");
+}
+
+/** Open the ANT stick and set it up for ANT+ channels.  This resets the
+ * stick and takes a few seconds, so it runs on a separate thread while the
+ * server keeps serving clients.  If 'trace' is not null, the messages
+ * received from the stick are recorded to it. */
+std::unique_ptr<AntStick> OpenAntStick(std::ostream *trace)
+{
+    auto transport = OpenUsbTransport();
+    if (trace)
+        transport = std::unique_ptr<AntTransport>(
+            new TraceRecorder(std::move(transport), *trace));
+    std::unique_ptr<AntStick> stick(new AntStick(std::move(transport)));
+    stick->SetNetworkKey(AntStick::g_AntPlusNetworkKey);
+    return stick;
+}
+
+/** Tick 'server' until 'f' is ready.  Returns false if the server was handed
+ * over to a new process in the meantime. */
+template <typename T>
+bool TickUntilReady(TelemetryServer &server, std::future<T> &f)
+{
+    while (f.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        server.Tick();
+        if (server.HandedOver())
+            return false;
     }
+    return true;
 }
 
-void ProcessAntSticks(std::ostream &log)
+/** Run the telemetry server until it is handed over to a new process.  The
+ * server accepts clients right away, while the ANT stick is opened in the
+ * background, and it keeps running if the stick fails, while the stick is
+ * opened again.
+ */
+void RunServer(const Options &options, const HandoverState *handover, std::ostream &log)
 {
-    while (true) {
+    TelemetryServer server (LoadConfig(options), options.workers, handover);
+    if (! options.mqtt_host.empty())
+        server.EnableMqtt(options.mqtt_host, options.mqtt_port);
+    if (! options.config_file.empty())
+        server.WatchConfig(options.config_file);
+
+    std::ofstream trace;
+    if (! options.record_file.empty()) {
+        trace.open(options.record_file, std::ios::app);
+        if (! trace)
+            throw std::runtime_error("cannot open trace: " + options.record_file);
+        trace << "# ANT trace, recorded by TrainerControl\n";
+    }
+
+    bool stick_missing = false;
+    while (! server.HandedOver()) {
+        auto init = std::async(std::launch::async, OpenAntStick,
+                               trace.is_open() ? &trace : nullptr);
+        if (! TickUntilReady(server, init))
+            break;
+
+        std::unique_ptr<AntStick> stick;
         try {
-            AntStick a;
-            auto t = std::time(nullptr);
-            auto tm = *std::localtime(&t);
-            log << std::put_time(&tm, "%c");
-            log << " USB Stick: Serial#: " << a.GetSerialNumber()
-                << ", version " << a.GetVersion()
-                << ", max " << a.GetMaxNetworks() << " networks, max "
-                << a.GetMaxChannels() << " channels\n" << std::flush;
-            a.SetNetworkKey(AntStick::g_AntPlusNetworkKey);
-            ProcessChannels(a, log);
+            stick = init.get();
+            stick_missing = false;
+            PutTimestamp(log);
+            log << " USB Stick: Serial#: " << stick->GetSerialNumber()
+                << ", version " << stick->GetVersion()
+                << ", max " << stick->GetMaxNetworks() << " networks, max "
+                << stick->GetMaxChannels() << " channels\n" << std::flush;
         }
         catch (const AntStickNotFound &e) {
-            auto t = std::time(nullptr);
-            auto tm = *std::localtime(&t);
-            log << std::put_time(&tm, "%c");
-            log << e.what() << std::endl;
-            return;
+            // Only report this once, we keep looking for a stick.
+            if (! stick_missing) {
+                PutTimestamp(log);
+                log << " " << e.what() << std::endl;
+                stick_missing = true;
+            }
+            auto delay = std::async(std::launch::async, [] () {
+                    std::this_thread::sleep_for(std::chrono::seconds(STICK_RETRY_DELAY));
+                });
+            TickUntilReady(server, delay);
+            continue;
+        }
+        catch (const std::exception &e) {
+            PutTimestamp(log);
+            log << " " << e.what() << std::endl;
+            continue;
         }
-        catch (std::exception &e) {
-            auto t = std::time(nullptr);
-            auto tm = *std::localtime(&t);
-            log << std::put_time(&tm, "%c");
-            log << e.what() << std::endl;
+
+        try {
+            server.AttachStick(stick.get());
+            while (! server.HandedOver() && ! stick->Failed()) {
+                server.Tick();
+            }
+        }
+        catch (const std::exception &e) {
+            PutTimestamp(log);
+            log << " " << e.what() << std::endl;
+        }
+        if (stick->Failed()) {
+            PutTimestamp(log);
+            log << " USB Stick: " << stick->FailureMessage() << std::endl;
         }
+        if (stick->GetDroppedMessages() > 0) {
+            PutTimestamp(log);
+            log << " USB Stick: dropped " << stick->GetDroppedMessages()
+                << " bad messages" << std::endl;
+        }
+        server.DetachStick();
     }
 }
 
-int main()
+/** Run the fault injection scenario in 'options.scenario_file' against a
+ * simulated ANT stick and write a report to 'log'.  A single rider with an
+ * HRM and a trainer is simulated, and the stick and sensor channels are
+ * recovered the same way as in RunServer().
+ */
+void RunSimulation(const Options &options, std::ostream &log)
+{
+    std::ifstream input(options.scenario_file);
+    if (! input)
+        throw std::runtime_error("cannot open scenario: " + options.scenario_file);
+    EnableVirtualClock();
+    AntSimulation simulation(input);
+
+    while (! simulation.Finished()) {
+        std::unique_ptr<AntStick> stick;
+        try {
+            stick = std::unique_ptr<AntStick>(
+                new AntStick(simulation.CreateTransport()));
+            stick->SetNetworkKey(AntStick::g_AntPlusNetworkKey);
+        }
+        catch (const std::exception &e) {
+            log << simulation.Now() << " ms: " << e.what() << std::endl;
+            simulation.Advance(SIMULATED_STICK_REOPEN_DELAY);
+            continue;
+        }
+
+        try {
+            Rider rider(stick.get(), 0, 0, SIMULATED_RIDER_WEIGHT);
+            while (! simulation.Finished() && ! stick->Failed()) {
+                auto hr_timestamp = rider.last_hr_timestamp;
+                auto power_timestamp = rider.last_power_timestamp;
+                TickAntStick(stick.get());
+                rider.CheckSensorHealth();
+                rider.UpdateStatistics();
+                if (rider.last_hr_timestamp != hr_timestamp)
+                    simulation.DataReceived(AntSimulation::HRM);
+                if (rider.last_power_timestamp != power_timestamp)
+                    simulation.DataReceived(AntSimulation::FEC);
+            }
+        }
+        catch (const std::exception &e) {
+            log << simulation.Now() << " ms: " << e.what() << std::endl;
+        }
+        if (stick->Failed())
+            log << simulation.Now() << " ms: " << stick->FailureMessage() << std::endl;
+    }
+
+    simulation.WriteReport(log);
+}
+
+/** Replay the ANT trace in 'options.replay_file', see ReplayTrace(), and
+ * compare the telemetry with the samples in 'options.golden_file'.
+ *
+ * The golden file also holds the decode time per message of the run which
+ * wrote it.  Returns the exit code for the process: 1 if the samples differ
+ * or the decode time increased by more than 'options.max_slowdown' percent,
+ * 0 otherwise.  With 'options.update_golden', the golden file is written
+ * instead.
+ */
+int RunReplay(const Options &options, std::ostream &log)
+{
+    std::ifstream input(options.replay_file);
+    if (! input)
+        throw std::runtime_error("cannot open trace: " + options.replay_file);
+    ReplaySamples actual = ReplayTrace(input, SIMULATED_RIDER_WEIGHT);
+
+    if (options.golden_file.empty() || options.update_golden) {
+        std::ofstream golden;
+        if (! options.golden_file.empty()) {
+            golden.open(options.golden_file);
+            if (! golden)
+                throw std::runtime_error("cannot write: " + options.golden_file);
+        }
+        WriteGolden(golden.is_open() ? golden : log, actual);
+        log << actual.messages << " messages, " << actual.samples.size()
+            << " samples, " << actual.ns_per_message << " ns/message" << std::endl;
+        return 0;
+    }
+
+    std::ifstream golden_input(options.golden_file);
+    if (! golden_input)
+        throw std::runtime_error("cannot open: " + options.golden_file);
+    ReplaySamples golden = ReadGolden(golden_input);
+    int mismatches = CompareSamples(golden, actual, log, MAX_REPORTED_MISMATCHES);
+
+    bool too_slow = golden.ns_per_message > 0
+        && actual.ns_per_message > golden.ns_per_message * (100 + options.max_slowdown) / 100;
+    log << actual.messages << " messages, " << actual.samples.size()
+        << " samples, " << mismatches << " mismatched, "
+        << actual.ns_per_message << " ns/message (golden " << golden.ns_per_message
+        << ")" << (too_slow ? ", too slow" : "") << std::endl;
+    return (mismatches == 0 && ! too_slow) ? 0 : 1;
+}
+
+/** Parse the command line arguments into 'options'.  The supported
+ * arguments are:
+ *
+ *    -config FILE -- read settings from FILE, see ReadServerConfig()
+ *    -mqtt HOST[:PORT] -- publish telemetry to an MQTT broker
+ *    -threads N -- number of network worker threads
+ *    -takeover -- take over clients and sensors from a running server
+ *    -simulate FILE -- run the scenario in FILE on a simulated ANT stick
+ *    -record FILE -- append the messages received from the ANT stick to FILE
+ *    -replay FILE -- replay an ANT trace, see RunReplay(), with:
+ *        -golden FILE -- expected samples, printed if not specified
+ *        -update-golden -- write the golden file instead of checking it
+ *        -max-slowdown PERCENT -- allowed decode time increase
+ */
+void ParseCommandLine(int argc, char **argv, Options &options)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-mqtt" && i + 1 < argc) {
+            std::string address = argv[++i];
+            auto colon = address.rfind(':');
+            if (colon != std::string::npos) {
+                options.mqtt_host = address.substr(0, colon);
+                options.mqtt_port = std::stoi(address.substr(colon + 1));
+            } else {
+                options.mqtt_host = address;
+            }
+        } else if (arg == "-config" && i + 1 < argc) {
+            options.config_file = argv[++i];
+        } else if (arg == "-simulate" && i + 1 < argc) {
+            options.scenario_file = argv[++i];
+        } else if (arg == "-record" && i + 1 < argc) {
+            options.record_file = argv[++i];
+        } else if (arg == "-replay" && i + 1 < argc) {
+            options.replay_file = argv[++i];
+        } else if (arg == "-golden" && i + 1 < argc) {
+            options.golden_file = argv[++i];
+        } else if (arg == "-update-golden") {
+            options.update_golden = true;
+        } else if (arg == "-max-slowdown" && i + 1 < argc) {
+            options.max_slowdown = std::max(std::stoi(argv[++i]), 0);
+        } else if (arg == "-takeover") {
+            options.takeover = true;
+        } else if (arg == "-threads" && i + 1 < argc) {
+            options.workers = std::max(std::stoi(argv[++i]), 1);
+        } else {
+            throw std::runtime_error("unknown command line argument: " + arg);
+        }
+    }
+}
+
+int main(int argc, char **argv)
 {
     try {
+        Options options;
+        ParseCommandLine(argc, argv, options);
+        if (! options.replay_file.empty())
+            return RunReplay(options, std::cout);
+        if (! options.scenario_file.empty()) {
+            RunSimulation(options, std::cout);
+            return 0;
+        }
         int r = libusb_init(NULL);
         if (r < 0)
             throw LibusbError("libusb_init", r);
-        ProcessAntSticks(std::cout);
+        // Take over before opening the ANT stick, as it is released by the
+        // old server only after the handover.
+        std::unique_ptr<HandoverState> handover;
+        if (options.takeover)
+            handover = std::unique_ptr<HandoverState>(
+                new HandoverState(TakeOver(LoadConfig(options).port)));
+        RunServer(options, handover.get(), std::cout);
     }
     catch (const std::exception &e) {
         std::cout << e.what() << "\n";
@@ -7,6 +7,7 @@
 #define _CRT_SECURE_NO_WARNINGS
 #define _WINSOCK_DEPRECATED_NO_WARNINGS
 #define _WINSOCKAPI_    // stops windows.h including winsock.h
+#define NOMINMAX        // stops windows.h defining min() and max() macros
 #include "targetver.h"
 
 #include <stdio.h>
@@ -0,0 +1,90 @@
+/**
+ *  AntSimulatorTest -- ANT stick tests using the simulated stick
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "AntSimulator.h"
+#include "HeartRateMonitor.h"
+#include "Tools.h"
+#include "Test.h"
+#include <sstream>
+
+namespace {
+
+enum {
+    // Time (milliseconds) between attempts to open the stick
+    REOPEN_DELAY = 100
+};
+
+};                                      // end anonymous namespace
+
+TEST(AntStickBadQueryReplies)
+{
+    // The stick sends truncated or no replies to the QueryInfo() requests
+    // for the first second.
+    EnableVirtualClock();
+    std::istringstream scenario("0 bad-reply 1000\n5000 end\n");
+    AntSimulation simulation(scenario);
+
+    int failures = 0;
+    std::unique_ptr<AntStick> stick;
+    while (! stick && ! simulation.Finished()) {
+        try {
+            stick = std::unique_ptr<AntStick>(
+                new AntStick(simulation.CreateTransport()));
+        }
+        catch (const std::runtime_error &) {
+            failures++;
+            simulation.Advance(REOPEN_DELAY);
+        }
+    }
+
+    REQUIRE(stick);
+    CHECK(failures > 0);
+    CHECK(simulation.Now() >= 1000);
+    CHECK_EQUAL(stick->GetVersion(), std::string("SIM1.00"));
+    CHECK(stick->GetMaxChannels() > 0);
+}
+
+TEST(HrmDeviceInfoPages)
+{
+    // The simulated HRM sends its device information in background pages,
+    // with the page toggle bit set on some of them.
+    EnableVirtualClock();
+    std::istringstream scenario("90000 end\n");
+    AntSimulation simulation(scenario);
+    AntStick stick(simulation.CreateTransport());
+    stick.SetNetworkKey(AntStick::g_AntPlusNetworkKey);
+    HeartRateMonitor hrm(&stick, 0);
+    while (! simulation.Finished())
+        TickAntStick(&stick);
+
+    REQUIRE(hrm.ChannelState() == AntChannel::CH_OPEN);
+    const auto &info = hrm.GetDeviceInfo();
+    CHECK_EQUAL(info.ManufacturerId, 1);
+    CHECK_EQUAL(info.SerialNumber, (static_cast<int64_t>(0x1234) << 16) | 1001);
+    CHECK_EQUAL(info.HardwareRevision, 5);
+    CHECK_EQUAL(info.SoftwareVersion, 3.4);
+    CHECK_EQUAL(info.ModelNumber, 7);
+    CHECK_EQUAL(info.BatteryLevel, 85);
+    CHECK_EQUAL(info.BatteryVoltage, 3.0);
+    CHECK_EQUAL(info.Battery, AntChannel::BATTERY_GOOD);
+
+    // The heart beat data in the background pages changes with every
+    // message, but the device info is only updated when a page is first
+    // received.
+    CHECK(hrm.DeviceInfoUpdates() < 10);
+}
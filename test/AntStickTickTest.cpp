@@ -0,0 +1,315 @@
+/**
+ *  AntStickTickTest -- tests for the message batching in AntStick::Tick()
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "AntStick.h"
+#include "Test.h"
+#include <deque>
+#include <memory>
+#include <vector>
+
+/** IMPLEMENTATION NOTE
+ *
+ * The stick is simulated by ScriptedStick, a transport which answers the
+ * commands sent by AntStick and AntChannel and returns the broadcast
+ * messages the test queued up, in order.  Each broadcast carries a sequence
+ * number, so the test can check the order in which the channel received
+ * them.  The AntSimulation in AntSimulator.h sends messages on its own
+ * schedule, these tests need to control exactly which messages are
+ * available to each read.
+ *
+ * Broadcasts which arrive while a command waits for its reply are set aside
+ * by AntStick::ReadInternalMessage(), ScriptedStick can send a number of
+ * them before each reply.  Opening a channel sends enough commands to fill
+ * the set aside queue, so the oldest broadcasts are dropped.
+ */
+
+namespace {
+
+enum {
+    // Must match MAX_DELAYED_MESSAGES and MAX_TICK_MESSAGES in AntStick.cpp
+    MAX_DELAYED_MESSAGES = 64,
+    MAX_TICK_MESSAGES = 64,
+    DEVICE_TYPE = 0x78,
+    DEVICE_NUMBER = 1234,               // known, so no channel ID requests
+    CHANNEL_PERIOD = 8070,
+    SEARCH_TIMEOUT = 30,
+    CHANNEL_FREQUENCY = 57,
+    // Broadcasts sent before each reply while opening the channel, enough
+    // to fill the set aside queue
+    BROADCASTS_BEFORE_REPLY = 20
+};
+
+Buffer MakeReply(uint8_t id, const Buffer &data)
+{
+    Buffer b;
+    b.push_back(SYNC_BYTE);
+    b.push_back(static_cast<uint8_t>(data.size()));
+    b.push_back(id);
+    b.insert(b.end(), data.begin(), data.end());
+    uint8_t c = 0;
+    for (auto e : b)
+        c ^= e;
+    b.push_back(c);
+    return b;
+}
+
+/** Transport simulating an ANT stick, see IMPLEMENTATION NOTE */
+class ScriptedStick : public AntTransport
+{
+public:
+    ScriptedStick()
+        : m_BroadcastsBeforeReply(0),
+          m_NextSequence(0),
+          m_WaitingReads(0),
+          m_ReceivedReads(0) {}
+
+    /** Queue 'count' broadcasts on channel 0 */
+    void Broadcast(int count)
+    {
+        for (int i = 0; i < count; i++) {
+            Buffer data;
+            data.push_back(0);                              // channel
+            data.push_back(0x01);                           // data page
+            data.push_back(static_cast<uint8_t>(m_NextSequence & 0xFF));
+            data.push_back(static_cast<uint8_t>(m_NextSequence >> 8));
+            data.insert(data.end(), 5, 0);
+            m_Received.push_back(MakeReply(BROADCAST_DATA, data));
+            m_NextSequence++;
+        }
+    }
+
+    /** Make the next read find no message, as if the following messages
+     * arrived later. */
+    void Gap() { m_Received.push_back(Buffer()); }
+
+    /** Send 'count' broadcasts before the reply to each command */
+    void SetBroadcastsBeforeReply(int count) { m_BroadcastsBeforeReply = count; }
+
+    /** Number of broadcasts queued so far */
+    int BroadcastCount() const { return m_NextSequence; }
+    int PendingCount() const { return static_cast<int>(m_Received.size()); }
+
+    /** Reads which may wait (MaybeGetNextMessage()) and reads of already
+     * received messages (GetReceivedMessage()) */
+    int WaitingReads() const { return m_WaitingReads; }
+    int ReceivedReads() const { return m_ReceivedReads; }
+
+    Status WriteMessage(const Buffer &message) override
+    {
+        uint8_t id = message[2];
+        Buffer data;
+        switch (id) {
+        case RESET_SYSTEM:
+            m_Received.clear();
+            data.push_back(0x20);       // reset caused by a command
+            m_Received.push_back(MakeReply(STARTUP_MESSAGE, data));
+            return IO_OK;
+        case REQUEST_MESSAGE:
+            switch (message[4]) {
+            case RESPONSE_SERIAL_NUMBER:
+                data.assign(4, 0);
+                break;
+            case RESPONSE_VERSION: {
+                const char version[] = "SCRIPT";
+                data.assign(version, version + sizeof(version));
+                break;
+            }
+            case RESPONSE_CAPABILITIES:
+                data.push_back(8);      // channels
+                data.push_back(8);      // networks
+                data.insert(data.end(), 4, 0);
+                break;
+            default:
+                return IO_OK;
+            }
+            m_Received.push_back(MakeReply(message[4], data));
+            return IO_OK;
+        default:
+            Broadcast(m_BroadcastsBeforeReply);
+            data.push_back(message[3]);
+            data.push_back(id);
+            data.push_back(RESPONSE_NO_ERROR);
+            m_Received.push_back(MakeReply(CHANNEL_RESPONSE, data));
+            return IO_OK;
+        }
+    }
+
+    Status MaybeGetNextMessage(Buffer &message) override
+    {
+        m_WaitingReads++;
+        return Pop(message);
+    }
+
+    Status GetNextMessage(Buffer &message) override
+    {
+        return Pop(message);
+    }
+
+    Status GetReceivedMessage(Buffer &message) override
+    {
+        m_ReceivedReads++;
+        return Pop(message);
+    }
+
+    Status WaitForEvents(int milliseconds) override
+    {
+        return IO_OK;
+    }
+
+private:
+    Status Pop(Buffer &message)
+    {
+        message.clear();
+        if (! m_Received.empty()) {
+            message.swap(m_Received.front());
+            m_Received.pop_front();
+        }
+        return IO_OK;
+    }
+
+    std::deque<Buffer> m_Received;
+    int m_BroadcastsBeforeReply;
+    int m_NextSequence;
+    int m_WaitingReads;
+    int m_ReceivedReads;
+};
+
+/** Channel which records the sequence numbers of the broadcasts sent by
+ * ScriptedStick, in the order it received them. */
+class RecordingChannel : public AntChannel
+{
+public:
+    explicit RecordingChannel(AntStick *stick)
+        : AntChannel(stick, AntChannel::Id(DEVICE_TYPE, DEVICE_NUMBER),
+                     CHANNEL_PERIOD, SEARCH_TIMEOUT, CHANNEL_FREQUENCY) {}
+
+    std::vector<int> received;
+
+private:
+    void OnMessageReceived(const uint8_t *data, int size) override
+    {
+        if (data[2] == BROADCAST_DATA)
+            received.push_back(data[5] | (data[6] << 8));
+    }
+};
+
+/** Check that 'channel' received the broadcasts 'first' .. 'last' - 1, in
+ * order, and nothing else. */
+void CheckReceived(const RecordingChannel &channel, int first, int last)
+{
+    REQUIRE(static_cast<int>(channel.received.size()) == last - first);
+    for (int i = 0; i < last - first; i++)
+        CHECK_EQUAL(channel.received[i], first + i);
+}
+
+/** Open a stick with a scripted transport, 'script' points to the
+ * transport, which is owned by the stick. */
+std::unique_ptr<AntStick> OpenStick(ScriptedStick *&script)
+{
+    script = new ScriptedStick();
+    std::unique_ptr<AntStick> stick(
+        new AntStick(std::unique_ptr<AntTransport>(script)));
+    stick->SetNetworkKey(AntStick::g_AntPlusNetworkKey);
+    return stick;
+}
+
+};                                      // end anonymous namespace
+
+TEST(AntStickTickProcessesSetAsideMessagesFirst)
+{
+    ScriptedStick *script = nullptr;
+    std::unique_ptr<AntStick> stick = OpenStick(script);
+    script->SetBroadcastsBeforeReply(2);
+    RecordingChannel channel(stick.get());
+    script->SetBroadcastsBeforeReply(0);
+    int set_aside = script->BroadcastCount();
+    REQUIRE(set_aside > 0 && set_aside < MAX_DELAYED_MESSAGES);
+    CHECK_EQUAL(script->PendingCount(), 0);
+
+    // New messages are read only after the set aside ones, and without
+    // waiting, since there were set aside messages
+    script->Broadcast(3);
+    stick->Tick();
+    CheckReceived(channel, 0, set_aside + 3);
+    CHECK_EQUAL(script->WaitingReads(), 0);
+    CHECK_EQUAL(script->ReceivedReads(), 4);    // 3 messages, 1 empty read
+    CHECK_EQUAL(stick->GetDroppedMessages(), 0);
+}
+
+TEST(AntStickTickStopsAtFirstEmptyRead)
+{
+    ScriptedStick *script = nullptr;
+    std::unique_ptr<AntStick> stick = OpenStick(script);
+    RecordingChannel channel(stick.get());
+
+    // The messages after the gap wait for the next tick
+    script->Broadcast(2);
+    script->Gap();
+    script->Broadcast(3);
+    stick->Tick();
+    CheckReceived(channel, 0, 2);
+    CHECK_EQUAL(script->WaitingReads(), 1);
+    CHECK_EQUAL(script->ReceivedReads(), 2);
+    CHECK_EQUAL(script->PendingCount(), 3);
+    stick->Tick();
+    CheckReceived(channel, 0, 5);
+    CHECK_EQUAL(script->PendingCount(), 0);
+
+    // Nothing to read: one read, which may wait
+    stick->Tick();
+    CHECK_EQUAL(script->WaitingReads(), 3);
+    CHECK_EQUAL(script->ReceivedReads(), 5);
+
+    // A batch is at most MAX_TICK_MESSAGES long
+    script->Broadcast(MAX_TICK_MESSAGES + 10);
+    stick->Tick();
+    CheckReceived(channel, 0, 5 + MAX_TICK_MESSAGES);
+    CHECK_EQUAL(script->PendingCount(), 10);
+    stick->Tick();
+    CheckReceived(channel, 0, 5 + MAX_TICK_MESSAGES + 10);
+}
+
+TEST(AntStickTickDrainsAfterDroppedMessages)
+{
+    ScriptedStick *script = nullptr;
+    std::unique_ptr<AntStick> stick = OpenStick(script);
+    script->SetBroadcastsBeforeReply(BROADCASTS_BEFORE_REPLY);
+    RecordingChannel channel(stick.get());
+    script->SetBroadcastsBeforeReply(0);
+
+    // Only the newest broadcasts were kept
+    int sent = script->BroadcastCount();
+    REQUIRE(sent > MAX_DELAYED_MESSAGES);
+    int dropped = sent - MAX_DELAYED_MESSAGES;
+    CHECK_EQUAL(stick->GetDroppedMessages(), dropped);
+
+    // The full set aside queue takes a whole batch, the new messages are
+    // processed by the next tick
+    script->Broadcast(5);
+    stick->Tick();
+    CheckReceived(channel, dropped, sent);
+    CHECK_EQUAL(script->WaitingReads(), 0);
+    CHECK_EQUAL(script->ReceivedReads(), 0);
+    CHECK_EQUAL(script->PendingCount(), 5);
+
+    stick->Tick();
+    CheckReceived(channel, dropped, sent + 5);
+    CHECK_EQUAL(script->WaitingReads(), 1);
+    CHECK_EQUAL(script->PendingCount(), 0);
+    CHECK_EQUAL(stick->GetDroppedMessages(), dropped);
+}
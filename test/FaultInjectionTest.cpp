@@ -0,0 +1,144 @@
+/**
+ *  FaultInjectionTest -- cost of processing ANT events under fault injection
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "AntSimulator.h"
+#include "TelemetryServer.h"
+#include "Tools.h"
+#include "Test.h"
+#include <chrono>
+#include <iostream>
+#include <sstream>
+
+/** IMPLEMENTATION NOTE
+ *
+ * This is a benchmark: the same rider runs on a simulated ANT stick twice,
+ * once without faults and once with a scenario which keeps injecting USB
+ * failures, bad replies, lost messages and channel drops.  The stick and
+ * the channels are recovered the same way as RunSimulation() in main.cpp.
+ * An event is one stick tick or one attempt to open the stick, the cost of
+ * an event is the real time the run took divided by the number of events.
+ *
+ * Expected I/O failures are reported as results (see AntTransport::Status),
+ * so a failure costs about as much as any other event, only opening the
+ * stick again throws.  The test prints both costs and fails if the faulty
+ * run is more than MAX_SLOWDOWN times slower per event, which would mean
+ * that the failures became expensive again.
+ */
+
+namespace {
+
+enum {
+    // Time (milliseconds) between attempts to open the stick, same as
+    // SIMULATED_STICK_REOPEN_DELAY in main.cpp
+    REOPEN_DELAY = 100,
+    RIDER_WEIGHT = 75,
+    MAX_SLOWDOWN = 10
+};
+
+const char CLEAN_SCENARIO[] = "600000 end\n";
+
+/** Faults repeated every 30 seconds for 10 minutes of simulated time */
+std::string FaultScenario()
+{
+    std::ostringstream scenario;
+    scenario << "seed 11\n";
+    for (int t = 10000; t < 600000; t += 30000) {
+        scenario << t << " usb-stall 1000\n"
+                 << t + 1000 << " bad-reply 500\n"
+                 << t + 5000 << " loss hrm 5000 0.5\n"
+                 << t + 12000 << " go-to-search fec 3000\n"
+                 << t + 18000 << " ack-fail fec 2000\n";
+    }
+    scenario << "600000 end\n";
+    return scenario.str();
+}
+
+struct RunResult {
+    RunResult() : events(0), failures(0), nanoseconds(0) {}
+    long events;
+    long failures;
+    long long nanoseconds;
+
+    double CostPerEvent() const
+    {
+        return events > 0 ? static_cast<double>(nanoseconds) / events : 0;
+    }
+};
+
+/** Run a rider on a stick simulating 'scenario' until the scenario ends */
+RunResult Run(const std::string &scenario)
+{
+    std::istringstream input(scenario);
+    AntSimulation simulation(input);
+    RunResult result;
+
+    auto start = std::chrono::steady_clock::now();
+    while (! simulation.Finished()) {
+        std::unique_ptr<AntStick> stick;
+        result.events++;
+        try {
+            stick = std::unique_ptr<AntStick>(
+                new AntStick(simulation.CreateTransport()));
+            stick->SetNetworkKey(AntStick::g_AntPlusNetworkKey);
+        }
+        catch (const std::exception &) {
+            result.failures++;
+            simulation.Advance(REOPEN_DELAY);
+            continue;
+        }
+
+        try {
+            Rider rider(stick.get(), 0, 0, RIDER_WEIGHT);
+            while (! simulation.Finished() && ! stick->Failed()) {
+                TickAntStick(stick.get());
+                rider.CheckSensorHealth();
+                rider.UpdateStatistics();
+                result.events++;
+            }
+        }
+        catch (const std::exception &) {
+            // a channel could not be opened, the stick is opened again
+        }
+        if (stick->Failed())
+            result.failures++;
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    result.nanoseconds =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    return result;
+}
+
+};                                      // end anonymous namespace
+
+TEST(FaultInjectionPerEventCost)
+{
+    EnableVirtualClock();
+    RunResult clean = Run(CLEAN_SCENARIO);
+    RunResult faulty = Run(FaultScenario());
+
+    std::cout << "  clean: " << clean.events << " events, "
+              << clean.CostPerEvent() << " ns/event\n"
+              << "  faults: " << faulty.events << " events, "
+              << faulty.failures << " stick failures, "
+              << faulty.CostPerEvent() << " ns/event" << std::endl;
+
+    CHECK_EQUAL(clean.failures, 0L);
+    CHECK(faulty.failures > 0);
+    REQUIRE(clean.events > 0);
+    CHECK(faulty.CostPerEvent() <= clean.CostPerEvent() * MAX_SLOWDOWN);
+}
@@ -0,0 +1,302 @@
+/**
+ *  FitnessEquipmentPagesTest -- decode the FE-C pages of non-bike equipment
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "AntTrace.h"
+#include "FitnessEquipmentControl.h"
+#include "Tools.h"
+#include "Test.h"
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+/** IMPLEMENTATION NOTE
+ *
+ * The pages are written as a trace (see TraceReplay) with one broadcast
+ * message for each page on channel 0, and are replayed one at a time to a
+ * FitnessEquipmentControl, which is the only channel on the stick.  The
+ * page bytes are the ones defined by the FE-C device profile, so each
+ * test shows the layout of the page it decodes.
+ *
+ * The channel never learns its device number, as the replay does not answer
+ * channel ID requests, so it does not send any requests to the equipment.
+ */
+
+namespace {
+
+enum {
+    PAGE_SIZE = 8,
+    PAGE_INTERVAL = 250,                // milliseconds
+    // Trainer state IN_USE in the high nibble of the last page byte
+    STATE_IN_USE = 0x30
+};
+
+typedef std::vector<uint8_t> Page;
+
+/** Vertical distances are reported in meters with a 0.1 m resolution,
+ * compare them as whole decimeters. */
+int Decimeters(double meters)
+{
+    return static_cast<int>(meters * 10 + 0.5);
+}
+
+/** Write 'pages' as a trace, one broadcast message on channel 0 for each
+ * page, PAGE_INTERVAL milliseconds apart. */
+std::string MakeTrace(const std::vector<Page> &pages)
+{
+    std::ostringstream trace;
+    uint32_t time = 0;
+    for (const auto &page : pages) {
+        REQUIRE(page.size() == PAGE_SIZE);
+        Buffer message;
+        message.push_back(SYNC_BYTE);
+        message.push_back(PAGE_SIZE + 1);
+        message.push_back(BROADCAST_DATA);
+        message.push_back(0);           // channel number
+        message.insert(message.end(), page.begin(), page.end());
+        uint8_t checksum = 0;
+        for (auto b : message)
+            checksum ^= b;
+        message.push_back(checksum);
+
+        trace << time << std::hex << std::setfill('0');
+        for (auto b : message)
+            trace << ' ' << std::setw(2) << static_cast<int>(b);
+        trace << std::dec << '\n';
+        time += PAGE_INTERVAL;
+    }
+    return trace.str();
+}
+
+/** Replays a list of pages to a FitnessEquipmentControl */
+class PageReplay
+{
+public:
+    explicit PageReplay(const std::vector<Page> &pages)
+        : m_Trace(MakeTrace(pages)),
+          m_Replay(m_Trace),
+          m_Stick(m_Replay.CreateTransport()),
+          m_Fec(nullptr)
+    {
+        m_Stick.SetNetworkKey(AntStick::g_AntPlusNetworkKey);
+        m_Fec.reset(new FitnessEquipmentControl(&m_Stick));
+    }
+
+    /** Pass the next page to the channel, returns false if there are no
+     * more pages. */
+    bool Next()
+    {
+        if (! m_Replay.NextMessage())
+            return false;
+        while (m_Replay.HasPending())
+            m_Stick.Tick();
+        return true;
+    }
+
+    const FitnessEquipmentControl& Fec() const { return *m_Fec; }
+
+private:
+    std::istringstream m_Trace;
+    TraceReplay m_Replay;
+    AntStick m_Stick;
+    std::unique_ptr<FitnessEquipmentControl> m_Fec;
+};
+
+/** General FE page (0x10) for 'equipment_type', moving at 'speed' mm/s */
+Page GeneralPage(uint8_t equipment_type, uint16_t speed)
+{
+    uint8_t p[] = { 0x10, equipment_type, 0, 0,
+                    static_cast<uint8_t>(speed & 0xFF),
+                    static_cast<uint8_t>(speed >> 8), 0xFF, STATE_IN_USE };
+    return Page(p, p + PAGE_SIZE);
+}
+
+/** Treadmill page (0x13): cadence, descent and ascent in 0.1 m */
+Page TreadmillPage(uint8_t cadence, uint8_t descent, uint8_t ascent)
+{
+    uint8_t p[] = { 0x13, 0xFF, 0xFF, 0xFF, cadence, descent, ascent,
+                    STATE_IN_USE };
+    return Page(p, p + PAGE_SIZE);
+}
+
+/** Elliptical page (0x14): stride count, ascent in 0.1 m, cadence and
+ * power */
+Page EllipticalPage(uint8_t strides, uint8_t ascent, uint8_t cadence,
+                    uint8_t power_lsb, uint8_t power_msb)
+{
+    uint8_t p[] = { 0x14, 0xFF, strides, ascent, cadence,
+                    power_lsb, power_msb, STATE_IN_USE };
+    return Page(p, p + PAGE_SIZE);
+}
+
+/** Rower (0x16), climber (0x17) and nordic skier (0x18) pages: stroke or
+ * stride count, rate and power */
+Page StrokePage(uint8_t page, uint8_t strokes, uint8_t rate,
+                uint8_t power_lsb, uint8_t power_msb)
+{
+    uint8_t p[] = { page, 0xFF, 0xFF, strokes, rate,
+                    power_lsb, power_msb, STATE_IN_USE };
+    return Page(p, p + PAGE_SIZE);
+}
+
+/** Check the decoding of a rower, climber or nordic skier 'page' */
+void CheckStrokePage(uint8_t page, uint8_t equipment_type)
+{
+    std::vector<Page> pages;
+    pages.push_back(GeneralPage(equipment_type, 2000));
+    pages.push_back(StrokePage(page, 245, 0xFF, 0xFF, 0xFF));
+    pages.push_back(StrokePage(page, 250, 30, 0x96, 0x00));
+    pages.push_back(StrokePage(page, 255, 0xFF, 0xFF, 0xFF));
+    pages.push_back(StrokePage(page, 3, 32, 0x2C, 0x01));
+    PageReplay replay(pages);
+    const FitnessEquipmentControl &fec = replay.Fec();
+
+    REQUIRE(replay.Next());
+    CHECK_EQUAL(fec.GetEquipmentType(),
+                static_cast<FitnessEquipmentControl::EquipmentType>(equipment_type));
+
+    // Rate and power are not available, the count is only a starting
+    // point
+    REQUIRE(replay.Next());
+    CHECK_EQUAL(fec.StrokeRate(), -1.0);
+    CHECK_EQUAL(fec.InstantPower(), 0.0);
+    CHECK_EQUAL(fec.StrokeCount(), 0u);
+
+    REQUIRE(replay.Next());
+    CHECK_EQUAL(fec.StrokeRate(), 30.0);
+    CHECK_EQUAL(fec.InstantPower(), 150.0);
+    CHECK_EQUAL(fec.StrokeCount(), 5u);
+
+    // Invalid rate and power keep the last values
+    uint32_t power_timestamp = fec.InstantPowerTimestamp();
+    REQUIRE(replay.Next());
+    CHECK_EQUAL(fec.StrokeRate(), 30.0);
+    CHECK_EQUAL(fec.InstantPower(), 150.0);
+    CHECK_EQUAL(fec.InstantPowerTimestamp(), power_timestamp);
+    CHECK_EQUAL(fec.StrokeCount(), 10u);
+
+    // The count rolls over at 256
+    REQUIRE(replay.Next());
+    CHECK_EQUAL(fec.StrokeRate(), 32.0);
+    CHECK_EQUAL(fec.InstantPower(), 300.0);
+    CHECK_EQUAL(fec.StrokeCount(), 14u);
+    CHECK(! replay.Next());
+}
+
+};                                      // end anonymous namespace
+
+TEST(FecTreadmillPage)
+{
+    EnableVirtualClock();
+    std::vector<Page> pages;
+    pages.push_back(GeneralPage(FitnessEquipmentControl::ET_TREADMILL, 2500));
+    pages.push_back(TreadmillPage(0xFF, 250, 10));
+    pages.push_back(TreadmillPage(90, 252, 20));
+    pages.push_back(TreadmillPage(0xFF, 5, 255));
+    pages.push_back(TreadmillPage(92, 5, 4));
+    PageReplay replay(pages);
+    const FitnessEquipmentControl &fec = replay.Fec();
+
+    REQUIRE(replay.Next());
+    CHECK_EQUAL(fec.GetEquipmentType(), FitnessEquipmentControl::ET_TREADMILL);
+    CHECK_EQUAL(fec.Pace(), 400.0);     // 2.5 m/s
+
+    // The first page only sets the starting point of the vertical distances
+    REQUIRE(replay.Next());
+    CHECK_EQUAL(fec.StrokeRate(), -1.0);
+    CHECK_EQUAL(Decimeters(fec.VerticalAscent()), 0);
+    CHECK_EQUAL(Decimeters(fec.VerticalDescent()), 0);
+
+    REQUIRE(replay.Next());
+    CHECK_EQUAL(fec.StrokeRate(), 90.0);
+    CHECK_EQUAL(Decimeters(fec.VerticalAscent()), 10);
+    CHECK_EQUAL(Decimeters(fec.VerticalDescent()), 2);
+
+    // The descent rolls over, an invalid cadence keeps the last one
+    REQUIRE(replay.Next());
+    CHECK_EQUAL(fec.StrokeRate(), 90.0);
+    CHECK_EQUAL(Decimeters(fec.VerticalAscent()), 245);
+    CHECK_EQUAL(Decimeters(fec.VerticalDescent()), 11);
+
+    // ... and so does the ascent
+    REQUIRE(replay.Next());
+    CHECK_EQUAL(fec.StrokeRate(), 92.0);
+    CHECK_EQUAL(Decimeters(fec.VerticalAscent()), 250);
+    CHECK_EQUAL(Decimeters(fec.VerticalDescent()), 11);
+
+    // Treadmills don't report power
+    CHECK_EQUAL(fec.InstantPower(), 0.0);
+    CHECK(! replay.Next());
+}
+
+TEST(FecEllipticalPage)
+{
+    EnableVirtualClock();
+    std::vector<Page> pages;
+    pages.push_back(GeneralPage(FitnessEquipmentControl::ET_ELLIPTICAL, 3000));
+    pages.push_back(EllipticalPage(200, 100, 60, 0xC8, 0x00));
+    pages.push_back(EllipticalPage(250, 110, 0xFF, 0xFF, 0xFF));
+    pages.push_back(EllipticalPage(10, 5, 64, 0x2C, 0x01));
+    PageReplay replay(pages);
+    const FitnessEquipmentControl &fec = replay.Fec();
+
+    REQUIRE(replay.Next());
+    CHECK_EQUAL(fec.GetEquipmentType(), FitnessEquipmentControl::ET_ELLIPTICAL);
+
+    REQUIRE(replay.Next());
+    CHECK_EQUAL(fec.StrokeRate(), 60.0);
+    CHECK_EQUAL(fec.InstantPower(), 200.0);
+    CHECK_EQUAL(fec.StrokeCount(), 0u);
+    CHECK_EQUAL(Decimeters(fec.VerticalAscent()), 0);
+
+    // Invalid cadence and power keep the last values
+    REQUIRE(replay.Next());
+    CHECK_EQUAL(fec.StrokeRate(), 60.0);
+    CHECK_EQUAL(fec.InstantPower(), 200.0);
+    CHECK_EQUAL(fec.StrokeCount(), 50u);
+    CHECK_EQUAL(Decimeters(fec.VerticalAscent()), 10);
+
+    // Stride count and ascent roll over at 256
+    REQUIRE(replay.Next());
+    CHECK_EQUAL(fec.StrokeRate(), 64.0);
+    CHECK_EQUAL(fec.InstantPower(), 300.0);
+    CHECK_EQUAL(fec.StrokeCount(), 66u);
+    CHECK_EQUAL(Decimeters(fec.VerticalAscent()), 161);
+
+    // Ellipticals don't report the descent
+    CHECK_EQUAL(Decimeters(fec.VerticalDescent()), 0);
+    CHECK(! replay.Next());
+}
+
+TEST(FecRowerPage)
+{
+    EnableVirtualClock();
+    CheckStrokePage(0x16, FitnessEquipmentControl::ET_ROWER);
+}
+
+TEST(FecClimberPage)
+{
+    EnableVirtualClock();
+    CheckStrokePage(0x17, FitnessEquipmentControl::ET_CLIMBER);
+}
+
+TEST(FecNordicSkierPage)
+{
+    EnableVirtualClock();
+    CheckStrokePage(0x18, FitnessEquipmentControl::ET_NORDIC_SKIER);
+}
@@ -0,0 +1,148 @@
+/**
+ *  HandoverTest -- tests for the handover to a new server process
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "NetTools.h"
+#include "TelemetryServer.h"
+#include "Tools.h"
+#include "Test.h"
+#include <sstream>
+
+/** IMPLEMENTATION NOTE
+ *
+ * The tests play the part of a new server process which connects to the
+ * handover pipe of a running TelemetryServer and then stops responding.
+ * The handover happens inside TelemetryServer::Tick(), which must return
+ * once the handover timeout has passed, with the server still serving its
+ * client.  The client checks this with a TIME-SYNC request, which is
+ * answered by the network workers.  The server runs without an ANT stick.
+ */
+
+namespace {
+
+enum {
+    SERVER_PORT = 18833,
+    // Must match HANDOVER_MAGIC and HANDOVER_TIMEOUT in Handover.cpp
+    HANDOVER_MAGIC = 0x54434831,
+    HANDOVER_TIMEOUT = 5000,            // milliseconds
+    // Time (milliseconds) Tick() may take beyond the handover timeout
+    TICK_SLACK = 1000,
+    READ_TIMEOUT = 2000                 // milliseconds
+};
+
+const char PIPE_NAME[] = "\\\\.\\pipe\\TrainerControl-18833";
+
+/** The tests may run on the virtual clock, which does not move, so
+ * timeouts use the system timer. */
+uint32_t RealMilliseconds()
+{
+    return static_cast<uint32_t>(timeGetTime());
+}
+
+/** Send a TIME-SYNC request on 's' and return true if it is answered. */
+bool ClientServed(SOCKET s)
+{
+    const char request[] = "TIME-SYNC 42\n";
+    send(s, request, sizeof(request) - 1, 0);
+    std::string input;
+    uint32_t start = RealMilliseconds();
+    while (RealMilliseconds() - start < READ_TIMEOUT) {
+        char buf[256];
+        int r = recv(s, &buf[0], sizeof(buf), 0);
+        if (r == 0)
+            return false;
+        if (r > 0)
+            input.append(&buf[0], r);
+        if (input.find("TIME-SYNC 42 ") != std::string::npos)
+            return true;
+        Sleep(10);
+    }
+    return false;
+}
+
+/** Connect to the handover pipe of the server, as a new process does */
+HANDLE ConnectPipe()
+{
+    REQUIRE(WaitNamedPipeA(PIPE_NAME, READ_TIMEOUT));
+    HANDLE pipe = CreateFileA(PIPE_NAME, GENERIC_READ | GENERIC_WRITE,
+                              0, NULL, OPEN_EXISTING, 0, NULL);
+    REQUIRE(pipe != INVALID_HANDLE_VALUE);
+    return pipe;
+}
+
+/** Tick 'server' once, as the handover happens inside Tick(), and check
+ * that it gave up on the handover in time. */
+void TickFailedHandover(TelemetryServer &server)
+{
+    uint32_t start = RealMilliseconds();
+    server.Tick();
+    uint32_t elapsed = RealMilliseconds() - start;
+    CHECK(! server.HandedOver());
+    std::ostringstream message;
+    message << "Tick() took " << elapsed << " milliseconds";
+    if (elapsed > HANDOVER_TIMEOUT + TICK_SLACK)
+        ReportFailure(__FILE__, __LINE__, message.str());
+}
+
+};                                      // end anonymous namespace
+
+TEST(HandoverPeerConnectsAndGoesSilent)
+{
+    ServerConfig config;
+    config.port = SERVER_PORT;
+    TelemetryServer server(config);
+    SOCKET client = tcp_connect("127.0.0.1", SERVER_PORT);
+    set_non_blocking(client, true);
+    REQUIRE(ClientServed(client));
+
+    // The new process never sends its request
+    HANDLE pipe = ConnectPipe();
+    TickFailedHandover(server);
+    CHECK(ClientServed(client));
+    CloseHandle(pipe);
+
+    closesocket(client);
+}
+
+TEST(HandoverPeerStopsAfterRequest)
+{
+    ServerConfig config;
+    config.port = SERVER_PORT;
+    TelemetryServer server(config);
+    SOCKET client = tcp_connect("127.0.0.1", SERVER_PORT);
+    set_non_blocking(client, true);
+    REQUIRE(ClientServed(client));
+
+    // The new process sends its request, but never confirms the handover,
+    // the client is served again by new workers.
+    HANDLE pipe = ConnectPipe();
+    uint32_t request[] = { HANDOVER_MAGIC, GetCurrentProcessId() };
+    DWORD written = 0;
+    REQUIRE(WriteFile(pipe, &request[0], sizeof(request), &written, NULL));
+    REQUIRE(written == sizeof(request));
+    TickFailedHandover(server);
+    CHECK(ClientServed(client));
+    CloseHandle(pipe);
+
+    // The listener waits for another process, which does not affect the
+    // server either.
+    server.Tick();
+    CHECK(! server.HandedOver());
+    CHECK(ClientServed(client));
+
+    closesocket(client);
+}
@@ -0,0 +1,293 @@
+/**
+ *  MqttPublisherTest -- test the MQTT publisher against a mock broker
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "MqttPublisher.h"
+#include "NetTools.h"
+#include "Tools.h"
+#include "Test.h"
+
+/** IMPLEMENTATION NOTE
+ *
+ * The mock broker is a listening socket on the loopback interface, the test
+ * plays the broker side of the conversation by hand.  The publisher is
+ * non-blocking, so the test calls Tick() until the expected data arrives,
+ * with a short real time wait between calls, giving up after
+ * MAX_WAIT_ROUNDS.  An MqttWorker calls Tick() on its own thread, the
+ * broker only waits for it.  The virtual clock is used to control the
+ * reconnect delay and the publish interval.
+ */
+
+namespace {
+
+enum {
+    BROKER_PORT = 18830,
+    MAX_WAIT_ROUNDS = 200,
+    WAIT_INTERVAL = 10                  // milliseconds
+};
+
+/** One end of a connection to the publisher */
+class MockBroker
+{
+public:
+    MockBroker()
+        : m_Server(tcp_listen(BROKER_PORT)), m_Client(INVALID_SOCKET)
+    {
+        set_non_blocking(m_Server, true);
+    }
+
+    ~MockBroker()
+    {
+        DropClient();
+        closesocket(m_Server);
+    }
+
+    /** Tick 'publisher' until it connects to the broker.  If 'publisher'
+     * is null, it is ticked by an MqttWorker. */
+    bool Accept(MqttPublisher *publisher)
+    {
+        for (int i = 0; i < MAX_WAIT_ROUNDS && m_Client == INVALID_SOCKET; i++) {
+            if (publisher)
+                publisher->Tick();
+            m_Client = tcp_try_accept(m_Server);
+            if (m_Client == INVALID_SOCKET)
+                Sleep(WAIT_INTERVAL);
+        }
+        if (m_Client != INVALID_SOCKET)
+            set_non_blocking(m_Client, true);
+        return m_Client != INVALID_SOCKET;
+    }
+
+    /** True if the publisher connected, without waiting for it */
+    bool HasPendingConnection()
+    {
+        SOCKET s = tcp_try_accept(m_Server);
+        if (s == INVALID_SOCKET)
+            return false;
+        closesocket(s);
+        return true;
+    }
+
+    /** Tick 'publisher' until a complete packet is received from it, see
+     * Accept().  Returns false if no packet arrives. */
+    bool ReadPacket(MqttPublisher *publisher, uint8_t &type, std::vector<uint8_t> &body)
+    {
+        for (int i = 0; i < MAX_WAIT_ROUNDS; i++) {
+            if (TakePacket(type, body))
+                return true;
+            if (publisher)
+                publisher->Tick();
+            uint8_t buf[256];
+            int r = recv(m_Client, reinterpret_cast<char*>(&buf[0]), sizeof(buf), 0);
+            if (r > 0)
+                m_Input.insert(m_Input.end(), &buf[0], &buf[r]);
+            else
+                Sleep(WAIT_INTERVAL);
+        }
+        return false;
+    }
+
+    void Send(const std::vector<uint8_t> &data)
+    {
+        send(m_Client, reinterpret_cast<const char*>(&data[0]),
+             static_cast<int>(data.size()), 0);
+    }
+
+    void DropClient()
+    {
+        if (m_Client != INVALID_SOCKET)
+            closesocket(m_Client);
+        m_Client = INVALID_SOCKET;
+        m_Input.clear();
+    }
+
+private:
+
+    bool TakePacket(uint8_t &type, std::vector<uint8_t> &body)
+    {
+        size_t pos = 1;
+        size_t length = 0;
+        int shift = 0;
+        while (true) {
+            if (pos >= m_Input.size())
+                return false;
+            uint8_t b = m_Input[pos++];
+            length |= static_cast<size_t>(b & 0x7F) << shift;
+            if ((b & 0x80) == 0)
+                break;
+            shift += 7;
+        }
+        if (m_Input.size() < pos + length)
+            return false;
+        type = m_Input[0];
+        body.assign(m_Input.begin() + pos, m_Input.begin() + pos + length);
+        m_Input.erase(m_Input.begin(), m_Input.begin() + pos + length);
+        return true;
+    }
+
+    SOCKET m_Server;
+    SOCKET m_Client;
+    std::vector<uint8_t> m_Input;
+};
+
+std::vector<uint8_t> Bytes(const std::string &s)
+{
+    return std::vector<uint8_t>(s.begin(), s.end());
+}
+
+/** The CONNECT packet body expected for 'client_id' */
+std::vector<uint8_t> ConnectBody(const std::string &client_id)
+{
+    std::vector<uint8_t> body = {
+        0x00, 0x04, 'M', 'Q', 'T', 'T',
+        0x04,                           // protocol level 3.1.1
+        0x02,                           // clean session
+        0x00, 0x3C                      // keep alive, 60 seconds
+    };
+    body.push_back(0x00);
+    body.push_back(static_cast<uint8_t>(client_id.size()));
+    body.insert(body.end(), client_id.begin(), client_id.end());
+    return body;
+}
+
+const std::vector<uint8_t> CONNACK = { 0x20, 0x02, 0x00, 0x00 };
+
+/** Split a PUBLISH body into its topic and payload */
+bool ParsePublish(const std::vector<uint8_t> &body, std::string &topic, std::string &payload)
+{
+    if (body.size() < 2)
+        return false;
+    size_t length = (body[0] << 8) | body[1];
+    if (body.size() < 2 + length)
+        return false;
+    topic.assign(body.begin() + 2, body.begin() + 2 + length);
+    payload.assign(body.begin() + 2 + length, body.end());
+    return true;
+}
+
+/** Connect 'publisher' to 'broker' and complete the CONNECT/CONNACK
+ * exchange. */
+void Handshake(MockBroker &broker, MqttPublisher &publisher)
+{
+    REQUIRE(broker.Accept(&publisher));
+
+    uint8_t type = 0;
+    std::vector<uint8_t> body;
+    REQUIRE(broker.ReadPacket(&publisher, type, body));
+    CHECK_EQUAL(static_cast<int>(type), 0x10);
+    CHECK(body == ConnectBody("test-client"));
+    CHECK(! publisher.IsConnected());
+
+    broker.Send(CONNACK);
+    for (int i = 0; i < MAX_WAIT_ROUNDS && ! publisher.IsConnected(); i++) {
+        publisher.Tick();
+        Sleep(WAIT_INTERVAL);
+    }
+    REQUIRE(publisher.IsConnected());
+}
+
+/** Check that the next packet received by 'broker' publishes 'payload' on
+ * 'topic', 'publisher' is null for an MqttWorker, see MockBroker::Accept() */
+void CheckPublish(MockBroker &broker, MqttPublisher *publisher,
+                  const std::string &topic, const std::string &payload)
+{
+    uint8_t type = 0;
+    std::vector<uint8_t> body;
+    REQUIRE(broker.ReadPacket(publisher, type, body));
+    CHECK_EQUAL(static_cast<int>(type), 0x30);
+    std::string t, p;
+    REQUIRE(ParsePublish(body, t, p));
+    CHECK_EQUAL(t, topic);
+    CHECK_EQUAL(p, payload);
+}
+
+};                                      // end anonymous namespace
+
+TEST(MqttPublisherConnectAndPublish)
+{
+    EnableVirtualClock();
+    MockBroker broker;
+    MqttPublisher publisher("127.0.0.1", BROKER_PORT, "test-client");
+
+    // Messages published before the broker accepted the connection are
+    // discarded.
+    publisher.Publish("trainer/0/telemetry", "dropped");
+    Handshake(broker, publisher);
+
+    publisher.Publish("trainer/0/telemetry", "HR: 120;PWR: 200");
+    publisher.Publish("trainer/1/telemetry", std::string(200, 'x'));
+    CheckPublish(broker, &publisher, "trainer/0/telemetry", "HR: 120;PWR: 200");
+    // A payload longer than 127 bytes uses two bytes for the length
+    CheckPublish(broker, &publisher, "trainer/1/telemetry", std::string(200, 'x'));
+}
+
+TEST(MqttPublisherReconnects)
+{
+    EnableVirtualClock();
+    MockBroker broker;
+    MqttPublisher publisher("127.0.0.1", BROKER_PORT, "test-client");
+    Handshake(broker, publisher);
+
+    broker.DropClient();
+    for (int i = 0; i < MAX_WAIT_ROUNDS && publisher.IsConnected(); i++) {
+        publisher.Tick();
+        Sleep(WAIT_INTERVAL);
+    }
+    REQUIRE(! publisher.IsConnected());
+    publisher.Publish("trainer/0/telemetry", "dropped");
+
+    // No reconnect attempt before the reconnect delay has passed
+    for (int i = 0; i < 10; i++) {
+        publisher.Tick();
+        Sleep(WAIT_INTERVAL);
+    }
+    CHECK(! broker.HasPendingConnection());
+
+    AdvanceVirtualClock(1000);
+    Handshake(broker, publisher);
+
+    publisher.Publish("trainer/0/telemetry", "PWR: 210");
+    CheckPublish(broker, &publisher, "trainer/0/telemetry", "PWR: 210");
+}
+
+TEST(MqttWorkerPublishesFrames)
+{
+    EnableVirtualClock();
+    MockBroker broker;
+    FrameRing frames;
+    MqttWorker worker("127.0.0.1", BROKER_PORT, "test-client", "trainer", 250, frames);
+
+    REQUIRE(broker.Accept(nullptr));
+    uint8_t type = 0;
+    std::vector<uint8_t> body;
+    REQUIRE(broker.ReadPacket(nullptr, type, body));
+    CHECK(body == ConnectBody("test-client"));
+    broker.Send(CONNACK);
+
+    // The worker publishes the latest frame once the interval has passed,
+    // the ANT thread only publishes the frame in the ring.
+    auto frame = std::make_shared<TelemetryFrame>();
+    frame->seq = frames.NextSeq();
+    frame->riders.resize(2);
+    frame->riders[0].telemetry.Set(Telemetry::HR, 120);
+    frame->riders[1].telemetry.Set(Telemetry::PWR, 200);
+    frames.Publish(frame);
+    AdvanceVirtualClock(1000);
+
+    CheckPublish(broker, nullptr, "trainer/0/telemetry", "HR: 120");
+    CheckPublish(broker, nullptr, "trainer/1/telemetry", "PWR: 200");
+}
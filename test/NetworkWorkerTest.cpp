@@ -0,0 +1,298 @@
+/**
+ *  NetworkWorkerTest -- test the network workers over loopback sockets
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "NetworkWorker.h"
+#include "NetTools.h"
+#include "Tools.h"
+#include "Test.h"
+#include <sstream>
+
+/** IMPLEMENTATION NOTE
+ *
+ * The tests run a NetworkWorker on its own thread, as the server does, and
+ * play the part of the ANT thread: frames with a single rider are recorded
+ * in the sessions and published to the FrameRing.  Clients are plain
+ * sockets connected over the loopback interface.  The worker polls for new
+ * frames every few milliseconds, so reads wait for up to READ_TIMEOUT.
+ */
+
+namespace {
+
+enum {
+    SERVER_PORT = 18831,
+    READ_TIMEOUT = 2000,                // milliseconds
+    POLL_INTERVAL = 10                  // milliseconds
+};
+
+/** The server side: a worker and the data structures it shares with the
+ * ANT thread. */
+struct TestServer
+{
+    TestServer()
+        : server(tcp_listen(SERVER_PORT))
+    {
+        set_non_blocking(server, true);
+        worker.reset(new NetworkWorker(server, frames, commands, sessions));
+    }
+
+    ~TestServer()
+    {
+        worker.reset();
+        closesocket(server);
+    }
+
+    /** Publish a frame where the rider has a heart rate of 'hr' */
+    void Publish(int hr)
+    {
+        auto frame = std::make_shared<TelemetryFrame>();
+        frame->seq = frames.NextSeq();
+        frame->status = STATUS_LIVE;
+        frame->riders.resize(1);
+        std::ostringstream text;
+        text << "TELEMETRY HR: " << hr << "\n";
+        frame->riders[0].text = text.str();
+        sessions.Record(*frame);
+        frames.Publish(frame);
+    }
+
+    SOCKET server;
+    FrameRing frames;
+    CommandQueue commands;
+    SessionTable sessions;
+    std::unique_ptr<NetworkWorker> worker;
+};
+
+class TestClient
+{
+public:
+    TestClient()
+        : m_Socket(tcp_connect("127.0.0.1", SERVER_PORT))
+    {
+        set_non_blocking(m_Socket, true);
+    }
+
+    ~TestClient()
+    {
+        Close();
+    }
+
+    void Close()
+    {
+        if (m_Socket != INVALID_SOCKET)
+            closesocket(m_Socket);
+        m_Socket = INVALID_SOCKET;
+    }
+
+    void Send(const std::string &message)
+    {
+        send(m_Socket, message.c_str(), static_cast<int>(message.length()), 0);
+    }
+
+    /** Read the next line which starts with 'prefix', skipping other lines.
+     * Returns an empty string if no such line arrives in time or the
+     * connection is closed. */
+    std::string ReadLine(const std::string &prefix)
+    {
+        uint32_t start = RealMilliseconds();
+        while (RealMilliseconds() - start < READ_TIMEOUT) {
+            auto eol = m_Input.find('\n');
+            if (eol != std::string::npos) {
+                std::string line = m_Input.substr(0, eol);
+                m_Input.erase(0, eol + 1);
+                if (line.compare(0, prefix.length(), prefix) == 0)
+                    return line;
+                continue;
+            }
+            if (! Receive())
+                break;
+        }
+        return std::string();
+    }
+
+    /** True if the server closed the connection */
+    bool WaitClosed()
+    {
+        uint32_t start = RealMilliseconds();
+        while (RealMilliseconds() - start < READ_TIMEOUT) {
+            if (! Receive())
+                return m_Closed;
+        }
+        return false;
+    }
+
+private:
+
+    /** Wait for data and append it to m_Input.  Returns false if the
+     * connection was closed. */
+    bool Receive()
+    {
+        std::vector<SOCKET> sockets(1, m_Socket);
+        auto status = get_socket_status(sockets, POLL_INTERVAL);
+        if (! (status[0] & SK_READ))
+            return true;
+        char buf[1024];
+        int r = recv(m_Socket, &buf[0], sizeof(buf), 0);
+        if (r == 0 || (r == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK)) {
+            m_Closed = true;
+            return false;
+        }
+        if (r > 0)
+            m_Input.append(&buf[0], r);
+        return true;
+    }
+
+    /** The tests may run on the virtual clock, which does not move, so
+     * timeouts use the system timer. */
+    static uint32_t RealMilliseconds()
+    {
+        return static_cast<uint32_t>(timeGetTime());
+    }
+
+    SOCKET m_Socket;
+    std::string m_Input;
+    bool m_Closed = false;
+};
+
+/** Start a session on 'client', returns the session token */
+std::string StartSession(TestClient &client)
+{
+    client.Send("SESSION\n");
+    std::string reply = client.ReadLine("SESSION ");
+    return reply.empty() ? reply : reply.substr(8);
+}
+
+std::string Frame(int hr, int seq)
+{
+    std::ostringstream text;
+    text << "TELEMETRY HR: " << hr << ";SEQ: " << seq;
+    return text.str();
+}
+
+};                                      // end anonymous namespace
+
+TEST(SessionResumeAfterDisconnect)
+{
+    TestServer server;
+    TestClient a;
+    std::string token = StartSession(a);
+    REQUIRE(! token.empty());
+
+    server.Publish(100);
+    CHECK_EQUAL(a.ReadLine("TELEMETRY"), Frame(100, 1));
+    a.Close();
+
+    // Frames published while no client is attached are recorded in the
+    // session and replayed on RESUME.
+    server.Publish(101);
+    server.Publish(102);
+
+    TestClient b;
+    b.Send("RESUME " + token + " 1\n");
+    CHECK_EQUAL(b.ReadLine("TELEMETRY"), Frame(101, 2));
+    CHECK_EQUAL(b.ReadLine("TELEMETRY"), Frame(102, 3));
+
+    server.Publish(103);
+    CHECK_EQUAL(b.ReadLine("TELEMETRY"), Frame(103, 4));
+}
+
+TEST(SessionResumeTakesOverAttachedSession)
+{
+    TestServer server;
+    TestClient a;
+    std::string token = StartSession(a);
+    REQUIRE(! token.empty());
+
+    server.Publish(100);
+    server.Publish(101);
+    CHECK_EQUAL(a.ReadLine("TELEMETRY"), Frame(100, 1));
+    CHECK_EQUAL(a.ReadLine("TELEMETRY"), Frame(101, 2));
+
+    // The client reconnects while the server still has the old connection,
+    // which is closed by the server.  The frames the client did not see
+    // are replayed exactly once.
+    TestClient b;
+    b.Send("RESUME " + token + " 1\n");
+    CHECK_EQUAL(b.ReadLine("TELEMETRY"), Frame(101, 2));
+    CHECK(a.WaitClosed());
+
+    server.Publish(102);
+    CHECK_EQUAL(b.ReadLine("TELEMETRY"), Frame(102, 3));
+}
+
+TEST(SessionResumeExpired)
+{
+    TestServer server;
+    TestClient a;
+    a.Send("RESUME 0123456789abcdef 10\n");
+    CHECK_EQUAL(a.ReadLine("SESSION-EXPIRED"), std::string("SESSION-EXPIRED 0123456789abcdef"));
+}
+
+TEST(CommandQueueFullReplyBusy)
+{
+    TestServer server;
+    TestClient a;
+
+    // Nobody takes the commands, so the queue fills up.
+    std::string commands;
+    for (int i = 0; i < CommandQueue::MAX_COMMANDS; ++i)
+        commands += "SET-SLOPE 1\n";
+    a.Send(commands);
+    a.Send("SET-ENCODING BINARY\n");
+    a.Send("SET-FTP 250\n");
+    CHECK_EQUAL(a.ReadLine("BUSY"), std::string("BUSY SET-FTP"));
+
+    // The keyframe request for SET-ENCODING was dropped too, this is
+    // reported with the next frame.
+    server.Publish(100);
+    CHECK_EQUAL(a.ReadLine("BUSY"), std::string("BUSY KEYFRAME"));
+
+    std::vector<ServerCommand> queued;
+    server.commands.TakeAll(queued);
+    CHECK_EQUAL(queued.size(), static_cast<size_t>(CommandQueue::MAX_COMMANDS));
+
+    // There is room again
+    a.Send("SET-FTP 250\n");
+    a.Send("CURVE\n");
+    CHECK_EQUAL(a.ReadLine("BUSY"), std::string());
+}
+
+TEST(PartialMessageDoesNotBlockWorker)
+{
+    TestServer server;
+    TestClient a;
+    TestClient b;
+
+    // 'a' sends the start of a command and stops, the worker keeps serving
+    // 'b' while it waits for the rest.
+    a.Send("TIME-SYNC 1");
+    b.Send("TIME-SYNC 2\n");
+    CHECK(! b.ReadLine("TIME-SYNC 2 ").empty());
+
+    // The rest of the command arrives, together with another one.
+    a.Send("11\nTIME-SYNC 12\n");
+    CHECK(! a.ReadLine("TIME-SYNC 111 ").empty());
+    CHECK(! a.ReadLine("TIME-SYNC 12 ").empty());
+}
+
+TEST(OverlongMessageClosesClient)
+{
+    TestServer server;
+    TestClient a;
+    a.Send(std::string(8192, 'x'));
+    CHECK(a.WaitClosed());
+}
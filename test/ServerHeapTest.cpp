@@ -0,0 +1,221 @@
+/**
+ *  ServerHeapTest -- check that the server does not grow its heap
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "AntSimulator.h"
+#include "NetTools.h"
+#include "TelemetryServer.h"
+#include "Tools.h"
+#include "Test.h"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <sstream>
+
+/** IMPLEMENTATION NOTE
+ *
+ * The global operator new and delete are replaced for the whole test
+ * program to keep track of the number of bytes allocated and not yet freed.
+ * Each block has a header holding its size.
+ *
+ * The test runs the server loop, TelemetryServer::Tick(), with a simulated
+ * ANT stick for an hour of simulated time, with a client connected and
+ * sending commands.  After a warm-up, during which the statistics windows,
+ * the frame rings and the reused buffers reach their full size, the heap in
+ * use must stay within HEAP_SLACK bytes of what it was at the end of the
+ * warm-up.
+ *
+ * The number of allocations is counted as well: once the frame pool and the
+ * message buffers are warmed up, publishing frames to the clients must not
+ * allocate at all.  This is measured with the stick detached, as the ANT
+ * simulator itself allocates the messages it sends.
+ */
+
+namespace {
+
+std::atomic<long long> g_HeapInUse(0);
+std::atomic<long long> g_Allocations(0);
+
+// Header size, keeps the blocks aligned for any type
+const size_t HEADER_SIZE = 16;
+
+void *CountedAlloc(size_t size)
+{
+    void *p = std::malloc(size + HEADER_SIZE);
+    if (! p)
+        throw std::bad_alloc();
+    *static_cast<size_t *>(p) = size;
+    g_HeapInUse += size;
+    g_Allocations++;
+    return static_cast<char *>(p) + HEADER_SIZE;
+}
+
+void CountedFree(void *p)
+{
+    if (! p)
+        return;
+    char *block = static_cast<char *>(p) - HEADER_SIZE;
+    g_HeapInUse -= *reinterpret_cast<size_t *>(block);
+    std::free(block);
+}
+
+};                                      // end anonymous namespace
+
+void *operator new(size_t size) { return CountedAlloc(size); }
+void *operator new[](size_t size) { return CountedAlloc(size); }
+void operator delete(void *p) noexcept { CountedFree(p); }
+void operator delete[](void *p) noexcept { CountedFree(p); }
+void operator delete(void *p, size_t) noexcept { CountedFree(p); }
+void operator delete[](void *p, size_t) noexcept { CountedFree(p); }
+
+namespace {
+
+enum {
+    SERVER_PORT = 18832,
+    WARM_UP_TIME = 5 * 60 * 1000,       // milliseconds
+    RUN_TIME = 60 * 60 * 1000,          // milliseconds
+    // Clients send a command every this many milliseconds
+    COMMAND_INTERVAL = 1000,
+    HEAP_SLACK = 64 * 1024,             // bytes
+    // Ticks needed to go once through the frame pool of the server, with
+    // one network worker, and ticks in which no allocations are allowed
+    WARM_UP_TICKS = 100,
+    MEASURED_TICKS = 200
+};
+
+/** Read and discard everything the server sent on 's' */
+void Drain(SOCKET s)
+{
+    char buf[4096];
+    while (recv(s, &buf[0], sizeof(buf), 0) > 0)
+        ;
+}
+
+};                                      // end anonymous namespace
+
+TEST(ServerHeapStaysFlat)
+{
+    EnableVirtualClock();
+    std::istringstream scenario("3600000 end\n");
+    AntSimulation simulation(scenario);
+
+    ServerConfig config;
+    config.port = SERVER_PORT;
+    TelemetryServer server(config);
+    AntStick stick(simulation.CreateTransport());
+    stick.SetNetworkKey(AntStick::g_AntPlusNetworkKey);
+    server.AttachStick(&stick);
+
+    // A text client and a binary client, both sending commands
+    SOCKET text_client = tcp_connect("127.0.0.1", SERVER_PORT);
+    SOCKET binary_client = tcp_connect("127.0.0.1", SERVER_PORT);
+    set_non_blocking(text_client, true);
+    set_non_blocking(binary_client, true);
+    const char encoding[] = "SET-ENCODING BINARY\n";
+    send(binary_client, encoding, sizeof(encoding) - 1, 0);
+
+    const char *commands[] = {
+        "SET-SLOPE 2.5\n", "CURVE\n", "DEVICE-INFO\n", "TIME-SYNC 12345\n"
+    };
+    int next_command = 0;
+    uint32_t last_command = simulation.Now();
+
+    long long baseline = -1;
+    long long peak = 0;
+    while (! simulation.Finished()) {
+        server.Tick();
+        Drain(text_client);
+        Drain(binary_client);
+
+        if (simulation.Now() - last_command >= COMMAND_INTERVAL) {
+            const char *command = commands[next_command++ % 4];
+            send(text_client, command, static_cast<int>(strlen(command)), 0);
+            send(binary_client, command, static_cast<int>(strlen(command)), 0);
+            last_command = simulation.Now();
+        }
+
+        if (simulation.Now() >= WARM_UP_TIME) {
+            if (baseline < 0)
+                baseline = g_HeapInUse;
+            peak = std::max(peak, g_HeapInUse.load());
+        }
+    }
+
+    closesocket(text_client);
+    closesocket(binary_client);
+
+    REQUIRE(baseline > 0);
+    std::ostringstream message;
+    message << "heap grew from " << baseline << " to " << peak << " bytes";
+    if (peak - baseline > HEAP_SLACK)
+        ReportFailure(__FILE__, __LINE__, message.str());
+    server.DetachStick();
+}
+
+TEST(ServerTickDoesNotAllocate)
+{
+    EnableVirtualClock();
+    std::istringstream scenario("300000 end\n");
+    AntSimulation simulation(scenario);
+
+    ServerConfig config;
+    config.port = SERVER_PORT;
+    TelemetryServer server(config);
+    AntStick stick(simulation.CreateTransport());
+    stick.SetNetworkKey(AntStick::g_AntPlusNetworkKey);
+    server.AttachStick(&stick);
+
+    // A text, a binary and a group display client
+    SOCKET clients[] = {
+        tcp_connect("127.0.0.1", SERVER_PORT),
+        tcp_connect("127.0.0.1", SERVER_PORT),
+        tcp_connect("127.0.0.1", SERVER_PORT)
+    };
+    for (auto c : clients)
+        set_non_blocking(c, true);
+    const char encoding[] = "SET-ENCODING BINARY\n";
+    send(clients[1], encoding, sizeof(encoding) - 1, 0);
+    const char group[] = "SUBSCRIBE-GROUP PWR\n";
+    send(clients[2], group, sizeof(group) - 1, 0);
+
+    // The riders get their sensor data and statistics from the simulation,
+    // they keep them once the stick is detached.
+    while (! simulation.Finished()) {
+        server.Tick();
+        for (auto c : clients)
+            Drain(c);
+    }
+    server.DetachStick();
+
+    long long allocations = 0;
+    for (int tick = 0; tick < WARM_UP_TICKS + MEASURED_TICKS; ++tick) {
+        long long before = g_Allocations;
+        server.Tick();
+        for (auto c : clients)
+            Drain(c);
+        if (tick >= WARM_UP_TICKS)
+            allocations += g_Allocations - before;
+    }
+
+    for (auto c : clients)
+        closesocket(c);
+
+    std::ostringstream message;
+    message << allocations << " allocations in " << MEASURED_TICKS << " ticks";
+    if (allocations > 0)
+        ReportFailure(__FILE__, __LINE__, message.str());
+}
@@ -0,0 +1,402 @@
+/**
+ *  TelemetryCodecTest -- round trip tests for the binary telemetry encoding
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "TelemetryCodec.h"
+#include "Test.h"
+#include <climits>
+#include <sstream>
+#include <vector>
+
+namespace {
+
+enum {
+    // Must match KEYFRAME_INTERVAL in TelemetryCodec.cpp
+    KEYFRAME_INTERVAL = 50
+};
+
+/** Describe the differences between 'a' and 'b', ignoring 'seq', which is
+ * not encoded.  Returns an empty string if they are the same. */
+std::string Differences(const Telemetry &a, const Telemetry &b)
+{
+    std::ostringstream out;
+    if (a.timestamp != b.timestamp)
+        out << " TS " << a.timestamp << " != " << b.timestamp;
+    if (a.hr_timestamp != b.hr_timestamp)
+        out << " HRTS " << a.hr_timestamp << " != " << b.hr_timestamp;
+    if (a.fec_timestamp != b.fec_timestamp)
+        out << " FETS " << a.fec_timestamp << " != " << b.fec_timestamp;
+    for (int i = 0; i < Telemetry::FIELD_COUNT; ++i) {
+        auto f = static_cast<Telemetry::Field>(i);
+        if (a.Has(f) != b.Has(f) || (a.Has(f) && a.value[i] != b.value[i])) {
+            out << " " << FieldName(f) << " ";
+            if (a.Has(f)) out << a.value[i]; else out << "missing";
+            out << " != ";
+            if (b.Has(f)) out << b.value[i]; else out << "missing";
+        }
+    }
+    if (a.npzones != b.npzones)
+        out << " npzones " << int(a.npzones) << " != " << int(b.npzones);
+    if (a.nhrzones != b.nhrzones)
+        out << " nhrzones " << int(a.nhrzones) << " != " << int(b.nhrzones);
+    for (int i = 0; i < a.npzones && i < b.npzones; ++i) {
+        if (a.pzones[i] != b.pzones[i])
+            out << " pzones[" << i << "] " << a.pzones[i] << " != " << b.pzones[i];
+    }
+    for (int i = 0; i < a.nhrzones && i < b.nhrzones; ++i) {
+        if (a.hrzones[i] != b.hrzones[i])
+            out << " hrzones[" << i << "] " << a.hrzones[i] << " != " << b.hrzones[i];
+    }
+    return out.str();
+}
+
+/** A record with all fields present */
+Telemetry FullTelemetry()
+{
+    Telemetry t;
+    t.timestamp = 1234567890123ULL;
+    t.hr_timestamp = 1234567880000ULL;
+    t.fec_timestamp = 1234567885000ULL;
+    t.Set(Telemetry::HR, 142);
+    t.Set(Telemetry::CAD, 91);
+    t.Set(Telemetry::PWR, 251.75);
+    t.Set(Telemetry::SPD, 9.876);
+    t.Set(Telemetry::PWR3S, 248.3);
+    t.Set(Telemetry::PWR10S, 245.1);
+    t.Set(Telemetry::PWR30S, 240.9);
+    t.Set(Telemetry::HR30S, 139.5);
+    t.Set(Telemetry::NP, 238.2);
+    t.Set(Telemetry::IF, 0.873);
+    t.Set(Telemetry::TSS, 45.6);
+    t.Set(Telemetry::MAXHR, 171);
+    t.Set(Telemetry::MAXPWR, 812);
+    t.Set(Telemetry::WBAL, 18350);
+    t.Set(Telemetry::SR, 28);
+    t.Set(Telemetry::PACE, 125.4);
+    t.Set(Telemetry::INCL, -2.5);
+    t.npzones = ZoneAccumulator::MAX_ZONES;
+    t.nhrzones = 5;
+    for (int i = 0; i < ZoneAccumulator::MAX_ZONES; ++i)
+        t.pzones[i] = 100 * i + 7;
+    for (int i = 0; i < 5; ++i)
+        t.hrzones[i] = 60 * i;
+    return t;
+}
+
+/** Encode 't', decode the frame and check that the result is the same as
+ * 't'.  Returns the frame. */
+std::string RoundTrip(TelemetryEncoder &encoder, TelemetryDecoder &decoder,
+                      const Telemetry &t, Telemetry &decoded)
+{
+    std::string frame = encoder.Encode(t);
+    if (frame.empty())
+        return frame;
+    CHECK(decoder.Decode(frame, decoded));
+    std::string diff = Differences(t, decoded);
+    if (! diff.empty())
+        ReportFailure(__FILE__, __LINE__, "decoded telemetry differs:" + diff);
+    return frame;
+}
+
+void PutVarint(std::string &out, uint64_t value)
+{
+    do {
+        uint8_t b = value & 0x7F;
+        value >>= 7;
+        out.push_back(static_cast<char>(value > 0 ? b | 0x80 : b));
+    } while (value > 0);
+}
+
+uint64_t GetVarint(const std::string &in, size_t &pos)
+{
+    uint64_t value = 0;
+    for (int shift = 0; pos < in.size(); shift += 7) {
+        uint8_t b = static_cast<uint8_t>(in[pos++]);
+        value |= static_cast<uint64_t>(b & 0x7F) << shift;
+        if ((b & 0x80) == 0)
+            break;
+    }
+    return value;
+}
+
+/** Return the field values in keyframe 'frame', decoded by hand, the way a
+ * client would. */
+std::vector<int64_t> KeyframeFields(const std::string &frame)
+{
+    std::vector<int64_t> fields;
+    size_t pos = 1;                     // skip the frame marker
+    GetVarint(frame, pos);              // length
+    pos++;                              // flags
+    uint64_t mask = GetVarint(frame, pos);
+    for (int i = 0; mask >> i; ++i) {
+        uint64_t v = (mask & (1ULL << i)) ? GetVarint(frame, pos) : 0;
+        fields.push_back(static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1));
+    }
+    return fields;
+}
+
+/** Build a keyframe containing 'fields', as an older server would send
+ * it. */
+std::string MakeKeyframe(const std::vector<int64_t> &fields)
+{
+    std::string body;
+    body.push_back(1);
+    PutVarint(body, (1ULL << fields.size()) - 1);
+    for (int64_t v : fields)
+        PutVarint(body, (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63));
+    std::string frame(1, '\0');
+    PutVarint(frame, body.size());
+    return frame + body;
+}
+
+};                                      // end anonymous namespace
+
+TEST(TelemetryCodecKeyframe)
+{
+    TelemetryEncoder encoder;
+    TelemetryDecoder decoder;
+    Telemetry decoded;
+
+    std::string frame = RoundTrip(encoder, decoder, FullTelemetry(), decoded);
+    REQUIRE(! frame.empty());
+    CHECK(encoder.IsKeyframe());
+
+    // An empty record is still a keyframe with all fields missing
+    TelemetryEncoder encoder2;
+    TelemetryDecoder decoder2;
+    Telemetry empty;
+    frame = RoundTrip(encoder2, decoder2, empty, decoded);
+    REQUIRE(! frame.empty());
+    CHECK(encoder2.IsKeyframe());
+}
+
+TEST(TelemetryCodecDeltaFrames)
+{
+    TelemetryEncoder encoder;
+    TelemetryDecoder decoder;
+    Telemetry decoded;
+
+    Telemetry t = FullTelemetry();
+    RoundTrip(encoder, decoder, t, decoded);
+
+    // Only the timestamp changed, nothing is sent
+    t.timestamp += 10000;
+    CHECK(encoder.Encode(t).empty());
+
+    t.timestamp += 10000;
+    t.Set(Telemetry::PWR, 260.25);
+    t.Set(Telemetry::HR, 141);
+    t.fec_timestamp += 250000;
+    std::string frame = RoundTrip(encoder, decoder, t, decoded);
+    REQUIRE(! frame.empty());
+    CHECK(! encoder.IsKeyframe());
+
+    // Decreasing values produce negative deltas
+    t.timestamp += 10000;
+    t.Set(Telemetry::PWR, 0);
+    t.Set(Telemetry::SPD, 0);
+    RoundTrip(encoder, decoder, t, decoded);
+    CHECK(! encoder.IsKeyframe());
+}
+
+TEST(TelemetryCodecMissingFields)
+{
+    TelemetryEncoder encoder;
+    TelemetryDecoder decoder;
+    Telemetry decoded;
+
+    Telemetry t = FullTelemetry();
+    RoundTrip(encoder, decoder, t, decoded);
+
+    // Fields which go missing in delta frames, including a signed one
+    t.timestamp += 10000;
+    t.Set(Telemetry::HR, -1);
+    t.Set(Telemetry::CAD, -1);
+    t.present &= ~(1u << Telemetry::INCL);
+    t.value[Telemetry::INCL] = 0;
+    t.hr_timestamp = 0;
+    RoundTrip(encoder, decoder, t, decoded);
+    CHECK(! decoded.Has(Telemetry::HR));
+    CHECK(! decoded.Has(Telemetry::INCL));
+
+    // ... and come back
+    t.timestamp += 10000;
+    t.Set(Telemetry::HR, 0);
+    t.Set(Telemetry::INCL, 0);
+    RoundTrip(encoder, decoder, t, decoded);
+    CHECK(decoded.Has(Telemetry::HR));
+    CHECK(decoded.Has(Telemetry::INCL));
+}
+
+TEST(TelemetryCodecSignedLimits)
+{
+    TelemetryEncoder encoder;
+    TelemetryDecoder decoder;
+    Telemetry decoded;
+
+    Telemetry t = FullTelemetry();
+    t.present &= ~(1u << Telemetry::INCL);
+    t.value[Telemetry::INCL] = 0;
+    RoundTrip(encoder, decoder, t, decoded);
+
+    // INT32_MIN is a valid value, it must not be mistaken for a missing
+    // value, in keyframes or in delta frames.
+    const int32_t values[] = { INT32_MIN, INT32_MAX, INT32_MIN, -1, INT32_MIN + 1, 0 };
+    for (int32_t v : values) {
+        t.timestamp += 10000;
+        t.present |= 1u << Telemetry::INCL;
+        t.value[Telemetry::INCL] = v;
+        RoundTrip(encoder, decoder, t, decoded);
+        CHECK(decoded.Has(Telemetry::INCL));
+        CHECK_EQUAL(decoded.value[Telemetry::INCL], v);
+    }
+
+    TelemetryEncoder encoder2;
+    TelemetryDecoder decoder2;
+    t.value[Telemetry::INCL] = INT32_MIN;
+    RoundTrip(encoder2, decoder2, t, decoded);
+    CHECK(encoder2.IsKeyframe());
+    CHECK_EQUAL(decoded.value[Telemetry::INCL], INT32_MIN);
+}
+
+TEST(TelemetryCodecZoneCounts)
+{
+    TelemetryEncoder encoder;
+    TelemetryDecoder decoder;
+    Telemetry decoded;
+
+    Telemetry t = FullTelemetry();
+    const int counts[][2] = {
+        { ZoneAccumulator::MAX_ZONES, 5 },
+        { 0, 0 },
+        { 3, ZoneAccumulator::MAX_ZONES },
+        { ZoneAccumulator::MAX_ZONES, 1 },
+        { 1, 0 }
+    };
+    for (const auto &c : counts) {
+        t.timestamp += 10000;
+        t.npzones = static_cast<uint8_t>(c[0]);
+        t.nhrzones = static_cast<uint8_t>(c[1]);
+        for (int i = 0; i < t.npzones; ++i)
+            t.pzones[i] += 1;
+        RoundTrip(encoder, decoder, t, decoded);
+        CHECK_EQUAL(int(decoded.npzones), c[0]);
+        CHECK_EQUAL(int(decoded.nhrzones), c[1]);
+    }
+}
+
+TEST(TelemetryCodecKeyframeInterval)
+{
+    TelemetryEncoder encoder;
+    TelemetryDecoder decoder;
+    Telemetry decoded;
+
+    Telemetry t = FullTelemetry();
+    RoundTrip(encoder, decoder, t, decoded);
+    REQUIRE(encoder.IsKeyframe());
+
+    // A decoder joining the stream late cannot decode delta frames and
+    // starts with the next keyframe.
+    TelemetryDecoder late_decoder;
+    Telemetry late;
+    bool late_synced = false;
+
+    for (int i = 1; i <= 2 * KEYFRAME_INTERVAL + 1; ++i) {
+        t.timestamp += 10000;
+        t.Set(Telemetry::PWR, 200 + i * 0.25);
+        t.pzones[2] += 1;
+        std::string frame = RoundTrip(encoder, decoder, t, decoded);
+        REQUIRE(! frame.empty());
+        bool expect_keyframe = (i % (KEYFRAME_INTERVAL + 1)) == 0;
+        CHECK_EQUAL(encoder.IsKeyframe(), expect_keyframe);
+
+        if (i > 10) {
+            bool ok = late_decoder.Decode(frame, late);
+            if (encoder.IsKeyframe())
+                late_synced = true;
+            CHECK_EQUAL(ok, late_synced);
+            if (ok)
+                CHECK_EQUAL(Differences(t, late), std::string());
+        }
+    }
+    CHECK(late_synced);
+
+    // A forced keyframe restarts the interval
+    t.timestamp += 10000;
+    t.Set(Telemetry::PWR, 100);
+    encoder.ForceKeyframe();
+    RoundTrip(encoder, decoder, t, decoded);
+    CHECK(encoder.IsKeyframe());
+}
+
+TEST(TelemetryCodecMalformedFrames)
+{
+    TelemetryDecoder decoder;
+    Telemetry t;
+    bool threw = false;
+    try {
+        decoder.Decode(std::string("TELEMETRY HR: 100"), t);
+    } catch (const std::runtime_error &) {
+        threw = true;
+    }
+    CHECK(threw);
+
+    TelemetryEncoder encoder;
+    std::string frame = encoder.Encode(FullTelemetry());
+    frame.resize(frame.size() - 1);
+    threw = false;
+    try {
+        decoder.Decode(frame, t);
+    } catch (const std::runtime_error &) {
+        threw = true;
+    }
+    CHECK(threw);
+}
+
+TEST(TelemetryCodecPowerFields)
+{
+    enum { PWR_FIELD = 3, FINE_POWER_FIELD = 36 };
+
+    // Field 3 holds the power in whole watts, as older clients expect, and
+    // field 36 the power in 0.25 W.
+    TelemetryEncoder encoder;
+    Telemetry t = FullTelemetry();
+    std::vector<int64_t> fields = KeyframeFields(encoder.Encode(t));
+    REQUIRE(fields.size() == TelemetryEncoder::FIELD_COUNT);
+    CHECK_EQUAL(fields[PWR_FIELD], 252);
+    CHECK_EQUAL(fields[FINE_POWER_FIELD], 1007);
+
+    // A missing power is -1 in both fields
+    TelemetryEncoder encoder2;
+    t.Set(Telemetry::PWR, -1);
+    fields = KeyframeFields(encoder2.Encode(t));
+    REQUIRE(fields.size() == TelemetryEncoder::FIELD_COUNT);
+    CHECK_EQUAL(fields[PWR_FIELD], -1);
+    CHECK_EQUAL(fields[FINE_POWER_FIELD], -1);
+
+    // A stream from an older server, without field 36, decodes the power in
+    // whole watts.
+    TelemetryEncoder encoder3;
+    fields = KeyframeFields(encoder3.Encode(FullTelemetry()));
+    fields.resize(FINE_POWER_FIELD);
+    TelemetryDecoder decoder;
+    Telemetry decoded;
+    REQUIRE(decoder.Decode(MakeKeyframe(fields), decoded));
+    CHECK(decoded.Has(Telemetry::PWR));
+    CHECK_EQUAL(decoded.Get(Telemetry::PWR), 252.0);
+    CHECK_EQUAL(decoded.Get(Telemetry::HR), 142.0);
+}
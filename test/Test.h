@@ -0,0 +1,86 @@
+/**
+ *  Test -- a minimal unit test framework
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <sstream>
+#include <string>
+
+/** Tests are functions defined with the TEST() macro, they register
+ * themselves and are run by TestMain.cpp, in the order they are defined in
+ * each file.  A test fails if any CHECK() or REQUIRE() fails or if it throws
+ * an exception.  CHECK() reports the failure and continues the test,
+ * REQUIRE() ends it.
+ *
+ *     TEST(AddsNumbers)
+ *     {
+ *         REQUIRE(Add(1, 2) == 3);
+ *         CHECK_EQUAL(Add(-1, 1), 0);
+ *     }
+ */
+
+typedef void (*TestFunction)();
+
+/** Add 'fn' to the tests run by RunAllTests(), used by the TEST() macro */
+int RegisterTest(const char *name, TestFunction fn);
+
+/** Report a failed check at 'file' and 'line'.  The test is marked as failed
+ * but continues to run. */
+void ReportFailure(const char *file, int line, const std::string &message);
+
+/** Thrown by REQUIRE() to end the current test */
+class TestAborted {};
+
+/** Run all registered tests, returns the number of failed tests. */
+int RunAllTests();
+
+#define TEST(name)                                                      \
+    static void Test_##name();                                          \
+    static int Test_##name##_registered = RegisterTest(#name, Test_##name); \
+    static void Test_##name()
+
+#define CHECK(expr)                                                     \
+    do {                                                                \
+        if (! (expr))                                                   \
+            ReportFailure(__FILE__, __LINE__, "CHECK(" #expr ") failed"); \
+    } while (0)
+
+#define REQUIRE(expr)                                                   \
+    do {                                                                \
+        if (! (expr)) {                                                 \
+            ReportFailure(__FILE__, __LINE__, "REQUIRE(" #expr ") failed"); \
+            throw TestAborted();                                        \
+        }                                                               \
+    } while (0)
+
+#define CHECK_EQUAL(actual, expected)                                   \
+    do {                                                                \
+        const auto &a_ = (actual);                                      \
+        const auto &e_ = (expected);                                    \
+        if (! (a_ == e_)) {                                             \
+            std::ostringstream m_;                                      \
+            m_ << "CHECK_EQUAL(" #actual ", " #expected "): got " << a_ \
+               << ", expected " << e_;                                  \
+            ReportFailure(__FILE__, __LINE__, m_.str());                \
+        }                                                               \
+    } while (0)
+
+/*
+  Local Variables:
+  mode: c++
+  End:
+*/
@@ -0,0 +1,81 @@
+/**
+ *  TestMain -- run the TrainerControl unit tests
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Test.h"
+#include <exception>
+#include <iostream>
+#include <vector>
+
+namespace {
+
+struct TestCase {
+    const char *name;
+    TestFunction fn;
+};
+
+/** The registered tests.  This is a function static, since tests register
+ * themselves from static initializers in other translation units. */
+std::vector<TestCase>& Tests()
+{
+    static std::vector<TestCase> tests;
+    return tests;
+}
+
+int g_Failures = 0;                     // failures in the current test
+
+};                                      // end anonymous namespace
+
+int RegisterTest(const char *name, TestFunction fn)
+{
+    TestCase t;
+    t.name = name;
+    t.fn = fn;
+    Tests().push_back(t);
+    return static_cast<int>(Tests().size());
+}
+
+void ReportFailure(const char *file, int line, const std::string &message)
+{
+    std::cerr << file << "(" << line << "): " << message << std::endl;
+    g_Failures++;
+}
+
+int RunAllTests()
+{
+    int failed = 0;
+    for (const auto &t : Tests()) {
+        g_Failures = 0;
+        try {
+            t.fn();
+        } catch (const TestAborted &) {
+            // failure already reported
+        } catch (const std::exception &e) {
+            ReportFailure(t.name, 0, std::string("exception: ") + e.what());
+        }
+        std::cout << (g_Failures == 0 ? "PASS " : "FAIL ") << t.name << std::endl;
+        if (g_Failures > 0)
+            failed++;
+    }
+    std::cout << Tests().size() - failed << " of " << Tests().size()
+              << " tests passed" << std::endl;
+    return failed;
+}
+
+int main()
+{
+    return RunAllTests() == 0 ? 0 : 1;
+}
@@ -0,0 +1,99 @@
+/**
+ *  TraceReplayTest -- check the sensor decoders against a recorded trace
+ *  Copyright (C) 2018 Alex Harsanyi <AlexHarsanyi@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "ReplayCheck.h"
+#include "Test.h"
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+/** IMPLEMENTATION NOTE
+ *
+ * replay.trace is a short trace recorded from the simulated sensors and
+ * replay.golden holds the samples it produced, the same check as running
+ * "-replay replay.trace -golden replay.golden".  Only the samples are
+ * compared, the decode time in the golden file depends on the machine it
+ * was written on.  If a change to the decoders or the statistics is meant
+ * to change the samples, write the golden file again with -update-golden.
+ *
+ * The files are found next to this source file, so the tests can run from
+ * any directory.
+ */
+
+namespace {
+
+enum {
+    RIDER_WEIGHT = 75,                  // same as the replay in main.cpp
+    MAX_REPORTED_MISMATCHES = 10
+};
+
+std::string TestFile(const char *name)
+{
+    std::string path = __FILE__;
+    auto slash = path.find_last_of("/\\");
+    return path.substr(0, slash + 1) + name;
+}
+
+ReplaySamples ReplayTestTrace()
+{
+    std::ifstream trace(TestFile("replay.trace"));
+    REQUIRE(trace.good());
+    return ReplayTrace(trace, RIDER_WEIGHT);
+}
+
+ReplaySamples ReadTestGolden()
+{
+    std::ifstream golden(TestFile("replay.golden"));
+    REQUIRE(golden.good());
+    return ReadGolden(golden);
+}
+
+};                                      // end anonymous namespace
+
+TEST(TraceReplayMatchesGolden)
+{
+    ReplaySamples golden = ReadTestGolden();
+    ReplaySamples actual = ReplayTestTrace();
+    REQUIRE(! golden.samples.empty());
+    CHECK(actual.messages > 0);
+    CHECK_EQUAL(CompareSamples(golden, actual, std::cout, MAX_REPORTED_MISMATCHES), 0);
+
+    // The sample times do not depend on the virtual clock left by a
+    // previous replay
+    ReplaySamples again = ReplayTestTrace();
+    CHECK_EQUAL(CompareSamples(golden, again, std::cout, MAX_REPORTED_MISMATCHES), 0);
+}
+
+TEST(TraceReplayReportsChangedSamples)
+{
+    ReplaySamples golden = ReadTestGolden();
+    REQUIRE(golden.samples.size() > 2);
+    ReplaySamples changed = golden;
+    changed.samples[1] += ";HR: 0";
+    changed.samples.pop_back();
+
+    std::ostringstream log;
+    CHECK_EQUAL(CompareSamples(golden, changed, log, MAX_REPORTED_MISMATCHES), 2);
+    CHECK(log.str().find("sample 2:") != std::string::npos);
+    CHECK(log.str().find("<none>") != std::string::npos);
+
+    // Only the first differences are reported
+    std::ostringstream short_log;
+    CHECK_EQUAL(CompareSamples(golden, changed, short_log, 1), 2);
+    CHECK(short_log.str().find("<none>") == std::string::npos);
+}